@@ -0,0 +1,68 @@
+/*****************************************************************************
+ MIT License
+
+ Copyright(c) 2023 Alexander Veselov
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this softwareand associated documentation files(the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions :
+
+ The above copyright noticeand this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *****************************************************************************/
+
+#include "acceleration_structure.hpp"
+
+std::vector<Triangle> AccelerationStructure::GatherTriangles(std::vector<Triangle> const& triangles) const
+{
+    std::vector<Triangle> ordered_triangles;
+    ordered_triangles.reserve(primitive_indices_.size());
+
+    for (std::uint32_t triangle_idx : primitive_indices_)
+    {
+        ordered_triangles.push_back(triangles[triangle_idx]);
+    }
+
+    return ordered_triangles;
+}
+
+std::vector<std::uint32_t> AccelerationStructure::MapToTriangleSlots(
+    std::vector<std::uint32_t> const& triangle_indices) const
+{
+    std::vector<std::uint32_t> slots(triangle_indices.size());
+    for (std::size_t i = 0; i < triangle_indices.size(); ++i)
+    {
+        slots[i] = triangle_slots_[triangle_indices[i]];
+    }
+
+    return slots;
+}
+
+void AccelerationStructure::SetPrimitiveIndices(std::vector<std::uint32_t> primitive_indices, std::size_t num_triangles)
+{
+    primitive_indices_ = std::move(primitive_indices);
+    triangle_slots_.assign(num_triangles, 0xFFFFFFFF);
+
+    // Walk backwards so that the first slot of the duplicated triangles wins
+    for (std::size_t slot = primitive_indices_.size(); slot-- > 0;)
+    {
+        std::uint32_t triangle_idx = primitive_indices_[slot];
+        if (triangle_idx >= num_triangles)
+        {
+            throw std::runtime_error("Triangle slot references an invalid triangle");
+        }
+
+        triangle_slots_[triangle_idx] = (std::uint32_t)slot;
+    }
+}
@@ -25,14 +25,70 @@
 #pragma once
 
 #include "kernels/common/shared_structures.h"
+#include <stdexcept>
 #include <vector>
 
-class CLContext;
+// Range of buffer elements that have to be uploaded again
+struct DirtyRange
+{
+    std::uint32_t first;
+    std::uint32_t count;
+};
+
+// Where the binary BVH traversal kernels keep the nodes that are still to be visited
+enum class BvhTraversal
+{
+    // Chosen per device by the integrator
+    kAuto,
+    // Private array of MAX_BVH_STACK_SIZE entries
+    kPrivateStack,
+    // A few entries per work item in local memory, the parent links recover the overflow
+    kShortStack,
+    // No stack, the traversal climbs the parent links
+    kStackless,
+    // Stackless, the rays after the first bounce are sorted by the treelet of their next node
+    // between the passes, so the rays tracing the same treelet run together
+    kTreelet
+};
+
 class AccelerationStructure
 {
 public:
-    virtual void BuildCPU(std::vector<Triangle> & triangles) = 0;
+    virtual ~AccelerationStructure() = default;
+
+    // The triangles are not reordered, the leaves reference triangle slots instead
+    virtual void BuildCPU(std::vector<Triangle> const& triangles) = 0;
+    // Binary BVH nodes, empty for the structures that are not BVHs
     virtual std::vector<LinearBVHNode> const& GetNodes() const = 0;
-    //virtual void IntersectRays(cl::Buffer const& rays_buffer, cl::Buffer const& ray_counter_buffer,
-    //    std::uint32_t max_num_rays, cl::Buffer const& hits_buffer, bool closest_hit = true) = 0;
+    // Scene triangle of every triangle slot referenced by the leaves, the GPU triangle buffers
+    // are stored in the slot order. Spatial splits reference a triangle from several slots
+    std::vector<std::uint32_t> const& GetPrimitiveIndices() const { return primitive_indices_; }
+    // First triangle slot of every scene triangle
+    std::vector<std::uint32_t> const& GetTriangleSlots() const { return triangle_slots_; }
+    // Copies the scene triangles into the slot order in a single pass
+    std::vector<Triangle> GatherTriangles(std::vector<Triangle> const& triangles) const;
+    // Translates the scene triangle indices into the first slots of these triangles
+    std::vector<std::uint32_t> MapToTriangleSlots(std::vector<std::uint32_t> const& triangle_indices) const;
+    // Updates the node bounds after the given scene triangles have moved, keeps the topology
+    // and the triangle slots. Returns the ranges of the changed nodes
+    virtual std::vector<DirtyRange> Refit(std::vector<Triangle> const& /*triangles*/,
+        std::vector<std::uint32_t> const& /*triangle_indices*/)
+    {
+        throw std::runtime_error("The acceleration structure does not support refitting");
+    }
+    // SAH cost of the refitted hierarchy relative to the cost after the last build
+    virtual float GetRefitCostRatio() const { return 1.0f; }
+    // Instances referenced by the leaves of the top level tree, empty for the single-level structures
+    virtual std::vector<Instance> const& GetInstances() const
+    {
+        static std::vector<Instance> const kNoInstances;
+        return kNoInstances;
+    }
+
+protected:
+    void SetPrimitiveIndices(std::vector<std::uint32_t> primitive_indices, std::size_t num_triangles);
+
+private:
+    std::vector<std::uint32_t> primitive_indices_;
+    std::vector<std::uint32_t> triangle_slots_;
 };
@@ -23,207 +23,1137 @@
  *****************************************************************************/
 
 #include "bvh.hpp"
+#include "bvh_metrics.hpp"
+#include "bvh_optimizer.hpp"
+#include "kernels/common/constants.h"
+#include "utils/thread_pool.hpp"
+#include "utils/timer.hpp"
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <limits>
+#include <stdexcept>
+#include <string>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define BVH_USE_SSE
+#include <immintrin.h>
+#endif
 
 namespace
 {
-    constexpr auto kMaxPrimitivesInNode = 4u;
+    constexpr unsigned int kMaxBuckets = 64u;
+    // Leaf primitive count is stored in 16 bits of LinearBVHNode
+    constexpr unsigned int kMaxLeafSize = 0xFFFFu;
+    // Build nodes are small, so a block holds several thousands of them
+    constexpr std::size_t kBuildNodeArenaBlockSize = 1024 * 1024;
+    // Nodes with more primitives build their children as separate tasks
+    constexpr unsigned int kParallelBuildThreshold = 4096u;
+    // Nodes with more primitives compute bounds, bin and partition in parallel
+    constexpr unsigned int kParallelBinningThreshold = 65536u;
+    // Number of primitives processed by one task of a parallel loop
+    constexpr std::size_t kParallelGrainSize = 16384u;
+
+    std::size_t GetNumChunks(std::size_t count)
+    {
+        return (count + kParallelGrainSize - 1) / kParallelGrainSize;
+    }
+
+    // Bounds of a SAH bin. The primitive is binned along all three axes at once,
+    // so the bounds are kept in SIMD registers to extend them with a couple of instructions
+    struct BinBounds
+    {
+#if defined(BVH_USE_SSE)
+        __m128 min = _mm_set1_ps(std::numeric_limits<float>::max());
+        __m128 max = _mm_set1_ps(std::numeric_limits<float>::lowest());
+
+        void Extend(__m128 other_min, __m128 other_max)
+        {
+            min = _mm_min_ps(min, other_min);
+            max = _mm_max_ps(max, other_max);
+        }
+
+        void Extend(BinBounds const& other) { Extend(other.min, other.max); }
+
+        float SurfaceArea() const
+        {
+            alignas(16) float d[4];
+            _mm_store_ps(d, _mm_sub_ps(max, min));
+            return 2.0f * (d[0] * d[1] + d[0] * d[2] + d[1] * d[2]);
+        }
+
+        Bounds3 ToBounds3() const
+        {
+            alignas(16) float bounds_min[4];
+            alignas(16) float bounds_max[4];
+            _mm_store_ps(bounds_min, min);
+            _mm_store_ps(bounds_max, max);
+
+            Bounds3 bounds;
+            bounds.min = float3(bounds_min[0], bounds_min[1], bounds_min[2]);
+            bounds.max = float3(bounds_max[0], bounds_max[1], bounds_max[2]);
+            return bounds;
+        }
+#else
+        Bounds3 bounds;
+
+        void Extend(BinBounds const& other) { bounds = Union(bounds, other.bounds); }
+        float SurfaceArea() const { return bounds.SurfaceArea(); }
+        Bounds3 ToBounds3() const { return bounds; }
+#endif
+    };
+
+    struct SahBin
+    {
+        BinBounds bounds;
+        unsigned int count = 0;
+    };
+
+    struct SahBins
+    {
+        SahBin bins[3][kMaxBuckets];
+    };
+
+    // Maps the centroid to the bins of the three axes, the partition uses the same mapping
+    struct BinMapping
+    {
+        BinMapping(Bounds3 const& centroid_bounds, unsigned int num_buckets)
+        {
+            float3 extent = centroid_bounds.Diagonal();
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                min[axis] = centroid_bounds.min[axis];
+                scale[axis] = extent[axis] > 0.0f ? (float)num_buckets / extent[axis] : 0.0f;
+            }
+
+            max_bin = (float)(num_buckets - 1);
+        }
+
+        unsigned int GetBin(float3 const& centroid, unsigned int axis) const
+        {
+            float bin = (centroid[axis] - min[axis]) * scale[axis];
+            return (unsigned int)std::min(std::max(bin, 0.0f), max_bin);
+        }
+
+        alignas(16) float min[4] = {};
+        alignas(16) float scale[4] = {};
+        float max_bin;
+    };
+
+    void BinPrimitives(std::vector<Bvh::BVHPrimitiveInfo> const& primitive_info, std::size_t begin, std::size_t end,
+        BinMapping const& mapping, SahBins& bins)
+    {
+#if defined(BVH_USE_SSE)
+        __m128 bin_min = _mm_load_ps(mapping.min);
+        __m128 bin_scale = _mm_load_ps(mapping.scale);
+        __m128 max_bin = _mm_set1_ps(mapping.max_bin);
+        __m128 zero = _mm_setzero_ps();
+
+        for (std::size_t i = begin; i < end; ++i)
+        {
+            auto const& info = primitive_info[i];
+            __m128 centroid = _mm_setr_ps(info.centroid.x, info.centroid.y, info.centroid.z, 0.0f);
+            __m128 prim_min = _mm_setr_ps(info.bounds.min.x, info.bounds.min.y, info.bounds.min.z, 0.0f);
+            __m128 prim_max = _mm_setr_ps(info.bounds.max.x, info.bounds.max.y, info.bounds.max.z, 0.0f);
+
+            // Same computation as BinMapping::GetBin for the three axes at once
+            __m128 bin = _mm_mul_ps(_mm_sub_ps(centroid, bin_min), bin_scale);
+            bin = _mm_min_ps(_mm_max_ps(bin, zero), max_bin);
+
+            alignas(16) std::int32_t bin_index[4];
+            _mm_store_si128((__m128i*)bin_index, _mm_cvttps_epi32(bin));
+
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                SahBin& sah_bin = bins.bins[axis][bin_index[axis]];
+                sah_bin.bounds.Extend(prim_min, prim_max);
+                sah_bin.count++;
+            }
+        }
+#else
+        for (std::size_t i = begin; i < end; ++i)
+        {
+            auto const& info = primitive_info[i];
+            for (unsigned int axis = 0; axis < 3; ++axis)
+            {
+                SahBin& sah_bin = bins.bins[axis][mapping.GetBin(info.centroid, axis)];
+                sah_bin.bounds.bounds = Union(sah_bin.bounds.bounds, info.bounds);
+                sah_bin.count++;
+            }
+        }
+#endif
+    }
+
+    bool IsEmpty(Bounds3 const& bounds)
+    {
+        return bounds.min.x > bounds.max.x || bounds.min.y > bounds.max.y || bounds.min.z > bounds.max.z;
+    }
+
+    float SurfaceAreaOrZero(Bounds3 const& bounds)
+    {
+        return IsEmpty(bounds) ? 0.0f : bounds.SurfaceArea();
+    }
+
+    Bounds3 Intersect(Bounds3 const& b1, Bounds3 const& b2)
+    {
+        Bounds3 ret;
+        ret.min = Max(b1.min, b2.min);
+        ret.max = Min(b1.max, b2.max);
+        return ret;
+    }
+
+    // Bounds of the part of the triangle that lies in the slab [plane_min, plane_max] along the axis
+    Bounds3 ClipTriangle(Triangle const& triangle, unsigned int axis, float plane_min, float plane_max)
+    {
+        float3 const vertices[3] = { triangle.v1.position, triangle.v2.position, triangle.v3.position };
+
+        Bounds3 bounds;
+        for (int i = 0; i < 3; ++i)
+        {
+            float3 const& v0 = vertices[i];
+            float3 const& v1 = vertices[(i + 1) % 3];
+
+            if (v0[axis] >= plane_min && v0[axis] <= plane_max)
+            {
+                bounds = Union(bounds, v0);
+            }
+
+            // Add the points where the edge crosses the slab planes
+            for (float plane : { plane_min, plane_max })
+            {
+                if ((v0[axis] < plane) != (v1[axis] < plane))
+                {
+                    float t = (plane - v0[axis]) / (v1[axis] - v0[axis]);
+                    float3 point = v0 + (v1 - v0) * t;
+                    point[axis] = plane;
+                    bounds = Union(bounds, point);
+                }
+            }
+        }
+
+        return bounds;
+    }
+
+    struct SpatialBin
+    {
+        Bounds3 bounds;
+        unsigned int entry = 0;
+        unsigned int exit = 0;
+    };
+
+    struct SpatialBins
+    {
+        SpatialBin bins[3][kMaxBuckets];
+    };
+
+    // Spatial bins split the node bounds into equal slabs. Each reference is clipped to every
+    // slab it overlaps and counted as entering its first slab and exiting its last one
+    void BinReferences(std::vector<Triangle> const& triangles, std::vector<Bvh::BVHPrimitiveInfo> const& primitive_info,
+        std::size_t begin, std::size_t end, Bounds3 const& node_bounds, unsigned int num_buckets, SpatialBins& bins)
+    {
+        float3 extent = node_bounds.Diagonal();
+
+        for (std::size_t i = begin; i < end; ++i)
+        {
+            auto const& info = primitive_info[i];
+            Triangle const& triangle = triangles[info.primitiveNumber];
+
+            for (unsigned int axis = 0; axis < 3; ++axis)
+            {
+                if (extent[axis] <= 0.0f)
+                {
+                    continue;
+                }
+
+                float bin_size = extent[axis] / num_buckets;
+                auto get_bin = [&](float x)
+                {
+                    float bin = (x - node_bounds.min[axis]) / bin_size;
+                    return (unsigned int)std::min(std::max(bin, 0.0f), float(num_buckets - 1));
+                };
+
+                unsigned int first_bin = get_bin(info.bounds.min[axis]);
+                unsigned int last_bin = get_bin(info.bounds.max[axis]);
+                auto& axis_bins = bins.bins[axis];
+
+                if (first_bin == last_bin)
+                {
+                    axis_bins[first_bin].bounds = Union(axis_bins[first_bin].bounds, info.bounds);
+                }
+                else
+                {
+                    for (unsigned int b = first_bin; b <= last_bin; ++b)
+                    {
+                        float plane_min = node_bounds.min[axis] + b * bin_size;
+                        float plane_max = b == num_buckets - 1 ? node_bounds.max[axis] : plane_min + bin_size;
+                        Bounds3 clipped = Intersect(ClipTriangle(triangle, axis, plane_min, plane_max), info.bounds);
+                        if (!IsEmpty(clipped))
+                        {
+                            axis_bins[b].bounds = Union(axis_bins[b].bounds, clipped);
+                        }
+                    }
+                }
+
+                axis_bins[first_bin].entry++;
+                axis_bins[last_bin].exit++;
+            }
+        }
+    }
+
+    // Stable partition of [start, end) that produces the same result as std::stable_partition
+    // regardless of the number of threads. Returns the index of the first element of the second group
+    template <typename Predicate>
+    unsigned int ParallelPartition(ThreadPool& thread_pool, std::vector<Bvh::BVHPrimitiveInfo>& primitive_info,
+        unsigned int start, unsigned int end, Predicate predicate)
+    {
+        std::size_t count = end - start;
+        std::vector<std::size_t> left_offsets(GetNumChunks(count));
+        std::vector<std::size_t> right_offsets(GetNumChunks(count));
+
+        // Count elements of each group per chunk
+        thread_pool.ParallelFor(count, kParallelGrainSize, [&](std::size_t begin, std::size_t end)
+            {
+                std::size_t num_left = 0;
+                for (std::size_t i = begin; i < end; ++i)
+                {
+                    num_left += predicate(primitive_info[start + i]) ? 1 : 0;
+                }
+
+                left_offsets[begin / kParallelGrainSize] = num_left;
+                right_offsets[begin / kParallelGrainSize] = (end - begin) - num_left;
+            });
+
+        // Exclusive prefix sums give the output position of each chunk
+        std::size_t total_left = 0;
+        for (auto& offset : left_offsets)
+        {
+            std::size_t num_left = offset;
+            offset = total_left;
+            total_left += num_left;
+        }
+
+        std::size_t total_right = total_left;
+        for (auto& offset : right_offsets)
+        {
+            std::size_t num_right = offset;
+            offset = total_right;
+            total_right += num_right;
+        }
+
+        std::vector<Bvh::BVHPrimitiveInfo> partitioned(count);
+        thread_pool.ParallelFor(count, kParallelGrainSize, [&](std::size_t begin, std::size_t end)
+            {
+                std::size_t left = left_offsets[begin / kParallelGrainSize];
+                std::size_t right = right_offsets[begin / kParallelGrainSize];
+                for (std::size_t i = begin; i < end; ++i)
+                {
+                    auto const& info = primitive_info[start + i];
+                    partitioned[predicate(info) ? left++ : right++] = info;
+                }
+            });
+
+        thread_pool.ParallelFor(count, kParallelGrainSize, [&](std::size_t begin, std::size_t end)
+            {
+                std::copy(partitioned.begin() + begin, partitioned.begin() + end, primitive_info.begin() + start + begin);
+            });
+
+        return start + (unsigned int)total_left;
+    }
 }
 
-Bvh::Bvh()
+struct Bvh::BuildContext
 {
+    BuildContext(ThreadPool& thread_pool, std::vector<Triangle> const& triangles)
+        : thread_pool(thread_pool), triangles(triangles)
+    {
+        // Each thread allocates the nodes from its own arena
+        for (std::uint32_t i = 0; i < thread_pool.GetThreadCount(); ++i)
+        {
+            arenas.push_back(std::make_unique<MemoryArena>(kBuildNodeArenaBlockSize));
+        }
+    }
+
+    ThreadPool& thread_pool;
+    std::vector<Triangle> const& triangles;
+    std::vector<std::unique_ptr<MemoryArena>> arenas;
+    // Surface area of the scene bounds, the spatial split overlap threshold is relative to it
+    float root_area = 0.0f;
+    std::atomic<unsigned int> total_nodes{ 0 };
+};
+
+Bvh::Bvh(BvhBuildOptions const& options)
+    : options_(options)
+{
+    if (options_.num_buckets < 2 || options_.num_buckets > kMaxBuckets)
+    {
+        throw std::runtime_error("BVH bucket count must be in [2, " + std::to_string(kMaxBuckets) + "]");
+    }
+
+    if (options_.max_leaf_size < 1 || options_.max_leaf_size > kMaxLeafSize)
+    {
+        throw std::runtime_error("BVH max leaf size must be in [1, " + std::to_string(kMaxLeafSize) + "]");
+    }
+
+    if (!(options_.traversal_cost >= 0.0f))
+    {
+        throw std::runtime_error("BVH traversal cost must be non-negative");
+    }
+
+    if (!(options_.max_duplication >= 0.0f))
+    {
+        throw std::runtime_error("BVH max duplication must be non-negative");
+    }
+
+    if (!(options_.optimization_time >= 0.0f))
+    {
+        throw std::runtime_error("BVH optimization time must be non-negative");
+    }
+
+    if (!(options_.rebuild_cost_ratio >= 1.0f))
+    {
+        throw std::runtime_error("BVH rebuild cost ratio must be at least 1");
+    }
 }
 
-void Bvh::BuildCPU(std::vector<Triangle> & triangles)
+void Bvh::BuildCPU(std::vector<Triangle> const& triangles)
 {
-    std::cout << "Building Bounding Volume Hierarchy for scene" << std::endl;
+    if (options_.print_stats)
+    {
+        std::cout << "Building Bounding Volume Hierarchy for scene" << std::endl;
+    }
+
+    build_stats_ = {};
+    auto start_time = Clock::now();
 
-    std::uint32_t max_prims_in_node = 4u;
+    ThreadPool thread_pool(options_.num_threads);
 
-    //double startTime = m_Render.GetCurtime();
     std::vector<BVHPrimitiveInfo> primitiveInfo(triangles.size());
-    for (unsigned int i = 0; i < triangles.size(); ++i)
+    thread_pool.ParallelFor(triangles.size(), kParallelGrainSize, [&](std::size_t begin, std::size_t end)
+        {
+            for (std::size_t i = begin; i < end; ++i)
+            {
+                primitiveInfo[i] = { (unsigned int)i, triangles[i].GetBounds() };
+            }
+        });
+
+    build_stats_.primitive_info_time = ElapsedMilliseconds(start_time, Clock::now());
+    std::size_t num_triangles = triangles.size();
+
+    std::vector<unsigned int> leafPrimitives;
+    BuildNodes(thread_pool, primitiveInfo, triangles, leafPrimitives);
+
+    // The triangles stay in place, the leaves reference them through the slots
+    SetPrimitiveIndices(std::move(leafPrimitives), num_triangles);
+
+    auto layout_start_time = Clock::now();
+
+    if (options_.layout != BvhLayout::kDepthFirst)
+    {
+        nodes_ = ApplyBvhLayout(nodes_, options_.layout, triangles, GetPrimitiveIndices(), options_.layout_sample_rays);
+    }
+
+    auto end_time = Clock::now();
+
+    build_stats_.layout_time = ElapsedMilliseconds(layout_start_time, end_time);
+    build_stats_.total_time = ElapsedMilliseconds(start_time, end_time);
+
+    if (options_.print_stats)
+    {
+        PrintBuildStats("triangles", num_triangles, thread_pool.GetThreadCount());
+    }
+}
+
+void Bvh::Build(std::vector<Bounds3> const& bounds, std::vector<unsigned int>& primitiveOrder)
+{
+    if (options_.spatial_splits)
+    {
+        throw std::runtime_error("BVH spatial splits require the triangles");
+    }
+
+    build_stats_ = {};
+    auto start_time = Clock::now();
+
+    ThreadPool thread_pool(options_.num_threads);
+
+    std::vector<BVHPrimitiveInfo> primitiveInfo(bounds.size());
+    for (std::size_t i = 0; i < bounds.size(); ++i)
+    {
+        primitiveInfo[i] = { (unsigned int)i, bounds[i] };
+    }
+
+    build_stats_.primitive_info_time = ElapsedMilliseconds(start_time, Clock::now());
+
+    BuildNodes(thread_pool, primitiveInfo, std::vector<Triangle>(), primitiveOrder);
+    SetPrimitiveIndices({}, 0);
+
+    build_stats_.total_time = ElapsedMilliseconds(start_time, Clock::now());
+
+    if (options_.print_stats)
+    {
+        PrintBuildStats("primitives", bounds.size(), thread_pool.GetThreadCount());
+    }
+}
+
+std::vector<DirtyRange> Bvh::Refit(std::vector<Triangle> const& triangles,
+    std::vector<std::uint32_t> const& triangle_indices)
+{
+    if (options_.spatial_splits)
     {
-        primitiveInfo[i] = { i, triangles[i].GetBounds() };
+        throw std::runtime_error("BVH refit is not supported with spatial splits");
     }
 
-    unsigned int totalNodes = 0;
-    std::vector<Triangle> orderedTriangles;
-    root_node_ = RecursiveBuild(triangles, primitiveInfo, 0, triangles.size(), &totalNodes, orderedTriangles);
-    triangles.swap(orderedTriangles);
+    if (!refitter_)
+    {
+        refitter_ = std::make_unique<BvhRefitter>(nodes_, GetPrimitiveIndices(), triangles.size(), options_.traversal_cost);
+    }
+
+    return refitter_->Refit(nodes_, triangles, triangle_indices);
+}
+
+void Bvh::BuildNodes(ThreadPool& thread_pool, std::vector<BVHPrimitiveInfo>& primitiveInfo,
+    std::vector<Triangle> const& triangles, std::vector<unsigned int>& leafPrimitives)
+{
+    auto build_start_time = Clock::now();
+    refitter_.reset();
+
+    // All build nodes live in the arenas and are released at once after flattening
+    BuildContext context(thread_pool, triangles);
+    std::size_t primitive_info_memory = primitiveInfo.capacity() * sizeof(BVHPrimitiveInfo);
+    unsigned int num_primitives = (unsigned int)primitiveInfo.size();
+
+    Bounds3 root_bounds;
+    Bounds3 root_centroid_bounds;
+    ComputeBounds(context, primitiveInfo, 0, num_primitives, root_bounds, root_centroid_bounds);
+    context.root_area = root_bounds.SurfaceArea();
+
+    unsigned int split_budget = options_.spatial_splits ? (unsigned int)(options_.max_duplication * num_primitives) : 0;
+    BVHBuildNode* root_node = RecursiveBuild(context, primitiveInfo, 0, num_primitives, split_budget);
+
+    auto optimization_start_time = Clock::now();
+
+    if (options_.optimization_time > 0.0f)
+    {
+        BvhOptimizationStats optimization_stats = OptimizeBvh(root_node, options_.traversal_cost,
+            options_.optimization_time * 1000.0);
+
+        if (options_.print_stats)
+        {
+            std::cout << "BVH optimization: " << optimization_stats.reinsertions << " reinsertions in "
+                << optimization_stats.passes << " passes, SAH cost " << optimization_stats.sah_cost_before << " -> "
+                << optimization_stats.sah_cost_after << " (" << optimization_stats.time << " ms)" << std::endl;
+        }
+    }
 
-    //primitiveInfo.resize(0);
-    std::cout << "BVH created with " << totalNodes << " nodes for " << triangles.size()
-        << " triangles (" << float(totalNodes * sizeof(BVHBuildNode)) / (1024.0f * 1024.0f) << " MB, "
-        //<< m_Render.GetCurtime() - startTime << "s elapsed)"
-        << std::endl;
+    auto flatten_start_time = Clock::now();
 
-    // Compute representation of depth-first traversal of BVH tree
+    // Compute representation of depth-first traversal of BVH tree. The object split leaves
+    // reference contiguous ranges of the partitioned primitive info, while the spatial split
+    // leaves get their ranges assigned here
+    unsigned int totalNodes = context.total_nodes;
     nodes_.resize(totalNodes);
     unsigned int offset = 0;
-    FlattenBVHTree(root_node_, &offset);
+    leafPrimitives.clear();
+    FlattenBVHTree(root_node, INVALID_ID, &offset, leafPrimitives);
     assert(totalNodes == offset);
+
+    if (!options_.spatial_splits)
+    {
+        leafPrimitives.resize(primitiveInfo.size());
+        thread_pool.ParallelFor(primitiveInfo.size(), kParallelGrainSize, [&](std::size_t begin, std::size_t end)
+            {
+                for (std::size_t i = begin; i < end; ++i)
+                {
+                    leafPrimitives[i] = primitiveInfo[i].primitiveNumber;
+                }
+            });
+    }
+
+    AnnotateShadowChildOrder(nodes_, triangles, leafPrimitives);
+
+    std::size_t arena_memory = 0;
+    for (auto const& arena : context.arenas)
+    {
+        arena_memory += arena->GetPeakAllocated();
+    }
+
+    // Free the memory as soon as possible
+    std::vector<BVHPrimitiveInfo>().swap(primitiveInfo);
+    context.arenas.clear();
+
+    auto end_time = Clock::now();
+
+    build_stats_.node_count = totalNodes;
+    build_stats_.reference_count = (std::uint32_t)leafPrimitives.size();
+    build_stats_.peak_memory = arena_memory + primitive_info_memory;
+    build_stats_.build_time = ElapsedMilliseconds(build_start_time, optimization_start_time);
+    build_stats_.optimization_time = ElapsedMilliseconds(optimization_start_time, flatten_start_time);
+    build_stats_.flatten_time = ElapsedMilliseconds(flatten_start_time, end_time);
+    build_stats_.sah_cost = ComputeSahCost(nodes_, options_.traversal_cost);
 }
 
-Bvh::BVHBuildNode* Bvh::RecursiveBuild(
-    std::vector<Triangle> const& triangles,
-    std::vector<BVHPrimitiveInfo>& primitiveInfo,
-    unsigned int start,
-    unsigned int end, unsigned int* totalNodes,
-    std::vector<Triangle>& orderedTriangles)
+void Bvh::PrintBuildStats(char const* primitive_name, std::size_t num_primitives, std::uint32_t num_threads) const
 {
-    assert(start <= end);
+    std::cout << "BVH created with " << build_stats_.node_count << " nodes (" << build_stats_.leaf_count
+        << " leaves) for " << num_primitives << " " << primitive_name << " (" << build_stats_.reference_count << " references, "
+        << sizeof(LinearBVHNode) << " bytes per node, " << float(nodes_.size() * sizeof(LinearBVHNode)) / (1024.0f * 1024.0f) << " MB, peak build memory "
+        << float(build_stats_.peak_memory) / (1024.0f * 1024.0f) << " MB, SAH cost " << build_stats_.sah_cost << ")" << std::endl;
+    std::cout << "BVH build time: " << build_stats_.total_time << " ms on " << num_threads
+        << " threads (primitive info " << build_stats_.primitive_info_time << " ms, build "
+        << build_stats_.build_time << " ms, optimization " << build_stats_.optimization_time << " ms, flatten " << build_stats_.flatten_time
+        << " ms, " << GetBvhLayoutName(options_.layout) << " layout " << build_stats_.layout_time << " ms)" << std::endl;
+}
 
-    //// TODO: Add memory pool
-    BVHBuildNode* node = new BVHBuildNode;
-    (*totalNodes)++;
+void Bvh::ComputeBounds(BuildContext& context, std::vector<BVHPrimitiveInfo> const& primitiveInfo,
+    unsigned int start, unsigned int end, Bounds3& bounds, Bounds3& centroidBounds) const
+{
+    if (end - start < kParallelBinningThreshold)
+    {
+        for (unsigned int i = start; i < end; ++i)
+        {
+            bounds = Union(bounds, primitiveInfo[i].bounds);
+            centroidBounds = Union(centroidBounds, primitiveInfo[i].centroid);
+        }
 
-    // Compute bounds of all primitives in BVH node
-    Bounds3 bounds;
-    for (unsigned int i = start; i < end; ++i)
+        return;
+    }
+
+    std::size_t count = end - start;
+    std::vector<Bounds3> chunk_bounds(GetNumChunks(count));
+    std::vector<Bounds3> chunk_centroid_bounds(GetNumChunks(count));
+
+    context.thread_pool.ParallelFor(count, kParallelGrainSize, [&](std::size_t begin, std::size_t end)
+        {
+            Bounds3 local_bounds;
+            Bounds3 local_centroid_bounds;
+            for (std::size_t i = start + begin; i < start + end; ++i)
+            {
+                local_bounds = Union(local_bounds, primitiveInfo[i].bounds);
+                local_centroid_bounds = Union(local_centroid_bounds, primitiveInfo[i].centroid);
+            }
+
+            chunk_bounds[begin / kParallelGrainSize] = local_bounds;
+            chunk_centroid_bounds[begin / kParallelGrainSize] = local_centroid_bounds;
+        });
+
+    for (std::size_t i = 0; i < chunk_bounds.size(); ++i)
     {
-        bounds = Union(bounds, primitiveInfo[i].bounds);
+        bounds = Union(bounds, chunk_bounds[i]);
+        centroidBounds = Union(centroidBounds, chunk_centroid_bounds[i]);
     }
+}
 
+Bvh::SplitInfo Bvh::FindBinnedSplit(BuildContext& context, std::vector<BVHPrimitiveInfo> const& primitiveInfo,
+    unsigned int start, unsigned int end, Bounds3 const& bounds, Bounds3 const& centroidBounds) const
+{
     unsigned int nPrimitives = end - start;
-    if (nPrimitives == 1)
+    unsigned int nBuckets = options_.num_buckets;
+    BinMapping mapping(centroidBounds, nBuckets);
+
+    SahBins bins;
+    if (nPrimitives < kParallelBinningThreshold)
     {
-        // Create leaf
-        int firstPrimOffset = orderedTriangles.size();
-        for (unsigned int i = start; i < end; ++i)
+        BinPrimitives(primitiveInfo, start, end, mapping, bins);
+    }
+    else
+    {
+        // Bin each chunk separately and merge the results in a fixed order
+        std::vector<SahBins> chunk_bins(GetNumChunks(nPrimitives));
+        context.thread_pool.ParallelFor(nPrimitives, kParallelGrainSize, [&](std::size_t begin, std::size_t end)
+            {
+                BinPrimitives(primitiveInfo, start + begin, start + end, mapping, chunk_bins[begin / kParallelGrainSize]);
+            });
+
+        for (auto const& local_bins : chunk_bins)
         {
-            int primNum = primitiveInfo[i].primitiveNumber;
-            orderedTriangles.push_back(triangles[primNum]);
+            for (unsigned int axis = 0; axis < 3; ++axis)
+            {
+                for (unsigned int b = 0; b < nBuckets; ++b)
+                {
+                    bins.bins[axis][b].bounds.Extend(local_bins.bins[axis][b].bounds);
+                    bins.bins[axis][b].count += local_bins.bins[axis][b].count;
+                }
+            }
         }
-        node->InitLeaf(firstPrimOffset, nPrimitives, bounds);
-        return node;
     }
-    else
+
+    // Sweep the bins from both sides to evaluate every split position in O(buckets)
+    SplitInfo split;
+    float inv_area = 1.0f / bounds.SurfaceArea();
+
+    for (unsigned int axis = 0; axis < 3; ++axis)
     {
-        // Compute bound of primitive centroids, choose split dimension
-        Bounds3 centroidBounds;
-        for (unsigned int i = start; i < end; ++i)
+        if (mapping.scale[axis] == 0.0f)
         {
-            centroidBounds = Union(centroidBounds, primitiveInfo[i].centroid);
+            continue;
         }
-        unsigned int dim = centroidBounds.MaximumExtent();
 
-        // Partition primitives into two sets and build children
-        unsigned int mid = (start + end) / 2;
-        if (centroidBounds.max[dim] == centroidBounds.min[dim])
+        auto const& axis_bins = bins.bins[axis];
+
+        // Right side cost of splitting after bin i
+        float right_cost[kMaxBuckets];
+        unsigned int right_count[kMaxBuckets];
+        BinBounds right_bounds[kMaxBuckets];
+        unsigned int count = 0;
+        for (unsigned int i = nBuckets - 1; i > 0; --i)
         {
-            // Create leaf
-            unsigned int firstPrimOffset = orderedTriangles.size();
-            for (unsigned int i = start; i < end; ++i)
+            right_bounds[i - 1] = right_bounds[i];
+            right_bounds[i - 1].Extend(axis_bins[i].bounds);
+            count += axis_bins[i].count;
+            right_count[i - 1] = count;
+            right_cost[i - 1] = count > 0 ? count * right_bounds[i - 1].SurfaceArea() : 0.0f;
+        }
+
+        BinBounds left_bounds;
+        count = 0;
+        for (unsigned int i = 0; i < nBuckets - 1; ++i)
+        {
+            left_bounds.Extend(axis_bins[i].bounds);
+            count += axis_bins[i].count;
+
+            if (count == 0 || right_count[i] == 0)
+            {
+                continue;
+            }
+
+            float cost = options_.traversal_cost + (count * left_bounds.SurfaceArea() + right_cost[i]) * inv_area;
+            if (cost < split.cost)
             {
-                unsigned int primNum = primitiveInfo[i].primitiveNumber;
-                orderedTriangles.push_back(triangles[primNum]);
+                split = { cost, axis, i, left_bounds.ToBounds3(), right_bounds[i].ToBounds3() };
             }
-            node->InitLeaf(firstPrimOffset, nPrimitives, bounds);
-            return node;
         }
-        else
+    }
+
+    return split;
+}
+
+Bvh::SplitInfo Bvh::FindSweepSplit(std::vector<BVHPrimitiveInfo>& primitiveInfo,
+    unsigned int start, unsigned int end, Bounds3 const& bounds, Bounds3 const& centroidBounds) const
+{
+    unsigned int nPrimitives = end - start;
+
+    auto sort_along_axis = [&](unsigned int axis)
+    {
+        // Ties are broken by the primitive number to keep the build deterministic
+        std::sort(primitiveInfo.begin() + start, primitiveInfo.begin() + end,
+            [axis](BVHPrimitiveInfo const& a, BVHPrimitiveInfo const& b)
+            {
+                return a.centroid[axis] < b.centroid[axis] ||
+                    (a.centroid[axis] == b.centroid[axis] && a.primitiveNumber < b.primitiveNumber);
+            });
+    };
+
+    SplitInfo split;
+    float inv_area = 1.0f / bounds.SurfaceArea();
+    std::vector<float> right_cost(nPrimitives);
+    int last_sorted_axis = -1;
+
+    for (unsigned int axis = 0; axis < 3; ++axis)
+    {
+        if (centroidBounds.max[axis] == centroidBounds.min[axis])
+        {
+            continue;
+        }
+
+        sort_along_axis(axis);
+        last_sorted_axis = axis;
+
+        // right_cost[i] is the cost of primitives [i, nPrimitives)
+        Bounds3 right_bounds;
+        for (unsigned int i = nPrimitives - 1; i > 0; --i)
         {
-            if (nPrimitives <= 2)
+            right_bounds = Union(right_bounds, primitiveInfo[start + i].bounds);
+            right_cost[i] = (nPrimitives - i) * right_bounds.SurfaceArea();
+        }
+
+        Bounds3 left_bounds;
+        for (unsigned int i = 1; i < nPrimitives; ++i)
+        {
+            left_bounds = Union(left_bounds, primitiveInfo[start + i - 1].bounds);
+            float cost = options_.traversal_cost + (i * left_bounds.SurfaceArea() + right_cost[i]) * inv_area;
+            if (cost < split.cost)
             {
-                // Partition primitives into equally-sized subsets
-                mid = (start + end) / 2;
-                std::nth_element(&primitiveInfo[start], &primitiveInfo[mid], &primitiveInfo[end - 1] + 1,
-                    [dim](const BVHPrimitiveInfo& a, const BVHPrimitiveInfo& b)
-                    {
-                        return a.centroid[dim] < b.centroid[dim];
-                    });
+                split.cost = cost;
+                split.axis = axis;
+                split.position = i;
             }
-            else
+        }
+    }
+
+    if (split.cost == std::numeric_limits<float>::max())
+    {
+        return split;
+    }
+
+    // Leave the primitives sorted along the best axis
+    if (last_sorted_axis != (int)split.axis)
+    {
+        sort_along_axis(split.axis);
+    }
+
+    for (unsigned int i = 0; i < nPrimitives; ++i)
+    {
+        Bounds3& child_bounds = i < split.position ? split.leftBounds : split.rightBounds;
+        child_bounds = Union(child_bounds, primitiveInfo[start + i].bounds);
+    }
+
+    return split;
+}
+
+Bvh::SplitInfo Bvh::FindSpatialSplit(BuildContext& context, std::vector<BVHPrimitiveInfo> const& primitiveInfo,
+    Bounds3 const& bounds) const
+{
+    std::size_t nPrimitives = primitiveInfo.size();
+    unsigned int nBuckets = options_.num_buckets;
+
+    SpatialBins bins;
+    if (nPrimitives < kParallelBinningThreshold)
+    {
+        BinReferences(context.triangles, primitiveInfo, 0, nPrimitives, bounds, nBuckets, bins);
+    }
+    else
+    {
+        std::vector<SpatialBins> chunk_bins(GetNumChunks(nPrimitives));
+        context.thread_pool.ParallelFor(nPrimitives, kParallelGrainSize, [&](std::size_t begin, std::size_t end)
             {
-                // Partition primitives using approximate SAH
-                const unsigned int nBuckets = 12;
-                BucketInfo buckets[nBuckets];
+                BinReferences(context.triangles, primitiveInfo, begin, end, bounds, nBuckets,
+                    chunk_bins[begin / kParallelGrainSize]);
+            });
 
-                // Initialize _BucketInfo_ for SAH partition buckets
-                for (unsigned int i = start; i < end; ++i)
+        for (auto const& local_bins : chunk_bins)
+        {
+            for (unsigned int axis = 0; axis < 3; ++axis)
+            {
+                for (unsigned int b = 0; b < nBuckets; ++b)
                 {
-                    int b = nBuckets * centroidBounds.Offset(primitiveInfo[i].centroid)[dim];
-                    if (b == nBuckets) b = nBuckets - 1;
-                    assert(b >= 0 && b < nBuckets);
-                    buckets[b].count++;
-                    buckets[b].bounds = Union(buckets[b].bounds, primitiveInfo[i].bounds);
+                    auto& bin = bins.bins[axis][b];
+                    bin.bounds = Union(bin.bounds, local_bins.bins[axis][b].bounds);
+                    bin.entry += local_bins.bins[axis][b].entry;
+                    bin.exit += local_bins.bins[axis][b].exit;
                 }
+            }
+        }
+    }
 
-                // Compute costs for splitting after each bucket
-                float cost[nBuckets - 1];
-                for (unsigned int i = 0; i < nBuckets - 1; ++i)
-                {
-                    Bounds3 b0, b1;
-                    int count0 = 0, count1 = 0;
-                    for (unsigned int j = 0; j <= i; ++j)
-                    {
-                        b0 = Union(b0, buckets[j].bounds);
-                        count0 += buckets[j].count;
-                    }
-                    for (unsigned int j = i + 1; j < nBuckets; ++j)
-                    {
-                        b1 = Union(b1, buckets[j].bounds);
-                        count1 += buckets[j].count;
-                    }
-                    cost[i] = 1.0f + (count0 * b0.SurfaceArea() + count1 * b1.SurfaceArea()) / bounds.SurfaceArea();
-                }
+    SplitInfo split;
+    float inv_area = 1.0f / bounds.SurfaceArea();
+    float3 extent = bounds.Diagonal();
 
-                // Find bucket to split at that minimizes SAH metric
-                float minCost = cost[0];
-                unsigned int minCostSplitBucket = 0;
-                for (unsigned int i = 1; i < nBuckets - 1; ++i)
-                {
-                    if (cost[i] < minCost)
-                    {
-                        minCost = cost[i];
-                        minCostSplitBucket = i;
-                    }
-                }
+    for (unsigned int axis = 0; axis < 3; ++axis)
+    {
+        if (extent[axis] <= 0.0f)
+        {
+            continue;
+        }
 
-                // Either create leaf or split primitives at selected SAH bucket
-                float leafCost = float(nPrimitives);
-                if (nPrimitives > kMaxPrimitivesInNode || minCost < leafCost)
-                {
-                    BVHPrimitiveInfo* pmid = std::partition(&primitiveInfo[start], &primitiveInfo[end - 1] + 1,
-                        [=](const BVHPrimitiveInfo& pi)
-                        {
-                            int b = nBuckets * centroidBounds.Offset(pi.centroid)[dim];
-                            if (b == nBuckets) b = nBuckets - 1;
-                            assert(b >= 0 && b < nBuckets);
-                            return b <= minCostSplitBucket;
-                        });
-                    mid = pmid - &primitiveInfo[0];
-                }
-                else
-                {
-                    // Create leaf
-                    unsigned int firstPrimOffset = orderedTriangles.size();
-                    for (unsigned int i = start; i < end; ++i)
-                    {
-                        unsigned int primNum = primitiveInfo[i].primitiveNumber;
-                        orderedTriangles.push_back(triangles[primNum]);
-                    }
-                    node->InitLeaf(firstPrimOffset, nPrimitives, bounds);
+        auto const& axis_bins = bins.bins[axis];
 
-                    return node;
-                }
+        // The references exiting to the right of the plane after bin i belong to the right child
+        Bounds3 right_bounds[kMaxBuckets];
+        unsigned int right_count[kMaxBuckets];
+        unsigned int count = 0;
+        for (unsigned int i = nBuckets - 1; i > 0; --i)
+        {
+            right_bounds[i - 1] = Union(i < nBuckets - 1 ? right_bounds[i] : Bounds3(), axis_bins[i].bounds);
+            count += axis_bins[i].exit;
+            right_count[i - 1] = count;
+        }
+
+        Bounds3 left_bounds;
+        count = 0;
+        for (unsigned int i = 0; i < nBuckets - 1; ++i)
+        {
+            left_bounds = Union(left_bounds, axis_bins[i].bounds);
+            count += axis_bins[i].entry;
+
+            if (count == 0 || right_count[i] == 0)
+            {
+                continue;
+            }
+
+            float cost = options_.traversal_cost + (count * SurfaceAreaOrZero(left_bounds)
+                + right_count[i] * SurfaceAreaOrZero(right_bounds[i])) * inv_area;
+            if (cost < split.cost)
+            {
+                split = { cost, axis, i, left_bounds, right_bounds[i] };
+            }
+        }
+    }
+
+    return split;
+}
+
+bool Bvh::PerformSpatialSplit(BuildContext& context, std::vector<BVHPrimitiveInfo> const& primitiveInfo,
+    Bounds3 const& bounds, SplitInfo const& split, unsigned int& splitBudget,
+    std::vector<BVHPrimitiveInfo>& left, std::vector<BVHPrimitiveInfo>& right) const
+{
+    unsigned int axis = split.axis;
+    float plane = bounds.min[axis] + (split.position + 1) * (bounds.Diagonal()[axis] / options_.num_buckets);
+
+    struct StraddlingReference
+    {
+        BVHPrimitiveInfo const* info;
+        Bounds3 left_bounds;
+        Bounds3 right_bounds;
+    };
+
+    // Sort out the references that lie entirely on one side of the plane
+    Bounds3 left_bounds;
+    Bounds3 right_bounds;
+    std::vector<StraddlingReference> straddling;
+    for (auto const& info : primitiveInfo)
+    {
+        if (info.bounds.max[axis] <= plane)
+        {
+            left.push_back(info);
+            left_bounds = Union(left_bounds, info.bounds);
+            continue;
+        }
+
+        if (info.bounds.min[axis] >= plane)
+        {
+            right.push_back(info);
+            right_bounds = Union(right_bounds, info.bounds);
+            continue;
+        }
+
+        Triangle const& triangle = context.triangles[info.primitiveNumber];
+        float lowest = std::numeric_limits<float>::lowest();
+        float highest = std::numeric_limits<float>::max();
+        StraddlingReference reference = { &info,
+            Intersect(ClipTriangle(triangle, axis, lowest, plane), info.bounds),
+            Intersect(ClipTriangle(triangle, axis, plane, highest), info.bounds) };
+
+        // The clipped part can vanish because of the limited precision
+        if (IsEmpty(reference.left_bounds) || IsEmpty(reference.right_bounds))
+        {
+            auto& side = IsEmpty(reference.left_bounds) ? right : left;
+            Bounds3& side_bounds = IsEmpty(reference.left_bounds) ? right_bounds : left_bounds;
+            side.push_back(info);
+            side_bounds = Union(side_bounds, info.bounds);
+            continue;
+        }
+
+        left_bounds = Union(left_bounds, reference.left_bounds);
+        right_bounds = Union(right_bounds, reference.right_bounds);
+        straddling.push_back(reference);
+    }
+
+    // Duplicate the straddling references unless it's cheaper to move them to one side
+    // (reference unsplitting), or the duplication budget is exhausted
+    std::size_t left_count = left.size() + straddling.size();
+    std::size_t right_count = right.size() + straddling.size();
+    for (auto const& reference : straddling)
+    {
+        Bounds3 left_union = Union(left_bounds, reference.info->bounds);
+        Bounds3 right_union = Union(right_bounds, reference.info->bounds);
+
+        float split_cost = left_bounds.SurfaceArea() * left_count + right_bounds.SurfaceArea() * right_count;
+        float left_cost = left_union.SurfaceArea() * left_count + right_bounds.SurfaceArea() * (right_count - 1);
+        float right_cost = left_bounds.SurfaceArea() * (left_count - 1) + right_union.SurfaceArea() * right_count;
+
+        if (splitBudget > 0 && split_cost < left_cost && split_cost < right_cost)
+        {
+            left.emplace_back(reference.info->primitiveNumber, reference.left_bounds);
+            right.emplace_back(reference.info->primitiveNumber, reference.right_bounds);
+            --splitBudget;
+        }
+        else if (left_cost <= right_cost)
+        {
+            left.push_back(*reference.info);
+            left_bounds = left_union;
+            --right_count;
+        }
+        else
+        {
+            right.push_back(*reference.info);
+            right_bounds = right_union;
+            --left_count;
+        }
+    }
+
+    return !left.empty() && !right.empty();
+}
+
+Bvh::BVHBuildNode* Bvh::RecursiveBuild(BuildContext& context, std::vector<BVHPrimitiveInfo>& primitiveInfo,
+    unsigned int start, unsigned int end, unsigned int splitBudget)
+{
+    assert(start < end);
+
+    MemoryArena& arena = *context.arenas[context.thread_pool.GetThreadIndex()];
+    BVHBuildNode* node = arena.Alloc<BVHBuildNode>();
+    context.total_nodes.fetch_add(1, std::memory_order_relaxed);
+
+    // Compute bounds of all primitives and their centroids in BVH node
+    Bounds3 bounds;
+    Bounds3 centroidBounds;
+    ComputeBounds(context, primitiveInfo, start, end, bounds, centroidBounds);
+
+    // The object split leaves reference the primitive info range directly, the triangle slots are set
+    // after the build. The spatial split build owns a separate reference list per node instead
+    auto init_leaf = [&]()
+    {
+        node->InitLeaf(start, end - start, bounds);
+
+        if (options_.spatial_splits)
+        {
+            node->primitiveNumbers = arena.AllocArray<unsigned int>(end - start);
+            for (unsigned int i = start; i < end; ++i)
+            {
+                node->primitiveNumbers[i - start] = primitiveInfo[i].primitiveNumber;
             }
+        }
+
+        return node;
+    };
+
+    unsigned int nPrimitives = end - start;
+    if (nPrimitives == 1)
+    {
+        return init_leaf();
+    }
+
+    bool full_sweep = nPrimitives <= options_.full_sweep_threshold;
+    SplitInfo split = full_sweep ? FindSweepSplit(primitiveInfo, start, end, bounds, centroidBounds)
+        : FindBinnedSplit(context, primitiveInfo, start, end, bounds, centroidBounds);
+    bool has_split = split.cost < std::numeric_limits<float>::max();
+
+    // Try a spatial split if the children of the object split overlap considerably
+    SplitInfo spatial;
+    if (options_.spatial_splits && splitBudget > 0)
+    {
+        float overlap_area = has_split ? SurfaceAreaOrZero(Intersect(split.leftBounds, split.rightBounds))
+            : std::numeric_limits<float>::max();
+
+        if (overlap_area > options_.spatial_split_alpha * context.root_area)
+        {
+            spatial = FindSpatialSplit(context, primitiveInfo, bounds);
+        }
+    }
+
+    // Either create leaf or split primitives at the selected position
+    float leafCost = float(nPrimitives);
+    float bestCost = std::min(split.cost, spatial.cost);
+    if (nPrimitives <= options_.max_leaf_size && leafCost <= bestCost)
+    {
+        return init_leaf();
+    }
+
+    // The spatial split may fail if all straddling references end up on one side
+    std::vector<BVHPrimitiveInfo> children_info[2];
+    bool spatial_split = spatial.cost < split.cost &&
+        PerformSpatialSplit(context, primitiveInfo, bounds, spatial, splitBudget, children_info[0], children_info[1]);
+
+    if (spatial_split)
+    {
+        split = spatial;
+    }
+    else
+    {
+        children_info[0].clear();
+        children_info[1].clear();
+    }
+
+    unsigned int dim = split.axis;
+    unsigned int mid = (start + end) / 2;
+
+    if (spatial_split)
+    {
+        // The children ranges are relative to their own reference lists
+        mid = 0;
+    }
+    else if (!has_split)
+    {
+        // All centroids are at the same point, but the leaf would be too large.
+        // Split the range in the middle, it's as good as any other split here
+        dim = bounds.MaximumExtent();
+    }
+    else if (full_sweep)
+    {
+        mid = start + split.position;
+    }
+    else
+    {
+        BinMapping mapping(centroidBounds, options_.num_buckets);
+        auto predicate = [&mapping, dim, split](const BVHPrimitiveInfo& pi)
+        {
+            return mapping.GetBin(pi.centroid, dim) <= split.position;
+        };
+
+        if (nPrimitives < kParallelBinningThreshold)
+        {
+            BVHPrimitiveInfo* pmid = std::partition(&primitiveInfo[start], &primitiveInfo[end - 1] + 1, predicate);
+            mid = pmid - &primitiveInfo[0];
+        }
+        else
+        {
+            mid = ParallelPartition(context.thread_pool, primitiveInfo, start, end, predicate);
+        }
+    }
 
-            node->InitInterior(dim,
-                RecursiveBuild(triangles, primitiveInfo, start, mid,
-                    totalNodes, orderedTriangles),
-                RecursiveBuild(triangles, primitiveInfo, mid, end,
-                    totalNodes, orderedTriangles));
+    // Each child of the spatial split build gets its own copy of the references
+    // and the remaining duplication budget in proportion to its size
+    unsigned int children_start[2] = { start, mid };
+    unsigned int children_end[2] = { mid, end };
+    unsigned int children_budget[2] = {};
+    if (options_.spatial_splits)
+    {
+        if (!spatial_split)
+        {
+            children_info[0].assign(primitiveInfo.begin() + start, primitiveInfo.begin() + mid);
+            children_info[1].assign(primitiveInfo.begin() + mid, primitiveInfo.begin() + end);
+        }
+
+        std::vector<BVHPrimitiveInfo>().swap(primitiveInfo);
+
+        std::size_t left_size = children_info[0].size();
+        std::size_t total_size = left_size + children_info[1].size();
+        children_budget[0] = (unsigned int)(std::uint64_t(splitBudget) * left_size / total_size);
+        children_budget[1] = splitBudget - children_budget[0];
+
+        for (int i = 0; i < 2; ++i)
+        {
+            children_start[i] = 0;
+            children_end[i] = (unsigned int)children_info[i].size();
         }
     }
 
+    assert(children_start[0] < children_end[0] && children_start[1] < children_end[1]);
+
+    auto build_child = [&](int i)
+    {
+        std::vector<BVHPrimitiveInfo>& child_info = options_.spatial_splits ? children_info[i] : primitiveInfo;
+        return RecursiveBuild(context, child_info, children_start[i], children_end[i], children_budget[i]);
+    };
+
+    BVHBuildNode* children[2] = {};
+    if (nPrimitives < kParallelBuildThreshold)
+    {
+        children[0] = build_child(0);
+        children[1] = build_child(1);
+    }
+    else
+    {
+        // Spawn a task for the left subtree and build the right one on this thread
+        ThreadPool::TaskGroup task_group;
+        context.thread_pool.Run(task_group, [&]()
+            {
+                children[0] = build_child(0);
+            });
+        children[1] = build_child(1);
+        context.thread_pool.Wait(task_group);
+    }
+
+    node->InitInterior(dim, children[0], children[1]);
+
     return node;
 }
 
-unsigned int Bvh::FlattenBVHTree(BVHBuildNode* node, unsigned int* offset)
+unsigned int Bvh::FlattenBVHTree(BVHBuildNode* node, unsigned int parent, unsigned int* offset,
+    std::vector<unsigned int>& leafPrimitives)
 {
     LinearBVHNode* linearNode = &nodes_[*offset];
     linearNode->bounds = node->bounds;
+    linearNode->parent = parent;
     unsigned int myOffset = (*offset)++;
     if (node->nPrimitives > 0)
     {
@@ -231,15 +1161,95 @@ unsigned int Bvh::FlattenBVHTree(BVHBuildNode* node, unsigned int* offset)
         assert(node->nPrimitives < 65536);
         linearNode->offset = node->firstPrimOffset;
         linearNode->num_primitives_axis = node->nPrimitives << 16;
+        ++build_stats_.leaf_count;
+
+        if (node->primitiveNumbers)
+        {
+            linearNode->offset = (unsigned int)leafPrimitives.size();
+            leafPrimitives.insert(leafPrimitives.end(), node->primitiveNumbers, node->primitiveNumbers + node->nPrimitives);
+        }
     }
     else
     {
         // Create interior flattened BVH node
         linearNode->num_primitives_axis = node->splitAxis;
         //linearNode->nPrimitives = 0;
-        FlattenBVHTree(node->children[0], offset);
-        linearNode->offset = FlattenBVHTree(node->children[1], offset);
+        linearNode->first_child = FlattenBVHTree(node->children[0], myOffset, offset, leafPrimitives);
+        linearNode->offset = FlattenBVHTree(node->children[1], myOffset, offset, leafPrimitives);
     }
 
     return myOffset;
 }
+
+void AnnotateShadowChildOrder(std::vector<LinearBVHNode>& nodes, std::vector<Triangle> const& triangles,
+    std::vector<std::uint32_t> const& primitive_indices)
+{
+    if (nodes.empty())
+    {
+        return;
+    }
+
+    // Pre-order of the nodes, the children are finished when iterating backwards
+    std::vector<std::uint32_t> order;
+    order.reserve(nodes.size());
+    std::vector<std::uint32_t> stack = { 0 };
+    while (!stack.empty())
+    {
+        std::uint32_t node_index = stack.back();
+        stack.pop_back();
+        order.push_back(node_index);
+
+        LinearBVHNode const& node = nodes[node_index];
+        if ((node.num_primitives_axis >> 16) == 0)
+        {
+            stack.push_back(node.first_child);
+            stack.push_back(node.offset);
+        }
+    }
+
+    // Triangle area or primitive count of every subtree
+    std::vector<float> occluder_areas(nodes.size(), 0.0f);
+
+    for (auto it = order.rbegin(); it != order.rend(); ++it)
+    {
+        LinearBVHNode& node = nodes[*it];
+        std::uint32_t num_primitives = node.num_primitives_axis >> 16;
+
+        if (num_primitives > 0)
+        {
+            for (std::uint32_t i = 0; i < num_primitives; ++i)
+            {
+                occluder_areas[*it] += triangles.empty() ? 1.0f : triangles[primitive_indices[node.offset + i]].GetArea();
+            }
+            continue;
+        }
+
+        LinearBVHNode const& first_child = nodes[node.first_child];
+        LinearBVHNode const& second_child = nodes[node.offset];
+        bool first_leaf = IsLeaf(first_child);
+        bool second_leaf = IsLeaf(second_child);
+        occluder_areas[*it] = occluder_areas[node.first_child] + occluder_areas[node.offset];
+
+        bool second_first;
+        if (first_leaf != second_leaf)
+        {
+            second_first = second_leaf;
+        }
+        else if (triangles.empty())
+        {
+            second_first = occluder_areas[node.offset] > occluder_areas[node.first_child];
+        }
+        else
+        {
+            // A ray entering a box is blocked by a triangle with a probability of about twice
+            // the triangle area over the box surface area, the box is entered with a
+            // probability proportional to its surface area
+            float first_score = std::min(first_child.bounds.SurfaceArea(), 2.0f * occluder_areas[node.first_child]);
+            float second_score = std::min(second_child.bounds.SurfaceArea(), 2.0f * occluder_areas[node.offset]);
+            second_first = second_score > first_score;
+        }
+
+        node.num_primitives_axis = (node.num_primitives_axis & BVH_NODE_AXIS_MASK)
+            | (second_first ? BVH_NODE_SHADOW_SECOND_FIRST : 0);
+    }
+}
@@ -25,16 +25,109 @@
 #pragma once
 
 #include "acceleration_structure.hpp"
+#include "bvh_layout.hpp"
+#include "bvh_refit.hpp"
+#include "utils/memory_arena.hpp"
+#include <limits>
 #include <memory>
 
+class ThreadPool;
+
+struct BvhBuildOptions
+{
+    // Number of build threads, 0 means all hardware threads
+    std::uint32_t num_threads = 0;
+    // Number of SAH bins per axis
+    std::uint32_t num_buckets = 16;
+    // Cost of a node traversal step relative to the cost of a ray-triangle test
+    float traversal_cost = 1.0f;
+    // Nodes with more primitives are always split
+    std::uint32_t max_leaf_size = 4;
+    // Nodes with at most this number of primitives evaluate every split position
+    // (exact SAH) instead of binning, 0 disables the full sweep
+    std::uint32_t full_sweep_threshold = 32;
+    // Spatial splits (SBVH) clip the triangles against the split plane and reference them
+    // from both children, which reduces the overlap of the nodes of large and long triangles
+    bool spatial_splits = false;
+    // Spatial splits are only evaluated if the children of the object split overlap
+    // by more than this fraction of the root surface area
+    float spatial_split_alpha = 1e-5f;
+    // Maximum number of duplicated triangle references relative to the triangle count
+    float max_duplication = 0.5f;
+    // Cells per triangle of the top level of the two-level grid
+    float grid_top_density = 1.0f / 16.0f;
+    // Cells per triangle of the subgrid of each top level cell
+    float grid_cell_density = 2.0f;
+    // Morton code length used by the linear builder, 30 or 63 bits
+    std::uint32_t morton_code_bits = 30;
+    // Branching factor of the traversed tree: 2 traverses the binary nodes,
+    // 4 and 8 collapse them into wide nodes before the upload
+    std::uint32_t width = 2;
+    // Quantize the child bounds of the binary nodes to 8 or 16 bits before the upload,
+    // 0 uploads the uncompressed nodes. Requires leaves of at most 16 primitives
+    std::uint32_t quantization_bits = 0;
+    // Stack strategy of the binary BVH traversal, only used with the uncompressed binary nodes
+    BvhTraversal traversal = BvhTraversal::kAuto;
+    // Time the treelet scheduled traversal against the single pass traversal every frame
+    bool treelet_benchmark = false;
+    // Intersect the triangles with the watertight test on their vertices instead of the
+    // Moller-Trumbore test on the precomputed edges
+    bool watertight_triangles = false;
+    // Store the leaf triangles as pools of unique vertices per leaf indexed by bytes instead
+    // of separate triangle records. Only used with the uncompressed binary nodes
+    bool compressed_leaves = false;
+    // Time budget in seconds of the reinsertion pass that improves the tree before
+    // flattening, 0 disables it. Only used by the SAH builder
+    float optimization_time = 0.0f;
+    // Memory order of the nodes of the triangle hierarchies
+    BvhLayout layout = BvhLayout::kDepthFirst;
+    // Number of rays traced to measure the node visits of the hot-first layout
+    std::uint32_t layout_sample_rays = 1 << 16;
+    // Print the build statistics to the console
+    bool print_stats = true;
+    // Refitted trees are rebuilt once their SAH cost exceeds the cost after the build
+    // by this factor
+    float rebuild_cost_ratio = 1.5f;
+    // Start rendering with a fast low quality tree and swap in the tree of these options once
+    // it has been built on a background thread. Only used by the SAH builder
+    bool background_build = false;
+};
+
 class Bvh : public AccelerationStructure
 {
 public:
-    Bvh();
+    explicit Bvh(BvhBuildOptions const& options = BvhBuildOptions());
 
-    // TODO: USE CONSTANT REF
-    void BuildCPU(std::vector<Triangle> & triangles) override;
+    void BuildCPU(std::vector<Triangle> const& triangles) override;
+    // Builds the hierarchy over arbitrary primitives given by their bounds, the leaves reference
+    // primitiveOrder, which receives the primitive indices. Spatial splits are not supported,
+    // the triangle slots are left empty
+    void Build(std::vector<Bounds3> const& bounds, std::vector<unsigned int>& primitiveOrder);
     std::vector<LinearBVHNode> const& GetNodes() const override { return nodes_; }
+    // Not supported with spatial splits, which duplicate the triangles
+    std::vector<DirtyRange> Refit(std::vector<Triangle> const& triangles,
+        std::vector<std::uint32_t> const& triangle_indices) override;
+    float GetRefitCostRatio() const override { return refitter_ ? refitter_->GetSahCostRatio() : 1.0f; }
+
+    struct BuildStats
+    {
+        std::uint32_t node_count = 0;
+        std::uint32_t leaf_count = 0;
+        // Number of triangles referenced by the leaves, includes the spatial split duplicates
+        std::uint32_t reference_count = 0;
+        // Peak memory used by the temporary build data in bytes
+        std::size_t peak_memory = 0;
+        // Wall time of each build phase in milliseconds
+        double primitive_info_time = 0.0;
+        double build_time = 0.0;
+        double optimization_time = 0.0;
+        double flatten_time = 0.0;
+        double layout_time = 0.0;
+        double total_time = 0.0;
+        float sah_cost = 0.0f;
+    };
+
+    BuildStats const& GetBuildStats() const { return build_stats_; }
 
     //void IntersectRays(cl::Buffer const& rays_buffer, cl::Buffer const& ray_counter_buffer,
     //    std::uint32_t max_num_rays, cl::Buffer const& hits_buffer, bool closest_hit = true) override;
@@ -63,6 +156,7 @@ public:
             nPrimitives = n;
             bounds = b;
             children[0] = children[1] = nullptr;
+            primitiveNumbers = nullptr;
 
         }
 
@@ -79,25 +173,55 @@ public:
         Bounds3 bounds;
         BVHBuildNode* children[2];
         int splitAxis, firstPrimOffset, nPrimitives;
+        // Leaves of the spatial split build keep their own primitive list since the references are duplicated
+        unsigned int* primitiveNumbers;
 
     };
 
-    struct BucketInfo
+private:
+    struct BuildContext;
+
+    struct SplitInfo
     {
-        int count = 0;
-        Bounds3 bounds;
+        // No split found until a candidate is evaluated
+        float cost = std::numeric_limits<float>::max();
+        unsigned int axis = 0;
+        // Last bin of the left child for the binned SAH and the spatial split,
+        // first primitive of the right child for the full sweep
+        unsigned int position = 0;
+        Bounds3 leftBounds;
+        Bounds3 rightBounds;
     };
 
-private:
-    BVHBuildNode* RecursiveBuild(
-        std::vector<Triangle> const& triangles,
-        std::vector<BVHPrimitiveInfo>& primitiveInfo,
-        unsigned int start,
-        unsigned int end, unsigned int* totalNodes,
-        std::vector<Triangle>& orderedTriangles);
-    unsigned int FlattenBVHTree(BVHBuildNode* node, unsigned int* offset);
-
+    BVHBuildNode* RecursiveBuild(BuildContext& context, std::vector<BVHPrimitiveInfo>& primitiveInfo,
+        unsigned int start, unsigned int end, unsigned int splitBudget);
+    void ComputeBounds(BuildContext& context, std::vector<BVHPrimitiveInfo> const& primitiveInfo,
+        unsigned int start, unsigned int end, Bounds3& bounds, Bounds3& centroidBounds) const;
+    SplitInfo FindBinnedSplit(BuildContext& context, std::vector<BVHPrimitiveInfo> const& primitiveInfo,
+        unsigned int start, unsigned int end, Bounds3 const& bounds, Bounds3 const& centroidBounds) const;
+    SplitInfo FindSweepSplit(std::vector<BVHPrimitiveInfo>& primitiveInfo,
+        unsigned int start, unsigned int end, Bounds3 const& bounds, Bounds3 const& centroidBounds) const;
+    SplitInfo FindSpatialSplit(BuildContext& context, std::vector<BVHPrimitiveInfo> const& primitiveInfo,
+        Bounds3 const& bounds) const;
+    bool PerformSpatialSplit(BuildContext& context, std::vector<BVHPrimitiveInfo> const& primitiveInfo,
+        Bounds3 const& bounds, SplitInfo const& split, unsigned int& splitBudget,
+        std::vector<BVHPrimitiveInfo>& left, std::vector<BVHPrimitiveInfo>& right) const;
+    void BuildNodes(ThreadPool& thread_pool, std::vector<BVHPrimitiveInfo>& primitiveInfo,
+        std::vector<Triangle> const& triangles, std::vector<unsigned int>& leafPrimitives);
+    void PrintBuildStats(char const* primitive_name, std::size_t num_primitives, std::uint32_t num_threads) const;
+    unsigned int FlattenBVHTree(BVHBuildNode* node, unsigned int parent, unsigned int* offset,
+        std::vector<unsigned int>& leafPrimitives);
+
+    BvhBuildOptions options_;
     std::vector<LinearBVHNode> nodes_;
-    BVHBuildNode* root_node_;
-    std::uint32_t max_prims_in_node_;
+    // Created by the first refit after a build
+    std::unique_ptr<BvhRefitter> refitter_;
+    BuildStats build_stats_;
 };
+
+// Sets BVH_NODE_SHADOW_SECOND_FIRST in the interior nodes whose second child is more likely to
+// stop a shadow ray. A leaf child is tested before an interior one, otherwise the child with
+// the larger expected occluded area goes first. The primitive counts replace the triangle
+// areas if the triangles are empty
+void AnnotateShadowChildOrder(std::vector<LinearBVHNode>& nodes, std::vector<Triangle> const& triangles,
+    std::vector<std::uint32_t> const& primitive_indices);
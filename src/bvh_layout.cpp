@@ -0,0 +1,630 @@
+/*****************************************************************************
+ MIT License
+
+ Copyright(c) 2023 Alexander Veselov
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this softwareand associated documentation files(the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions :
+
+ The above copyright noticeand this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *****************************************************************************/
+
+#include "bvh_layout.hpp"
+#include "kernels/common/constants.h"
+#include "utils/timer.hpp"
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <numeric>
+#include <queue>
+#include <random>
+#include <stdexcept>
+
+namespace
+{
+    // 4 nodes of 48 bytes fill exactly 3 cache lines of 64 bytes
+    constexpr std::uint32_t kTreeletSize = 4;
+    constexpr std::uint32_t kCacheLineSize = 64;
+    constexpr std::uint32_t kMaxStackSize = 64;
+    constexpr std::uint32_t kSampleRaySeed = 5489;
+
+    struct SampleRay
+    {
+        float3 origin;
+        float3 direction;
+    };
+
+    // Random rays starting inside the scene bounds, uniformly distributed over the directions
+    std::vector<SampleRay> GenerateSampleRays(Bounds3 const& bounds, std::uint32_t num_rays)
+    {
+        std::mt19937 rng(kSampleRaySeed);
+        std::uniform_real_distribution<float> distribution(0.0f, 1.0f);
+
+        std::vector<SampleRay> rays(num_rays);
+        for (auto& ray : rays)
+        {
+            float3 extent = bounds.max - bounds.min;
+            ray.origin = bounds.min + float3(extent.x * distribution(rng), extent.y * distribution(rng), extent.z * distribution(rng));
+
+            float z = 1.0f - 2.0f * distribution(rng);
+            float r = std::sqrt(std::max(0.0f, 1.0f - z * z));
+            float phi = 2.0f * MATH_PI * distribution(rng);
+            ray.direction = float3(r * std::cos(phi), r * std::sin(phi), z);
+        }
+
+        return rays;
+    }
+
+    bool RayBounds(Bounds3 const& bounds, float3 const& origin, float3 const& inv_dir, float t_max)
+    {
+        float t_min = 0.0f;
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            float t0 = (bounds.min[axis] - origin[axis]) * inv_dir[axis];
+            float t1 = (bounds.max[axis] - origin[axis]) * inv_dir[axis];
+            t_min = std::max(t_min, std::min(t0, t1));
+            t_max = std::min(t_max, std::max(t0, t1));
+        }
+
+        return t_min <= t_max;
+    }
+
+    bool RayTriangle(SampleRay const& ray, Triangle const& triangle, float& t)
+    {
+        float3 e1 = triangle.v2.position - triangle.v1.position;
+        float3 e2 = triangle.v3.position - triangle.v1.position;
+        float3 s1 = Cross(ray.direction, e2);
+        float determinant = Dot(s1, e1);
+        if (determinant == 0.0f)
+        {
+            return false;
+        }
+
+        float inv_determinant = 1.0f / determinant;
+        float3 d = ray.origin - triangle.v1.position;
+        float b1 = Dot(d, s1) * inv_determinant;
+        float3 s2 = Cross(d, e1);
+        float b2 = Dot(ray.direction, s2) * inv_determinant;
+        float hit_t = Dot(e2, s2) * inv_determinant;
+
+        if (b1 < 0.0f || b2 < 0.0f || b1 + b2 > 1.0f || hit_t < 0.0f || hit_t > t)
+        {
+            return false;
+        }
+
+        t = hit_t;
+        return true;
+    }
+
+    // Closest hit traversal of the subtree below root in the same order as TraceBvh, calls
+    // visit for every fetched node. The subtree below skipped_node isn't entered. Shortens t to
+    // the closest hit and returns the leaf of the hit, INVALID_ID if nothing has been hit
+    template <typename Visitor>
+    std::uint32_t TraceSubtree(std::vector<LinearBVHNode> const& nodes, std::vector<Triangle> const& triangles,
+        std::vector<std::uint32_t> const& primitive_indices, SampleRay const& ray, std::uint32_t root,
+        std::uint32_t skipped_node, float& t, Visitor&& visit)
+    {
+        float3 inv_dir(1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z);
+        std::uint32_t hit_leaf = INVALID_ID;
+
+        std::uint32_t stack[kMaxStackSize];
+        std::uint32_t stack_size = 0;
+        std::uint32_t node_index = root;
+
+        while (true)
+        {
+            LinearBVHNode const& node = nodes[node_index];
+
+            bool skipped = node_index == skipped_node;
+            if (!skipped)
+            {
+                visit(node_index);
+            }
+
+            if (!skipped && RayBounds(node.bounds, ray.origin, inv_dir, t))
+            {
+                std::uint32_t num_primitives = node.num_primitives_axis >> 16;
+                if (num_primitives == 0)
+                {
+                    if (stack_size == kMaxStackSize)
+                    {
+                        throw std::runtime_error("BVH is too deep for the traversal stack");
+                    }
+
+                    bool negative = inv_dir[node.num_primitives_axis & BVH_NODE_AXIS_MASK] < 0.0f;
+                    stack[stack_size++] = negative ? node.first_child : node.offset;
+                    node_index = negative ? node.offset : node.first_child;
+                    continue;
+                }
+
+                for (std::uint32_t i = 0; i < num_primitives; ++i)
+                {
+                    if (RayTriangle(ray, triangles[primitive_indices[node.offset + i]], t))
+                    {
+                        hit_leaf = node_index;
+                    }
+                }
+            }
+
+            if (stack_size == 0)
+            {
+                break;
+            }
+
+            node_index = stack[--stack_size];
+        }
+
+        return hit_leaf;
+    }
+
+    template <typename Visitor>
+    void TraceRay(std::vector<LinearBVHNode> const& nodes, std::vector<Triangle> const& triangles,
+        std::vector<std::uint32_t> const& primitive_indices, SampleRay const& ray, Visitor&& visit)
+    {
+        float t = std::numeric_limits<float>::max();
+        TraceSubtree(nodes, triangles, primitive_indices, ray, 0, INVALID_ID, t, visit);
+    }
+
+    class BvhLayoutBuilder
+    {
+    public:
+        BvhLayoutBuilder(std::vector<LinearBVHNode> const& nodes, std::vector<Triangle> const& triangles,
+            std::vector<std::uint32_t> const& primitive_indices)
+            : nodes_(nodes), triangles_(triangles), primitive_indices_(primitive_indices)
+        {
+        }
+
+        std::vector<LinearBVHNode> Apply(BvhLayout layout, std::uint32_t sample_rays)
+        {
+            order_.clear();
+            order_.reserve(nodes_.size());
+
+            switch (layout)
+            {
+            case BvhLayout::kDepthFirst:
+                LayoutDepthFirst();
+                break;
+            case BvhLayout::kVanEmdeBoas:
+                LayoutVanEmdeBoas(0, ComputeHeight());
+                break;
+            case BvhLayout::kTreelet:
+                LayoutTreelets();
+                break;
+            case BvhLayout::kHotFirst:
+                LayoutHotFirst(sample_rays);
+                break;
+            default:
+                throw std::runtime_error("Unknown BVH layout");
+            }
+
+            return Reorder();
+        }
+
+    private:
+        void LayoutDepthFirst()
+        {
+            std::vector<std::uint32_t> stack = { 0 };
+            while (!stack.empty())
+            {
+                std::uint32_t node_index = stack.back();
+                stack.pop_back();
+                order_.push_back(node_index);
+
+                LinearBVHNode const& node = nodes_[node_index];
+                if (!IsLeaf(node))
+                {
+                    stack.push_back(node.offset);
+                    stack.push_back(node.first_child);
+                }
+            }
+        }
+
+        // Number of levels of the deepest path from the root
+        std::uint32_t ComputeHeight() const
+        {
+            std::uint32_t height = 0;
+            std::vector<std::pair<std::uint32_t, std::uint32_t>> stack = { { 0, 1 } };
+            while (!stack.empty())
+            {
+                auto [node_index, depth] = stack.back();
+                stack.pop_back();
+                height = std::max(height, depth);
+
+                LinearBVHNode const& node = nodes_[node_index];
+                if (!IsLeaf(node))
+                {
+                    stack.push_back({ node.offset, depth + 1 });
+                    stack.push_back({ node.first_child, depth + 1 });
+                }
+            }
+
+            return height;
+        }
+
+        // Lays out the subtree of the given height, the bottom subtrees start below the top half
+        void LayoutVanEmdeBoas(std::uint32_t root, std::uint32_t levels)
+        {
+            if (levels == 1 || IsLeaf(nodes_[root]))
+            {
+                order_.push_back(root);
+                return;
+            }
+
+            std::uint32_t top_levels = levels / 2;
+            LayoutVanEmdeBoas(root, top_levels);
+
+            // Roots of the bottom subtrees from left to right
+            std::vector<std::uint32_t> bottom_roots;
+            std::vector<std::pair<std::uint32_t, std::uint32_t>> stack = { { root, 0 } };
+            while (!stack.empty())
+            {
+                auto [node_index, depth] = stack.back();
+                stack.pop_back();
+
+                LinearBVHNode const& node = nodes_[node_index];
+                if (depth == top_levels)
+                {
+                    bottom_roots.push_back(node_index);
+                }
+                else if (!IsLeaf(node))
+                {
+                    stack.push_back({ node.offset, depth + 1 });
+                    stack.push_back({ node.first_child, depth + 1 });
+                }
+            }
+
+            for (std::uint32_t bottom_root : bottom_roots)
+            {
+                LayoutVanEmdeBoas(bottom_root, levels - top_levels);
+            }
+        }
+
+        // Grows each treelet from its root by the node with the largest surface area, which is
+        // the most likely to be hit. The treelets below are laid out depth-first after it
+        void LayoutTreelets()
+        {
+            std::vector<std::uint32_t> treelet_roots = { 0 };
+            std::vector<std::uint32_t> frontier;
+
+            while (!treelet_roots.empty())
+            {
+                frontier.assign(1, treelet_roots.back());
+                treelet_roots.pop_back();
+
+                for (std::uint32_t size = 0; size < kTreeletSize && !frontier.empty(); ++size)
+                {
+                    auto largest = std::max_element(frontier.begin(), frontier.end(),
+                        [this](std::uint32_t lhs, std::uint32_t rhs)
+                        {
+                            return nodes_[lhs].bounds.SurfaceArea() < nodes_[rhs].bounds.SurfaceArea();
+                        });
+
+                    std::uint32_t node_index = *largest;
+                    frontier.erase(largest);
+                    order_.push_back(node_index);
+
+                    LinearBVHNode const& node = nodes_[node_index];
+                    if (!IsLeaf(node))
+                    {
+                        frontier.push_back(node.first_child);
+                        frontier.push_back(node.offset);
+                    }
+                }
+
+                // The largest remaining node starts the next treelet
+                std::sort(frontier.begin(), frontier.end(), [this](std::uint32_t lhs, std::uint32_t rhs)
+                    {
+                        return nodes_[lhs].bounds.SurfaceArea() < nodes_[rhs].bounds.SurfaceArea();
+                    });
+                treelet_roots.insert(treelet_roots.end(), frontier.begin(), frontier.end());
+            }
+        }
+
+        // A child is fetched at most as often as its parent, so sorting by the visit count
+        // keeps the parents first as long as the ties keep the original order
+        void LayoutHotFirst(std::uint32_t sample_rays)
+        {
+            std::vector<std::uint32_t> visits(nodes_.size(), 0);
+            for (auto const& ray : GenerateSampleRays(nodes_[0].bounds, sample_rays))
+            {
+                TraceRay(nodes_, triangles_, primitive_indices_, ray, [&visits](std::uint32_t node_index) { ++visits[node_index]; });
+            }
+
+            LayoutDepthFirst();
+            std::stable_sort(order_.begin(), order_.end(), [&visits](std::uint32_t lhs, std::uint32_t rhs)
+                {
+                    return visits[lhs] > visits[rhs];
+                });
+        }
+
+        std::vector<LinearBVHNode> Reorder() const
+        {
+            if (order_.size() != nodes_.size())
+            {
+                throw std::runtime_error("BVH layout does not cover every node");
+            }
+
+            std::vector<std::uint32_t> new_indices(nodes_.size());
+            for (std::uint32_t i = 0; i < order_.size(); ++i)
+            {
+                new_indices[order_[i]] = i;
+            }
+
+            std::vector<LinearBVHNode> nodes(nodes_.size());
+            for (std::uint32_t i = 0; i < order_.size(); ++i)
+            {
+                LinearBVHNode node = nodes_[order_[i]];
+                if (!IsLeaf(node))
+                {
+                    node.first_child = new_indices[node.first_child];
+                    node.offset = new_indices[node.offset];
+                }
+                if (node.parent != INVALID_ID)
+                {
+                    node.parent = new_indices[node.parent];
+                }
+
+                nodes[i] = node;
+            }
+
+            return nodes;
+        }
+
+        std::vector<LinearBVHNode> const& nodes_;
+        std::vector<Triangle> const& triangles_;
+        std::vector<std::uint32_t> const& primitive_indices_;
+        std::vector<std::uint32_t> order_;
+    };
+}
+
+std::vector<LinearBVHNode> ApplyBvhLayout(std::vector<LinearBVHNode> const& nodes, BvhLayout layout,
+    std::vector<Triangle> const& triangles, std::vector<std::uint32_t> const& primitive_indices,
+    std::uint32_t sample_rays)
+{
+    if (nodes.empty())
+    {
+        return nodes;
+    }
+
+    return BvhLayoutBuilder(nodes, triangles, primitive_indices).Apply(layout, sample_rays);
+}
+
+std::vector<std::uint32_t> AssignBvhTreelets(std::vector<LinearBVHNode> const& nodes,
+    std::uint32_t max_treelet_nodes, std::uint32_t& num_treelets)
+{
+    std::vector<std::uint32_t> node_treelets(nodes.size(), INVALID_ID);
+    num_treelets = 0;
+
+    if (nodes.empty())
+    {
+        return node_treelets;
+    }
+
+    auto smaller_area = [&nodes](std::uint32_t lhs, std::uint32_t rhs)
+    {
+        return nodes[lhs].bounds.SurfaceArea() < nodes[rhs].bounds.SurfaceArea();
+    };
+
+    std::vector<std::uint32_t> treelet_roots = { 0 };
+    std::priority_queue<std::uint32_t, std::vector<std::uint32_t>, decltype(smaller_area)> frontier(smaller_area);
+
+    while (!treelet_roots.empty())
+    {
+        frontier.push(treelet_roots.back());
+        treelet_roots.pop_back();
+
+        for (std::uint32_t size = 0; size < max_treelet_nodes && !frontier.empty(); ++size)
+        {
+            // The small subtrees left below the treelets above share a treelet, otherwise most
+            // treelets would hold a single leaf
+            if (frontier.size() == 1 && !treelet_roots.empty() && IsLeaf(nodes[frontier.top()]))
+            {
+                frontier.push(treelet_roots.back());
+                treelet_roots.pop_back();
+            }
+
+            std::uint32_t node_index = frontier.top();
+            frontier.pop();
+            node_treelets[node_index] = num_treelets;
+
+            LinearBVHNode const& node = nodes[node_index];
+            if (!IsLeaf(node))
+            {
+                frontier.push(node.first_child);
+                frontier.push(node.offset);
+            }
+        }
+
+        // The nodes left in the frontier start the treelets below
+        while (!frontier.empty())
+        {
+            treelet_roots.push_back(frontier.top());
+            frontier.pop();
+        }
+
+        ++num_treelets;
+    }
+
+    return node_treelets;
+}
+
+char const* GetBvhLayoutName(BvhLayout layout)
+{
+    switch (layout)
+    {
+    case BvhLayout::kDepthFirst:
+        return "depth-first";
+    case BvhLayout::kVanEmdeBoas:
+        return "van Emde Boas";
+    case BvhLayout::kTreelet:
+        return "treelet";
+    case BvhLayout::kHotFirst:
+        return "hot-first";
+    default:
+        return "unknown";
+    }
+}
+
+BvhLayout ParseBvhLayout(std::string const& name)
+{
+    if (name == "dfs")
+    {
+        return BvhLayout::kDepthFirst;
+    }
+    else if (name == "veb")
+    {
+        return BvhLayout::kVanEmdeBoas;
+    }
+    else if (name == "treelet")
+    {
+        return BvhLayout::kTreelet;
+    }
+    else if (name == "hot")
+    {
+        return BvhLayout::kHotFirst;
+    }
+    else
+    {
+        throw std::runtime_error("Unknown BVH layout: " + name);
+    }
+}
+
+void BenchmarkBvhLayouts(std::vector<LinearBVHNode> const& nodes, std::vector<Triangle> const& triangles,
+    std::vector<std::uint32_t> const& primitive_indices, std::uint32_t num_rays, std::uint32_t sample_rays)
+{
+    if (nodes.empty())
+    {
+        return;
+    }
+
+    // Use different rays than the hot-first layout measurement
+    std::vector<SampleRay> rays = GenerateSampleRays(nodes[0].bounds, num_rays);
+    std::reverse(rays.begin(), rays.end());
+
+    std::cout << "BVH layout benchmark with " << num_rays << " random rays, " << nodes.size() << " nodes" << std::endl;
+
+    for (BvhLayout layout : { BvhLayout::kDepthFirst, BvhLayout::kVanEmdeBoas, BvhLayout::kTreelet, BvhLayout::kHotFirst })
+    {
+        std::vector<LinearBVHNode> layout_nodes = ApplyBvhLayout(nodes, layout, triangles, primitive_indices, sample_rays);
+
+        // Distinct cache lines fetched per ray, a node may straddle two lines
+        std::uint64_t num_visits = 0;
+        std::uint64_t num_cache_lines = 0;
+        for (auto const& ray : rays)
+        {
+            std::vector<std::uint64_t> lines;
+            TraceRay(layout_nodes, triangles, primitive_indices, ray, [&](std::uint32_t node_index)
+                {
+                    ++num_visits;
+                    std::uint64_t first_byte = (std::uint64_t)node_index * sizeof(LinearBVHNode);
+                    for (std::uint64_t line = first_byte / kCacheLineSize;
+                        line <= (first_byte + sizeof(LinearBVHNode) - 1) / kCacheLineSize; ++line)
+                    {
+                        lines.push_back(line);
+                    }
+                });
+
+            std::sort(lines.begin(), lines.end());
+            num_cache_lines += std::unique(lines.begin(), lines.end()) - lines.begin();
+        }
+
+        auto start_time = Clock::now();
+        for (auto const& ray : rays)
+        {
+            TraceRay(layout_nodes, triangles, primitive_indices, ray, [](std::uint32_t) {});
+        }
+        double trace_time = ElapsedMilliseconds(start_time, Clock::now());
+
+        std::cout << "  " << std::left << std::setw(14) << GetBvhLayoutName(layout) << std::right
+            << " trace time " << std::setw(9) << trace_time << " ms, "
+            << double(num_visits) / num_rays << " nodes per ray, "
+            << double(num_cache_lines) / num_rays << " cache lines per ray" << std::endl;
+    }
+}
+
+void BenchmarkEntryHints(std::vector<LinearBVHNode> const& nodes, std::vector<Triangle> const& triangles,
+    std::vector<std::uint32_t> const& primitive_indices, std::uint32_t width, std::uint32_t height)
+{
+    if (nodes.empty() || width == 0 || height == 0)
+    {
+        return;
+    }
+
+    // Same orientation and field of view as the default camera, placed in the middle of the near
+    // face of the scene bounds
+    Bounds3 const& bounds = nodes[0].bounds;
+    float3 position((bounds.min.x + bounds.max.x) * 0.5f, bounds.min.y, (bounds.min.z + bounds.max.z) * 0.5f);
+    float3 front(0.0f, 1.0f, 0.0f);
+    float3 up(0.0f, 0.0f, 1.0f);
+    float3 right = Cross(front, up);
+    float tan_half_fov = std::tan(75.0f * MATH_PI / 360.0f);
+    float aspect_ratio = float(width) / height;
+
+    std::mt19937 rng(kSampleRaySeed);
+    std::uniform_real_distribution<float> distribution(0.0f, 1.0f);
+
+    // The hint of every pixel is the parent of the leaf hit in the previous frame
+    std::vector<std::uint32_t> entry_hints(width * height, INVALID_ID);
+    std::uint64_t num_full_visits = 0;
+    std::uint64_t num_hinted_visits = 0;
+    std::uint64_t num_hinted_rays = 0;
+    std::uint64_t num_mismatches = 0;
+
+    for (std::uint32_t frame = 0; frame < 2; ++frame)
+    {
+        for (std::uint32_t pixel_idx = 0; pixel_idx < width * height; ++pixel_idx)
+        {
+            // Jitter the rays inside the pixels like the accumulated frames do
+            float x = ((pixel_idx % width + distribution(rng)) / width * 2.0f - 1.0f) * tan_half_fov * aspect_ratio;
+            float y = ((pixel_idx / width + distribution(rng)) / height * 2.0f - 1.0f) * tan_half_fov;
+            SampleRay ray = { position, (front + right * x + up * y).Normalize() };
+
+            float t = std::numeric_limits<float>::max();
+            std::uint32_t num_visits = 0;
+            std::uint32_t hit_leaf = TraceSubtree(nodes, triangles, primitive_indices, ray, 0, INVALID_ID, t,
+                [&num_visits](std::uint32_t) { ++num_visits; });
+
+            if (frame > 0)
+            {
+                // Trace the hinted subtree first and the rest of the tree with the bound it gives
+                std::uint32_t hint = entry_hints[pixel_idx];
+                float hinted_t = std::numeric_limits<float>::max();
+                auto count_visits = [&num_hinted_visits](std::uint32_t) { ++num_hinted_visits; };
+                if (hint != INVALID_ID)
+                {
+                    TraceSubtree(nodes, triangles, primitive_indices, ray, hint, INVALID_ID, hinted_t, count_visits);
+                    ++num_hinted_rays;
+                }
+                TraceSubtree(nodes, triangles, primitive_indices, ray, 0, hint, hinted_t, count_visits);
+
+                num_full_visits += num_visits;
+                num_mismatches += hinted_t != t;
+            }
+
+            std::uint32_t parent = hit_leaf != INVALID_ID ? nodes[hit_leaf].parent : INVALID_ID;
+            entry_hints[pixel_idx] = parent != 0 ? parent : INVALID_ID;
+        }
+    }
+
+    std::uint32_t num_rays = width * height;
+    std::cout << "Entry hint benchmark with " << width << "x" << height << " primary rays, " << nodes.size() << " nodes" << std::endl;
+    std::cout << "  full traversal " << double(num_full_visits) / num_rays << " nodes per ray, with the hints "
+        << double(num_hinted_visits) / num_rays << " nodes per ray, "
+        << 100.0 * num_hinted_rays / num_rays << "% of the rays hinted, "
+        << num_mismatches << " mismatching hits" << std::endl;
+}
@@ -0,0 +1,73 @@
+/*****************************************************************************
+ MIT License
+
+ Copyright(c) 2023 Alexander Veselov
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this softwareand associated documentation files(the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions :
+
+ The above copyright noticeand this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *****************************************************************************/
+
+#pragma once
+
+#include "kernels/common/shared_structures.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Order of the binary BVH nodes in memory. The root is always the first node and the
+// parents are stored before their children, the children are referenced explicitly
+enum class BvhLayout
+{
+    // Plain depth-first order, the first child follows its parent
+    kDepthFirst,
+    // Cache-oblivious layout: the top half of the tree is stored recursively, followed by
+    // the bottom subtrees, so a path of any length touches few blocks of any size
+    kVanEmdeBoas,
+    // Treelets of the nodes most likely to be visited together, sized to whole cache lines
+    kTreelet,
+    // Nodes sorted by the number of visits of sample rays, the hot nodes are packed together
+    kHotFirst
+};
+
+// Reorders the nodes built in any layout. Only the hot-first layout uses the triangles, which
+// the leaves reference through primitive_indices. It traces sample_rays random rays through
+// the tree to count the node visits
+std::vector<LinearBVHNode> ApplyBvhLayout(std::vector<LinearBVHNode> const& nodes, BvhLayout layout,
+    std::vector<Triangle> const& triangles, std::vector<std::uint32_t> const& primitive_indices,
+    std::uint32_t sample_rays);
+
+// Cuts the tree into treelets of at most max_treelet_nodes nodes, grown from their roots by
+// the largest surface area like the treelet layout, the small subtrees at the bottom are packed
+// into shared treelets. Returns the treelet of every node, the treelet of the root is 0
+std::vector<std::uint32_t> AssignBvhTreelets(std::vector<LinearBVHNode> const& nodes,
+    std::uint32_t max_treelet_nodes, std::uint32_t& num_treelets);
+
+char const* GetBvhLayoutName(BvhLayout layout);
+// Parses the command line name of the layout: dfs, veb, treelet or hot
+BvhLayout ParseBvhLayout(std::string const& name);
+
+// Traces the same random rays through every layout of the tree on the CPU and prints the
+// traversal time and the number of distinct cache lines fetched per ray
+void BenchmarkBvhLayouts(std::vector<LinearBVHNode> const& nodes, std::vector<Triangle> const& triangles,
+    std::vector<std::uint32_t> const& primitive_indices, std::uint32_t num_rays, std::uint32_t sample_rays);
+
+// Traces two frames of jittered primary rays through the tree on the CPU and prints the node
+// visits per ray of the second frame with and without the entry hints of the first one: the
+// subtree around the leaf hit by the pixel is traced first to bound the full traversal
+void BenchmarkEntryHints(std::vector<LinearBVHNode> const& nodes, std::vector<Triangle> const& triangles,
+    std::vector<std::uint32_t> const& primitive_indices, std::uint32_t width, std::uint32_t height);
@@ -0,0 +1,267 @@
+/*****************************************************************************
+ MIT License
+
+ Copyright(c) 2023 Alexander Veselov
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this softwareand associated documentation files(the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions :
+
+ The above copyright noticeand this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *****************************************************************************/
+
+#include "bvh_metrics.hpp"
+#include "kernels/common/constants.h"
+#include "utils/thread_pool.hpp"
+#include <algorithm>
+
+namespace
+{
+    constexpr std::size_t kEpoGrainSize = 1024;
+
+    // A triangle clipped by the 6 planes of a box has at most 9 vertices
+    struct ClippedPolygon
+    {
+        float3 vertices[9];
+        std::uint32_t count = 0;
+    };
+
+    // Sutherland-Hodgman clipping against the slabs of the box
+    ClippedPolygon ClipPolygon(ClippedPolygon const& polygon, Bounds3 const& bounds)
+    {
+        ClippedPolygon result = polygon;
+        for (int axis = 0; axis < 3 && result.count > 0; ++axis)
+        {
+            for (int side = 0; side < 2 && result.count > 0; ++side)
+            {
+                ClippedPolygon input = result;
+                result.count = 0;
+
+                float plane = side ? bounds.max[axis] : bounds.min[axis];
+                for (std::uint32_t i = 0; i < input.count; ++i)
+                {
+                    float3 const& a = input.vertices[i];
+                    float3 const& b = input.vertices[(i + 1) % input.count];
+                    // Non-negative inside the slab
+                    float da = side ? plane - a[axis] : a[axis] - plane;
+                    float db = side ? plane - b[axis] : b[axis] - plane;
+
+                    if (da >= 0.0f)
+                    {
+                        result.vertices[result.count++] = a;
+                    }
+
+                    if ((da >= 0.0f) != (db >= 0.0f))
+                    {
+                        result.vertices[result.count++] = a + (b - a) * (da / (da - db));
+                    }
+                }
+            }
+        }
+
+        return result;
+    }
+
+    float PolygonArea(ClippedPolygon const& polygon)
+    {
+        float3 normal(0.0f, 0.0f, 0.0f);
+        for (std::uint32_t i = 1; i + 1 < polygon.count; ++i)
+        {
+            normal += Cross(polygon.vertices[i] - polygon.vertices[0], polygon.vertices[i + 1] - polygon.vertices[0]);
+        }
+
+        return 0.5f * normal.Length();
+    }
+}
+
+float ComputeSahCost(std::vector<LinearBVHNode> const& nodes, float traversal_cost)
+{
+    if (nodes.empty())
+    {
+        return 0.0f;
+    }
+
+    float root_area = nodes[0].bounds.SurfaceArea();
+    if (root_area <= 0.0f)
+    {
+        return 0.0f;
+    }
+
+    // The probability of hitting a node is proportional to its surface area
+    double cost = 0.0;
+    for (auto const& node : nodes)
+    {
+        unsigned int num_primitives = node.num_primitives_axis >> 16;
+        double node_cost = num_primitives > 0 ? num_primitives : traversal_cost;
+        cost += node_cost * node.bounds.SurfaceArea();
+    }
+
+    return float(cost / root_area);
+}
+
+float ComputeEpo(std::vector<LinearBVHNode> const& nodes, std::vector<Triangle> const& triangles,
+    std::vector<std::uint32_t> const& primitive_indices, float traversal_cost, std::uint32_t num_threads)
+{
+    if (nodes.empty() || triangles.empty())
+    {
+        return 0.0f;
+    }
+
+    // The nodes that contain a triangle are the ancestors of its leaves
+    std::vector<std::uint32_t> parents(nodes.size(), INVALID_ID);
+    std::vector<std::vector<std::uint32_t>> triangle_leaves(triangles.size());
+    for (std::uint32_t node_idx = 0; node_idx < nodes.size(); ++node_idx)
+    {
+        LinearBVHNode const& node = nodes[node_idx];
+        if (IsLeaf(node))
+        {
+            for (std::uint32_t i = node.offset; i < node.offset + (node.num_primitives_axis >> 16); ++i)
+            {
+                triangle_leaves[primitive_indices[i]].push_back(node_idx);
+            }
+        }
+        else
+        {
+            parents[node.first_child] = node_idx;
+            parents[node.offset] = node_idx;
+        }
+    }
+
+    ThreadPool thread_pool(num_threads);
+    std::size_t num_chunks = (triangles.size() + kEpoGrainSize - 1) / kEpoGrainSize;
+    std::vector<double> chunk_overlap(num_chunks, 0.0);
+    std::vector<double> chunk_area(num_chunks, 0.0);
+
+    thread_pool.ParallelFor(triangles.size(), kEpoGrainSize, [&](std::size_t begin, std::size_t end)
+        {
+            std::vector<std::uint32_t> containing_nodes;
+            std::vector<std::pair<std::uint32_t, ClippedPolygon>> stack;
+            double overlap = 0.0;
+            double area = 0.0;
+
+            for (std::size_t triangle_idx = begin; triangle_idx < end; ++triangle_idx)
+            {
+                containing_nodes.clear();
+                for (std::uint32_t leaf_idx : triangle_leaves[triangle_idx])
+                {
+                    for (std::uint32_t node_idx = leaf_idx; node_idx != INVALID_ID; node_idx = parents[node_idx])
+                    {
+                        containing_nodes.push_back(node_idx);
+                    }
+                }
+                std::sort(containing_nodes.begin(), containing_nodes.end());
+
+                Triangle const& triangle = triangles[triangle_idx];
+                ClippedPolygon polygon;
+                polygon.vertices[0] = triangle.v1.position;
+                polygon.vertices[1] = triangle.v2.position;
+                polygon.vertices[2] = triangle.v3.position;
+                polygon.count = 3;
+                area += PolygonArea(polygon);
+
+                // The children are inside their parent, so the polygon clipped by the parent is
+                // clipped further on the way down
+                stack.clear();
+                stack.emplace_back(0u, polygon);
+                while (!stack.empty())
+                {
+                    std::uint32_t node_idx = stack.back().first;
+                    ClippedPolygon clipped = ClipPolygon(stack.back().second, nodes[node_idx].bounds);
+                    stack.pop_back();
+
+                    if (clipped.count < 3)
+                    {
+                        continue;
+                    }
+
+                    LinearBVHNode const& node = nodes[node_idx];
+                    if (!std::binary_search(containing_nodes.begin(), containing_nodes.end(), node_idx))
+                    {
+                        double node_cost = IsLeaf(node) ? GetPrimitiveCount(node) : traversal_cost;
+                        overlap += node_cost * PolygonArea(clipped);
+                    }
+
+                    if (!IsLeaf(node))
+                    {
+                        stack.emplace_back(node.first_child, clipped);
+                        stack.emplace_back(node.offset, clipped);
+                    }
+                }
+            }
+
+            chunk_overlap[begin / kEpoGrainSize] = overlap;
+            chunk_area[begin / kEpoGrainSize] = area;
+        });
+
+    // Sum in a fixed order so the result doesn't depend on the thread count
+    double total_overlap = 0.0;
+    double total_area = 0.0;
+    for (std::size_t chunk = 0; chunk < num_chunks; ++chunk)
+    {
+        total_overlap += chunk_overlap[chunk];
+        total_area += chunk_area[chunk];
+    }
+
+    return total_area > 0.0 ? float(total_overlap / total_area) : 0.0f;
+}
+
+BvhTopologyStats ComputeTopologyStats(std::vector<LinearBVHNode> const& nodes)
+{
+    BvhTopologyStats stats;
+    stats.node_count = (std::uint32_t)nodes.size();
+    if (nodes.empty())
+    {
+        return stats;
+    }
+
+    std::vector<std::pair<std::uint32_t, std::uint32_t>> stack = { { 0u, 0u } };
+    double depth_sum = 0.0;
+    while (!stack.empty())
+    {
+        auto [node_idx, depth] = stack.back();
+        stack.pop_back();
+
+        LinearBVHNode const& node = nodes[node_idx];
+        stats.max_depth = std::max(stats.max_depth, depth);
+
+        if (IsLeaf(node))
+        {
+            std::uint32_t num_primitives = node.num_primitives_axis >> 16;
+            if (stats.leaf_size_histogram.size() <= num_primitives)
+            {
+                stats.leaf_size_histogram.resize(num_primitives + 1, 0);
+            }
+            if (stats.leaf_depth_histogram.size() <= depth)
+            {
+                stats.leaf_depth_histogram.resize(depth + 1, 0);
+            }
+
+            ++stats.leaf_size_histogram[num_primitives];
+            ++stats.leaf_depth_histogram[depth];
+            ++stats.leaf_count;
+            depth_sum += depth;
+        }
+        else
+        {
+            stack.emplace_back(node.first_child, depth + 1);
+            stack.emplace_back(node.offset, depth + 1);
+        }
+    }
+
+    stats.average_leaf_depth = depth_sum / stats.leaf_count;
+    // A leaf at depth d is reached with at most d far children on the stack
+    stats.max_stack_depth = stats.max_depth;
+    return stats;
+}
@@ -0,0 +1,56 @@
+/*****************************************************************************
+ MIT License
+
+ Copyright(c) 2023 Alexander Veselov
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this softwareand associated documentation files(the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions :
+
+ The above copyright noticeand this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *****************************************************************************/
+
+#pragma once
+
+#include "kernels/common/shared_structures.h"
+#include <cstdint>
+#include <vector>
+
+// Expected cost of a random ray traversing the flattened hierarchy, measured in
+// ray-triangle intersection tests. Lower is better, used to compare the builders
+float ComputeSahCost(std::vector<LinearBVHNode> const& nodes, float traversal_cost = 1.0f);
+
+// End-point overlap of the hierarchy: the triangle area that lies inside the nodes which don't
+// contain these triangles, weighted by the node costs of ComputeSahCost and normalized by the
+// total triangle area. Unlike SAH, it accounts for the nodes that overlap each other.
+// The leaves reference the triangles through primitive_indices
+float ComputeEpo(std::vector<LinearBVHNode> const& nodes, std::vector<Triangle> const& triangles,
+    std::vector<std::uint32_t> const& primitive_indices, float traversal_cost = 1.0f, std::uint32_t num_threads = 0);
+
+struct BvhTopologyStats
+{
+    std::uint32_t node_count = 0;
+    std::uint32_t leaf_count = 0;
+    std::uint32_t max_depth = 0;
+    double average_leaf_depth = 0.0;
+    // Deepest stack the binary traversal kernels may need, they push one far child per
+    // interior node on the way to a leaf
+    std::uint32_t max_stack_depth = 0;
+    // Number of leaves per primitive count and per depth, the root has depth 0
+    std::vector<std::uint32_t> leaf_size_histogram;
+    std::vector<std::uint32_t> leaf_depth_histogram;
+};
+
+BvhTopologyStats ComputeTopologyStats(std::vector<LinearBVHNode> const& nodes);
@@ -0,0 +1,294 @@
+/*****************************************************************************
+ MIT License
+
+ Copyright(c) 2023 Alexander Veselov
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this softwareand associated documentation files(the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions :
+
+ The above copyright noticeand this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *****************************************************************************/
+
+#include "bvh_optimizer.hpp"
+#include "utils/timer.hpp"
+#include <algorithm>
+#include <cmath>
+#include <queue>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace
+{
+    // Stop once a pass improves the SAH cost by less than this fraction
+    constexpr float kMinPassImprovement = 1e-3f;
+
+    using BuildNode = Bvh::BVHBuildNode;
+
+    bool IsLeaf(BuildNode const* node)
+    {
+        return node->nPrimitives > 0;
+    }
+
+    // Sum of the node costs weighted by the surface area, not normalized by the root area
+    double ComputeTreeCost(BuildNode const* node, float traversal_cost)
+    {
+        double area = node->bounds.SurfaceArea();
+        if (IsLeaf(node))
+        {
+            return area * node->nPrimitives;
+        }
+
+        return area * traversal_cost + ComputeTreeCost(node->children[0], traversal_cost)
+            + ComputeTreeCost(node->children[1], traversal_cost);
+    }
+
+    class BvhOptimizer
+    {
+    public:
+        explicit BvhOptimizer(BuildNode* root)
+            : root_(root)
+        {
+            CollectNodes(root, nullptr);
+        }
+
+        // Runs one pass over the candidates in order of decreasing surface area
+        template <typename Callback>
+        std::uint32_t RunPass(Callback const& is_out_of_time)
+        {
+            // Nodes right below the root are never moved, so the root stays in place
+            std::vector<BuildNode*> candidates;
+            candidates.reserve(nodes_.size());
+            for (BuildNode* node : nodes_)
+            {
+                if (node != root_ && parents_[node] != root_)
+                {
+                    candidates.push_back(node);
+                }
+            }
+
+            std::stable_sort(candidates.begin(), candidates.end(), [](BuildNode const* a, BuildNode const* b)
+                {
+                    return a->bounds.SurfaceArea() > b->bounds.SurfaceArea();
+                });
+
+            std::uint32_t reinsertions = 0;
+            for (BuildNode* node : candidates)
+            {
+                if (is_out_of_time())
+                {
+                    break;
+                }
+
+                // The parent of the candidate may have become the root child by an earlier move
+                if (parents_[node] != root_ && Reinsert(node))
+                {
+                    ++reinsertions;
+                }
+            }
+
+            return reinsertions;
+        }
+
+    private:
+        void CollectNodes(BuildNode* node, BuildNode* parent)
+        {
+            nodes_.push_back(node);
+            parents_[node] = parent;
+            if (!IsLeaf(node))
+            {
+                CollectNodes(node->children[0], node);
+                CollectNodes(node->children[1], node);
+            }
+        }
+
+        static BuildNode* GetSibling(BuildNode const* parent, BuildNode const* node)
+        {
+            return parent->children[0] == node ? parent->children[1] : parent->children[0];
+        }
+
+        static void ReplaceChild(BuildNode* parent, BuildNode const* child, BuildNode* new_child)
+        {
+            parent->children[parent->children[0] == child ? 0 : 1] = new_child;
+        }
+
+        void Refit(BuildNode* node)
+        {
+            for (; node; node = parents_[node])
+            {
+                node->bounds = Union(node->children[0]->bounds, node->children[1]->bounds);
+            }
+        }
+
+        // Increase of the ancestor areas if the node bounds are added below the given node
+        float ComputeInducedCost(BuildNode* node, Bounds3 const& bounds)
+        {
+            float cost = 0.0f;
+            for (BuildNode* ancestor = parents_[node]; ancestor; ancestor = parents_[ancestor])
+            {
+                cost += Union(ancestor->bounds, bounds).SurfaceArea() - ancestor->bounds.SurfaceArea();
+            }
+
+            return cost;
+        }
+
+        // Finds the node to become the sibling of the subtree with the given bounds
+        BuildNode* FindInsertionPosition(Bounds3 const& bounds, BuildNode* current_sibling)
+        {
+            using Candidate = std::pair<float, BuildNode*>;
+            auto compare = [](Candidate const& a, Candidate const& b) { return a.first > b.first; };
+            std::priority_queue<Candidate, std::vector<Candidate>, decltype(compare)> queue(compare);
+
+            // Keep the node in place unless there is a strictly cheaper position
+            BuildNode* best_node = current_sibling;
+            float best_cost = ComputeInducedCost(current_sibling, bounds) + Union(current_sibling->bounds, bounds).SurfaceArea();
+            float area = bounds.SurfaceArea();
+
+            float root_induced_cost = Union(root_->bounds, bounds).SurfaceArea() - root_->bounds.SurfaceArea();
+            queue.emplace(root_induced_cost, root_->children[0]);
+            queue.emplace(root_induced_cost, root_->children[1]);
+
+            while (!queue.empty())
+            {
+                float induced_cost = queue.top().first;
+                BuildNode* node = queue.top().second;
+                queue.pop();
+
+                // The direct cost is at least the area of the inserted subtree
+                if (induced_cost + area >= best_cost)
+                {
+                    break;
+                }
+
+                float node_area = node->bounds.SurfaceArea();
+                float merged_area = Union(node->bounds, bounds).SurfaceArea();
+                float cost = induced_cost + merged_area;
+                if (cost < best_cost)
+                {
+                    best_cost = cost;
+                    best_node = node;
+                }
+
+                float child_induced_cost = induced_cost + merged_area - node_area;
+                if (!IsLeaf(node) && child_induced_cost + area < best_cost)
+                {
+                    queue.emplace(child_induced_cost, node->children[0]);
+                    queue.emplace(child_induced_cost, node->children[1]);
+                }
+            }
+
+            return best_node;
+        }
+
+        // Orders the children along the axis that separates their centroids the most,
+        // the traversal visits the first child first for rays in the positive direction
+        static void SetChildren(BuildNode* parent, BuildNode* a, BuildNode* b)
+        {
+            float3 a_centroid = a->bounds.min * 0.5f + a->bounds.max * 0.5f;
+            float3 b_centroid = b->bounds.min * 0.5f + b->bounds.max * 0.5f;
+
+            int axis = 0;
+            float max_distance = -1.0f;
+            for (int i = 0; i < 3; ++i)
+            {
+                float distance = std::abs(a_centroid[i] - b_centroid[i]);
+                if (distance > max_distance)
+                {
+                    max_distance = distance;
+                    axis = i;
+                }
+            }
+
+            bool swap = a_centroid[axis] > b_centroid[axis];
+            parent->children[0] = swap ? b : a;
+            parent->children[1] = swap ? a : b;
+            parent->splitAxis = axis;
+        }
+
+        // Removes the subtree together with its parent and inserts it at the best position,
+        // the parent node is reused. Returns true if the subtree has moved
+        bool Reinsert(BuildNode* node)
+        {
+            BuildNode* parent = parents_[node];
+            BuildNode* sibling = GetSibling(parent, node);
+            BuildNode* grandparent = parents_[parent];
+
+            // Remove
+            ReplaceChild(grandparent, parent, sibling);
+            parents_[sibling] = grandparent;
+            Refit(grandparent);
+
+            BuildNode* position = FindInsertionPosition(node->bounds, sibling);
+
+            // Insert as a sibling of the found node
+            BuildNode* position_parent = parents_[position];
+            ReplaceChild(position_parent, position, parent);
+            parents_[parent] = position_parent;
+            parents_[position] = parent;
+            SetChildren(parent, position, node);
+            Refit(parent);
+
+            return position != sibling;
+        }
+
+        BuildNode* root_;
+        // All nodes in depth-first order, the set of nodes does not change
+        std::vector<BuildNode*> nodes_;
+        std::unordered_map<BuildNode*, BuildNode*> parents_;
+    };
+}
+
+BvhOptimizationStats OptimizeBvh(Bvh::BVHBuildNode* root, float traversal_cost, double time_budget)
+{
+    BvhOptimizationStats stats;
+    auto start_time = Clock::now();
+
+    float root_area = root->bounds.SurfaceArea();
+    double cost = ComputeTreeCost(root, traversal_cost);
+    stats.sah_cost_before = root_area > 0.0f ? float(cost / root_area) : 0.0f;
+    stats.sah_cost_after = stats.sah_cost_before;
+
+    if (IsLeaf(root) || root_area <= 0.0f)
+    {
+        return stats;
+    }
+
+    BvhOptimizer optimizer(root);
+    auto is_out_of_time = [&]()
+    {
+        return ElapsedMilliseconds(start_time, Clock::now()) >= time_budget;
+    };
+
+    while (!is_out_of_time())
+    {
+        std::uint32_t reinsertions = optimizer.RunPass(is_out_of_time);
+        stats.reinsertions += reinsertions;
+        ++stats.passes;
+
+        double new_cost = ComputeTreeCost(root, traversal_cost);
+        bool converged = reinsertions == 0 || new_cost > cost * (1.0 - kMinPassImprovement);
+        cost = new_cost;
+
+        if (converged)
+        {
+            break;
+        }
+    }
+
+    stats.sah_cost_after = float(cost / root_area);
+    stats.time = ElapsedMilliseconds(start_time, Clock::now());
+    return stats;
+}
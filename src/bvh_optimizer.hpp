@@ -0,0 +1,44 @@
+/*****************************************************************************
+ MIT License
+
+ Copyright(c) 2023 Alexander Veselov
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this softwareand associated documentation files(the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions :
+
+ The above copyright noticeand this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *****************************************************************************/
+
+#pragma once
+
+#include "bvh.hpp"
+
+struct BvhOptimizationStats
+{
+    float sah_cost_before = 0.0f;
+    float sah_cost_after = 0.0f;
+    std::uint32_t passes = 0;
+    // Number of subtrees moved to a cheaper position
+    std::uint32_t reinsertions = 0;
+    double time = 0.0;
+};
+
+// Improves the build tree in place by node reinsertion (Bittner et al. 2013, Meister and
+// Bittner 2018): the subtrees with the largest surface area are removed and reinserted
+// at the position that minimizes the SAH cost, found with a branch and bound search.
+// The leaves are left untouched, so the primitive ranges stay valid. Stops when the time
+// budget in milliseconds is used up or a pass no longer improves the cost noticeably
+BvhOptimizationStats OptimizeBvh(Bvh::BVHBuildNode* root, float traversal_cost, double time_budget);
@@ -0,0 +1,178 @@
+/*****************************************************************************
+ MIT License
+
+ Copyright(c) 2023 Alexander Veselov
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this softwareand associated documentation files(the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions :
+
+ The above copyright noticeand this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *****************************************************************************/
+
+#include "bvh_refit.hpp"
+#include "kernels/common/constants.h"
+#include <algorithm>
+#include <stdexcept>
+
+namespace
+{
+bool operator==(Bounds3 const& lhs, Bounds3 const& rhs)
+{
+    return lhs.min.x == rhs.min.x && lhs.min.y == rhs.min.y && lhs.min.z == rhs.min.z
+        && lhs.max.x == rhs.max.x && lhs.max.y == rhs.max.y && lhs.max.z == rhs.max.z;
+}
+
+}
+
+std::vector<DirtyRange> CoalesceDirtyRanges(std::vector<std::uint32_t> indices, std::uint32_t max_gap)
+{
+    std::sort(indices.begin(), indices.end());
+
+    std::vector<DirtyRange> ranges;
+    for (std::uint32_t index : indices)
+    {
+        if (!ranges.empty() && index <= ranges.back().first + ranges.back().count + max_gap)
+        {
+            ranges.back().count = std::max(ranges.back().count, index - ranges.back().first + 1);
+        }
+        else
+        {
+            ranges.push_back({ index, 1 });
+        }
+    }
+
+    return ranges;
+}
+
+BvhRefitter::BvhRefitter(std::vector<LinearBVHNode> const& nodes, std::vector<std::uint32_t> const& primitive_indices,
+    std::size_t num_triangles, float traversal_cost)
+    : primitive_indices_(primitive_indices)
+    , parents_(nodes.size(), INVALID_ID)
+    , triangle_leaves_(num_triangles, INVALID_ID)
+    , visited_(nodes.size(), false)
+    , traversal_cost_(traversal_cost)
+{
+    if (nodes.empty())
+    {
+        throw std::runtime_error("Cannot refit an empty BVH");
+    }
+
+    for (std::uint32_t node_idx = 0; node_idx < nodes.size(); ++node_idx)
+    {
+        LinearBVHNode const& node = nodes[node_idx];
+        std::uint32_t num_primitives = GetPrimitiveCount(node);
+
+        if (num_primitives == 0)
+        {
+            parents_[node.first_child] = node_idx;
+            parents_[node.offset] = node_idx;
+        }
+        else
+        {
+            for (std::uint32_t i = node.offset; i < node.offset + num_primitives; ++i)
+            {
+                if (i >= primitive_indices_.size() || primitive_indices_[i] >= num_triangles
+                    || triangle_leaves_[primitive_indices_[i]] != INVALID_ID)
+                {
+                    throw std::runtime_error("Refit requires every triangle to be referenced by exactly one leaf");
+                }
+
+                triangle_leaves_[primitive_indices_[i]] = node_idx;
+            }
+        }
+
+        weighted_area_ += GetNodeCost(node) * node.bounds.SurfaceArea();
+    }
+
+    root_area_ = nodes[0].bounds.SurfaceArea();
+    build_sah_cost_ = root_area_ > 0.0f ? weighted_area_ / root_area_ : 0.0;
+}
+
+float BvhRefitter::GetNodeCost(LinearBVHNode const& node) const
+{
+    std::uint32_t num_primitives = GetPrimitiveCount(node);
+    return num_primitives > 0 ? (float)num_primitives : traversal_cost_;
+}
+
+std::vector<DirtyRange> BvhRefitter::Refit(std::vector<LinearBVHNode>& nodes, std::vector<Triangle> const& triangles,
+    std::vector<std::uint32_t> const& triangle_indices)
+{
+    if (nodes.size() != parents_.size() || triangles.size() != triangle_leaves_.size())
+    {
+        throw std::runtime_error("BVH refit data does not match the hierarchy");
+    }
+
+    // Collect the dirty leaves and their ancestors, stop at the already collected nodes
+    std::vector<std::uint32_t> dirty_nodes;
+    for (std::uint32_t triangle_idx : triangle_indices)
+    {
+        if (triangle_idx >= triangles.size())
+        {
+            throw std::runtime_error("Refit triangle index is out of range");
+        }
+
+        for (std::uint32_t node_idx = triangle_leaves_[triangle_idx];
+            node_idx != INVALID_ID && !visited_[node_idx]; node_idx = parents_[node_idx])
+        {
+            visited_[node_idx] = true;
+            dirty_nodes.push_back(node_idx);
+        }
+    }
+
+    // The children are stored after their parents, so the bottom-up order is the reversed index order
+    std::sort(dirty_nodes.begin(), dirty_nodes.end(), std::greater<std::uint32_t>());
+
+    std::vector<std::uint32_t> changed_nodes;
+    for (std::uint32_t node_idx : dirty_nodes)
+    {
+        visited_[node_idx] = false;
+        LinearBVHNode& node = nodes[node_idx];
+        std::uint32_t num_primitives = GetPrimitiveCount(node);
+
+        Bounds3 bounds;
+        if (num_primitives > 0)
+        {
+            for (std::uint32_t i = node.offset; i < node.offset + num_primitives; ++i)
+            {
+                bounds = Union(bounds, triangles[primitive_indices_[i]].GetBounds());
+            }
+        }
+        else
+        {
+            bounds = Union(nodes[node.first_child].bounds, nodes[node.offset].bounds);
+        }
+
+        if (!(bounds == node.bounds))
+        {
+            weighted_area_ += GetNodeCost(node) * (bounds.SurfaceArea() - node.bounds.SurfaceArea());
+            node.bounds = bounds;
+            changed_nodes.push_back(node_idx);
+        }
+    }
+
+    root_area_ = nodes[0].bounds.SurfaceArea();
+    return CoalesceDirtyRanges(std::move(changed_nodes));
+}
+
+float BvhRefitter::GetSahCostRatio() const
+{
+    if (build_sah_cost_ <= 0.0 || root_area_ <= 0.0f)
+    {
+        return 1.0f;
+    }
+
+    return float(weighted_area_ / root_area_ / build_sah_cost_);
+}
@@ -0,0 +1,64 @@
+/*****************************************************************************
+ MIT License
+
+ Copyright(c) 2023 Alexander Veselov
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this softwareand associated documentation files(the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions :
+
+ The above copyright noticeand this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *****************************************************************************/
+
+#pragma once
+
+#include "acceleration_structure.hpp"
+#include <vector>
+
+// Merges the sorted or unsorted element indices into ranges, indices that are at most
+// max_gap elements apart end up in the same range to reduce the number of uploads
+std::vector<DirtyRange> CoalesceDirtyRanges(std::vector<std::uint32_t> indices, std::uint32_t max_gap = 16);
+
+// Updates the bounds of a binary BVH in place after some triangles have moved. The topology
+// and the triangle slots are kept, so the quality of the tree degrades with the motion,
+// which is tracked by the SAH cost of the refitted tree
+class BvhRefitter
+{
+public:
+    // Every triangle must be referenced by exactly one leaf, which rules out spatial splits
+    BvhRefitter(std::vector<LinearBVHNode> const& nodes, std::vector<std::uint32_t> const& primitive_indices,
+        std::size_t num_triangles, float traversal_cost);
+
+    // Recomputes the leaves of the given scene triangles and their ancestors, returns the
+    // ranges of the nodes whose bounds have changed
+    std::vector<DirtyRange> Refit(std::vector<LinearBVHNode>& nodes, std::vector<Triangle> const& triangles,
+        std::vector<std::uint32_t> const& triangle_indices);
+
+    // SAH cost of the refitted tree relative to the cost of the tree it was created for
+    float GetSahCostRatio() const;
+
+private:
+    float GetNodeCost(LinearBVHNode const& node) const;
+
+    std::vector<std::uint32_t> primitive_indices_;
+    std::vector<std::uint32_t> parents_;
+    std::vector<std::uint32_t> triangle_leaves_;
+    std::vector<bool> visited_;
+    float traversal_cost_;
+    // Surface area sums weighted by the node costs, the SAH cost is the sum divided by the root area
+    double weighted_area_ = 0.0;
+    double build_sah_cost_ = 0.0;
+    float root_area_ = 0.0f;
+};
@@ -0,0 +1,154 @@
+/*****************************************************************************
+ MIT License
+
+ Copyright(c) 2023 Alexander Veselov
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this softwareand associated documentation files(the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions :
+
+ The above copyright noticeand this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *****************************************************************************/
+
+#include "compressed_leaves.hpp"
+#include "utils/timer.hpp"
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+namespace
+{
+    // Must match DecodeLeafTriangle in kernels/cl/trace_bvh.cl
+    constexpr std::uint32_t kMaxLeafVertices = 256;
+    constexpr std::uint32_t kIndicesPerWord = 4;
+
+    std::uint32_t FloatBits(float value)
+    {
+        std::uint32_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        return bits;
+    }
+
+    bool SamePosition(float3 const& a, float3 const& b)
+    {
+        // Bitwise, the decoded triangles must be identical to the uncompressed ones
+        return FloatBits(a.x) == FloatBits(b.x) && FloatBits(a.y) == FloatBits(b.y) && FloatBits(a.z) == FloatBits(b.z);
+    }
+}
+
+CompressedLeaves CompressLeaves(std::vector<LinearBVHNode> const& nodes, std::vector<Triangle> const& triangles,
+    bool print_stats)
+{
+    auto start_time = Clock::now();
+
+    CompressedLeaves leaves;
+    leaves.record_offsets.resize(nodes.size());
+
+    std::vector<float3> pool;
+    std::vector<std::uint8_t> indices;
+    std::uint32_t num_triangles = 0;
+    std::uint32_t num_vertices = 0;
+
+    for (std::size_t node_idx = 0; node_idx < nodes.size(); ++node_idx)
+    {
+        LinearBVHNode const& node = nodes[node_idx];
+        if (!IsLeaf(node))
+        {
+            continue;
+        }
+
+        std::uint32_t num_primitives = node.num_primitives_axis >> 16;
+        pool.clear();
+        indices.clear();
+
+        for (std::uint32_t slot = node.offset; slot < node.offset + num_primitives; ++slot)
+        {
+            Triangle const& triangle = triangles[slot];
+            for (float3 const& position : { triangle.v1.position, triangle.v2.position, triangle.v3.position })
+            {
+                // Leaves are small, a linear search is faster than hashing
+                std::size_t index = 0;
+                while (index < pool.size() && !SamePosition(pool[index], position))
+                {
+                    ++index;
+                }
+
+                if (index == pool.size())
+                {
+                    if (pool.size() == kMaxLeafVertices)
+                    {
+                        throw std::runtime_error("Compressed BVH leaves can't reference more than "
+                            + std::to_string(kMaxLeafVertices) + " unique vertices");
+                    }
+
+                    pool.push_back(position);
+                }
+
+                indices.push_back(static_cast<std::uint8_t>(index));
+            }
+        }
+
+        leaves.record_offsets[node_idx] = static_cast<std::uint32_t>(leaves.data.size());
+
+        for (std::size_t i = 0; i < indices.size(); i += kIndicesPerWord)
+        {
+            std::uint32_t word = 0;
+            for (std::size_t j = 0; j < kIndicesPerWord && i + j < indices.size(); ++j)
+            {
+                word |= std::uint32_t(indices[i + j]) << (8 * j);
+            }
+            leaves.data.push_back(word);
+        }
+
+        for (float3 const& position : pool)
+        {
+            leaves.data.push_back(FloatBits(position.x));
+            leaves.data.push_back(FloatBits(position.y));
+            leaves.data.push_back(FloatBits(position.z));
+        }
+
+        num_triangles += num_primitives;
+        num_vertices += static_cast<std::uint32_t>(pool.size());
+    }
+
+    auto end_time = Clock::now();
+    double compress_time = ElapsedMilliseconds(start_time, end_time);
+
+    if (print_stats)
+    {
+        std::cout << "Compressed BVH leaves created with " << float(num_vertices) / float(num_triangles)
+            << " vertices per triangle (" << float(leaves.data.size() * sizeof(std::uint32_t)) / (1024.0f * 1024.0f)
+            << " MB vs " << float(num_triangles * sizeof(RTTriangle)) / (1024.0f * 1024.0f) << " MB uncompressed) in "
+            << compress_time << " ms" << std::endl;
+    }
+
+    return leaves;
+}
+
+std::vector<LinearBVHNode> LinkCompressedLeaves(std::vector<LinearBVHNode> const& nodes,
+    std::vector<std::uint32_t> const& record_offsets)
+{
+    std::vector<LinearBVHNode> linked_nodes = nodes;
+    for (std::size_t node_idx = 0; node_idx < linked_nodes.size(); ++node_idx)
+    {
+        if (IsLeaf(linked_nodes[node_idx]))
+        {
+            linked_nodes[node_idx].first_child = record_offsets[node_idx];
+        }
+    }
+
+    return linked_nodes;
+}
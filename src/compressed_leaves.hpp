@@ -0,0 +1,49 @@
+/*****************************************************************************
+ MIT License
+
+ Copyright(c) 2023 Alexander Veselov
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this softwareand associated documentation files(the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions :
+
+ The above copyright noticeand this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *****************************************************************************/
+
+#pragma once
+
+#include "kernels/common/shared_structures.h"
+#include <cstdint>
+#include <vector>
+
+// Leaf geometry of the binary BVH stored as a pool of unique vertices per leaf. The triangles
+// of a leaf reference the pool by byte indices, so the vertices shared by the triangle pairs
+// and strips of a mesh are stored once. A leaf record holds the 3 byte indices of each
+// triangle packed 4 per word, followed by the pool as 3 floats per vertex
+struct CompressedLeaves
+{
+    std::vector<std::uint32_t> data;
+    // Word offset of the record of each leaf, indexed by the node index, 0 for interior nodes
+    std::vector<std::uint32_t> record_offsets;
+};
+
+// Encodes the leaves of the nodes, the triangles are in the slot order of the nodes. Throws
+// if a leaf references more than 256 unique vertices. Prints the size of the vertex pools if print_stats is set
+CompressedLeaves CompressLeaves(std::vector<LinearBVHNode> const& nodes, std::vector<Triangle> const& triangles,
+    bool print_stats = true);
+
+// Copy of the nodes with the leaves pointing to their records through first_child
+std::vector<LinearBVHNode> LinkCompressedLeaves(std::vector<LinearBVHNode> const& nodes,
+    std::vector<std::uint32_t> const& record_offsets);
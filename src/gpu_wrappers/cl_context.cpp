@@ -93,9 +93,9 @@ CLContext::CLContext(const cl::Platform& platform)
 
 }
 
-void CLContext::WriteBuffer(const cl::Buffer& buffer, const void* data, size_t size) const
+void CLContext::WriteBuffer(const cl::Buffer& buffer, const void* data, size_t size, size_t offset) const
 {
-    cl_int status = queue_.enqueueWriteBuffer(buffer, true, 0, size, data);
+    cl_int status = queue_.enqueueWriteBuffer(buffer, true, offset, size, data);
     ThrowIfFailed(status, "Failed to write buffer");
 }
 
@@ -112,9 +112,16 @@ void CLContext::CopyBuffer(const cl::Buffer& src_buffer, const cl::Buffer& dst_b
     ThrowIfFailed(status, "Failed to copy buffer");
 }
 
-void CLContext::ExecuteKernel(CLKernel const& kernel, std::size_t work_size) const
+void CLContext::ExecuteKernel(CLKernel const& kernel, std::size_t work_size, std::size_t group_size) const
 {
-    cl_int status = queue_.enqueueNDRangeKernel(kernel.GetKernel(), cl::NullRange, cl::NDRange(work_size), cl::NullRange, 0);
+    cl::NDRange local_range = cl::NullRange;
+    if (group_size > 0)
+    {
+        work_size = (work_size + group_size - 1) / group_size * group_size;
+        local_range = cl::NDRange(group_size);
+    }
+
+    cl_int status = queue_.enqueueNDRangeKernel(kernel.GetKernel(), cl::NullRange, cl::NDRange(work_size), local_range, 0);
     ThrowIfFailed(status, ("Failed to enqueue kernel " + kernel.GetName()).c_str());
 }
 
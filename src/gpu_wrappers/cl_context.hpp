@@ -41,11 +41,12 @@ public:
     std::shared_ptr<CLKernel> CreateKernel(const char* filename, char const* kernel_name,
         std::vector<std::string> const& definitions = std::vector<std::string>());
 
-    void WriteBuffer(const cl::Buffer& buffer, const void* data, size_t size) const;
+    void WriteBuffer(const cl::Buffer& buffer, const void* data, size_t size, size_t offset = 0) const;
     void ReadBuffer(const cl::Buffer& buffer, void* ptr, size_t size) const;
     void CopyBuffer(const cl::Buffer& src_buffer, const cl::Buffer& dst_buffer,
         std::size_t src_offset, std::size_t dst_offset, std::size_t size) const;
-    void ExecuteKernel(CLKernel const& kernel, std::size_t work_size) const;
+    // A nonzero group_size rounds the work size up to a multiple of it
+    void ExecuteKernel(CLKernel const& kernel, std::size_t work_size, std::size_t group_size = 0) const;
     void Finish() const { queue_.finish(); }
     void AcquireGLObject(cl_mem mem);
     void ReleaseGLObject(cl_mem mem);
@@ -28,7 +28,11 @@
 #include "utils/cl_exception.hpp"
 #include "Scene/scene.hpp"
 #include "acceleration_structure.hpp"
+#include "two_level_grid.hpp"
+#include "kernels/common/constants.h"
 #include "Utils/blue_noise_sampler.hpp"
+#include "utils/timer.hpp"
+#include <iostream>
 
 namespace args
 {
@@ -76,6 +80,7 @@ namespace args
             kPixelIndicesBuffer,
             kHitsBuffer,
             kTrianglesBuffer,
+            kInstancesBuffer,
             kMaterialsBuffer,
             kTexturesBuffer,
             kTextureDataBuffer,
@@ -101,6 +106,7 @@ namespace args
             kIncomingPixelIndicesBuffer,
             kHitsBuffer,
             kTrianglesBuffer,
+            kInstancesBuffer,
             kAnalyticLightsBuffer,
             kEmissiveIndicesBuffer,
             kMaterialsBuffer,
@@ -122,6 +128,7 @@ namespace args
             kShadowRayBuffer,
             kShadowRayCounterBuffer,
             kShadowPixelIndicesBuffer,
+            kShadowOccluderSlotsBuffer,
             kDirectLightSamplesBuffer,
             kRadianceBuffer,
         };
@@ -212,6 +219,7 @@ CLPathTraceIntegrator::CLPathTraceIntegrator(std::uint32_t width, std::uint32_t
 
     shadow_rays_buffer_ = CreateBuffer(num_rays * sizeof(Ray));
     shadow_pixel_indices_buffer_ = CreateBuffer(num_rays * sizeof(std::uint32_t));
+    shadow_occluder_slots_buffer_ = CreateBuffer(num_rays * sizeof(std::uint32_t));
     shadow_ray_counter_buffer_ = CreateBuffer(sizeof(std::uint32_t));
     hits_buffer_ = CreateBuffer(num_rays * sizeof(Hit));
     shadow_hits_buffer_ = CreateBuffer(num_rays * sizeof(std::uint32_t));
@@ -252,6 +260,7 @@ CLPathTraceIntegrator::CLPathTraceIntegrator(std::uint32_t width, std::uint32_t
         GL_TEXTURE_2D, 0, gl_interop_image_, &status);
     ThrowIfFailed(status, "Failed to create output image");
 
+    CreateTraversalBackend();
     CreateKernels();
 
     // Don't forget to reset frame index
@@ -293,8 +302,15 @@ void CLPathTraceIntegrator::CreateKernels()
         temporal_accumulation_kernel_ = cl_context_.CreateKernel("denoiser.cl", "TemporalAccumulation");
     }
 
-    intersect_kernel_ = cl_context_.CreateKernel("trace_bvh.cl", "TraceBvh");
-    intersect_shadow_kernel_ = cl_context_.CreateKernel("trace_bvh.cl", "TraceBvh", { "SHADOW_RAYS" });
+    CLTraversalOptions traversal_options;
+    traversal_options.traversal = bvh_traversal_;
+    traversal_options.sign_order = enable_bvh_sign_order_;
+    traversal_options.watertight_triangles = enable_watertight_triangles_;
+    traversal_options.compressed_leaves = enable_compressed_leaves_;
+    traversal_options.alpha_test = enable_alpha_test_;
+    traversal_options.entry_hints = enable_entry_hints_;
+    traversal_options.occluder_cache = enable_occluder_cache_;
+    traversal_backend_->CreateKernels(traversal_options);
 
     // Setup kernels
     cl_mem output_image_mem = (*output_image_)();
@@ -373,9 +389,7 @@ void CLPathTraceIntegrator::SetCameraData(Camera const& camera)
 void CLPathTraceIntegrator::UploadGPUData(Scene const& scene, AccelerationStructure const& acc_structure)
 {
     // Create scene buffers
-    auto const& triangles = scene.GetTriangles();
     auto const& materials = scene.GetMaterials();
-    auto const& emissive_indices = scene.GetEmissiveIndices();
     auto const& lights = scene.GetLights();
     auto const& textures = scene.GetTextures();
     auto const& texture_data = scene.GetTextureData();
@@ -383,36 +397,11 @@ void CLPathTraceIntegrator::UploadGPUData(Scene const& scene, AccelerationStruct
 
     cl_int status;
 
-    assert(!triangles.empty());
-    triangle_buffer_ = cl::Buffer(cl_context_.GetContext(), CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-        triangles.size() * sizeof(Triangle), (void*)triangles.data(), &status);
-    ThrowIfFailed(status, "Failed to create triangle buffer");
-
-    // Additional compressed triangle buffer
-    {
-        std::vector<RTTriangle> rt_triangles;
-        for (auto const& triangle : triangles)
-        {
-            rt_triangles.emplace_back(triangle.v1.position, triangle.v2.position, triangle.v3.position);
-        }
-
-        rt_triangle_buffer_ = cl::Buffer(cl_context_.GetContext(), CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-            rt_triangles.size() * sizeof(RTTriangle), (void*)rt_triangles.data(), &status);
-        ThrowIfFailed(status, "Failed to create rt triangle buffer");
-    }
-
     assert(!materials.empty());
     material_buffer_ = cl::Buffer(cl_context_.GetContext(), CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
         materials.size() * sizeof(PackedMaterial), (void*)materials.data(), &status);
     ThrowIfFailed(status, "Failed to create material buffer");
 
-    if (!emissive_indices.empty())
-    {
-        emissive_buffer_ = cl::Buffer(cl_context_.GetContext(), CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-            emissive_indices.size() * sizeof(std::uint32_t), (void*)emissive_indices.data(), &status);
-        ThrowIfFailed(status, "Failed to create emissive buffer");
-    }
-
     if (!lights.empty())
     {
         analytic_light_buffer_ = cl::Buffer(cl_context_.GetContext(), CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
@@ -444,15 +433,172 @@ void CLPathTraceIntegrator::UploadGPUData(Scene const& scene, AccelerationStruct
 
     scene_info_ = scene.GetSceneInfo();
 
-    auto const& nodes = acc_structure_.GetNodes();
+    UploadSlotData(scene);
+}
+
+void CLPathTraceIntegrator::UploadSlotData(Scene const& scene)
+{
+    // The triangles are stored in the slot order of the acceleration structure. The buffers are
+    // created again, another tree may reference the triangles from a different number of slots
+    // and the mesh roots of its instances may differ
+    std::vector<Triangle> triangles = acc_structure_->GatherTriangles(scene.GetTriangles());
+    std::vector<std::uint32_t> emissive_indices = acc_structure_->MapToTriangleSlots(scene.GetEmissiveIndices());
 
-    // Upload BVH data
-    nodes_buffer_ = cl::Buffer(cl_context_.GetContext(), CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-        nodes.size() * sizeof(LinearBVHNode), (void*)nodes.data(), &status);
-    if (status != CL_SUCCESS)
+    cl_int status;
+
+    assert(!triangles.empty());
+    triangle_buffer_ = cl::Buffer(cl_context_.GetContext(), CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+        triangles.size() * sizeof(Triangle), (void*)triangles.data(), &status);
+    ThrowIfFailed(status, "Failed to create triangle buffer");
+
+    if (!emissive_indices.empty())
+    {
+        emissive_buffer_ = cl::Buffer(cl_context_.GetContext(), CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+            emissive_indices.size() * sizeof(std::uint32_t), (void*)emissive_indices.data(), &status);
+        ThrowIfFailed(status, "Failed to create emissive buffer");
+    }
+
+    // The instance ids of the hits index the instances of the acceleration structure
+    auto const& instances = acc_structure_->GetInstances();
+    if (!instances.empty())
     {
-        throw CLException("Failed to create BVH node buffer", status);
+        instances_buffer_ = cl::Buffer(cl_context_.GetContext(), CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+            instances.size() * sizeof(Instance), (void*)instances.data(), &status);
+        ThrowIfFailed(status, "Failed to create instance buffer");
     }
+
+    UploadAlphaTriangles(scene, triangles);
+    traversal_backend_->Upload(*acc_structure_, triangles);
+}
+
+void CLPathTraceIntegrator::UploadAlphaTriangles(Scene const& scene, std::vector<Triangle> const& triangles)
+{
+    auto const& materials = scene.GetMaterials();
+
+    // Most triangles are opaque and only take the INVALID_ID of their slot
+    std::vector<std::uint32_t> triangle_alpha(triangles.size(), INVALID_ID);
+    std::vector<AlphaTriangle> alpha_triangles;
+
+    for (std::size_t slot = 0; slot < triangles.size(); ++slot)
+    {
+        Triangle const& triangle = triangles[slot];
+        std::uint32_t packed = materials[triangle.mtlIndex].ior_emission_idx_transparency;
+        // Unpacked the same way as by the shading
+        float transparency = (float)((packed >> 16) & 0xFF) / 255.0f;
+        std::uint32_t texture_idx = packed >> 24;
+
+        // The texture only lowers the transparency
+        if (texture_idx == INVALID_TEXTURE_IDX && transparency >= 0.5f)
+        {
+            continue;
+        }
+
+        AlphaTriangle alpha_triangle;
+        alpha_triangle.texcoord1 = float2(triangle.v1.texcoord.x, triangle.v1.texcoord.y);
+        alpha_triangle.texcoord2 = float2(triangle.v2.texcoord.x, triangle.v2.texcoord.y);
+        alpha_triangle.texcoord3 = float2(triangle.v3.texcoord.x, triangle.v3.texcoord.y);
+        alpha_triangle.transparency = transparency;
+        alpha_triangle.texture_idx = texture_idx;
+
+        triangle_alpha[slot] = (std::uint32_t)alpha_triangles.size();
+        alpha_triangles.push_back(alpha_triangle);
+    }
+
+    // The buffers can't be empty
+    if (alpha_triangles.empty())
+    {
+        alpha_triangles.push_back({});
+    }
+
+    cl_int status;
+    alpha_test_buffers_.triangle_alpha = cl::Buffer(cl_context_.GetContext(), CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+        triangle_alpha.size() * sizeof(std::uint32_t), (void*)triangle_alpha.data(), &status);
+    ThrowIfFailed(status, "Failed to create triangle alpha buffer");
+
+    alpha_test_buffers_.alpha_triangles = cl::Buffer(cl_context_.GetContext(), CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+        alpha_triangles.size() * sizeof(AlphaTriangle), (void*)alpha_triangles.data(), &status);
+    ThrowIfFailed(status, "Failed to create alpha triangle buffer");
+
+    alpha_test_buffers_.textures = texture_buffer_;
+    alpha_test_buffers_.texture_data = texture_data_buffer_;
+    traversal_backend_->SetAlphaTestBuffers(alpha_test_buffers_);
+}
+
+void CLPathTraceIntegrator::UpdateGPUData(Scene const& scene, std::vector<DirtyRange> const& triangle_ranges,
+    std::vector<DirtyRange> const& node_ranges)
+{
+    UploadTriangles(scene, triangle_ranges);
+    traversal_backend_->Update(scene.GetTriangles(), triangle_ranges, node_ranges);
+    RequestReset();
+}
+
+void CLPathTraceIntegrator::UploadTriangles(Scene const& scene, std::vector<DirtyRange> const& triangle_ranges)
+{
+    auto const& triangles = scene.GetTriangles();
+    auto const& primitive_indices = acc_structure_->GetPrimitiveIndices();
+
+    std::vector<Triangle> range_triangles;
+    for (auto const& range : triangle_ranges)
+    {
+        range_triangles.clear();
+        for (std::uint32_t slot = range.first; slot < range.first + range.count; ++slot)
+        {
+            range_triangles.push_back(triangles[primitive_indices[slot]]);
+        }
+
+        cl_context_.WriteBuffer(triangle_buffer_, range_triangles.data(),
+            range.count * sizeof(Triangle), range.first * sizeof(Triangle));
+    }
+}
+
+void CLPathTraceIntegrator::CreateTraversalBackend()
+{
+    if (dynamic_cast<TwoLevelGrid const*>(acc_structure_))
+    {
+        if (bvh_width_ != 2 || bvh_quantization_bits_ != 0)
+        {
+            throw std::runtime_error("BVH width and quantization are not supported for the grid");
+        }
+
+        traversal_backend_ = std::make_unique<CLGridBackend>(cl_context_, *acc_structure_);
+    }
+    else if (bvh_quantization_bits_ != 0)
+    {
+        traversal_backend_ = std::make_unique<CLQuantizedBvhBackend>(cl_context_, *acc_structure_, bvh_quantization_bits_);
+    }
+    else if (bvh_width_ != 2)
+    {
+        traversal_backend_ = std::make_unique<CLWideBvhBackend>(cl_context_, *acc_structure_, bvh_width_);
+    }
+    else if (bvh_traversal_ == BvhTraversal::kTreelet && acc_structure_->GetInstances().empty())
+    {
+        traversal_backend_ = std::make_unique<CLTreeletBvhBackend>(cl_context_, *acc_structure_);
+    }
+    else
+    {
+        traversal_backend_ = std::make_unique<CLBinaryBvhBackend>(cl_context_, *acc_structure_);
+    }
+
+    traversal_backend_->SetAlphaTestBuffers(alpha_test_buffers_);
+}
+
+void CLPathTraceIntegrator::ChangeTraversalBackend()
+{
+    CreateTraversalBackend();
+    CreateKernels();
+
+    // The scene is uploaded into the backend with the scene data otherwise. The triangles of
+    // the shading buffer are in the slot order the backend expects
+    if (triangle_buffer_())
+    {
+        std::vector<Triangle> triangles(acc_structure_->GetPrimitiveIndices().size(),
+            Triangle(Vertex(), Vertex(), Vertex(), 0));
+        cl_context_.ReadBuffer(triangle_buffer_, triangles.data(), triangles.size() * sizeof(Triangle));
+        cl_context_.Finish();
+        traversal_backend_->Upload(*acc_structure_, triangles);
+    }
+
+    RequestReset();
 }
 
 void CLPathTraceIntegrator::SetSamplerType(SamplerType sampler_type)
@@ -494,6 +640,135 @@ void CLPathTraceIntegrator::EnableDenoiser(bool enable_denoiser)
     RequestReset();
 }
 
+void CLPathTraceIntegrator::SetBvhWidth(std::uint32_t width)
+{
+    if (width == bvh_width_)
+    {
+        return;
+    }
+
+    if (width != 2 && width != 4 && width != 8)
+    {
+        throw std::runtime_error("BVH width must be 2, 4 or 8");
+    }
+
+    if (width != 2 && bvh_quantization_bits_ != 0)
+    {
+        throw std::runtime_error("Quantized BVH nodes are only supported for the binary BVH");
+    }
+
+    if (width != 2 && !acc_structure_->GetInstances().empty())
+    {
+        throw std::runtime_error("Instanced scenes are only supported for the binary BVH");
+    }
+
+    if (width != 2 && enable_compressed_leaves_)
+    {
+        throw std::runtime_error("Compressed BVH leaves are only supported for the binary BVH");
+    }
+
+    bvh_width_ = width;
+    ChangeTraversalBackend();
+}
+
+void CLPathTraceIntegrator::SetBvhQuantization(std::uint32_t bits)
+{
+    if (bits == bvh_quantization_bits_)
+    {
+        return;
+    }
+
+    if (bits != 0 && bits != 8 && bits != 16)
+    {
+        throw std::runtime_error("BVH quantization must be 0, 8 or 16 bits");
+    }
+
+    if (bits != 0 && bvh_width_ != 2)
+    {
+        throw std::runtime_error("Quantized BVH nodes are only supported for the binary BVH");
+    }
+
+    if (bits != 0 && !acc_structure_->GetInstances().empty())
+    {
+        throw std::runtime_error("Quantized BVH nodes are not supported for instanced scenes");
+    }
+
+    if (bits != 0 && enable_compressed_leaves_)
+    {
+        throw std::runtime_error("Quantized BVH nodes don't support compressed leaves");
+    }
+
+    bvh_quantization_bits_ = bits;
+    ChangeTraversalBackend();
+}
+
+void CLPathTraceIntegrator::SetBvhTraversal(BvhTraversal traversal)
+{
+    if (traversal == bvh_traversal_)
+    {
+        return;
+    }
+
+    // The treelets are assigned by a backend of their own
+    bool change_backend = (traversal == BvhTraversal::kTreelet) != (bvh_traversal_ == BvhTraversal::kTreelet);
+    bvh_traversal_ = traversal;
+
+    if (change_backend)
+    {
+        ChangeTraversalBackend();
+        return;
+    }
+
+    CreateKernels();
+    RequestReset();
+}
+
+void CLPathTraceIntegrator::EnableWatertightTriangles(bool enable)
+{
+    if (enable == enable_watertight_triangles_)
+    {
+        return;
+    }
+
+    // The records of the uploaded triangles can't be converted without the scene
+    if (triangle_buffer_())
+    {
+        throw std::runtime_error("The triangle test must be selected before the scene is uploaded");
+    }
+
+    enable_watertight_triangles_ = enable;
+    CreateKernels();
+    RequestReset();
+}
+
+void CLPathTraceIntegrator::EnableCompressedLeaves(bool enable)
+{
+    if (enable == enable_compressed_leaves_)
+    {
+        return;
+    }
+
+    if (enable && (bvh_width_ != 2 || bvh_quantization_bits_ != 0))
+    {
+        throw std::runtime_error("Compressed BVH leaves are only supported for the binary BVH without quantization");
+    }
+
+    if (enable && !acc_structure_->GetInstances().empty())
+    {
+        throw std::runtime_error("Compressed BVH leaves are not supported for instanced scenes");
+    }
+
+    // The leaf records are encoded from the scene
+    if (triangle_buffer_())
+    {
+        throw std::runtime_error("Compressed BVH leaves must be selected before the scene is uploaded");
+    }
+
+    enable_compressed_leaves_ = enable;
+    CreateKernels();
+    RequestReset();
+}
+
 void CLPathTraceIntegrator::Reset()
 {
     if (!enable_denoiser_)
@@ -524,18 +799,43 @@ void CLPathTraceIntegrator::IntersectRays(std::uint32_t bounce)
     std::uint32_t max_num_rays = width_ * height_;
     std::uint32_t incoming_idx = bounce & 1;
 
-    CLKernel& kernel = *intersect_kernel_;
-    kernel.SetArgument(0, rays_buffer_[incoming_idx]);
-    kernel.SetArgument(1, ray_counter_buffer_[incoming_idx]);
-    kernel.SetArgument(2, rt_triangle_buffer_);
-    kernel.SetArgument(3, nodes_buffer_);
-    kernel.SetArgument(4, hits_buffer_);
+    // The camera rays are coherent
+    if (bounce == 0)
+    {
+        traversal_backend_->IntersectCameraRays(rays_buffer_[incoming_idx], ray_counter_buffer_[incoming_idx],
+            max_num_rays, hits_buffer_);
+        return;
+    }
+
+    if (!enable_treelet_benchmark_ || bvh_traversal_ != BvhTraversal::kTreelet)
+    {
+        traversal_backend_->IntersectIncoherentRays(rays_buffer_[incoming_idx], ray_counter_buffer_[incoming_idx],
+            max_num_rays, hits_buffer_);
+        return;
+    }
+
+    // Trace the rays with the single pass traversal first, the treelet passes write the same hits
+    cl_context_.Finish();
+    auto start_time = Clock::now();
+    traversal_backend_->IntersectRays(rays_buffer_[incoming_idx], ray_counter_buffer_[incoming_idx],
+        max_num_rays, hits_buffer_);
+    cl_context_.Finish();
+    auto single_pass_time = Clock::now();
+    traversal_backend_->IntersectIncoherentRays(rays_buffer_[incoming_idx], ray_counter_buffer_[incoming_idx],
+        max_num_rays, hits_buffer_);
+    cl_context_.Finish();
+    auto end_time = Clock::now();
 
-    ///@TODO: use indirect dispatch
-    cl_context_.ExecuteKernel(kernel, max_num_rays);
+    treelet_benchmark_.single_pass_time += ElapsedMilliseconds(start_time, single_pass_time);
+    treelet_benchmark_.treelet_time += ElapsedMilliseconds(single_pass_time, end_time);
 
-    //acc_structure_.IntersectRays(rays_buffer_[incoming_idx], ray_counter_buffer_[incoming_idx],
-    //    max_num_rays, hits_buffer_);
+    if (++treelet_benchmark_.num_traces == kTreeletBenchmarkTraces)
+    {
+        std::cout << "Incoherent rays, average of " << kTreeletBenchmarkTraces << " traces: single pass "
+            << treelet_benchmark_.single_pass_time / kTreeletBenchmarkTraces << " ms, treelet scheduled "
+            << treelet_benchmark_.treelet_time / kTreeletBenchmarkTraces << " ms" << std::endl;
+        treelet_benchmark_ = {};
+    }
 }
 
 void CLPathTraceIntegrator::ComputeAOVs()
@@ -548,6 +848,7 @@ void CLPathTraceIntegrator::ComputeAOVs()
     aov_kernel_->SetArgument(args::Aov::kPixelIndicesBuffer, pixel_indices_buffer_[0]);
     aov_kernel_->SetArgument(args::Aov::kHitsBuffer, hits_buffer_);
     aov_kernel_->SetArgument(args::Aov::kTrianglesBuffer, triangle_buffer_);
+    aov_kernel_->SetArgument(args::Aov::kInstancesBuffer, instances_buffer_);
     aov_kernel_->SetArgument(args::Aov::kMaterialsBuffer, material_buffer_);
     aov_kernel_->SetArgument(args::Aov::kTexturesBuffer, texture_buffer_);
     aov_kernel_->SetArgument(args::Aov::kTextureDataBuffer, texture_data_buffer_);
@@ -564,19 +865,11 @@ void CLPathTraceIntegrator::ComputeAOVs()
 void CLPathTraceIntegrator::IntersectShadowRays()
 {
     std::uint32_t max_num_rays = width_ * height_;
+    // The shadow rays of the camera hits are cached per pixel and light
+    std::uint32_t num_occluder_slots = enable_occluder_cache_ ? max_num_rays * scene_info_.analytic_light_count : 0;
 
-    CLKernel& kernel = *intersect_shadow_kernel_;
-    kernel.SetArgument(0, shadow_rays_buffer_);
-    kernel.SetArgument(1, shadow_ray_counter_buffer_);
-    kernel.SetArgument(2, rt_triangle_buffer_);
-    kernel.SetArgument(3, nodes_buffer_);
-    kernel.SetArgument(4, shadow_hits_buffer_);
-
-    ///@TODO: use indirect dispatch
-    cl_context_.ExecuteKernel(kernel, max_num_rays);
-
-    //acc_structure_.IntersectRays(shadow_rays_buffer_, shadow_ray_counter_buffer_,
-    //    max_num_rays, shadow_hits_buffer_, false);
+    traversal_backend_->IntersectShadowRays(shadow_rays_buffer_, shadow_ray_counter_buffer_,
+        max_num_rays, shadow_hits_buffer_, shadow_occluder_slots_buffer_, num_occluder_slots);
 }
 
 void CLPathTraceIntegrator::ShadeMissedRays(std::uint32_t bounce)
@@ -606,6 +899,7 @@ void CLPathTraceIntegrator::ShadeSurfaceHits(std::uint32_t bounce)
     hit_surface_kernel_->SetArgument(args::HitSurface::kHitsBuffer, hits_buffer_);
 
     hit_surface_kernel_->SetArgument(args::HitSurface::kTrianglesBuffer, triangle_buffer_);
+    hit_surface_kernel_->SetArgument(args::HitSurface::kInstancesBuffer, instances_buffer_);
     hit_surface_kernel_->SetArgument(args::HitSurface::kAnalyticLightsBuffer, analytic_light_buffer_);
     hit_surface_kernel_->SetArgument(args::HitSurface::kEmissiveIndicesBuffer, emissive_buffer_);
     hit_surface_kernel_->SetArgument(args::HitSurface::kMaterialsBuffer, material_buffer_);
@@ -634,6 +928,7 @@ void CLPathTraceIntegrator::ShadeSurfaceHits(std::uint32_t bounce)
     hit_surface_kernel_->SetArgument(args::HitSurface::kShadowRayBuffer, shadow_rays_buffer_);
     hit_surface_kernel_->SetArgument(args::HitSurface::kShadowRayCounterBuffer, shadow_ray_counter_buffer_);
     hit_surface_kernel_->SetArgument(args::HitSurface::kShadowPixelIndicesBuffer, shadow_pixel_indices_buffer_);
+    hit_surface_kernel_->SetArgument(args::HitSurface::kShadowOccluderSlotsBuffer, shadow_occluder_slots_buffer_);
     hit_surface_kernel_->SetArgument(args::HitSurface::kDirectLightSamplesBuffer, direct_light_samples_buffer_);
 
     // Output radiance
@@ -25,6 +25,7 @@
 #pragma once
 
 #include "integrator.hpp"
+#include "cl_traversal_backend.hpp"
 #include "gpu_wrappers/cl_context.hpp"
 
 class CLPathTraceIntegrator : public Integrator
@@ -33,12 +34,20 @@ public:
     CLPathTraceIntegrator(std::uint32_t width, std::uint32_t height,
         AccelerationStructure& acc_structure, CLContext& cl_context, unsigned int out_image);
     void UploadGPUData(Scene const& scene, AccelerationStructure const& acc_structure) override;
+    void UpdateGPUData(Scene const& scene, std::vector<DirtyRange> const& triangle_ranges,
+        std::vector<DirtyRange> const& node_ranges) override;
     void SetCameraData(Camera const& camera) override;
     void SetSamplerType(SamplerType sampler_type) override;
     void SetAOV(AOV aov) override;
     void EnableDenoiser(bool enable) override;
+    void SetBvhWidth(std::uint32_t width) override;
+    void SetBvhQuantization(std::uint32_t bits) override;
+    void SetBvhTraversal(BvhTraversal traversal) override;
+    void EnableWatertightTriangles(bool enable) override;
+    void EnableCompressedLeaves(bool enable) override;
 
 protected:
+    void UploadSlotData(Scene const& scene) override;
     void CreateKernels() override;
     void Reset() override;
     void AdvanceSampleCount() override;
@@ -57,6 +66,13 @@ protected:
 
 private:
     cl::Buffer CreateBuffer(std::size_t size);
+    // Creates the backend of the node format selected by the BVH width and quantization
+    void CreateTraversalBackend();
+    // Switches to the backend of the new node format, uploads the scene into it if already uploaded
+    void ChangeTraversalBackend();
+    void UploadTriangles(Scene const& scene, std::vector<DirtyRange> const& triangle_ranges);
+    // Creates the alpha test records of the transparent materials for the triangles in the slot order
+    void UploadAlphaTriangles(Scene const& scene, std::vector<Triangle> const& triangles);
 
     CLContext& cl_context_;
     cl_GLuint gl_interop_image_;
@@ -73,15 +89,26 @@ private:
     std::shared_ptr<CLKernel> temporal_accumulation_kernel_;
     std::shared_ptr<CLKernel> resolve_kernel_;
 
-    // BVH traversal kernels
-    std::shared_ptr<CLKernel> intersect_kernel_;
-    std::shared_ptr<CLKernel> intersect_shadow_kernel_;
+    // Trace kernels and buffers of the acceleration structure
+    std::unique_ptr<CLTraversalBackend> traversal_backend_;
+    CLAlphaTestBuffers alpha_test_buffers_;
+
+    // Trace times of the rays after the first bounce summed for the treelet benchmark
+    struct TreeletBenchmark
+    {
+        double single_pass_time = 0.0;
+        double treelet_time = 0.0;
+        std::uint32_t num_traces = 0;
+    };
+    static constexpr std::uint32_t kTreeletBenchmarkTraces = 64;
+    TreeletBenchmark treelet_benchmark_;
 
     // Internal buffers
     cl::Buffer rays_buffer_[2]; // 2 buffers for incoming-outgoing rays
     cl::Buffer shadow_rays_buffer_;
     cl::Buffer pixel_indices_buffer_[2];
     cl::Buffer shadow_pixel_indices_buffer_;
+    cl::Buffer shadow_occluder_slots_buffer_;
     cl::Buffer ray_counter_buffer_[2];
     cl::Buffer shadow_ray_counter_buffer_;
     cl::Buffer hits_buffer_;
@@ -99,7 +126,7 @@ private:
 
     // Scene buffers
     cl::Buffer triangle_buffer_;
-    cl::Buffer rt_triangle_buffer_;
+    cl::Buffer instances_buffer_;
     cl::Buffer material_buffer_;
     cl::Buffer texture_buffer_;
     cl::Buffer texture_data_buffer_;
@@ -109,9 +136,6 @@ private:
     cl::Image2D env_texture_;
     SceneInfo scene_info_;
 
-    // Acceleration structure buffer
-    cl::Buffer nodes_buffer_;
-
     // Sampler buffers
     cl::Buffer sampler_sobol_buffer_;
     cl::Buffer sampler_scrambling_tile_buffer_;
@@ -0,0 +1,780 @@
+/*****************************************************************************
+ MIT License
+
+ Copyright(c) 2023 Alexander Veselov
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this softwareand associated documentation files(the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions :
+
+ The above copyright noticeand this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *****************************************************************************/
+
+#include "cl_traversal_backend.hpp"
+#include "integrator.hpp"
+#include "bvh_layout.hpp"
+#include "compressed_leaves.hpp"
+#include "quantized_bvh.hpp"
+#include "two_level_grid.hpp"
+#include "wide_bvh.hpp"
+#include "kernels/common/constants.h"
+#include "utils/cl_exception.hpp"
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+namespace
+{
+    // The short stack traversal takes 64 * 8 * 4 = 2 KB of local memory per group
+    constexpr std::size_t kTraceGroupSize = 64;
+    constexpr std::size_t kShortStackSize = 8;
+    // Prefer the stackless traversal if fewer groups fit into the local memory
+    constexpr std::size_t kMinResidentTraceGroups = 8;
+    // 256 nodes of 48 bytes fill 12 KB, the size of a typical L1 cache
+    constexpr std::uint32_t kMaxTreeletNodes = 256;
+    // Most rays finish within a few treelets, the rest is finished by a single pass
+    constexpr std::uint32_t kTreeletPasses = 8;
+    constexpr std::size_t kTreeletScanGroupSize = 64;
+
+    char const* GetBvhTraversalName(BvhTraversal traversal)
+    {
+        switch (traversal)
+        {
+        case BvhTraversal::kPrivateStack:
+            return "private stack";
+        case BvhTraversal::kShortStack:
+            return "local memory short stack";
+        case BvhTraversal::kStackless:
+            return "stackless";
+        case BvhTraversal::kTreelet:
+            return "treelet scheduled";
+        default:
+            return "auto";
+        }
+    }
+}
+
+namespace args
+{
+    namespace Trace
+    {
+        enum
+        {
+            // Input
+            kRayBuffer,
+            kRayCounterBuffer,
+            kTrianglesBuffer,
+            kNodesBuffer,
+            // Output
+            kHitsBuffer,
+            // Input of the two-level BVH
+            kInstancesBuffer,
+        };
+    }
+
+    namespace TraceGrid
+    {
+        enum
+        {
+            // Input
+            kCellsBuffer = Trace::kHitsBuffer + 1,
+            kReferencesBuffer,
+            kGridInfoBuffer,
+        };
+    }
+
+    namespace TraceAlphaTest
+    {
+        enum
+        {
+            // Input, following the last argument of the trace kernel
+            kTriangleAlphaBuffer,
+            kAlphaTrianglesBuffer,
+            kTexturesBuffer,
+            kTextureDataBuffer,
+        };
+    }
+
+    namespace TraceTreelets
+    {
+        enum
+        {
+            // Input and output
+            kNextNodesBuffer = Trace::kHitsBuffer + 1,
+            // Input
+            kNodeTreeletsBuffer,
+            kRayQueueBuffer,
+            kTreeletCountersBuffer,
+            kNumTreelets,
+            kFinish,
+            // Input of the alpha test
+            kAlphaTest,
+        };
+    }
+
+    namespace TraceOccluderCache
+    {
+        enum
+        {
+            // Input, following the scene arguments of the shadow ray kernel
+            kOccluderSlotsBuffer,
+            // Input and output
+            kOccluderCacheBuffer,
+        };
+    }
+}
+
+CLTraversalBackend::CLTraversalBackend(CLContext& cl_context, AccelerationStructure const& acc_structure)
+    : cl_context_(cl_context)
+    , acc_structure_(&acc_structure)
+{
+}
+
+void CLTraversalBackend::Upload(AccelerationStructure const& acc_structure, std::vector<Triangle> const& triangles)
+{
+    acc_structure_ = &acc_structure;
+    UploadTriangles(triangles);
+    UploadNodes();
+}
+
+void CLTraversalBackend::Update(std::vector<Triangle> const& scene_triangles, std::vector<DirtyRange> const& triangle_ranges,
+    std::vector<DirtyRange> const&)
+{
+    UpdateTriangles(scene_triangles, triangle_ranges);
+
+    // The encoded nodes depend on the whole tree
+    UploadNodes();
+}
+
+void CLTraversalBackend::IntersectRays(cl::Buffer const& rays_buffer, cl::Buffer const& ray_counter_buffer,
+    std::uint32_t max_num_rays, cl::Buffer const& hits_buffer, bool closest_hit)
+{
+    CLKernel& kernel = closest_hit ? *intersect_kernel_ : *intersect_shadow_kernel_;
+    kernel.SetArgument(args::Trace::kRayBuffer, rays_buffer);
+    kernel.SetArgument(args::Trace::kRayCounterBuffer, ray_counter_buffer);
+    kernel.SetArgument(args::Trace::kHitsBuffer, hits_buffer);
+    SetSceneArguments(kernel);
+
+    ///@TODO: use indirect dispatch
+    cl_context_.ExecuteKernel(kernel, max_num_rays, group_size_);
+}
+
+void CLTraversalBackend::IntersectIncoherentRays(cl::Buffer const& rays_buffer, cl::Buffer const& ray_counter_buffer,
+    std::uint32_t max_num_rays, cl::Buffer const& hits_buffer)
+{
+    IntersectRays(rays_buffer, ray_counter_buffer, max_num_rays, hits_buffer);
+}
+
+void CLTraversalBackend::IntersectCameraRays(cl::Buffer const& rays_buffer, cl::Buffer const& ray_counter_buffer,
+    std::uint32_t max_num_rays, cl::Buffer const& hits_buffer)
+{
+    IntersectRays(rays_buffer, ray_counter_buffer, max_num_rays, hits_buffer);
+}
+
+void CLTraversalBackend::IntersectShadowRays(cl::Buffer const& rays_buffer, cl::Buffer const& ray_counter_buffer,
+    std::uint32_t max_num_rays, cl::Buffer const& shadow_hits_buffer, cl::Buffer const&, std::uint32_t)
+{
+    IntersectRays(rays_buffer, ray_counter_buffer, max_num_rays, shadow_hits_buffer, false);
+}
+
+void CLTraversalBackend::SetAlphaTestArguments(CLKernel& kernel, std::uint32_t first_index)
+{
+    kernel.SetArgument(first_index + args::TraceAlphaTest::kTriangleAlphaBuffer, alpha_test_buffers_.triangle_alpha);
+    kernel.SetArgument(first_index + args::TraceAlphaTest::kAlphaTrianglesBuffer, alpha_test_buffers_.alpha_triangles);
+    kernel.SetArgument(first_index + args::TraceAlphaTest::kTexturesBuffer, alpha_test_buffers_.textures);
+    kernel.SetArgument(first_index + args::TraceAlphaTest::kTextureDataBuffer, alpha_test_buffers_.texture_data);
+}
+
+void CLTraversalBackend::UpdateTriangles(std::vector<Triangle> const& scene_triangles,
+    std::vector<DirtyRange> const& triangle_ranges)
+{
+    auto const& primitive_indices = acc_structure_->GetPrimitiveIndices();
+
+    std::vector<RTTriangle> rt_triangles;
+    for (auto const& range : triangle_ranges)
+    {
+        rt_triangles.clear();
+        for (std::uint32_t slot = range.first; slot < range.first + range.count; ++slot)
+        {
+            rt_triangles.push_back(PackRTTriangle(scene_triangles[primitive_indices[slot]], options_.watertight_triangles));
+        }
+
+        cl_context_.WriteBuffer(rt_triangle_buffer_, rt_triangles.data(),
+            range.count * sizeof(RTTriangle), range.first * sizeof(RTTriangle));
+    }
+}
+
+void CLTraversalBackend::CreateTraceKernels(char const* kernel_name, std::vector<std::string> definitions)
+{
+    if (options_.watertight_triangles)
+    {
+        definitions.push_back("WATERTIGHT_TRIANGLES");
+    }
+
+    intersect_kernel_ = cl_context_.CreateKernel("trace_bvh.cl", kernel_name, definitions);
+    definitions.push_back("SHADOW_RAYS");
+    intersect_shadow_kernel_ = cl_context_.CreateKernel("trace_bvh.cl", kernel_name, definitions);
+}
+
+void CLTraversalBackend::UploadTriangles(std::vector<Triangle> const& triangles)
+{
+    std::vector<RTTriangle> rt_triangles;
+    for (auto const& triangle : triangles)
+    {
+        rt_triangles.push_back(PackRTTriangle(triangle, options_.watertight_triangles));
+    }
+
+    cl_int status;
+    rt_triangle_buffer_ = cl::Buffer(cl_context_.GetContext(), CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+        rt_triangles.size() * sizeof(RTTriangle), (void*)rt_triangles.data(), &status);
+    ThrowIfFailed(status, "Failed to create rt triangle buffer");
+}
+
+void CLTraversalBackend::SetSceneArguments(CLKernel& kernel)
+{
+    kernel.SetArgument(args::Trace::kTrianglesBuffer, rt_triangle_buffer_);
+    kernel.SetArgument(args::Trace::kNodesBuffer, nodes_buffer_);
+}
+
+void CLBinaryBvhBackend::CreateKernels(CLTraversalOptions const& options)
+{
+    options_ = options;
+    group_size_ = 0;
+
+    if (!acc_structure_->GetInstances().empty())
+    {
+        if (options_.compressed_leaves)
+        {
+            throw std::runtime_error("Compressed BVH leaves are not supported for instanced scenes");
+        }
+
+        CreateTraceKernels("TraceTwoLevelBvh", {});
+        return;
+    }
+
+    std::vector<std::string> definitions;
+    BvhTraversal traversal = SelectTraversal(options_.traversal);
+    if (traversal == BvhTraversal::kShortStack)
+    {
+        definitions.push_back("BVH_SHORT_STACK_SIZE=" + std::to_string(kShortStackSize));
+        definitions.push_back("TRACE_GROUP_SIZE=" + std::to_string(kTraceGroupSize));
+        group_size_ = kTraceGroupSize;
+    }
+    else if (traversal == BvhTraversal::kStackless)
+    {
+        definitions.push_back("BVH_STACKLESS");
+    }
+
+    if (options_.sign_order)
+    {
+        definitions.push_back("BVH_SIGN_ORDER");
+    }
+
+    if (options_.compressed_leaves)
+    {
+        definitions.push_back("COMPRESSED_LEAVES");
+    }
+
+    if (options_.alpha_test)
+    {
+        definitions.push_back("ALPHA_TEST");
+    }
+
+    std::cout << "BVH traversal: " << GetBvhTraversalName(traversal) << std::endl;
+    CreateTraceKernels("TraceBvh", definitions);
+
+    if (options_.watertight_triangles)
+    {
+        definitions.push_back("WATERTIGHT_TRIANGLES");
+    }
+
+    entry_hints_kernel_.reset();
+    if (options_.entry_hints)
+    {
+        std::vector<std::string> entry_hints_definitions = definitions;
+        entry_hints_definitions.push_back("ENTRY_HINTS");
+        entry_hints_kernel_ = cl_context_.CreateKernel("trace_bvh.cl", "TraceBvh", entry_hints_definitions);
+    }
+
+    // The cached occluders are fetched from the triangle records
+    occluder_cache_kernel_.reset();
+    if (options_.occluder_cache && !options_.compressed_leaves)
+    {
+        std::vector<std::string> occluder_cache_definitions = definitions;
+        occluder_cache_definitions.push_back("SHADOW_RAYS");
+        occluder_cache_definitions.push_back("OCCLUDER_CACHE");
+        occluder_cache_kernel_ = cl_context_.CreateKernel("trace_bvh.cl", "TraceBvh", occluder_cache_definitions);
+    }
+}
+
+void CLBinaryBvhBackend::Update(std::vector<Triangle> const& scene_triangles, std::vector<DirtyRange> const& triangle_ranges,
+    std::vector<DirtyRange> const& node_ranges)
+{
+    // The vertex pools of the leaves change with any moved vertex
+    if (options_.compressed_leaves)
+    {
+        UploadTriangles(acc_structure_->GatherTriangles(scene_triangles));
+        UploadNodes();
+        return;
+    }
+
+    UpdateTriangles(scene_triangles, triangle_ranges);
+
+    auto const& nodes = acc_structure_->GetNodes();
+    for (auto const& range : node_ranges)
+    {
+        cl_context_.WriteBuffer(nodes_buffer_, &nodes[range.first],
+            range.count * sizeof(LinearBVHNode), range.first * sizeof(LinearBVHNode));
+    }
+}
+
+void CLBinaryBvhBackend::UploadTriangles(std::vector<Triangle> const& triangles)
+{
+    // The cached occluders index the previous triangle slots
+    num_occluder_slots_ = 0;
+
+    if (!options_.compressed_leaves)
+    {
+        CLTraversalBackend::UploadTriangles(triangles);
+        return;
+    }
+
+    CompressedLeaves leaves = CompressLeaves(acc_structure_->GetNodes(), triangles);
+    leaf_record_offsets_ = std::move(leaves.record_offsets);
+
+    cl_int status;
+    leaf_data_buffer_ = cl::Buffer(cl_context_.GetContext(), CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+        leaves.data.size() * sizeof(std::uint32_t), (void*)leaves.data.data(), &status);
+    ThrowIfFailed(status, "Failed to create compressed leaf buffer");
+}
+
+void CLBinaryBvhBackend::UploadNodes()
+{
+    cl_int status;
+    auto const& nodes = acc_structure_->GetNodes();
+
+    if (options_.compressed_leaves)
+    {
+        std::vector<LinearBVHNode> linked_nodes = LinkCompressedLeaves(nodes, leaf_record_offsets_);
+        nodes_buffer_ = cl::Buffer(cl_context_.GetContext(), CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+            linked_nodes.size() * sizeof(LinearBVHNode), (void*)linked_nodes.data(), &status);
+    }
+    else
+    {
+        nodes_buffer_ = cl::Buffer(cl_context_.GetContext(), CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+            nodes.size() * sizeof(LinearBVHNode), (void*)nodes.data(), &status);
+    }
+
+    ThrowIfFailed(status, "Failed to create BVH node buffer");
+
+    // The instances reference the mesh roots in the nodes
+    auto const& instances = acc_structure_->GetInstances();
+    if (!instances.empty())
+    {
+        instances_buffer_ = cl::Buffer(cl_context_.GetContext(), CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+            instances.size() * sizeof(Instance), (void*)instances.data(), &status);
+        ThrowIfFailed(status, "Failed to create instance buffer");
+    }
+
+    // The hints index the previous nodes
+    num_entry_hints_ = 0;
+}
+
+void CLBinaryBvhBackend::IntersectCameraRays(cl::Buffer const& rays_buffer, cl::Buffer const& ray_counter_buffer,
+    std::uint32_t max_num_rays, cl::Buffer const& hits_buffer)
+{
+    if (!entry_hints_kernel_)
+    {
+        IntersectRays(rays_buffer, ray_counter_buffer, max_num_rays, hits_buffer);
+        return;
+    }
+
+    if (max_num_rays != num_entry_hints_)
+    {
+        std::vector<std::uint32_t> entry_hints(max_num_rays, INVALID_ID);
+
+        cl_int status;
+        entry_hints_buffer_ = cl::Buffer(cl_context_.GetContext(), CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+            entry_hints.size() * sizeof(std::uint32_t), (void*)entry_hints.data(), &status);
+        ThrowIfFailed(status, "Failed to create BVH entry hint buffer");
+        num_entry_hints_ = max_num_rays;
+    }
+
+    CLKernel& kernel = *entry_hints_kernel_;
+    kernel.SetArgument(args::Trace::kRayBuffer, rays_buffer);
+    kernel.SetArgument(args::Trace::kRayCounterBuffer, ray_counter_buffer);
+    kernel.SetArgument(args::Trace::kHitsBuffer, hits_buffer);
+    SetSceneArguments(kernel);
+    kernel.SetArgument(GetCacheArgumentsIndex(), entry_hints_buffer_);
+
+    ///@TODO: use indirect dispatch
+    cl_context_.ExecuteKernel(kernel, max_num_rays, group_size_);
+}
+
+void CLBinaryBvhBackend::IntersectShadowRays(cl::Buffer const& rays_buffer, cl::Buffer const& ray_counter_buffer,
+    std::uint32_t max_num_rays, cl::Buffer const& shadow_hits_buffer, cl::Buffer const& occluder_slots_buffer,
+    std::uint32_t num_occluder_slots)
+{
+    if (!occluder_cache_kernel_ || num_occluder_slots == 0)
+    {
+        IntersectRays(rays_buffer, ray_counter_buffer, max_num_rays, shadow_hits_buffer, false);
+        return;
+    }
+
+    if (num_occluder_slots != num_occluder_slots_)
+    {
+        std::vector<std::uint32_t> occluders(num_occluder_slots, INVALID_ID);
+
+        cl_int status;
+        occluder_cache_buffer_ = cl::Buffer(cl_context_.GetContext(), CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+            occluders.size() * sizeof(std::uint32_t), (void*)occluders.data(), &status);
+        ThrowIfFailed(status, "Failed to create occluder cache buffer");
+        num_occluder_slots_ = num_occluder_slots;
+    }
+
+    CLKernel& kernel = *occluder_cache_kernel_;
+    kernel.SetArgument(args::Trace::kRayBuffer, rays_buffer);
+    kernel.SetArgument(args::Trace::kRayCounterBuffer, ray_counter_buffer);
+    kernel.SetArgument(args::Trace::kHitsBuffer, shadow_hits_buffer);
+    SetSceneArguments(kernel);
+
+    std::uint32_t first_index = GetCacheArgumentsIndex();
+    kernel.SetArgument(first_index + args::TraceOccluderCache::kOccluderSlotsBuffer, occluder_slots_buffer);
+    kernel.SetArgument(first_index + args::TraceOccluderCache::kOccluderCacheBuffer, occluder_cache_buffer_);
+
+    ///@TODO: use indirect dispatch
+    cl_context_.ExecuteKernel(kernel, max_num_rays, group_size_);
+}
+
+std::uint32_t CLBinaryBvhBackend::GetCacheArgumentsIndex() const
+{
+    std::uint32_t first_index = args::Trace::kHitsBuffer + 1;
+    if (options_.alpha_test)
+    {
+        first_index += args::TraceAlphaTest::kTextureDataBuffer + 1;
+    }
+
+    return first_index;
+}
+
+void CLBinaryBvhBackend::SetSceneArguments(CLKernel& kernel)
+{
+    kernel.SetArgument(args::Trace::kTrianglesBuffer, options_.compressed_leaves ? leaf_data_buffer_ : rt_triangle_buffer_);
+    kernel.SetArgument(args::Trace::kNodesBuffer, nodes_buffer_);
+
+    if (instances_buffer_())
+    {
+        kernel.SetArgument(args::Trace::kInstancesBuffer, instances_buffer_);
+    }
+    else if (options_.alpha_test)
+    {
+        SetAlphaTestArguments(kernel, args::Trace::kHitsBuffer + 1);
+    }
+}
+
+BvhTraversal CLBinaryBvhBackend::SelectTraversal(BvhTraversal traversal) const
+{
+    cl::Device const& device = cl_context_.GetDevices()[0];
+    bool fits_short_stack = device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>() >= kTraceGroupSize
+        && device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>() >= kMinResidentTraceGroups * kTraceGroupSize * kShortStackSize * sizeof(cl_uint);
+
+    if (traversal == BvhTraversal::kShortStack && device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>() < kTraceGroupSize)
+    {
+        throw std::runtime_error("The device doesn't support the work group size of the short stack traversal");
+    }
+
+    if (traversal != BvhTraversal::kAuto)
+    {
+        return traversal;
+    }
+
+    // The private stack stays in the caches of the CPU
+    if (device.getInfo<CL_DEVICE_TYPE>() & CL_DEVICE_TYPE_CPU)
+    {
+        return BvhTraversal::kPrivateStack;
+    }
+
+    // Local memory emulated in global memory is no better than a spilled private stack
+    if (device.getInfo<CL_DEVICE_LOCAL_MEM_TYPE>() == CL_LOCAL && fits_short_stack)
+    {
+        return BvhTraversal::kShortStack;
+    }
+
+    return BvhTraversal::kStackless;
+}
+
+void CLTreeletBvhBackend::CreateKernels(CLTraversalOptions const& options)
+{
+    if (options.compressed_leaves)
+    {
+        throw std::runtime_error("Compressed BVH leaves are not supported by the treelet traversal");
+    }
+
+    // The coherent rays are traced in a single pass
+    CLTraversalOptions coherent_options = options;
+    coherent_options.traversal = BvhTraversal::kAuto;
+    CLBinaryBvhBackend::CreateKernels(coherent_options);
+    options_ = options;
+
+    std::vector<std::string> definitions = { "TREELET_SCAN_GROUP_SIZE=" + std::to_string(kTreeletScanGroupSize) };
+    if (options_.sign_order)
+    {
+        definitions.push_back("BVH_SIGN_ORDER");
+    }
+
+    if (options_.watertight_triangles)
+    {
+        definitions.push_back("WATERTIGHT_TRIANGLES");
+    }
+
+    if (options_.alpha_test)
+    {
+        definitions.push_back("ALPHA_TEST");
+    }
+
+    init_kernel_ = cl_context_.CreateKernel("trace_bvh.cl", "InitTreeletTraversal", definitions);
+    clear_counters_kernel_ = cl_context_.CreateKernel("trace_bvh.cl", "ClearTreeletCounters", definitions);
+    count_kernel_ = cl_context_.CreateKernel("trace_bvh.cl", "CountTreeletRays", definitions);
+    scan_kernel_ = cl_context_.CreateKernel("trace_bvh.cl", "ScanTreeletCounters", definitions);
+    queue_kernel_ = cl_context_.CreateKernel("trace_bvh.cl", "QueueTreeletRays", definitions);
+    trace_kernel_ = cl_context_.CreateKernel("trace_bvh.cl", "TraceTreelets", definitions);
+    std::cout << "BVH traversal of the incoherent rays: " << GetBvhTraversalName(BvhTraversal::kTreelet) << std::endl;
+}
+
+void CLTreeletBvhBackend::UploadNodes()
+{
+    CLBinaryBvhBackend::UploadNodes();
+
+    // The refitted nodes keep the topology, so the treelets only change with the upload
+    std::vector<std::uint32_t> node_treelets = AssignBvhTreelets(acc_structure_->GetNodes(), kMaxTreeletNodes, num_treelets_);
+
+    cl_int status;
+    node_treelets_buffer_ = cl::Buffer(cl_context_.GetContext(), CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+        node_treelets.size() * sizeof(std::uint32_t), (void*)node_treelets.data(), &status);
+    ThrowIfFailed(status, "Failed to create BVH node treelet buffer");
+
+    // The counter past the last treelet receives the number of queued rays
+    treelet_counters_buffer_ = cl::Buffer(cl_context_.GetContext(), CL_MEM_READ_WRITE,
+        (num_treelets_ + 1) * sizeof(std::uint32_t), nullptr, &status);
+    ThrowIfFailed(status, "Failed to create treelet counter buffer");
+}
+
+void CLTreeletBvhBackend::IntersectIncoherentRays(cl::Buffer const& rays_buffer, cl::Buffer const& ray_counter_buffer,
+    std::uint32_t max_num_rays, cl::Buffer const& hits_buffer)
+{
+    if (max_num_rays > max_num_queued_rays_)
+    {
+        cl_int status;
+        next_nodes_buffer_ = cl::Buffer(cl_context_.GetContext(), CL_MEM_READ_WRITE,
+            max_num_rays * sizeof(std::uint32_t), nullptr, &status);
+        ThrowIfFailed(status, "Failed to create treelet next node buffer");
+        ray_queue_buffer_ = cl::Buffer(cl_context_.GetContext(), CL_MEM_READ_WRITE,
+            max_num_rays * sizeof(std::uint32_t), nullptr, &status);
+        ThrowIfFailed(status, "Failed to create treelet ray queue buffer");
+        max_num_queued_rays_ = max_num_rays;
+    }
+
+    init_kernel_->SetArgument(0, ray_counter_buffer);
+    init_kernel_->SetArgument(1, next_nodes_buffer_);
+    init_kernel_->SetArgument(2, hits_buffer);
+
+    std::uint32_t num_counters = num_treelets_ + 1;
+    clear_counters_kernel_->SetArgument(0, &num_counters, sizeof(num_counters));
+    clear_counters_kernel_->SetArgument(1, treelet_counters_buffer_);
+
+    count_kernel_->SetArgument(0, ray_counter_buffer);
+    count_kernel_->SetArgument(1, next_nodes_buffer_);
+    count_kernel_->SetArgument(2, node_treelets_buffer_);
+    count_kernel_->SetArgument(3, treelet_counters_buffer_);
+
+    scan_kernel_->SetArgument(0, &num_treelets_, sizeof(num_treelets_));
+    scan_kernel_->SetArgument(1, treelet_counters_buffer_);
+
+    queue_kernel_->SetArgument(0, ray_counter_buffer);
+    queue_kernel_->SetArgument(1, next_nodes_buffer_);
+    queue_kernel_->SetArgument(2, node_treelets_buffer_);
+    queue_kernel_->SetArgument(3, treelet_counters_buffer_);
+    queue_kernel_->SetArgument(4, ray_queue_buffer_);
+
+    CLKernel& trace_kernel = *trace_kernel_;
+    trace_kernel.SetArgument(args::Trace::kRayBuffer, rays_buffer);
+    trace_kernel.SetArgument(args::Trace::kRayCounterBuffer, ray_counter_buffer);
+    trace_kernel.SetArgument(args::Trace::kHitsBuffer, hits_buffer);
+    trace_kernel.SetArgument(args::Trace::kTrianglesBuffer, rt_triangle_buffer_);
+    trace_kernel.SetArgument(args::Trace::kNodesBuffer, nodes_buffer_);
+    if (options_.alpha_test)
+    {
+        SetAlphaTestArguments(trace_kernel, args::TraceTreelets::kAlphaTest);
+    }
+    trace_kernel.SetArgument(args::TraceTreelets::kNextNodesBuffer, next_nodes_buffer_);
+    trace_kernel.SetArgument(args::TraceTreelets::kNodeTreeletsBuffer, node_treelets_buffer_);
+    trace_kernel.SetArgument(args::TraceTreelets::kRayQueueBuffer, ray_queue_buffer_);
+    trace_kernel.SetArgument(args::TraceTreelets::kTreeletCountersBuffer, treelet_counters_buffer_);
+    trace_kernel.SetArgument(args::TraceTreelets::kNumTreelets, &num_treelets_, sizeof(num_treelets_));
+
+    ///@TODO: use indirect dispatch
+    cl_context_.ExecuteKernel(*init_kernel_, max_num_rays);
+
+    std::uint32_t finish = 0;
+    trace_kernel.SetArgument(args::TraceTreelets::kFinish, &finish, sizeof(finish));
+
+    for (std::uint32_t pass = 0; pass < kTreeletPasses; ++pass)
+    {
+        // Counting sort of the unfinished rays by the treelet of their next node
+        cl_context_.ExecuteKernel(*clear_counters_kernel_, num_counters);
+        cl_context_.ExecuteKernel(*count_kernel_, max_num_rays);
+        cl_context_.ExecuteKernel(*scan_kernel_, kTreeletScanGroupSize, kTreeletScanGroupSize);
+        cl_context_.ExecuteKernel(*queue_kernel_, max_num_rays);
+        cl_context_.ExecuteKernel(trace_kernel, max_num_rays);
+    }
+
+    // The remaining rays are traced to the end in the ray order
+    finish = 1;
+    trace_kernel.SetArgument(args::TraceTreelets::kFinish, &finish, sizeof(finish));
+    cl_context_.ExecuteKernel(trace_kernel, max_num_rays);
+}
+
+CLWideBvhBackend::CLWideBvhBackend(CLContext& cl_context, AccelerationStructure const& acc_structure, std::uint32_t width)
+    : CLTraversalBackend(cl_context, acc_structure)
+    , width_(width)
+{
+    if (width != 4 && width != 8)
+    {
+        throw std::runtime_error("Wide BVH width must be 4 or 8");
+    }
+}
+
+void CLWideBvhBackend::CreateKernels(CLTraversalOptions const& options)
+{
+    options_ = options;
+    group_size_ = 0;
+    CreateTraceKernels("TraceBvhWide", { "BVH_WIDTH=" + std::to_string(width_) });
+}
+
+void CLWideBvhBackend::UploadNodes()
+{
+    if (!acc_structure_->GetInstances().empty())
+    {
+        throw std::runtime_error("Instanced scenes are only supported for the binary BVH");
+    }
+
+    std::vector<WideBVHNode> wide_nodes = CollapseBvh(acc_structure_->GetNodes(), width_);
+
+    // The stack of the trace kernel is not bounds checked
+    std::uint32_t stack_size = ComputeWideStackSize(wide_nodes, width_);
+    if (stack_size > width_ * WIDE_BVH_STACK_SIZE_PER_LANE)
+    {
+        throw std::runtime_error("Wide BVH traversal needs a stack of " + std::to_string(stack_size)
+            + " entries, the trace kernel has " + std::to_string(width_ * WIDE_BVH_STACK_SIZE_PER_LANE));
+    }
+
+    cl_int status;
+    nodes_buffer_ = cl::Buffer(cl_context_.GetContext(), CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+        wide_nodes.size() * sizeof(WideBVHNode), (void*)wide_nodes.data(), &status);
+    ThrowIfFailed(status, "Failed to create BVH node buffer");
+}
+
+CLQuantizedBvhBackend::CLQuantizedBvhBackend(CLContext& cl_context, AccelerationStructure const& acc_structure, std::uint32_t bits)
+    : CLTraversalBackend(cl_context, acc_structure)
+    , bits_(bits)
+{
+    if (bits != 8 && bits != 16)
+    {
+        throw std::runtime_error("BVH quantization must be 8 or 16 bits");
+    }
+}
+
+void CLQuantizedBvhBackend::CreateKernels(CLTraversalOptions const& options)
+{
+    options_ = options;
+    group_size_ = 0;
+    CreateTraceKernels("TraceBvhQuantized", { "QUANTIZED_BVH_BITS=" + std::to_string(bits_) });
+}
+
+void CLQuantizedBvhBackend::UploadNodes()
+{
+    if (!acc_structure_->GetInstances().empty())
+    {
+        throw std::runtime_error("Quantized BVH nodes are not supported for instanced scenes");
+    }
+
+    cl_int status;
+    auto const& nodes = acc_structure_->GetNodes();
+
+    if (bits_ == 8)
+    {
+        std::vector<QuantizedBVHNode8> quantized_nodes = QuantizeBvh8(nodes);
+        nodes_buffer_ = cl::Buffer(cl_context_.GetContext(), CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+            quantized_nodes.size() * sizeof(QuantizedBVHNode8), (void*)quantized_nodes.data(), &status);
+    }
+    else
+    {
+        std::vector<QuantizedBVHNode16> quantized_nodes = QuantizeBvh16(nodes);
+        nodes_buffer_ = cl::Buffer(cl_context_.GetContext(), CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+            quantized_nodes.size() * sizeof(QuantizedBVHNode16), (void*)quantized_nodes.data(), &status);
+    }
+
+    ThrowIfFailed(status, "Failed to create BVH node buffer");
+}
+
+void CLGridBackend::CreateKernels(CLTraversalOptions const& options)
+{
+    if (options.compressed_leaves)
+    {
+        throw std::runtime_error("Compressed BVH leaves are not supported for the grid");
+    }
+
+    options_ = options;
+    group_size_ = 0;
+    CreateTraceKernels("TraceGrid", {});
+}
+
+void CLGridBackend::UploadNodes()
+{
+    auto grid = dynamic_cast<TwoLevelGrid const*>(acc_structure_);
+    if (!grid)
+    {
+        throw std::runtime_error("The grid traversal requires a two-level grid");
+    }
+
+    cl_int status;
+    auto const& top_cells = grid->GetTopCells();
+    nodes_buffer_ = cl::Buffer(cl_context_.GetContext(), CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+        top_cells.size() * sizeof(GridTopCell), (void*)top_cells.data(), &status);
+    ThrowIfFailed(status, "Failed to create grid top cell buffer");
+
+    auto const& cells = grid->GetCells();
+    cells_buffer_ = cl::Buffer(cl_context_.GetContext(), CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+        cells.size() * sizeof(CellData), (void*)cells.data(), &status);
+    ThrowIfFailed(status, "Failed to create grid cell buffer");
+
+    auto const& references = grid->GetReferences();
+    references_buffer_ = cl::Buffer(cl_context_.GetContext(), CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+        references.size() * sizeof(std::uint32_t), (void*)references.data(), &status);
+    ThrowIfFailed(status, "Failed to create grid reference buffer");
+
+    GridInfo const& grid_info = grid->GetGridInfo();
+    grid_info_buffer_ = cl::Buffer(cl_context_.GetContext(), CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+        sizeof(GridInfo), (void*)&grid_info, &status);
+    ThrowIfFailed(status, "Failed to create grid info buffer");
+}
+
+void CLGridBackend::SetSceneArguments(CLKernel& kernel)
+{
+    CLTraversalBackend::SetSceneArguments(kernel);
+    kernel.SetArgument(args::TraceGrid::kCellsBuffer, cells_buffer_);
+    kernel.SetArgument(args::TraceGrid::kReferencesBuffer, references_buffer_);
+    kernel.SetArgument(args::TraceGrid::kGridInfoBuffer, grid_info_buffer_);
+}
@@ -0,0 +1,255 @@
+/*****************************************************************************
+ MIT License
+
+ Copyright(c) 2023 Alexander Veselov
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this softwareand associated documentation files(the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions :
+
+ The above copyright noticeand this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *****************************************************************************/
+
+#pragma once
+
+#include "acceleration_structure.hpp"
+#include "gpu_wrappers/cl_context.hpp"
+#include <memory>
+#include <vector>
+
+// Settings of the trace kernels, the triangle records are packed for the settings of the upload
+struct CLTraversalOptions
+{
+    // Stack of the binary BVH traversal
+    BvhTraversal traversal = BvhTraversal::kAuto;
+    // Order the binary BVH children by the ray direction sign instead of the entry distance
+    bool sign_order = false;
+    // Intersect the triangle vertices with the watertight test instead of Moller-Trumbore
+    bool watertight_triangles = false;
+    // Decode the leaf triangles from the vertex pools of the binary BVH leaves
+    bool compressed_leaves = false;
+    // Skip the transparent hits in the traversal, supported by the binary BVH without instancing
+    bool alpha_test = false;
+    // Start the camera rays at the subtree hit by the pixel in the previous frame, supported by
+    // the binary BVH without instancing
+    bool entry_hints = false;
+    // Test the triangle that blocked the shadow ray of the pixel and the light in the previous
+    // frame before the traversal, supported by the binary BVH without instancing and compressed leaves
+    bool occluder_cache = false;
+};
+
+// Alpha test data in the triangle slot order, created by the integrator from the materials
+struct CLAlphaTestBuffers
+{
+    // AlphaTriangle index of every triangle slot, INVALID_ID for the opaque triangles
+    cl::Buffer triangle_alpha;
+    cl::Buffer alpha_triangles;
+    cl::Buffer textures;
+    cl::Buffer texture_data;
+};
+
+// Device side of an acceleration structure for the OpenCL integrator. Owns the node and
+// triangle records and the kernels tracing the rays through them, so the integrator doesn't
+// depend on the node format
+class CLTraversalBackend
+{
+public:
+    CLTraversalBackend(CLContext& cl_context, AccelerationStructure const& acc_structure);
+    virtual ~CLTraversalBackend() = default;
+
+    // Compiles the trace kernels, called again after the options have changed
+    virtual void CreateKernels(CLTraversalOptions const& options) = 0;
+    // Sets the alpha test data of the triangle slots of the next upload
+    void SetAlphaTestBuffers(CLAlphaTestBuffers const& buffers) { alpha_test_buffers_ = buffers; }
+    // Creates the buffers of the acceleration structure, the triangles are in its slot order
+    void Upload(AccelerationStructure const& acc_structure, std::vector<Triangle> const& triangles);
+    // Uploads the moved triangles and the refitted nodes, the scene triangles are indexed by
+    // the primitive indices of the acceleration structure
+    virtual void Update(std::vector<Triangle> const& scene_triangles, std::vector<DirtyRange> const& triangle_ranges,
+        std::vector<DirtyRange> const& node_ranges);
+    // Writes the closest Hit of each ray, or 0 for the rays hitting anything and INVALID_ID
+    // for the others if closest_hit is false
+    virtual void IntersectRays(cl::Buffer const& rays_buffer, cl::Buffer const& ray_counter_buffer,
+        std::uint32_t max_num_rays, cl::Buffer const& hits_buffer, bool closest_hit = true);
+    // Writes the closest Hit of the rays scattered by the surfaces, which don't share their
+    // traversal paths. Traced like the camera rays unless the backend reorders them
+    virtual void IntersectIncoherentRays(cl::Buffer const& rays_buffer, cl::Buffer const& ray_counter_buffer,
+        std::uint32_t max_num_rays, cl::Buffer const& hits_buffer);
+    // Writes the closest Hit of the camera rays, the ray of each pixel has the same index
+    // in every frame
+    virtual void IntersectCameraRays(cl::Buffer const& rays_buffer, cl::Buffer const& ray_counter_buffer,
+        std::uint32_t max_num_rays, cl::Buffer const& hits_buffer);
+    // Writes 0 for the shadow rays hitting anything and INVALID_ID for the others. The rays with
+    // an occluder slot below num_occluder_slots reuse the occluder found for their slot before,
+    // the slots of INVALID_ID aren't cached
+    virtual void IntersectShadowRays(cl::Buffer const& rays_buffer, cl::Buffer const& ray_counter_buffer,
+        std::uint32_t max_num_rays, cl::Buffer const& shadow_hits_buffer, cl::Buffer const& occluder_slots_buffer,
+        std::uint32_t num_occluder_slots);
+
+protected:
+    // Creates the closest and the any hit variant of a trace kernel
+    void CreateTraceKernels(char const* kernel_name, std::vector<std::string> definitions);
+    virtual void UploadTriangles(std::vector<Triangle> const& triangles);
+    // Packs the rt triangles of the given slot ranges into the existing buffer
+    void UpdateTriangles(std::vector<Triangle> const& scene_triangles, std::vector<DirtyRange> const& triangle_ranges);
+    virtual void UploadNodes() = 0;
+    // Binds the buffers of the acceleration structure to a trace kernel
+    virtual void SetSceneArguments(CLKernel& kernel);
+    // Binds the alpha test buffers to the arguments starting at first_index
+    void SetAlphaTestArguments(CLKernel& kernel, std::uint32_t first_index);
+
+    CLContext& cl_context_;
+    AccelerationStructure const* acc_structure_;
+    CLTraversalOptions options_;
+
+    std::shared_ptr<CLKernel> intersect_kernel_;
+    std::shared_ptr<CLKernel> intersect_shadow_kernel_;
+    // Work group size required by the trace kernels, 0 lets the runtime decide
+    std::size_t group_size_ = 0;
+
+    cl::Buffer rt_triangle_buffer_;
+    cl::Buffer nodes_buffer_;
+    CLAlphaTestBuffers alpha_test_buffers_;
+};
+
+// Binary BVH nodes, or the two-level BVH of the instanced scenes. Supports every traversal
+// stack, the compressed leaves and the alpha test
+class CLBinaryBvhBackend : public CLTraversalBackend
+{
+public:
+    using CLTraversalBackend::CLTraversalBackend;
+
+    void CreateKernels(CLTraversalOptions const& options) override;
+    void Update(std::vector<Triangle> const& scene_triangles, std::vector<DirtyRange> const& triangle_ranges,
+        std::vector<DirtyRange> const& node_ranges) override;
+    void IntersectCameraRays(cl::Buffer const& rays_buffer, cl::Buffer const& ray_counter_buffer,
+        std::uint32_t max_num_rays, cl::Buffer const& hits_buffer) override;
+    void IntersectShadowRays(cl::Buffer const& rays_buffer, cl::Buffer const& ray_counter_buffer,
+        std::uint32_t max_num_rays, cl::Buffer const& shadow_hits_buffer, cl::Buffer const& occluder_slots_buffer,
+        std::uint32_t num_occluder_slots) override;
+
+protected:
+    void UploadTriangles(std::vector<Triangle> const& triangles) override;
+    void UploadNodes() override;
+    void SetSceneArguments(CLKernel& kernel) override;
+
+private:
+    // Resolves the automatic traversal for the device
+    BvhTraversal SelectTraversal(BvhTraversal traversal) const;
+    // First argument of the camera and shadow ray caches, following the scene arguments
+    std::uint32_t GetCacheArgumentsIndex() const;
+
+    // Compressed leaf records replacing the rt triangles and their offsets linked into the nodes
+    cl::Buffer leaf_data_buffer_;
+    std::vector<std::uint32_t> leaf_record_offsets_;
+    cl::Buffer instances_buffer_;
+
+    // Closest hit kernel of the camera rays reading and writing the entry hints
+    std::shared_ptr<CLKernel> entry_hints_kernel_;
+    // Parent of the leaf hit by the camera ray of every pixel, INVALID_ID for the missed pixels.
+    // Recreated for a new render size and with the uploaded nodes
+    cl::Buffer entry_hints_buffer_;
+    std::uint32_t num_entry_hints_ = 0;
+
+    // Any hit kernel of the shadow rays testing the cached occluders first
+    std::shared_ptr<CLKernel> occluder_cache_kernel_;
+    // Triangle slot of the last occluder of every occluder slot, INVALID_ID if the ray was
+    // unblocked. Recreated for a new number of slots and with the uploaded triangles
+    cl::Buffer occluder_cache_buffer_;
+    std::uint32_t num_occluder_slots_ = 0;
+};
+
+// Binary BVH cut into treelets of a few KB. The incoherent rays are traced in passes, each pass
+// queues the rays by the treelet of their next node and advances them until they leave it, so
+// the neighboring work items fetch the same nodes. The camera and shadow rays are traced by the
+// automatically selected binary BVH traversal
+class CLTreeletBvhBackend : public CLBinaryBvhBackend
+{
+public:
+    using CLBinaryBvhBackend::CLBinaryBvhBackend;
+
+    void CreateKernels(CLTraversalOptions const& options) override;
+    void IntersectIncoherentRays(cl::Buffer const& rays_buffer, cl::Buffer const& ray_counter_buffer,
+        std::uint32_t max_num_rays, cl::Buffer const& hits_buffer) override;
+
+protected:
+    void UploadNodes() override;
+
+private:
+    std::shared_ptr<CLKernel> init_kernel_;
+    std::shared_ptr<CLKernel> clear_counters_kernel_;
+    std::shared_ptr<CLKernel> count_kernel_;
+    std::shared_ptr<CLKernel> scan_kernel_;
+    std::shared_ptr<CLKernel> queue_kernel_;
+    std::shared_ptr<CLKernel> trace_kernel_;
+
+    // Treelet of every node and the ray counts, then the queue offsets of the treelets
+    cl::Buffer node_treelets_buffer_;
+    cl::Buffer treelet_counters_buffer_;
+    std::uint32_t num_treelets_ = 0;
+    // Next node of every ray and the ray indices sorted by treelet
+    cl::Buffer next_nodes_buffer_;
+    cl::Buffer ray_queue_buffer_;
+    std::uint32_t max_num_queued_rays_ = 0;
+};
+
+// Binary BVH collapsed into 4 or 8 wide nodes
+class CLWideBvhBackend : public CLTraversalBackend
+{
+public:
+    CLWideBvhBackend(CLContext& cl_context, AccelerationStructure const& acc_structure, std::uint32_t width);
+
+    void CreateKernels(CLTraversalOptions const& options) override;
+
+protected:
+    void UploadNodes() override;
+
+private:
+    std::uint32_t width_;
+};
+
+// Binary BVH with the child bounds quantized to 8 or 16 bits
+class CLQuantizedBvhBackend : public CLTraversalBackend
+{
+public:
+    CLQuantizedBvhBackend(CLContext& cl_context, AccelerationStructure const& acc_structure, std::uint32_t bits);
+
+    void CreateKernels(CLTraversalOptions const& options) override;
+
+protected:
+    void UploadNodes() override;
+
+private:
+    std::uint32_t bits_;
+};
+
+// Two-level uniform grid traversed with 3D-DDA
+class CLGridBackend : public CLTraversalBackend
+{
+public:
+    using CLTraversalBackend::CLTraversalBackend;
+
+    void CreateKernels(CLTraversalOptions const& options) override;
+
+protected:
+    // The top cells take the place of the nodes
+    void UploadNodes() override;
+    void SetSceneArguments(CLKernel& kernel) override;
+
+private:
+    cl::Buffer cells_buffer_;
+    cl::Buffer references_buffer_;
+    cl::Buffer grid_info_buffer_;
+};
@@ -24,6 +24,7 @@
 
 #include "gl_pt_integrator.hpp"
 #include "acceleration_structure.hpp"
+#include "quantized_bvh.hpp"
 #include "glm/ext/matrix_clip_space.hpp"
 #include "glm/ext/matrix_transform.hpp"
 
@@ -91,41 +92,20 @@ GLPathTraceIntegrator::GLPathTraceIntegrator(std::uint32_t width, std::uint32_t
 void GLPathTraceIntegrator::UploadGPUData(Scene const& scene, AccelerationStructure const& acc_structure)
 {
     // Create scene buffers
-    auto const& triangles = scene.GetTriangles();
     auto const& materials = scene.GetMaterials();
-    auto const& emissive_indices = scene.GetEmissiveIndices();
     auto const& lights = scene.GetLights();
     auto const& textures = scene.GetTextures();
     auto const& texture_data = scene.GetTextureData();
     auto const& env_image = scene.GetEnvImage();
 
-    // Triangle buffer
-    num_triangles_ = triangles.size();
-
-    glCreateBuffers(1, &triangle_buffer_);
-    glNamedBufferData(triangle_buffer_, triangles.size() * sizeof(Triangle), triangles.data(), GL_STATIC_DRAW);
-
-    // Additional compressed triangle buffer
+    if (!acc_structure.GetInstances().empty())
     {
-        std::vector<RTTriangle> rt_triangles;
-        for (auto const& triangle : triangles)
-        {
-            rt_triangles.emplace_back(triangle.v1.position, triangle.v2.position, triangle.v3.position);
-        }
-
-        glCreateBuffers(1, &rt_triangle_buffer_);
-        glNamedBufferData(rt_triangle_buffer_, rt_triangles.size() * sizeof(RTTriangle), rt_triangles.data(), GL_STATIC_DRAW);
+        throw std::runtime_error("Instanced scenes are not supported by the OpenGL backend");
     }
 
     glCreateBuffers(1, &material_buffer_);
     glNamedBufferData(material_buffer_, materials.size() * sizeof(PackedMaterial), materials.data(), GL_STATIC_DRAW);
 
-    if (!emissive_indices.empty())
-    {
-        glCreateBuffers(1, &emissive_buffer_);
-        glNamedBufferData(emissive_buffer_, emissive_indices.size() * sizeof(std::uint32_t), emissive_indices.data(), GL_STATIC_DRAW);
-    }
-
     if (!lights.empty())
     {
         glCreateBuffers(1, &analytic_light_buffer_);
@@ -165,10 +145,128 @@ void GLPathTraceIntegrator::UploadGPUData(Scene const& scene, AccelerationStruct
     glTextureStorage2D(env_image_, 1, GL_RGBA32F, env_image.width, env_image.height);
     glTextureSubImage2D(env_image_, 0, 0, 0, env_image.width, env_image.height, GL_RGBA, GL_FLOAT, env_image.data.data());
 
+    UploadSlotData(scene);
+}
+
+void GLPathTraceIntegrator::UploadSlotData(Scene const& scene)
+{
+    // The triangles are stored in the slot order of the acceleration structure. The storage is
+    // specified again, another tree may reference the triangles from a different number of slots
+    std::vector<Triangle> triangles = acc_structure_->GatherTriangles(scene.GetTriangles());
+    std::vector<std::uint32_t> emissive_indices = acc_structure_->MapToTriangleSlots(scene.GetEmissiveIndices());
+
+    // Triangle buffer
+    num_triangles_ = triangles.size();
+
+    if (triangle_buffer_ == 0)
+    {
+        glCreateBuffers(1, &triangle_buffer_);
+    }
+
+    glNamedBufferData(triangle_buffer_, triangles.size() * sizeof(Triangle), triangles.data(), GL_STATIC_DRAW);
+
+    // Additional compressed triangle buffer
+    {
+        std::vector<RTTriangle> rt_triangles;
+        for (auto const& triangle : triangles)
+        {
+            rt_triangles.push_back(PackRTTriangle(triangle, enable_watertight_triangles_));
+        }
+
+        if (rt_triangle_buffer_ == 0)
+        {
+            glCreateBuffers(1, &rt_triangle_buffer_);
+        }
+
+        glNamedBufferData(rt_triangle_buffer_, rt_triangles.size() * sizeof(RTTriangle), rt_triangles.data(), GL_STATIC_DRAW);
+    }
+
+    if (!emissive_indices.empty())
+    {
+        if (emissive_buffer_ == 0)
+        {
+            glCreateBuffers(1, &emissive_buffer_);
+        }
+
+        glNamedBufferData(emissive_buffer_, emissive_indices.size() * sizeof(std::uint32_t), emissive_indices.data(), GL_STATIC_DRAW);
+    }
+
+    UploadBvhNodes();
+}
+
+void GLPathTraceIntegrator::UpdateGPUData(Scene const& scene, std::vector<DirtyRange> const& triangle_ranges,
+    std::vector<DirtyRange> const& node_ranges)
+{
+    UploadTriangles(scene, triangle_ranges);
+
+    if (bvh_quantization_bits_ != 0)
+    {
+        // The quantized nodes are encoded from the whole tree
+        UploadBvhNodes();
+    }
+    else
+    {
+        auto const& nodes = acc_structure_->GetNodes();
+        for (auto const& range : node_ranges)
+        {
+            glNamedBufferSubData(nodes_buffer_, range.first * sizeof(LinearBVHNode),
+                range.count * sizeof(LinearBVHNode), &nodes[range.first]);
+        }
+    }
+
+    RequestReset();
+}
+
+void GLPathTraceIntegrator::UploadTriangles(Scene const& scene, std::vector<DirtyRange> const& triangle_ranges)
+{
+    auto const& triangles = scene.GetTriangles();
+    auto const& primitive_indices = acc_structure_->GetPrimitiveIndices();
+
+    std::vector<Triangle> range_triangles;
+    std::vector<RTTriangle> rt_triangles;
+    for (auto const& range : triangle_ranges)
+    {
+        range_triangles.clear();
+        rt_triangles.clear();
+        for (std::uint32_t slot = range.first; slot < range.first + range.count; ++slot)
+        {
+            Triangle const& triangle = triangles[primitive_indices[slot]];
+            range_triangles.push_back(triangle);
+            rt_triangles.push_back(PackRTTriangle(triangle, enable_watertight_triangles_));
+        }
+
+        glNamedBufferSubData(triangle_buffer_, range.first * sizeof(Triangle),
+            range.count * sizeof(Triangle), range_triangles.data());
+
+        glNamedBufferSubData(rt_triangle_buffer_, range.first * sizeof(RTTriangle),
+            range.count * sizeof(RTTriangle), rt_triangles.data());
+    }
+}
+
+void GLPathTraceIntegrator::UploadBvhNodes()
+{
+    auto const& nodes = acc_structure_->GetNodes();
+
+    if (nodes_buffer_ == 0)
+    {
+        glCreateBuffers(1, &nodes_buffer_);
+    }
+
     // Upload BVH data
-    auto const& nodes = acc_structure.GetNodes();
-    glCreateBuffers(1, &nodes_buffer_);
-    glNamedBufferData(nodes_buffer_, nodes.size() * sizeof(LinearBVHNode), nodes.data(), GL_STATIC_DRAW);
+    if (bvh_quantization_bits_ == 8)
+    {
+        std::vector<QuantizedBVHNode8> quantized_nodes = QuantizeBvh8(nodes);
+        glNamedBufferData(nodes_buffer_, quantized_nodes.size() * sizeof(QuantizedBVHNode8), quantized_nodes.data(), GL_STATIC_DRAW);
+    }
+    else if (bvh_quantization_bits_ == 16)
+    {
+        std::vector<QuantizedBVHNode16> quantized_nodes = QuantizeBvh16(nodes);
+        glNamedBufferData(nodes_buffer_, quantized_nodes.size() * sizeof(QuantizedBVHNode16), quantized_nodes.data(), GL_STATIC_DRAW);
+    }
+    else
+    {
+        glNamedBufferData(nodes_buffer_, nodes.size() * sizeof(LinearBVHNode), nodes.data(), GL_STATIC_DRAW);
+    }
 }
 
 void GLPathTraceIntegrator::SetCameraData(Camera const& camera)
@@ -216,14 +314,31 @@ void GLPathTraceIntegrator::CreateKernels()
     clear_counter_pipeline_ = std::make_unique<ComputePipeline>("clear_counter.comp");
     hit_surface_pipeline_ = std::make_unique<ComputePipeline>("hit_surface.comp", definitions);
     increment_counter_pipeline_ = std::make_unique<ComputePipeline>("increment_counter.comp");
-    initialize_hits_pipeline_ = std::make_unique<ComputePipeline>("initialize_hits.comp");
+    std::vector<std::string> triangle_definitions;
+    if (enable_watertight_triangles_)
+    {
+        triangle_definitions.push_back("WATERTIGHT_TRIANGLES");
+    }
+
+    initialize_hits_pipeline_ = std::make_unique<ComputePipeline>("initialize_hits.comp", triangle_definitions);
     miss_pipeline_ = std::make_unique<ComputePipeline>("miss.comp", definitions);
     raygen_pipeline_ = std::make_unique<ComputePipeline>("raygeneration.comp");
     reset_pipeline_ = std::make_unique<ComputePipeline>("reset_radiance.comp");
     resolve_pipeline_ = std::make_unique<ComputePipeline>("resolve_radiance.comp", definitions);
-    intersect_pipeline_ = std::make_unique<ComputePipeline>("trace_bvh.comp");
+    std::vector<std::string> trace_definitions = triangle_definitions;
+    if (bvh_quantization_bits_ != 0)
+    {
+        trace_definitions.push_back("QUANTIZED_BVH_BITS " + std::to_string(bvh_quantization_bits_));
+    }
+    else if (enable_bvh_sign_order_)
+    {
+        trace_definitions.push_back("BVH_SIGN_ORDER");
+    }
+
+    intersect_pipeline_ = std::make_unique<ComputePipeline>("trace_bvh.comp", trace_definitions);
 
-    std::vector<std::string> trace_shadow_definitions = { "SHADOW_RAYS" };
+    std::vector<std::string> trace_shadow_definitions = trace_definitions;
+    trace_shadow_definitions.push_back("SHADOW_RAYS");
     intersect_shadow_pipeline_ = std::make_unique<ComputePipeline>("trace_bvh.comp", trace_shadow_definitions);
 }
 
@@ -242,6 +357,74 @@ void GLPathTraceIntegrator::EnableDenoiser(bool enable)
 
 }
 
+void GLPathTraceIntegrator::SetBvhWidth(std::uint32_t width)
+{
+    if (width != 2)
+    {
+        throw std::runtime_error("Wide BVH traversal is not supported by the OpenGL backend");
+    }
+}
+
+void GLPathTraceIntegrator::SetBvhQuantization(std::uint32_t bits)
+{
+    if (bits == bvh_quantization_bits_)
+    {
+        return;
+    }
+
+    if (bits != 0 && bits != 8 && bits != 16)
+    {
+        throw std::runtime_error("BVH quantization must be 0, 8 or 16 bits");
+    }
+
+    bvh_quantization_bits_ = bits;
+    CreateKernels();
+
+    // The nodes are uploaded with the scene data otherwise
+    if (nodes_buffer_ != 0)
+    {
+        UploadBvhNodes();
+    }
+
+    RequestReset();
+}
+
+void GLPathTraceIntegrator::SetBvhTraversal(BvhTraversal traversal)
+{
+    if (traversal == BvhTraversal::kShortStack || traversal == BvhTraversal::kStackless || traversal == BvhTraversal::kTreelet)
+    {
+        throw std::runtime_error("Only the private stack BVH traversal is supported by the OpenGL backend");
+    }
+
+    bvh_traversal_ = traversal;
+}
+
+void GLPathTraceIntegrator::EnableWatertightTriangles(bool enable)
+{
+    if (enable == enable_watertight_triangles_)
+    {
+        return;
+    }
+
+    // The records of the uploaded triangles can't be converted without the scene
+    if (rt_triangle_buffer_ != 0)
+    {
+        throw std::runtime_error("The triangle test must be selected before the scene is uploaded");
+    }
+
+    enable_watertight_triangles_ = enable;
+    CreateKernels();
+    RequestReset();
+}
+
+void GLPathTraceIntegrator::EnableCompressedLeaves(bool enable)
+{
+    if (enable)
+    {
+        throw std::runtime_error("Compressed BVH leaves are not supported by the OpenGL backend");
+    }
+}
+
 void GLPathTraceIntegrator::Reset()
 {
     if (!enable_denoiser_)
@@ -35,12 +35,20 @@ public:
     GLPathTraceIntegrator(std::uint32_t width, std::uint32_t height,
         AccelerationStructure& acc_structure, std::uint32_t out_image);
     void UploadGPUData(Scene const& scene, AccelerationStructure const& acc_structure) override;
+    void UpdateGPUData(Scene const& scene, std::vector<DirtyRange> const& triangle_ranges,
+        std::vector<DirtyRange> const& node_ranges) override;
     void SetCameraData(Camera const& camera) override;
     void SetSamplerType(SamplerType sampler_type) override;
     void SetAOV(AOV aov) override;
     void EnableDenoiser(bool enable) override;
+    void SetBvhWidth(std::uint32_t width) override;
+    void SetBvhQuantization(std::uint32_t bits) override;
+    void SetBvhTraversal(BvhTraversal traversal) override;
+    void EnableWatertightTriangles(bool enable) override;
+    void EnableCompressedLeaves(bool enable) override;
 
 protected:
+    void UploadSlotData(Scene const& scene) override;
     void CreateKernels() override;
     void Reset() override;
     void AdvanceSampleCount() override;
@@ -59,6 +67,8 @@ protected:
 
 private:
     void RasterizePrimaryBounce();
+    void UploadBvhNodes();
+    void UploadTriangles(Scene const& scene, std::vector<DirtyRange> const& triangle_ranges);
 
     // Pipelines
     std::unique_ptr<GraphicsPipeline> visibility_pipeline_;
@@ -84,11 +94,11 @@ private:
     GLuint out_image_;
 
     // Scene buffers
-    GLuint triangle_buffer_;
+    GLuint triangle_buffer_ = 0;
     GLuint material_buffer_;
     GLuint texture_buffer_;
     GLuint texture_data_buffer_;
-    GLuint emissive_buffer_;
+    GLuint emissive_buffer_ = 0;
     GLuint analytic_light_buffer_;
     GLuint scene_info_buffer_;
     std::vector<GLuint> textures_;
@@ -99,8 +109,8 @@ private:
     GLuint env_image_;
 
     // Acceleration structure
-    GLuint rt_triangle_buffer_;
-    GLuint nodes_buffer_;
+    GLuint rt_triangle_buffer_ = 0;
+    GLuint nodes_buffer_ = 0;
 
     // Indirect rays
     GLuint rays_buffer_[2]; // 2 buffers for incoming-outgoing rays
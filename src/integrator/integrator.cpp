@@ -75,3 +75,74 @@ void Integrator::EnableWhiteFurnace(bool enable)
     CreateKernels();
     RequestReset();
 }
+
+void Integrator::UploadRebuiltGeometry(Scene const& scene)
+{
+    UploadSlotData(scene);
+    RequestReset();
+}
+
+void Integrator::SwapAccelerationStructure(Scene const& scene, AccelerationStructure& acc_structure)
+{
+    // The geometry is unchanged, only the slot order of the triangles differs
+    acc_structure_ = &acc_structure;
+    UploadSlotData(scene);
+}
+
+RTTriangle PackRTTriangle(Triangle const& triangle, bool watertight)
+{
+    if (watertight)
+    {
+        return RTTriangle(triangle.v1.position, triangle.v2.position, triangle.v3.position);
+    }
+
+    return RTTriangle::WithEdges(triangle.v1.position, triangle.v2.position, triangle.v3.position);
+}
+
+void Integrator::EnableBvhSignOrder(bool enable)
+{
+    if (enable == enable_bvh_sign_order_)
+    {
+        return;
+    }
+
+    enable_bvh_sign_order_ = enable;
+    CreateKernels();
+    RequestReset();
+}
+
+void Integrator::EnableAlphaTest(bool enable)
+{
+    if (enable == enable_alpha_test_)
+    {
+        return;
+    }
+
+    enable_alpha_test_ = enable;
+    CreateKernels();
+    RequestReset();
+}
+
+void Integrator::EnableEntryHints(bool enable)
+{
+    if (enable == enable_entry_hints_)
+    {
+        return;
+    }
+
+    enable_entry_hints_ = enable;
+    CreateKernels();
+    RequestReset();
+}
+
+void Integrator::EnableOccluderCache(bool enable)
+{
+    if (enable == enable_occluder_cache_)
+    {
+        return;
+    }
+
+    enable_occluder_cache_ = enable;
+    CreateKernels();
+    RequestReset();
+}
@@ -25,11 +25,15 @@
 #pragma once
 
 #include "gpu_wrappers/cl_context.hpp"
+#include "acceleration_structure.hpp"
 #include <memory>
 
 class Scene;
 class CameraController;
-class AccelerationStructure;
+
+// Triangle record of the watertight test on the vertices or of the Moller-Trumbore test on the
+// precomputed edges
+RTTriangle PackRTTriangle(Triangle const& triangle, bool watertight);
 
 class Integrator
 {
@@ -50,16 +54,50 @@ public:
     };
 
     Integrator(std::uint32_t width, std::uint32_t height, AccelerationStructure& acc_structure)
-        : width_(width), height_(height), acc_structure_(acc_structure) {}
+        : width_(width), height_(height), acc_structure_(&acc_structure) {}
     void Integrate();
     virtual void UploadGPUData(Scene const& scene, AccelerationStructure const& acc_structure) = 0;
+    // Uploads the given ranges of the triangle slots and of the refitted BVH nodes into the
+    // existing buffers
+    virtual void UpdateGPUData(Scene const& scene, std::vector<DirtyRange> const& triangle_ranges,
+        std::vector<DirtyRange> const& node_ranges) = 0;
+    // Uploads the triangles in the new slot order and the nodes after the BVH has been rebuilt
+    void UploadRebuiltGeometry(Scene const& scene);
+    // Replaces the acceleration structure with another tree over the same triangles, e.g. the
+    // high quality build finished in the background. Keeps the accumulated samples
+    void SwapAccelerationStructure(Scene const& scene, AccelerationStructure& acc_structure);
     virtual void SetCameraData(Camera const& camera) = 0;
     void RequestReset() { request_reset_ = true; }
     void EnableWhiteFurnace(bool enable);
+    // Orders the binary BVH children by the ray direction sign instead of the entry distance
+    void EnableBvhSignOrder(bool enable);
+    // Skips the transparent hits in the traversal instead of passing the paths through them in
+    // the shading, which takes a bounce per transparent layer. OpenCL binary BVH only
+    void EnableAlphaTest(bool enable);
+    // Traces the camera ray of each pixel through the subtree hit in the previous frame first,
+    // its hit bounds the traversal of the rest of the tree. OpenCL binary BVH only
+    void EnableEntryHints(bool enable);
+    // Tests the triangle that blocked the shadow ray of the camera hit of each pixel and light
+    // in the previous frame before traversing the BVH. OpenCL binary BVH only
+    void EnableOccluderCache(bool enable);
     void SetMaxBounces(std::uint32_t max_bounces);
     virtual void SetSamplerType(SamplerType sampler_type) = 0;
     virtual void SetAOV(AOV aov) = 0;
     virtual void EnableDenoiser(bool enable) = 0;
+    // 2 traverses the binary BVH, 4 and 8 traverse the collapsed wide BVH
+    virtual void SetBvhWidth(std::uint32_t width) = 0;
+    // 0 traverses the uncompressed nodes, 8 and 16 traverse the quantized binary BVH
+    virtual void SetBvhQuantization(std::uint32_t bits) = 0;
+    virtual void SetBvhTraversal(BvhTraversal traversal) = 0;
+    // Traces the rays after the first bounce with both the single pass and the treelet
+    // scheduled traversal and prints the average times, used with BvhTraversal::kTreelet
+    void EnableTreeletBenchmark(bool enable) { enable_treelet_benchmark_ = enable; }
+    // Intersects the triangles with the watertight test instead of Moller-Trumbore. Selects
+    // the triangle records packed by UploadGPUData, so it has to be called before the upload
+    virtual void EnableWatertightTriangles(bool enable) = 0;
+    // Stores the leaf triangles of the binary BVH as per-leaf vertex pools indexed by bytes.
+    // Replaces the triangle records packed by UploadGPUData, so it has to be called before the upload
+    virtual void EnableCompressedLeaves(bool enable) = 0;
 
 protected:
     virtual void CreateKernels() = 0;
@@ -78,17 +116,24 @@ protected:
     virtual void CopyHistoryBuffers() = 0;
     virtual void ResolveRadiance() = 0;
 
+    // Creates the buffers stored in the triangle slot order of the acceleration structure,
+    // the triangles and the emissive indices, and uploads the nodes
+    virtual void UploadSlotData(Scene const& scene) = 0;
+
     // Render size
     std::uint32_t width_;
     std::uint32_t height_;
 
-    // Acceleration structure
-    AccelerationStructure& acc_structure_;
+    // Acceleration structure, replaced by SwapAccelerationStructure
+    AccelerationStructure* acc_structure_;
 
     Camera camera_ = {};
     Camera prev_camera_ = {};
 
     std::uint32_t max_bounces_ = 3u;
+    std::uint32_t bvh_width_ = 2u;
+    std::uint32_t bvh_quantization_bits_ = 0u;
+    BvhTraversal bvh_traversal_ = BvhTraversal::kAuto;
     SamplerType sampler_type_ = SamplerType::kRandom;
     AOV aov_ = AOV::kShadedColor;
 
@@ -96,5 +141,12 @@ protected:
     // For debugging
     bool enable_white_furnace_ = false;
     bool enable_denoiser_ = false;
+    bool enable_bvh_sign_order_ = false;
+    bool enable_alpha_test_ = true;
+    bool enable_entry_hints_ = false;
+    bool enable_occluder_cache_ = false;
+    bool enable_watertight_triangles_ = false;
+    bool enable_compressed_leaves_ = false;
+    bool enable_treelet_benchmark_ = false;
 
 };
@@ -26,6 +26,7 @@
 #include "src/kernels/common/material.h"
 #include "src/kernels/common/sampling.h"
 #include "src/kernels/common/light.h"
+#include "src/kernels/common/bvh.h"
 
 float2 ProjectScreen(float3 position, Camera camera)
 {
@@ -49,6 +50,7 @@ __kernel void GenerateAOV
     __global uint*           pixel_indices,
     __global Hit*            hits,
     __global Triangle*       triangles,
+    __global Instance*       instances,
     __global PackedMaterial* materials,
     __global Texture*        textures,
     __global uint*           texture_data,
@@ -88,6 +90,11 @@ __kernel void GenerateAOV
 
     Triangle triangle = triangles[hit.primitive_id];
 
+    if (hit.instance_id != INVALID_ID)
+    {
+        triangle = InstanceToWorldTriangle(instances[hit.instance_id], triangle);
+    }
+
     float3 position = InterpolateAttributes(triangle.v1.position,
         triangle.v2.position, triangle.v3.position, hit.bc);
 
@@ -26,6 +26,7 @@
 #include "src/kernels/common/material.h"
 #include "src/kernels/common/sampling.h"
 #include "src/kernels/common/light.h"
+#include "src/kernels/common/bvh.h"
 
 __kernel void HitSurface
 (
@@ -35,6 +36,7 @@ __kernel void HitSurface
     __global uint*           incoming_pixel_indices,
     __global Hit*            hits,
     __global Triangle*       triangles,
+    __global Instance*       instances,
     __global Light*          analytic_lights,
     __global uint*           emissive_indices,
     __global PackedMaterial* materials,
@@ -57,6 +59,7 @@ __kernel void HitSurface
     __global Ray*    shadow_rays,
     __global uint*   shadow_ray_counter,
     __global uint*   shadow_pixel_indices,
+    __global uint*   shadow_occluder_slots,
     __global float3* direct_light_samples,
     __global float4* result_radiance
 )
@@ -87,6 +90,11 @@ __kernel void HitSurface
 
     Triangle triangle = triangles[hit.primitive_id];
 
+    if (hit.instance_id != INVALID_ID)
+    {
+        triangle = InstanceToWorldTriangle(instances[hit.instance_id], triangle);
+    }
+
     float3 position = InterpolateAttributes(triangle.v1.position,
         triangle.v2.position, triangle.v3.position, hit.bc);
 
@@ -140,6 +148,10 @@ __kernel void HitSurface
             // Store to the memory
             shadow_rays[shadow_ray_idx] = shadow_ray;
             shadow_pixel_indices[shadow_ray_idx] = pixel_idx;
+            // The shadow rays of the camera hits are cached per pixel and light, the rays of the
+            // later bounces change their direction every frame
+            shadow_occluder_slots[shadow_ray_idx] = bounce == 0 ?
+                pixel_idx * scene_info.analytic_light_count + Light_SampleIndex(scene_info, s_light) : INVALID_ID;
             direct_light_samples[shadow_ray_idx] = light_sample;
         }
     }
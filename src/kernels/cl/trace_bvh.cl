@@ -24,84 +24,181 @@
 
 #include "src/kernels/common/shared_structures.h"
 #include "src/kernels/common/constants.h"
+#include "src/kernels/common/bvh.h"
+#include "src/kernels/common/triangle.h"
 
-bool RayTriangle(Ray ray, const __global RTTriangle* triangle, float2* bc, float* out_t)
+float max3(float3 val)
 {
-    float3 e1 = triangle->position2 - triangle->position1;
-    float3 e2 = triangle->position3 - triangle->position1;
-    // Calculate planes normal vector
-    float3 pvec = cross(ray.direction.xyz, e2);
-    float det = dot(e1, pvec);
+    return max(max(val.x, val.y), val.z);
+}
 
-    // Ray is parallel to plane
-    if (det < 1e-8f || -det > 1e-8f)
-    {
-        return false;
-    }
+float min3(float3 val)
+{
+    return min(min(val.x, val.y), val.z);
+}
 
-    float inv_det = 1.0f / det;
-    float3 tvec = ray.origin.xyz - triangle->position1;
-    float u = dot(tvec, pvec) * inv_det;
+#ifdef ALPHA_TEST
+#include "src/kernels/common/material.h"
 
-    if (u < 0.0f || u > 1.0f)
+// Any hit step of the traversal, skips the transparent hits the shading would pass through
+bool IsOpaqueHit(uint primitive_id, float2 bc, __global uint* triangle_alpha,
+    __global AlphaTriangle* alpha_triangles, __global Texture* textures, __global uint* texture_data)
+{
+    uint alpha_idx = triangle_alpha[primitive_id];
+    if (alpha_idx == INVALID_ID)
     {
-        return false;
+        return true;
     }
 
-    float3 qvec = cross(tvec, e1);
-    float v = dot(ray.direction.xyz, qvec) * inv_det;
+    AlphaTriangle alpha_triangle = alpha_triangles[alpha_idx];
+    float transparency = alpha_triangle.transparency;
 
-    if (v < 0.0f || u + v > 1.0f)
+    if (alpha_triangle.texture_idx != INVALID_TEXTURE_IDX)
     {
-        return false;
+        float2 texcoord = InterpolateAttributes2(alpha_triangle.texcoord1,
+            alpha_triangle.texcoord2, alpha_triangle.texcoord3, bc);
+        transparency *= SampleTexture(textures[alpha_triangle.texture_idx], texcoord, texture_data).x;
     }
 
-    float t = dot(e2, qvec) * inv_det;
-    float t_min = ray.origin.w;
-    float t_max = ray.direction.w;
+    return transparency >= 0.5f;
+}
 
-    if (t < t_min || t > t_max)
-    {
-        return false;
-    }
+#define OPAQUE_HIT(primitive_id, bc) IsOpaqueHit(primitive_id, bc, triangle_alpha, alpha_triangles, textures, texture_data)
+#else
+#define OPAQUE_HIT(primitive_id, bc) true
+#endif
+
+// Clamps the zero direction components, their infinite inverse would produce NaN slab
+// distances for the planes going through the ray origin
+float3 SafeInvDir(float3 direction)
+{
+    float3 min_direction = (float3)(1e-8f, 1e-8f, 1e-8f);
+    float3 safe_direction = select(direction, copysign(min_direction, direction),
+        isless(fabs(direction), min_direction));
+    return (float3)(1.0f, 1.0f, 1.0f) / safe_direction;
+}
+
+// Slab test with the precomputed ray_origin * ray_inv_dir, one fused multiply-add per plane.
+// The entry distance only depends on t_min, so the child order is stable while t_max shrinks.
+// The rounded product may miss the boxes touching a ray that runs exactly in their face plane
+bool RayNodeBounds(Bounds3 bounds, float3 ray_inv_dir, float3 ray_origin_inv_dir,
+    float t_min, float t_max, float* t_enter)
+{
+    float3 t0 = fma(bounds.pos[0], ray_inv_dir, -ray_origin_inv_dir);
+    float3 t1 = fma(bounds.pos[1], ray_inv_dir, -ray_origin_inv_dir);
 
-    // Intersection is found
-    *bc = (float2)(u, v);
-    *out_t = t;
+    *t_enter = max(max3(min(t0, t1)), t_min);
+    float t_exit = min(min3(max(t0, t1)), t_max);
 
-    return true;
+    return (t_exit >= *t_enter);
 }
 
-float max3(float3 val)
+// The children of the binary BVH nodes are visited by their entry distance, BVH_SIGN_ORDER
+// switches to the cheaper but less accurate order by the ray direction sign on the split axis.
+// Any hit ends the shadow rays, they visit the child more likely to hold an occluder first
+bool SecondChildFirst(float first_t, float second_t, uint node_flags, int* ray_sign)
 {
-    return max(max(val.x, val.y), val.z);
+#if defined(SHADOW_RAYS)
+    return (node_flags & BVH_NODE_SHADOW_SECOND_FIRST) != 0;
+#elif defined(BVH_SIGN_ORDER)
+    return ray_sign[node_flags & BVH_NODE_AXIS_MASK];
+#else
+    return second_t < first_t;
+#endif
 }
 
-float min3(float3 val)
+// The binary BVH traversal keeps the far children in one of the following stacks:
+// - private stack of MAX_BVH_STACK_SIZE entries (default), fast where private memory is cached
+// - BVH_SHORT_STACK_SIZE entries per work item in __local memory, the oldest entries are dropped
+//   on overflow and found again by climbing the parent links once the stack runs empty
+// - BVH_STACKLESS: no stack at all, the finished subtrees are left through the parent links
+#ifdef BVH_SHORT_STACK_SIZE
+#ifndef TRACE_GROUP_SIZE
+#define TRACE_GROUP_SIZE 64
+#endif
+// The entries of the work items of a group are interleaved to avoid bank conflicts
+#define SHORT_STACK_ENTRY(i) short_stacks[(i) * TRACE_GROUP_SIZE + get_local_id(0)]
+#endif
+
+// Child order of the stackless traversal, which doesn't depend on the ray length
+bool SecondChildNear(__global LinearBVHNode* nodes, LinearBVHNode parent, float3 ray_inv_dir,
+    float3 ray_origin_inv_dir, float t_min, int* ray_sign)
 {
-    return min(min(val.x, val.y), val.z);
+    float child_t[2] = { 0.0f, 0.0f };
+#if !defined(BVH_SIGN_ORDER) && !defined(SHADOW_RAYS)
+    RayNodeBounds(nodes[parent.first_child].bounds, ray_inv_dir, ray_origin_inv_dir, t_min, t_min, &child_t[0]);
+    RayNodeBounds(nodes[parent.offset].bounds, ray_inv_dir, ray_origin_inv_dir, t_min, t_min, &child_t[1]);
+#endif
+    return SecondChildFirst(child_t[0], child_t[1], parent.num_primitives_axis, ray_sign);
 }
 
-bool RayBounds(Bounds3 bounds, float3 ray_origin, float3 ray_inv_dir, float t_min, float t_max)
+// Returns the far child of the closest ancestor of the finished node that was entered through
+// its near child, INVALID_ID once the whole subtree below subtree_root is finished. The near
+// child is the one the stack traversal visits first, the far child still has to be tested
+uint ClimbBvh(__global LinearBVHNode* nodes, uint node_index, float3 ray_inv_dir,
+    float3 ray_origin_inv_dir, float t_min, int* ray_sign, uint subtree_root)
 {
-    float3 aabb_min = bounds.pos[0];
-    float3 aabb_max = bounds.pos[1];
+    uint parent_index = nodes[node_index].parent;
 
-    float3 t0 = (aabb_min - ray_origin) * ray_inv_dir;
-    float3 t1 = (aabb_max - ray_origin) * ray_inv_dir;
+    while (node_index != subtree_root)
+    {
+        LinearBVHNode parent = nodes[parent_index];
+        bool second_first = SecondChildNear(nodes, parent, ray_inv_dir, ray_origin_inv_dir, t_min, ray_sign);
+        uint near_child = second_first ? parent.offset : parent.first_child;
 
-    float tmin = max(max3(min(t0, t1)), t_min);
-    float tmax = min(min3(max(t0, t1)), t_max);
+        if (node_index == near_child)
+        {
+            return second_first ? parent.first_child : parent.offset;
+        }
 
-    return (tmax >= tmin);
+        node_index = parent_index;
+        parent_index = parent.parent;
+    }
+
+    return INVALID_ID;
+}
+
+#ifdef COMPRESSED_LEAVES
+// Decodes a triangle of a compressed leaf record: the byte vertex indices of the triangles
+// packed 4 per word, followed by the unique vertices of the leaf as 3 floats each
+RTTriangle DecodeLeafTriangle(__global uint* leaf_data, uint record, uint num_primitives, uint primitive)
+{
+    __global float* vertices = (__global float*)(leaf_data + record + (3 * num_primitives + 3) / 4);
+    float3 positions[3];
+
+    for (uint i = 0; i < 3; ++i)
+    {
+        uint index_byte = 3 * primitive + i;
+        uint vertex_index = (leaf_data[record + index_byte / 4] >> (8 * (index_byte % 4))) & 0xFF;
+        positions[i] = vload3(vertex_index, vertices);
+    }
+
+    RTTriangle triangle;
+    triangle.position1 = positions[0];
+#ifdef WATERTIGHT_TRIANGLES
+    triangle.position2 = positions[1];
+    triangle.position3 = positions[2];
+#else
+    triangle.position2 = positions[1] - positions[0];
+    triangle.position3 = positions[2] - positions[0];
+#endif
+    return triangle;
 }
+#endif
 
+#ifdef BVH_SHORT_STACK_SIZE
+__attribute__((reqd_work_group_size(TRACE_GROUP_SIZE, 1, 1)))
+#endif
 __kernel void TraceBvh
 (
     // Input
     __global Ray* rays,
     __global uint* ray_counter,
+#ifdef COMPRESSED_LEAVES
+    __global uint* leaf_data,
+#else
     __global RTTriangle* triangles,
+#endif
     __global LinearBVHNode* nodes,
     // Output
 #ifdef SHADOW_RAYS
@@ -109,8 +206,29 @@ __kernel void TraceBvh
 #else
     __global Hit* hits
 #endif
+#ifdef ALPHA_TEST
+    // Input
+    , __global uint* triangle_alpha,
+    __global AlphaTriangle* alpha_triangles,
+    __global Texture* textures,
+    __global uint* texture_data
+#endif
+#ifdef ENTRY_HINTS
+    // Input and output, per primary ray
+    , __global uint* entry_hints
+#endif
+#ifdef OCCLUDER_CACHE
+    // Input, the cache slot of every shadow ray or INVALID_ID
+    , __global uint* occluder_slots,
+    // Input and output
+    __global uint* occluder_cache
+#endif
 )
 {
+#ifdef BVH_SHORT_STACK_SIZE
+    __local uint short_stacks[BVH_SHORT_STACK_SIZE * TRACE_GROUP_SIZE];
+#endif
+
     uint ray_idx = get_global_id(0);
     ///@TODO: use indirect dispatch
     uint num_rays = ray_counter[0];
@@ -121,8 +239,9 @@ __kernel void TraceBvh
     }
 
     Ray ray = rays[ray_idx];
-    // TODO: fix it
-    float3 ray_inv_dir = (float3)(1.0f, 1.0f, 1.0f) / ray.direction.xyz;
+    float3 ray_inv_dir = SafeInvDir(ray.direction.xyz);
+    float3 ray_origin_inv_dir = ray.origin.xyz * ray_inv_dir;
+    TriangleTestRay test_ray = PrepareTriangleTest(ray.direction.xyz);
     int ray_sign[3];
     ray_sign[0] = ray_inv_dir.x < 0;
     ray_sign[1] = ray_inv_dir.y < 0;
@@ -134,18 +253,58 @@ __kernel void TraceBvh
 
     Hit hit;
     hit.primitive_id = INVALID_ID;
+    hit.instance_id = INVALID_ID;
+
+#ifdef OCCLUDER_CACHE
+    // Triangle that blocked the shadow ray of the pixel and the light in the previous frame. Any
+    // triangle blocking the ray answers the shadow query, so the stale entries stay exact
+    uint occluder_slot = occluder_slots[ray_idx];
+    uint cached_occluder = occluder_slot != INVALID_ID ? occluder_cache[occluder_slot] : INVALID_ID;
+
+    if (cached_occluder != INVALID_ID)
+    {
+        float2 bc;
+        float t;
+        if (RayTriangle(ray, test_ray, triangles[cached_occluder], &bc, &t) && OPAQUE_HIT(cached_occluder, bc))
+        {
+            hit.primitive_id = cached_occluder;
+            shadow_hit = 0;
+            goto endtrace;
+        }
+    }
+#endif
 
-    float t;
-    // Follow ray through BVH nodes to find primitive intersections
+    // The traversal starts at subtreeRoot, the subtree below skippedNode is never entered
+    uint subtreeRoot = 0;
+    uint skippedNode = INVALID_ID;
+#ifdef ENTRY_HINTS
+    // Parent of the leaf hit by the ray of the pixel in the previous frame. Its subtree is traced
+    // first, the hit found there shortens the ray for the traversal of the rest of the tree
+    uint entry_hint = entry_hints[ray_idx];
+    subtreeRoot = entry_hint != INVALID_ID ? entry_hint : 0;
+    entry_hint = INVALID_ID;
+#endif
+
+    // Follow ray through BVH nodes to find primitive intersections. Both children are tested
+    // in their parent, the nodes taken from the stack are tested again with the shortened ray
+    uint currentNodeIndex = subtreeRoot;
+    LinearBVHNode node = nodes[subtreeRoot];
+    float t_enter;
+    bool visitNode = RayNodeBounds(node.bounds, ray_inv_dir, ray_origin_inv_dir,
+        ray.origin.w, ray.direction.w, &t_enter);
+#if defined(BVH_SHORT_STACK_SIZE)
+    // Ring buffer, the top entry is at toVisitOffset - 1
+    uint toVisitOffset = 0;
+    uint stackSize = 0;
+    bool stackOverflow = false;
+#elif !defined(BVH_STACKLESS)
     int toVisitOffset = 0;
-    int currentNodeIndex = 0;
-    int nodesToVisit[64];
+    int nodesToVisit[MAX_BVH_STACK_SIZE];
+#endif
 
     while (true)
     {
-        LinearBVHNode node = nodes[currentNodeIndex];
-
-        if (RayBounds(node.bounds, ray.origin.xyz, ray_inv_dir, ray.origin.w, ray.direction.w))
+        if (visitNode)
         {
             int num_primitives = node.num_primitives_axis >> 16;
             // Leaf node
@@ -154,12 +313,25 @@ __kernel void TraceBvh
                 // Intersect ray with primitives in leaf BVH node
                 for (int i = 0; i < num_primitives; ++i)
                 {
-                    if (RayTriangle(ray, &triangles[node.offset + i], &hit.bc, &hit.t))
+#ifdef COMPRESSED_LEAVES
+                    // The leaf record offset is stored in place of the first child
+                    RTTriangle triangle = DecodeLeafTriangle(leaf_data, node.first_child, num_primitives, i);
+#else
+                    RTTriangle triangle = triangles[node.offset + i];
+#endif
+                    float2 bc;
+                    float t;
+                    if (RayTriangle(ray, test_ray, triangle, &bc, &t) && OPAQUE_HIT(node.offset + i, bc))
                     {
+                        hit.bc = bc;
+                        hit.t = t;
                         hit.primitive_id = node.offset + i;
                         // Set ray t_max
                         // TODO: remove t from hit structure
                         ray.direction.w = hit.t;
+#ifdef ENTRY_HINTS
+                        entry_hint = node.parent != 0 ? node.parent : INVALID_ID;
+#endif
 
 #ifdef SHADOW_RAYS
                         shadow_hit = 0;
@@ -167,38 +339,261 @@ __kernel void TraceBvh
 #endif
                     }
                 }
+            }
+            else
+            {
+                LinearBVHNode first_child = nodes[node.first_child];
+                LinearBVHNode second_child = nodes[node.offset];
+
+                float first_t;
+                float second_t;
+                bool first_hit = node.first_child != skippedNode && RayNodeBounds(first_child.bounds,
+                    ray_inv_dir, ray_origin_inv_dir, ray.origin.w, ray.direction.w, &first_t);
+                bool second_hit = node.offset != skippedNode && RayNodeBounds(second_child.bounds,
+                    ray_inv_dir, ray_origin_inv_dir, ray.origin.w, ray.direction.w, &second_t);
+
+                if (first_hit && second_hit)
+                {
+                    // Put far BVH node on _nodesToVisit_ stack, advance to near node
+                    bool second_first = SecondChildFirst(first_t, second_t, node.num_primitives_axis, ray_sign);
+                    uint farNodeIndex = second_first ? node.first_child : node.offset;
+#if defined(BVH_SHORT_STACK_SIZE)
+                    SHORT_STACK_ENTRY(toVisitOffset) = farNodeIndex;
+                    toVisitOffset = (toVisitOffset + 1) % BVH_SHORT_STACK_SIZE;
+                    stackOverflow |= stackSize == BVH_SHORT_STACK_SIZE;
+                    stackSize = min(stackSize + 1, (uint)BVH_SHORT_STACK_SIZE);
+#elif !defined(BVH_STACKLESS)
+                    nodesToVisit[toVisitOffset++] = farNodeIndex;
+#endif
+                    currentNodeIndex = second_first ? node.offset : node.first_child;
+                    node = second_first ? second_child : first_child;
+                    continue;
+                }
 
-                if (toVisitOffset == 0)
+                if (first_hit || second_hit)
                 {
-                    break;
+                    currentNodeIndex = second_hit ? node.offset : node.first_child;
+                    node = second_hit ? second_child : first_child;
+                    continue;
                 }
+            }
+        }
+
+        // The subtree of the current node is finished
+#if defined(BVH_SHORT_STACK_SIZE)
+        if (stackSize > 0)
+        {
+            toVisitOffset = (toVisitOffset + BVH_SHORT_STACK_SIZE - 1) % BVH_SHORT_STACK_SIZE;
+            --stackSize;
+            currentNodeIndex = SHORT_STACK_ENTRY(toVisitOffset);
+        }
+        else if (stackOverflow)
+        {
+            // Find the far children dropped from the stack
+            currentNodeIndex = ClimbBvh(nodes, currentNodeIndex, ray_inv_dir, ray_origin_inv_dir,
+                ray.origin.w, ray_sign, subtreeRoot);
+        }
+        else
+        {
+            currentNodeIndex = INVALID_ID;
+        }
+#elif defined(BVH_STACKLESS)
+        currentNodeIndex = ClimbBvh(nodes, currentNodeIndex, ray_inv_dir, ray_origin_inv_dir,
+            ray.origin.w, ray_sign, subtreeRoot);
+#else
+        currentNodeIndex = toVisitOffset > 0 ? nodesToVisit[--toVisitOffset] : INVALID_ID;
+#endif
 
-                currentNodeIndex = nodesToVisit[--toVisitOffset];
+        if (currentNodeIndex == INVALID_ID)
+        {
+#ifdef ENTRY_HINTS
+            // The hinted subtree is finished, continue from the root without entering it again
+            if (subtreeRoot != 0)
+            {
+                skippedNode = subtreeRoot;
+                subtreeRoot = 0;
+                currentNodeIndex = 0;
+#if defined(BVH_SHORT_STACK_SIZE)
+                stackOverflow = false;
+#endif
             }
             else
+#endif
+            {
+                break;
+            }
+        }
+
+        node = nodes[currentNodeIndex];
+        visitNode = currentNodeIndex != skippedNode && RayNodeBounds(node.bounds, ray_inv_dir,
+            ray_origin_inv_dir, ray.origin.w, ray.direction.w, &t_enter);
+    }
+
+endtrace:
+    // Write the result to the output buffer
+#ifdef SHADOW_RAYS
+    shadow_hits[ray_idx] = shadow_hit;
+#else
+    hits[ray_idx] = hit;
+#endif
+#ifdef ENTRY_HINTS
+    entry_hints[ray_idx] = entry_hint;
+#endif
+#ifdef OCCLUDER_CACHE
+    // The any hit traversal stops at the first blocking triangle
+    uint occluder = shadow_hit == 0 ? hit.primitive_id : INVALID_ID;
+    if (occluder_slot != INVALID_ID && occluder != cached_occluder)
+    {
+        occluder_cache[occluder_slot] = occluder;
+    }
+#endif
+}
+
+#ifndef BVH_WIDTH
+#define BVH_WIDTH 4
+#endif
+
+#define WIDE_BVH_RECORDS (BVH_WIDTH / 4)
+// Each level pushes up to BVH_WIDTH interior children and pops one of them,
+// CLWideBvhBackend rejects the trees that could overflow the stack
+#define WIDE_BVH_STACK_SIZE (BVH_WIDTH * WIDE_BVH_STACK_SIZE_PER_LANE)
+
+// Inserts the child into the list sorted by the entry distance
+void InsertChild(float* child_t, uint* child_offset, uint* child_info, int* num_children,
+    float t, uint offset, uint info)
+{
+    int i = (*num_children)++;
+    while (i > 0 && child_t[i - 1] > t)
+    {
+        child_t[i] = child_t[i - 1];
+        child_offset[i] = child_offset[i - 1];
+        child_info[i] = child_info[i - 1];
+        --i;
+    }
+
+    child_t[i] = t;
+    child_offset[i] = offset;
+    child_info[i] = info;
+}
+
+__kernel void TraceBvhWide
+(
+    // Input
+    __global Ray* rays,
+    __global uint* ray_counter,
+    __global RTTriangle* triangles,
+    __global WideBVHNode* nodes,
+    // Output
+#ifdef SHADOW_RAYS
+    __global uint* shadow_hits
+#else
+    __global Hit* hits
+#endif
+)
+{
+    uint ray_idx = get_global_id(0);
+    ///@TODO: use indirect dispatch
+    uint num_rays = ray_counter[0];
+
+    if (ray_idx >= num_rays)
+    {
+        return;
+    }
+
+    Ray ray = rays[ray_idx];
+    float3 ray_inv_dir = SafeInvDir(ray.direction.xyz);
+    TriangleTestRay test_ray = PrepareTriangleTest(ray.direction.xyz);
+
+#ifdef SHADOW_RAYS
+    uint shadow_hit = INVALID_ID;
+#endif
+
+    Hit hit;
+    hit.primitive_id = INVALID_ID;
+    hit.instance_id = INVALID_ID;
+
+    uint stack[WIDE_BVH_STACK_SIZE];
+    int stack_size = 0;
+    uint node_index = 0;
+
+    while (true)
+    {
+        // Test all children of the node at once, the bounds are stored in SoA form
+        float child_t[BVH_WIDTH];
+        uint child_offset[BVH_WIDTH];
+        uint child_info[BVH_WIDTH];
+        int num_children = 0;
+
+        for (int record = 0; record < WIDE_BVH_RECORDS; ++record)
+        {
+            __global WideBVHNode* node = &nodes[node_index + record];
+
+            float4 t0_x = (vload4(0, node->min_x) - ray.origin.x) * ray_inv_dir.x;
+            float4 t1_x = (vload4(0, node->max_x) - ray.origin.x) * ray_inv_dir.x;
+            float4 t0_y = (vload4(0, node->min_y) - ray.origin.y) * ray_inv_dir.y;
+            float4 t1_y = (vload4(0, node->max_y) - ray.origin.y) * ray_inv_dir.y;
+            float4 t0_z = (vload4(0, node->min_z) - ray.origin.z) * ray_inv_dir.z;
+            float4 t1_z = (vload4(0, node->max_z) - ray.origin.z) * ray_inv_dir.z;
+
+            float4 t_enter = max(max(min(t0_x, t1_x), min(t0_y, t1_y)), max(min(t0_z, t1_z), ray.origin.w));
+            float4 t_exit = min(min(max(t0_x, t1_x), max(t0_y, t1_y)), min(max(t0_z, t1_z), ray.direction.w));
+
+            float lane_t_enter[4];
+            float lane_t_exit[4];
+            vstore4(t_enter, 0, lane_t_enter);
+            vstore4(t_exit, 0, lane_t_exit);
+
+            for (int lane = 0; lane < 4; ++lane)
             {
-                // Put far BVH node on _nodesToVisit_ stack, advance to near node
-                if (ray_sign[node.num_primitives_axis & 0xFFFF])
+                uint info = node->child_info[lane];
+                if (info != INVALID_ID && lane_t_exit[lane] >= lane_t_enter[lane])
                 {
-                    nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
-                    currentNodeIndex = node.offset;
+                    InsertChild(child_t, child_offset, child_info, &num_children,
+                        lane_t_enter[lane], node->child_offset[lane], info);
                 }
-                else
+            }
+        }
+
+        // Intersect the leaves from near to far, they can shorten the ray before the interior children are visited
+        for (int i = 0; i < num_children; ++i)
+        {
+            int num_primitives = child_info[i] >> 16;
+            if (num_primitives == 0 || child_t[i] > ray.direction.w)
+            {
+                continue;
+            }
+
+            for (int j = 0; j < num_primitives; ++j)
+            {
+                uint primitive_id = child_offset[i] + j;
+                if (RayTriangle(ray, test_ray, triangles[primitive_id], &hit.bc, &hit.t))
                 {
-                    nodesToVisit[toVisitOffset++] = node.offset;
-                    currentNodeIndex = currentNodeIndex + 1;
+                    hit.primitive_id = primitive_id;
+                    ray.direction.w = hit.t;
+
+#ifdef SHADOW_RAYS
+                    shadow_hit = 0;
+                    goto endtrace;
+#endif
                 }
             }
         }
-        else
+
+        // Push the interior children from far to near, so the nearest one is popped first
+        for (int i = num_children - 1; i >= 0; --i)
         {
-            if (toVisitOffset == 0)
+            if (child_info[i] == 0 && child_t[i] <= ray.direction.w)
             {
-                break;
+                stack[stack_size++] = child_offset[i];
             }
+        }
 
-            currentNodeIndex = nodesToVisit[--toVisitOffset];
+        if (stack_size == 0)
+        {
+            break;
         }
+
+        node_index = stack[--stack_size];
     }
 
 endtrace:
@@ -209,3 +604,729 @@ endtrace:
     hits[ray_idx] = hit;
 #endif
 }
+
+#ifdef QUANTIZED_BVH_BITS
+
+bool RayChildBounds(Bounds3 bounds, float3 ray_origin, float3 ray_inv_dir, float t_min, float t_max, float* t_enter)
+{
+    float3 t0 = (bounds.pos[0] - ray_origin) * ray_inv_dir;
+    float3 t1 = (bounds.pos[1] - ray_origin) * ray_inv_dir;
+
+    float tmin = max(max3(min(t0, t1)), t_min);
+    float tmax = min(min3(max(t0, t1)), t_max);
+
+    *t_enter = tmin;
+    return (tmax >= tmin);
+}
+
+__kernel void TraceBvhQuantized
+(
+    // Input
+    __global Ray* rays,
+    __global uint* ray_counter,
+    __global RTTriangle* triangles,
+    __global QuantizedBVHNode* nodes,
+    // Output
+#ifdef SHADOW_RAYS
+    __global uint* shadow_hits
+#else
+    __global Hit* hits
+#endif
+)
+{
+    uint ray_idx = get_global_id(0);
+    ///@TODO: use indirect dispatch
+    uint num_rays = ray_counter[0];
+
+    if (ray_idx >= num_rays)
+    {
+        return;
+    }
+
+    Ray ray = rays[ray_idx];
+    float3 ray_inv_dir = SafeInvDir(ray.direction.xyz);
+    TriangleTestRay test_ray = PrepareTriangleTest(ray.direction.xyz);
+
+#ifdef SHADOW_RAYS
+    uint shadow_hit = INVALID_ID;
+#endif
+
+    Hit hit;
+    hit.primitive_id = INVALID_ID;
+    hit.instance_id = INVALID_ID;
+
+    uint stack[MAX_BVH_STACK_SIZE];
+    int stack_size = 0;
+    uint node_index = 0;
+
+    while (true)
+    {
+        // Both children are tested in the parent, so the node bounds are never fetched
+        QuantizedBVHNode node = nodes[node_index];
+
+        float child_t[2];
+        bool child_hit[2];
+        for (uint child = 0; child < 2; ++child)
+        {
+            child_hit[child] = node.child_info[child] != 0 && RayChildBounds(DecodeChildBounds(node, child),
+                ray.origin.xyz, ray_inv_dir, ray.origin.w, ray.direction.w, &child_t[child]);
+        }
+
+        uint near_child = (child_hit[1] && (!child_hit[0] || child_t[1] < child_t[0])) ? 1 : 0;
+        uint next_node = 0;
+
+        for (uint i = 0; i < 2; ++i)
+        {
+            uint child = i == 0 ? near_child : 1 - near_child;
+            if (!child_hit[child] || child_t[child] > ray.direction.w)
+            {
+                continue;
+            }
+
+            uint info = node.child_info[child];
+            if (info & QUANTIZED_BVH_LEAF_FLAG)
+            {
+                uint offset = info & QUANTIZED_BVH_OFFSET_MASK;
+                uint num_primitives = ((info >> QUANTIZED_BVH_COUNT_SHIFT) & QUANTIZED_BVH_COUNT_MASK) + 1;
+
+                for (uint j = 0; j < num_primitives; ++j)
+                {
+                    if (RayTriangle(ray, test_ray, triangles[offset + j], &hit.bc, &hit.t))
+                    {
+                        hit.primitive_id = offset + j;
+                        ray.direction.w = hit.t;
+
+#ifdef SHADOW_RAYS
+                        shadow_hit = 0;
+                        goto endtrace;
+#endif
+                    }
+                }
+            }
+            else if (next_node == 0)
+            {
+                next_node = info;
+            }
+            else
+            {
+                stack[stack_size++] = info;
+            }
+        }
+
+        if (next_node == 0)
+        {
+            if (stack_size == 0)
+            {
+                break;
+            }
+
+            next_node = stack[--stack_size];
+        }
+
+        node_index = next_node;
+    }
+
+endtrace:
+    // Write the result to the output buffer
+#ifdef SHADOW_RAYS
+    shadow_hits[ray_idx] = shadow_hit;
+#else
+    hits[ray_idx] = hit;
+#endif
+}
+
+#endif // #ifdef QUANTIZED_BVH_BITS
+
+__kernel void TraceTwoLevelBvh
+(
+    // Input
+    __global Ray* rays,
+    __global uint* ray_counter,
+    __global RTTriangle* triangles,
+    __global LinearBVHNode* nodes,
+    // Output
+#ifdef SHADOW_RAYS
+    __global uint* shadow_hits,
+#else
+    __global Hit* hits,
+#endif
+    // The top level leaves reference the instances
+    __global Instance* instances
+)
+{
+    uint ray_idx = get_global_id(0);
+    ///@TODO: use indirect dispatch
+    uint num_rays = ray_counter[0];
+
+    if (ray_idx >= num_rays)
+    {
+        return;
+    }
+
+    Ray ray = rays[ray_idx];
+    float3 world_origin = ray.origin.xyz;
+    float3 world_direction = ray.direction.xyz;
+    float3 ray_inv_dir = SafeInvDir(ray.direction.xyz);
+    float3 ray_origin_inv_dir = ray.origin.xyz * ray_inv_dir;
+    TriangleTestRay test_ray = PrepareTriangleTest(ray.direction.xyz);
+    int ray_sign[3];
+    ray_sign[0] = ray_inv_dir.x < 0;
+    ray_sign[1] = ray_inv_dir.y < 0;
+    ray_sign[2] = ray_inv_dir.z < 0;
+
+#ifdef SHADOW_RAYS
+    uint shadow_hit = INVALID_ID;
+#endif
+
+    Hit hit;
+    hit.primitive_id = INVALID_ID;
+    hit.instance_id = INVALID_ID;
+
+    // The mesh BVH of an instance is traversed with the same stack, the instance is left
+    // once the stack shrinks back to the size it had on entering. TwoLevelBvh rejects the
+    // trees that could overflow it
+    uint stack[MAX_BVH_STACK_SIZE];
+    int stack_size = 0;
+    uint instance_id = INVALID_ID;
+    int instance_stack_size = 0;
+
+    // Both children are tested in their parent like in TraceBvh, the nodes taken from the
+    // stack are tested again with the shortened ray
+    LinearBVHNode node = nodes[0];
+    float t_enter;
+    bool visit_node = RayNodeBounds(node.bounds, ray_inv_dir, ray_origin_inv_dir,
+        ray.origin.w, ray.direction.w, &t_enter);
+
+    while (true)
+    {
+        if (visit_node)
+        {
+            uint num_primitives = node.num_primitives_axis >> 16;
+
+            if (num_primitives == 0)
+            {
+                LinearBVHNode first_child = nodes[node.first_child];
+                LinearBVHNode second_child = nodes[node.offset];
+
+                float first_t;
+                float second_t;
+                bool first_hit = RayNodeBounds(first_child.bounds, ray_inv_dir, ray_origin_inv_dir,
+                    ray.origin.w, ray.direction.w, &first_t);
+                bool second_hit = RayNodeBounds(second_child.bounds, ray_inv_dir, ray_origin_inv_dir,
+                    ray.origin.w, ray.direction.w, &second_t);
+
+                if (first_hit && second_hit)
+                {
+                    // Put far BVH node on the stack, advance to near node
+                    bool second_first = SecondChildFirst(first_t, second_t, node.num_primitives_axis, ray_sign);
+                    stack[stack_size++] = second_first ? node.first_child : node.offset;
+                    node = second_first ? second_child : first_child;
+                    continue;
+                }
+
+                if (first_hit || second_hit)
+                {
+                    node = second_hit ? second_child : first_child;
+                    continue;
+                }
+            }
+            else if (instance_id == INVALID_ID)
+            {
+                // Top level leaf, the instances are entered from the stack one by one
+                for (uint i = 0; i < num_primitives; ++i)
+                {
+                    stack[stack_size++] = (node.offset + num_primitives - 1 - i) | TWO_LEVEL_BVH_INSTANCE_FLAG;
+                }
+            }
+            else
+            {
+                for (uint i = 0; i < num_primitives; ++i)
+                {
+                    if (RayTriangle(ray, test_ray, triangles[node.offset + i], &hit.bc, &hit.t))
+                    {
+                        hit.primitive_id = node.offset + i;
+                        hit.instance_id = instance_id;
+                        ray.direction.w = hit.t;
+
+#ifdef SHADOW_RAYS
+                        shadow_hit = 0;
+                        goto endtrace;
+#endif
+                    }
+                }
+            }
+        }
+
+        if (instance_id != INVALID_ID && stack_size == instance_stack_size)
+        {
+            // Leave the instance, the hit distance is the same in world space
+            instance_id = INVALID_ID;
+            ray.origin.xyz = world_origin;
+            ray.direction.xyz = world_direction;
+            ray_inv_dir = SafeInvDir(ray.direction.xyz);
+            ray_origin_inv_dir = ray.origin.xyz * ray_inv_dir;
+            test_ray = PrepareTriangleTest(ray.direction.xyz);
+            ray_sign[0] = ray_inv_dir.x < 0;
+            ray_sign[1] = ray_inv_dir.y < 0;
+            ray_sign[2] = ray_inv_dir.z < 0;
+        }
+
+        if (stack_size == 0)
+        {
+            break;
+        }
+
+        uint entry = stack[--stack_size];
+        uint node_index = entry;
+
+        if (entry & TWO_LEVEL_BVH_INSTANCE_FLAG)
+        {
+            // Enter the instance, transform the ray into the mesh space
+            instance_id = entry & ~TWO_LEVEL_BVH_INSTANCE_FLAG;
+            instance_stack_size = stack_size;
+
+            Instance instance = instances[instance_id];
+            ray.origin.xyz = TransformPoint(instance.world_to_object, world_origin, 1.0f);
+            ray.direction.xyz = TransformPoint(instance.world_to_object, world_direction, 0.0f);
+            ray_inv_dir = SafeInvDir(ray.direction.xyz);
+            ray_origin_inv_dir = ray.origin.xyz * ray_inv_dir;
+            test_ray = PrepareTriangleTest(ray.direction.xyz);
+            ray_sign[0] = ray_inv_dir.x < 0;
+            ray_sign[1] = ray_inv_dir.y < 0;
+            ray_sign[2] = ray_inv_dir.z < 0;
+            node_index = instance.blas_root;
+        }
+
+        node = nodes[node_index];
+        visit_node = RayNodeBounds(node.bounds, ray_inv_dir, ray_origin_inv_dir,
+            ray.origin.w, ray.direction.w, &t_enter);
+    }
+
+endtrace:
+    // Write the result to the output buffer
+#ifdef SHADOW_RAYS
+    shadow_hits[ray_idx] = shadow_hit;
+#else
+    hits[ray_idx] = hit;
+#endif
+}
+
+// 3D-DDA walking the cells of a uniform grid along the ray
+typedef struct
+{
+    int3 cell;
+    int3 step;
+    // Cell index past the grid in the step direction
+    int3 end;
+    // Distance to the next cell boundary on each axis
+    float3 t_next;
+    float3 t_delta;
+} GridDda;
+
+// Starts in the cell of the ray point at t
+GridDda InitGridDda(float3 grid_min, float3 cell_size, int3 resolution, Ray ray, float3 ray_inv_dir, float t)
+{
+    int3 negative = isless(ray_inv_dir, (float3)(0.0f, 0.0f, 0.0f));
+    float3 position = (ray.origin.xyz + ray.direction.xyz * t - grid_min) / cell_size;
+
+    GridDda dda;
+    dda.cell = clamp(convert_int3_rtn(position), (int3)(0, 0, 0), resolution - 1);
+    dda.step = select((int3)(1, 1, 1), (int3)(-1, -1, -1), negative);
+    dda.end = select(resolution, (int3)(-1, -1, -1), negative);
+    float3 boundary = grid_min + convert_float3(dda.cell + select((int3)(1, 1, 1), (int3)(0, 0, 0), negative)) * cell_size;
+    dda.t_next = (boundary - ray.origin.xyz) * ray_inv_dir;
+    dda.t_delta = cell_size * fabs(ray_inv_dir);
+    return dda;
+}
+
+// Moves to the next cell, returns false once the ray has left the grid
+bool StepGridDda(GridDda* dda)
+{
+    if (dda->t_next.x < dda->t_next.y && dda->t_next.x < dda->t_next.z)
+    {
+        dda->cell.x += dda->step.x;
+        dda->t_next.x += dda->t_delta.x;
+        return dda->cell.x != dda->end.x;
+    }
+    else if (dda->t_next.y < dda->t_next.z)
+    {
+        dda->cell.y += dda->step.y;
+        dda->t_next.y += dda->t_delta.y;
+        return dda->cell.y != dda->end.y;
+    }
+    else
+    {
+        dda->cell.z += dda->step.z;
+        dda->t_next.z += dda->t_delta.z;
+        return dda->cell.z != dda->end.z;
+    }
+}
+
+__kernel void TraceGrid
+(
+    // Input
+    __global Ray* rays,
+    __global uint* ray_counter,
+    __global RTTriangle* triangles,
+    __global GridTopCell* top_cells,
+    // Output
+#ifdef SHADOW_RAYS
+    __global uint* shadow_hits,
+#else
+    __global Hit* hits,
+#endif
+    // Input
+    __global CellData* cells,
+    __global uint* references,
+    __global GridInfo* grid_info
+)
+{
+    uint ray_idx = get_global_id(0);
+    ///@TODO: use indirect dispatch
+    uint num_rays = ray_counter[0];
+
+    if (ray_idx >= num_rays)
+    {
+        return;
+    }
+
+    Ray ray = rays[ray_idx];
+    float3 ray_inv_dir = SafeInvDir(ray.direction.xyz);
+    TriangleTestRay test_ray = PrepareTriangleTest(ray.direction.xyz);
+
+#ifdef SHADOW_RAYS
+    uint shadow_hit = INVALID_ID;
+#endif
+
+    Hit hit;
+    hit.primitive_id = INVALID_ID;
+    hit.instance_id = INVALID_ID;
+
+    GridInfo grid = grid_info[0];
+    int3 resolution = (int3)((int)grid.resolution_x, (int)grid.resolution_y, (int)grid.resolution_z);
+
+    // Clip the ray to the grid bounds
+    float3 t0 = (grid.bounds.pos[0] - ray.origin.xyz) * ray_inv_dir;
+    float3 t1 = (grid.bounds.pos[1] - ray.origin.xyz) * ray_inv_dir;
+    float t_enter = max(max3(min(t0, t1)), ray.origin.w);
+    float t_exit = min(min3(max(t0, t1)), ray.direction.w);
+
+    if (t_enter > t_exit)
+    {
+        goto endtrace;
+    }
+
+    GridDda top_dda = InitGridDda(grid.bounds.pos[0], grid.cell_size, resolution, ray, ray_inv_dir, t_enter);
+
+    while (true)
+    {
+        float top_t_exit = min3(top_dda.t_next);
+        GridTopCell top_cell = top_cells[top_dda.cell.x + resolution.x * (top_dda.cell.y + resolution.y * top_dda.cell.z)];
+
+        if (top_cell.resolution != 0)
+        {
+            int3 cell_resolution = (int3)((int)(top_cell.resolution & 0xFF),
+                (int)((top_cell.resolution >> 8) & 0xFF), (int)((top_cell.resolution >> 16) & 0xFF));
+            float3 subgrid_min = grid.bounds.pos[0] + convert_float3(top_dda.cell) * grid.cell_size;
+            float3 subgrid_cell_size = grid.cell_size / convert_float3(cell_resolution);
+            GridDda dda = InitGridDda(subgrid_min, subgrid_cell_size, cell_resolution, ray, ray_inv_dir, t_enter);
+
+            while (true)
+            {
+                CellData cell = cells[top_cell.first_cell + dda.cell.x + cell_resolution.x * (dda.cell.y + cell_resolution.y * dda.cell.z)];
+
+                for (uint i = 0; i < cell.count; ++i)
+                {
+                    uint slot = references[cell.start_index + i];
+                    if (RayTriangle(ray, test_ray, triangles[slot], &hit.bc, &hit.t))
+                    {
+                        hit.primitive_id = slot;
+                        ray.direction.w = hit.t;
+
+#ifdef SHADOW_RAYS
+                        shadow_hit = 0;
+                        goto endtrace;
+#endif
+                    }
+                }
+
+                // A triangle overlapping several cells may be hit behind the current cell,
+                // the hits inside the cell are closer than anything in the next cells
+                if (ray.direction.w <= min3(dda.t_next) || !StepGridDda(&dda))
+                {
+                    break;
+                }
+            }
+        }
+
+        if (ray.direction.w <= top_t_exit || !StepGridDda(&top_dda))
+        {
+            break;
+        }
+
+        t_enter = top_t_exit;
+    }
+
+endtrace:
+    // Write the result to the output buffer
+#ifdef SHADOW_RAYS
+    shadow_hits[ray_idx] = shadow_hit;
+#else
+    hits[ray_idx] = hit;
+#endif
+}
+
+// Treelet scheduled traversal of the incoherent rays. The rays are queued per treelet of the
+// next node they visit, consecutive work items trace the rays of the same treelet through the
+// same nodes until they leave it. The traversal is stackless, the next node is all the state
+// kept between the passes
+
+#ifndef TREELET_SCAN_GROUP_SIZE
+#define TREELET_SCAN_GROUP_SIZE 64
+#endif
+
+__kernel void InitTreeletTraversal
+(
+    __global uint* ray_counter,
+    // Output
+    __global uint* next_nodes,
+    __global Hit* hits
+)
+{
+    uint ray_idx = get_global_id(0);
+
+    if (ray_idx >= ray_counter[0])
+    {
+        return;
+    }
+
+    next_nodes[ray_idx] = 0;
+    hits[ray_idx].primitive_id = INVALID_ID;
+    hits[ray_idx].instance_id = INVALID_ID;
+}
+
+__kernel void ClearTreeletCounters
+(
+    uint num_counters,
+    // Output
+    __global uint* treelet_counters
+)
+{
+    uint counter_idx = get_global_id(0);
+
+    if (counter_idx < num_counters)
+    {
+        treelet_counters[counter_idx] = 0;
+    }
+}
+
+__kernel void CountTreeletRays
+(
+    __global uint* ray_counter,
+    __global uint* next_nodes,
+    __global uint* node_treelets,
+    // Output
+    __global uint* treelet_counters
+)
+{
+    uint ray_idx = get_global_id(0);
+
+    if (ray_idx >= ray_counter[0])
+    {
+        return;
+    }
+
+    uint node_index = next_nodes[ray_idx];
+    if (node_index != INVALID_ID)
+    {
+        atomic_inc(&treelet_counters[node_treelets[node_index]]);
+    }
+}
+
+// Replaces the ray counts of the treelets with the first queue entries of the treelets, the
+// counter past the last treelet receives the number of queued rays. Runs in a single work group
+__attribute__((reqd_work_group_size(TREELET_SCAN_GROUP_SIZE, 1, 1)))
+__kernel void ScanTreeletCounters
+(
+    uint num_treelets,
+    // Input and output
+    __global uint* treelet_counters
+)
+{
+    __local uint group_offsets[TREELET_SCAN_GROUP_SIZE];
+
+    uint local_idx = get_local_id(0);
+    uint treelets_per_item = (num_treelets + TREELET_SCAN_GROUP_SIZE - 1) / TREELET_SCAN_GROUP_SIZE;
+    uint first_treelet = min(local_idx * treelets_per_item, num_treelets);
+    uint last_treelet = min(first_treelet + treelets_per_item, num_treelets);
+
+    uint count = 0;
+    for (uint i = first_treelet; i < last_treelet; ++i)
+    {
+        count += treelet_counters[i];
+    }
+
+    group_offsets[local_idx] = count;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (local_idx == 0)
+    {
+        uint offset = 0;
+        for (uint i = 0; i < TREELET_SCAN_GROUP_SIZE; ++i)
+        {
+            uint item_count = group_offsets[i];
+            group_offsets[i] = offset;
+            offset += item_count;
+        }
+        treelet_counters[num_treelets] = offset;
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    uint offset = group_offsets[local_idx];
+    for (uint i = first_treelet; i < last_treelet; ++i)
+    {
+        uint treelet_count = treelet_counters[i];
+        treelet_counters[i] = offset;
+        offset += treelet_count;
+    }
+}
+
+__kernel void QueueTreeletRays
+(
+    __global uint* ray_counter,
+    __global uint* next_nodes,
+    __global uint* node_treelets,
+    // Input and output
+    __global uint* treelet_counters,
+    // Output
+    __global uint* ray_queue
+)
+{
+    uint ray_idx = get_global_id(0);
+
+    if (ray_idx >= ray_counter[0])
+    {
+        return;
+    }
+
+    uint node_index = next_nodes[ray_idx];
+    if (node_index != INVALID_ID)
+    {
+        ray_queue[atomic_inc(&treelet_counters[node_treelets[node_index]])] = ray_idx;
+    }
+}
+
+__kernel void TraceTreelets
+(
+    // Input
+    __global Ray* rays,
+    __global uint* ray_counter,
+    __global RTTriangle* triangles,
+    __global LinearBVHNode* nodes,
+    // Input and output
+    __global Hit* hits,
+    __global uint* next_nodes,
+    // Input
+    __global uint* node_treelets,
+    __global uint* ray_queue,
+    // The counter past the last treelet holds the queue size
+    __global uint* treelet_counters,
+    uint num_treelets,
+    // The last pass traces the remaining rays to the end instead of stopping at the treelet
+    // boundaries, the work items index the rays directly
+    uint finish
+#ifdef ALPHA_TEST
+    , __global uint* triangle_alpha,
+    __global AlphaTriangle* alpha_triangles,
+    __global Texture* textures,
+    __global uint* texture_data
+#endif
+)
+{
+    uint ray_idx = get_global_id(0);
+
+    if (finish)
+    {
+        if (ray_idx >= ray_counter[0])
+        {
+            return;
+        }
+    }
+    else
+    {
+        // The queue ends at the last treelet, so the end of the queue is the offset past it
+        if (ray_idx >= treelet_counters[num_treelets])
+        {
+            return;
+        }
+
+        ray_idx = ray_queue[ray_idx];
+    }
+
+    uint node_index = next_nodes[ray_idx];
+    if (node_index == INVALID_ID)
+    {
+        return;
+    }
+
+    Ray ray = rays[ray_idx];
+    float3 ray_inv_dir = SafeInvDir(ray.direction.xyz);
+    float3 ray_origin_inv_dir = ray.origin.xyz * ray_inv_dir;
+    TriangleTestRay test_ray = PrepareTriangleTest(ray.direction.xyz);
+    int ray_sign[3];
+    ray_sign[0] = ray_inv_dir.x < 0;
+    ray_sign[1] = ray_inv_dir.y < 0;
+    ray_sign[2] = ray_inv_dir.z < 0;
+
+    // Continue with the closest hit of the previous passes
+    Hit hit = hits[ray_idx];
+    if (hit.primitive_id != INVALID_ID)
+    {
+        ray.direction.w = hit.t;
+    }
+
+    uint treelet = node_treelets[node_index];
+
+    while (node_index != INVALID_ID)
+    {
+        // The ray is queued for the treelet of the next node by the next pass
+        if (!finish && node_treelets[node_index] != treelet)
+        {
+            break;
+        }
+
+        LinearBVHNode node = nodes[node_index];
+        float t_enter;
+        if (RayNodeBounds(node.bounds, ray_inv_dir, ray_origin_inv_dir, ray.origin.w, ray.direction.w, &t_enter))
+        {
+            uint num_primitives = node.num_primitives_axis >> 16;
+
+            if (num_primitives == 0)
+            {
+                bool second_first = SecondChildNear(nodes, node, ray_inv_dir, ray_origin_inv_dir, ray.origin.w, ray_sign);
+                node_index = second_first ? node.offset : node.first_child;
+                continue;
+            }
+
+            for (uint i = 0; i < num_primitives; ++i)
+            {
+                float2 bc;
+                float t;
+                if (RayTriangle(ray, test_ray, triangles[node.offset + i], &bc, &t) && OPAQUE_HIT(node.offset + i, bc))
+                {
+                    hit.bc = bc;
+                    hit.t = t;
+                    hit.primitive_id = node.offset + i;
+                    ray.direction.w = hit.t;
+                }
+            }
+        }
+
+        node_index = ClimbBvh(nodes, node_index, ray_inv_dir, ray_origin_inv_dir, ray.origin.w, ray_sign, 0);
+    }
+
+    next_nodes[ray_idx] = node_index;
+    hits[ray_idx] = hit;
+}
+
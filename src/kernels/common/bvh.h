@@ -0,0 +1,115 @@
+/*****************************************************************************
+ MIT License
+
+ Copyright(c) 2023 Alexander Veselov
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this softwareand associated documentation files(the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions :
+
+ The above copyright noticeand this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *****************************************************************************/
+
+#ifndef BVH_H
+#define BVH_H
+
+#ifdef GLSL
+#define AS_FLOAT(x) uintBitsToFloat(x)
+#define TO_FLOAT(x) float(x)
+#define MAKE_FLOAT3(x, y, z) float3(x, y, z)
+#else
+#define AS_FLOAT(x) as_float(x)
+#define TO_FLOAT(x) (float)(x)
+#define MAKE_FLOAT3(x, y, z) (float3)(x, y, z)
+#endif
+
+// Child info of the quantized BVH nodes. Leaves have the flag set, 4 bits of the primitive
+// count minus one and 27 bits of the first primitive index. Interior children store the
+// index of the child node, 0 marks an empty child since the root is never referenced
+#define QUANTIZED_BVH_LEAF_FLAG 0x80000000u
+#define QUANTIZED_BVH_COUNT_SHIFT 27
+#define QUANTIZED_BVH_COUNT_MASK 0xFu
+#define QUANTIZED_BVH_OFFSET_MASK 0x07FFFFFFu
+
+#ifdef QUANTIZED_BVH_BITS
+
+#if QUANTIZED_BVH_BITS == 16
+#define QuantizedBVHNode QuantizedBVHNode16
+#else
+#define QuantizedBVHNode QuantizedBVHNode8
+#endif
+
+// Coordinate index is child * 6 + (max ? 3 : 0) + axis
+float GetQuantizedCoordinate(QuantizedBVHNode node, uint index)
+{
+#if QUANTIZED_BVH_BITS == 16
+    return TO_FLOAT((node.child_bounds[index >> 1] >> ((index & 1) * 16)) & 0xFFFF);
+#else
+    return TO_FLOAT((node.child_bounds[index >> 2] >> ((index & 3) * 8)) & 0xFF);
+#endif
+}
+
+Bounds3 DecodeChildBounds(QuantizedBVHNode node, uint child)
+{
+    float3 origin = MAKE_FLOAT3(node.origin_x, node.origin_y, node.origin_z);
+    float3 scale = MAKE_FLOAT3(AS_FLOAT((node.exponents & 0xFF) << 23),
+        AS_FLOAT(((node.exponents >> 8) & 0xFF) << 23),
+        AS_FLOAT(((node.exponents >> 16) & 0xFF) << 23));
+
+    uint base = child * 6;
+    float3 q_min = MAKE_FLOAT3(GetQuantizedCoordinate(node, base + 0),
+        GetQuantizedCoordinate(node, base + 1), GetQuantizedCoordinate(node, base + 2));
+    float3 q_max = MAKE_FLOAT3(GetQuantizedCoordinate(node, base + 3),
+        GetQuantizedCoordinate(node, base + 4), GetQuantizedCoordinate(node, base + 5));
+
+    Bounds3 bounds;
+    bounds.pos[0] = origin + q_min * scale;
+    bounds.pos[1] = origin + q_max * scale;
+    return bounds;
+}
+
+#endif // #ifdef QUANTIZED_BVH_BITS
+
+// Marks the stack entries of the two-level traversal that enter an instance
+#define TWO_LEVEL_BVH_INSTANCE_FLAG 0x80000000u
+
+// Applies the row-major 3x4 matrix, w = 0 transforms a direction
+float3 TransformPoint(float m[12], float3 p, float w)
+{
+    return MAKE_FLOAT3(m[0] * p.x + m[1] * p.y + m[2] * p.z + m[3] * w,
+        m[4] * p.x + m[5] * p.y + m[6] * p.z + m[7] * w,
+        m[8] * p.x + m[9] * p.y + m[10] * p.z + m[11] * w);
+}
+
+// Normals are transformed by the transposed inverse matrix
+float3 TransformNormal(float inverse[12], float3 n)
+{
+    return normalize(MAKE_FLOAT3(inverse[0] * n.x + inverse[4] * n.y + inverse[8] * n.z,
+        inverse[1] * n.x + inverse[5] * n.y + inverse[9] * n.z,
+        inverse[2] * n.x + inverse[6] * n.y + inverse[10] * n.z));
+}
+
+Triangle InstanceToWorldTriangle(Instance instance, Triangle triangle)
+{
+    triangle.v1.position = TransformPoint(instance.object_to_world, triangle.v1.position, 1.0f);
+    triangle.v2.position = TransformPoint(instance.object_to_world, triangle.v2.position, 1.0f);
+    triangle.v3.position = TransformPoint(instance.object_to_world, triangle.v3.position, 1.0f);
+    triangle.v1.normal = TransformNormal(instance.world_to_object, triangle.v1.normal);
+    triangle.v2.normal = TransformNormal(instance.world_to_object, triangle.v2.normal);
+    triangle.v3.normal = TransformNormal(instance.world_to_object, triangle.v3.normal);
+    return triangle;
+}
+
+#endif // BVH_H
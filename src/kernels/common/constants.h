@@ -34,5 +34,9 @@
 #define INVALID_ID 0xFFFFFFFF
 #define INVALID_TEXTURE_IDX 0xFF
 #define MAX_TEXTURES 512
+// Traversal stack of the binary BVH kernels, deeper trees overflow it
+#define MAX_BVH_STACK_SIZE 64
+// Traversal stack of the wide BVH kernel is BVH_WIDTH times this many entries
+#define WIDE_BVH_STACK_SIZE_PER_LANE 16
 
 #endif // CONSTANTS_H
@@ -27,6 +27,16 @@
 
 #include "src/kernels/common/constants.h"
 
+// Index of the light picked by Light_Sample for the random number s
+int Light_SampleIndex(SceneInfo scene_info, float s)
+{
+#ifdef GLSL
+    return clamp(int(s * float(scene_info.analytic_light_count)), 0, int(scene_info.analytic_light_count) - 1);
+#else
+    return clamp((int)(s * (float)scene_info.analytic_light_count), 0, (int)scene_info.analytic_light_count - 1);
+#endif
+}
+
 float3 Light_Sample(
 #ifdef GLSL
     SceneInfo scene_info, float3 position, float3 normal, float s, out float3 outgoing, out float pdf)
@@ -35,12 +45,7 @@ float3 Light_Sample(
 #endif
 {
     // Fetch random light
-#ifdef GLSL
-    int light_idx = clamp(int(s * float(scene_info.analytic_light_count)), 0, int(scene_info.analytic_light_count) - 1);
-#else
-    int light_idx = clamp((int)(s * (float)scene_info.analytic_light_count), 0, (int)scene_info.analytic_light_count - 1);
-#endif
-    Light light = analytic_lights[light_idx];
+    Light light = analytic_lights[Light_SampleIndex(scene_info, s)];
 
     // Compute light selection pdf
     OUT(pdf) = 1.0f / scene_info.analytic_light_count;
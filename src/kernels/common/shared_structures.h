@@ -63,6 +63,9 @@ STRUCT_BEGIN(Hit)
     unsigned int primitive_id;
     // TODO: remove t from hit structure
     float t;
+    // Instance of the two-level BVH, INVALID_ID for the triangles in world space
+    unsigned int instance_id;
+    unsigned int padding;
 STRUCT_END(Hit)
 
 STRUCT_BEGIN(SceneInfo)
@@ -133,6 +136,11 @@ STRUCT_BEGIN(Triangle)
     {
         return Union(Bounds3(v1.position, v2.position), v3.position);
     }
+
+    float GetArea() const
+    {
+        return 0.5f * Cross(v2.position - v1.position, v3.position - v1.position).Length();
+    }
 #endif
 
     Vertex v1, v2, v3;
@@ -140,23 +148,65 @@ STRUCT_BEGIN(Triangle)
     unsigned int padding[3];
 STRUCT_END(Triangle)
 
+// Triangle record of the intersection kernels. The watertight test reads the three vertices,
+// the Moller-Trumbore test reads the edges going from position1 in place of the other two
 STRUCT_BEGIN(RTTriangle)
 #ifdef __cplusplus
     RTTriangle(float3 v1, float3 v2, float3 v3)
         : position1(v1), position2(v2), position3(v3)
     {}
+
+    // Record of the Moller-Trumbore test
+    static RTTriangle WithEdges(float3 v1, float3 v2, float3 v3)
+    {
+        return RTTriangle(v1, v2 - v1, v3 - v1);
+    }
 #endif
 
     float3 position1;
-    float3 position2;
-    float3 position3;
+    float3 position2; // or position2 - position1
+    float3 position3; // or position3 - position1
 STRUCT_END(RTTriangle)
 
+// Leaf cell of the two-level grid, a range of the triangle slot references
 STRUCT_BEGIN(CellData)
     unsigned int start_index;
     unsigned int count;
 STRUCT_END(CellData)
 
+// Top level cell of the two-level grid. The leaf cells of its subgrid are stored consecutively,
+// x changes fastest
+STRUCT_BEGIN(GridTopCell)
+    unsigned int first_cell;
+    // Subgrid resolution, 8 bits per axis starting with x in the lowest bits. 0 marks an empty cell
+    unsigned int resolution;
+STRUCT_END(GridTopCell)
+
+STRUCT_BEGIN(GridInfo)
+    Bounds3 bounds;
+    // Extent of the top level cells
+    float3 cell_size;
+    unsigned int resolution_x;
+    unsigned int resolution_y;
+    unsigned int resolution_z;
+    unsigned int padding;
+STRUCT_END(GridInfo)
+
+// Texture coordinates and transparency of a triangle the traversal may skip, the material is
+// transparent where transparency times the red channel of the texture is below 0.5
+STRUCT_BEGIN(AlphaTriangle)
+    float2 texcoord1;
+    float2 texcoord2;
+    float2 texcoord3;
+    float transparency;
+    unsigned int texture_idx; // INVALID_TEXTURE_IDX for the constant transparency
+STRUCT_END(AlphaTriangle)
+
+// Low bits of LinearBVHNode::num_primitives_axis of the interior nodes: the split axis and the
+// child the shadow rays visit first, the one more likely to hold an occluder
+#define BVH_NODE_AXIS_MASK 0x3
+#define BVH_NODE_SHADOW_SECOND_FIRST 0x4
+
 STRUCT_BEGIN(LinearBVHNode)
 #ifdef __cplusplus
     LinearBVHNode() {}
@@ -166,10 +216,79 @@ STRUCT_BEGIN(LinearBVHNode)
     // 4 bytes
     unsigned int offset; // primitives (leaf) or second child (interior) offset
     // 4 bytes
-    unsigned int num_primitives_axis;  // 0 -> interior node
-    unsigned int padding[2]; // ensure 48 byte total size
+    unsigned int num_primitives_axis;  // primitive count << 16, 0 -> interior node with the BVH_NODE_* bits
+    // 4 bytes
+    unsigned int first_child; // first child offset (interior), the node layout decides where it is, or the leaf record offset of the compressed leaves
+    // 4 bytes
+    unsigned int parent; // parent node offset for the stackless traversal, INVALID_ID at the root
 STRUCT_END(LinearBVHNode)
 
+#ifdef __cplusplus
+inline unsigned int GetPrimitiveCount(LinearBVHNode const& node)
+{
+    return node.num_primitives_axis >> 16;
+}
+
+inline bool IsLeaf(LinearBVHNode const& node)
+{
+    return GetPrimitiveCount(node) != 0;
+}
+#endif
+
+// Binary BVH nodes with the bounds of both children quantized relative to the node bounds.
+// A child coordinate is decoded as origin + q * 2^(exponent - 127)
+STRUCT_BEGIN(QuantizedBVHNode8)
+    // 12 bytes
+    float origin_x;
+    float origin_y;
+    float origin_z;
+    // 4 bytes
+    unsigned int exponents; // biased exponents of the quantization step, 8 bits per axis
+    // 12 bytes
+    unsigned int child_bounds[3]; // 8 bit min xyz and max xyz of the first child, then the second one
+    // 8 bytes
+    unsigned int child_info[2]; // see QUANTIZED_BVH_LEAF_FLAG in bvh.h, 0 -> empty child
+STRUCT_END(QuantizedBVHNode8)
+
+STRUCT_BEGIN(QuantizedBVHNode16)
+    // 12 bytes
+    float origin_x;
+    float origin_y;
+    float origin_z;
+    // 4 bytes
+    unsigned int exponents;
+    // 24 bytes
+    unsigned int child_bounds[6]; // 16 bit min xyz and max xyz of the first child, then the second one
+    // 8 bytes
+    unsigned int child_info[2];
+STRUCT_END(QuantizedBVHNode16)
+
+// Instance of a mesh in the two-level BVH
+STRUCT_BEGIN(Instance)
+    // 48 bytes, row-major 3x4 matrix
+    float object_to_world[12];
+    // 48 bytes
+    float world_to_object[12];
+    // 8 bytes
+    unsigned int blas_root; // node index of the mesh BVH
+    unsigned int mesh_index;
+STRUCT_END(Instance)
+
+// Node of the collapsed 4-wide BVH, a node of the 8-wide BVH takes two consecutive records
+STRUCT_BEGIN(WideBVHNode)
+    // 96 bytes, child bounds in SoA form
+    float min_x[4];
+    float max_x[4];
+    float min_y[4];
+    float max_y[4];
+    float min_z[4];
+    float max_z[4];
+    // 16 bytes
+    unsigned int child_offset[4]; // primitives (leaf) or child node offset (interior)
+    // 16 bytes
+    unsigned int child_info[4]; // number of primitives << 16, 0 -> interior node, INVALID_ID -> empty lane
+STRUCT_END(WideBVHNode)
+
 STRUCT_BEGIN(Camera)
     float3 position;
     float3 front;
@@ -0,0 +1,192 @@
+/*****************************************************************************
+ MIT License
+
+ Copyright(c) 2023 Alexander Veselov
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this softwareand associated documentation files(the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions :
+
+ The above copyright noticeand this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *****************************************************************************/
+
+#ifndef TRIANGLE_H
+#define TRIANGLE_H
+
+#ifdef GLSL
+#define MAKE_FLOAT2(x, y) float2(x, y)
+#define MAKE_UINT4(x, y, z, w) uint4(x, y, z, w)
+#define PRECISE precise
+#else
+#define MAKE_FLOAT2(x, y) (float2)(x, y)
+#define MAKE_UINT4(x, y, z, w) (uint4)(x, y, z, w)
+#define PRECISE
+#endif
+
+// Ray-triangle tests on the RTTriangle records. The default Moller-Trumbore test reads the
+// first vertex and the two edges precomputed at upload time. WATERTIGHT_TRIANGLES selects the
+// watertight test of Woop, Benthin and Wald, it reads the three vertices and never lets a ray
+// slip between the triangles sharing an edge. Both tests cull the back faces
+
+// Per ray data of the watertight test: the axes permuted to make z the dominant axis of the
+// ray direction and the shear that aligns the direction with z
+STRUCT_BEGIN(TriangleTestRay)
+    uint4 axes;
+    float3 shear;
+STRUCT_END(TriangleTestRay)
+
+float3 PermuteAxes(float3 v, uint4 axes)
+{
+#ifdef GLSL
+    return float3(v[axes.x], v[axes.y], v[axes.z]);
+#else
+    return shuffle((float4)(v, 0.0f), axes).xyz;
+#endif
+}
+
+TriangleTestRay PrepareTriangleTest(float3 direction)
+{
+    float3 abs_direction = max(direction, -direction);
+    uint kz = abs_direction.x > abs_direction.y ?
+        (abs_direction.x > abs_direction.z ? 0 : 2) : (abs_direction.y > abs_direction.z ? 1 : 2);
+    uint kx = kz == 2 ? 0 : kz + 1;
+    uint ky = kx == 2 ? 0 : kx + 1;
+
+    TriangleTestRay test_ray;
+    test_ray.axes = MAKE_UINT4(kx, ky, kz, 3);
+    float3 permuted_direction = PermuteAxes(direction, test_ray.axes);
+
+    // Swap x and y for the negative direction to keep the winding of the triangles
+    if (permuted_direction.z < 0.0f)
+    {
+        test_ray.axes = MAKE_UINT4(ky, kx, kz, 3);
+        permuted_direction = PermuteAxes(direction, test_ray.axes);
+    }
+
+    float shear_z = 1.0f / permuted_direction.z;
+    test_ray.shear = permuted_direction * shear_z;
+    test_ray.shear.z = shear_z;
+
+    return test_ray;
+}
+
+#ifdef GLSL
+bool RayTriangle(Ray ray, TriangleTestRay test_ray, RTTriangle triangle, out float2 bc, out float out_t)
+#else
+bool RayTriangle(Ray ray, TriangleTestRay test_ray, RTTriangle triangle, float2* bc, float* out_t)
+#endif
+{
+#if defined(WATERTIGHT_TRIANGLES) && !defined(GLSL)
+    // The edge functions of a shared edge must be exact negations in both triangles
+#pragma OPENCL FP_CONTRACT OFF
+#endif
+    float t_min = ray.origin.w;
+    float t_max = ray.direction.w;
+
+#ifdef WATERTIGHT_TRIANGLES
+    float3 a = PermuteAxes(triangle.position1 - ray.origin.xyz, test_ray.axes);
+    float3 b = PermuteAxes(triangle.position2 - ray.origin.xyz, test_ray.axes);
+    float3 c = PermuteAxes(triangle.position3 - ray.origin.xyz, test_ray.axes);
+
+    // Shear the vertices so that the ray goes along z
+    PRECISE float ax = a.x - test_ray.shear.x * a.z;
+    PRECISE float ay = a.y - test_ray.shear.y * a.z;
+    PRECISE float bx = b.x - test_ray.shear.x * b.z;
+    PRECISE float by = b.y - test_ray.shear.y * b.z;
+    PRECISE float cx = c.x - test_ray.shear.x * c.z;
+    PRECISE float cy = c.y - test_ray.shear.y * c.z;
+
+    // Scaled barycentric coordinates, the ray is outside of the front face if any of them is negative
+    PRECISE float u = cx * by - cy * bx;
+    PRECISE float v = ax * cy - ay * cx;
+    PRECISE float w = bx * ay - by * ax;
+
+    if (u < 0.0f || v < 0.0f || w < 0.0f)
+    {
+        return false;
+    }
+
+    float det = u + v + w;
+
+    // The ray goes along the plane
+    if (det == 0.0f)
+    {
+        return false;
+    }
+
+    float scaled_t = (u * a.z + v * b.z + w * c.z) * test_ray.shear.z;
+
+    if (scaled_t < t_min * det || scaled_t > t_max * det)
+    {
+        return false;
+    }
+
+    float inv_det = 1.0f / det;
+    float2 hit_bc = MAKE_FLOAT2(v * inv_det, w * inv_det);
+    float t = scaled_t * inv_det;
+#else
+    // The record stores the edges instead of the second and the third vertex
+    float3 e1 = triangle.position2;
+    float3 e2 = triangle.position3;
+    // Calculate planes normal vector
+    float3 pvec = cross(ray.direction.xyz, e2);
+    float det = dot(e1, pvec);
+
+    // Back face or the ray is parallel to plane
+    if (det < 1e-8f)
+    {
+        return false;
+    }
+
+    float inv_det = 1.0f / det;
+    float3 tvec = ray.origin.xyz - triangle.position1;
+    float u = dot(tvec, pvec) * inv_det;
+
+    if (u < 0.0f || u > 1.0f)
+    {
+        return false;
+    }
+
+    float3 qvec = cross(tvec, e1);
+    float v = dot(ray.direction.xyz, qvec) * inv_det;
+
+    if (v < 0.0f || u + v > 1.0f)
+    {
+        return false;
+    }
+
+    float t = dot(e2, qvec) * inv_det;
+
+    if (t < t_min || t > t_max)
+    {
+        return false;
+    }
+
+    float2 hit_bc = MAKE_FLOAT2(u, v);
+#endif
+
+    // Intersection is found
+#ifdef GLSL
+    bc = hit_bc;
+    out_t = t;
+#else
+    *bc = hit_bc;
+    *out_t = t;
+#endif
+
+    return true;
+}
+
+#endif // TRIANGLE_H
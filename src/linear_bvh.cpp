@@ -0,0 +1,525 @@
+/*****************************************************************************
+ MIT License
+
+ Copyright(c) 2023 Alexander Veselov
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this softwareand associated documentation files(the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions :
+
+ The above copyright noticeand this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *****************************************************************************/
+
+#include "linear_bvh.hpp"
+#include "bvh_metrics.hpp"
+#include "kernels/common/constants.h"
+#include "utils/thread_pool.hpp"
+#include "utils/timer.hpp"
+#include <algorithm>
+#include <array>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+namespace
+{
+    constexpr std::size_t kParallelGrainSize = 16384;
+    // Ranges with fewer primitives are emitted by a single task
+    constexpr unsigned int kSubtreeSize = 16384;
+    constexpr unsigned int kRadixBits = 8;
+    constexpr unsigned int kRadixSize = 1u << kRadixBits;
+    // Parent of the root node
+    // Leaf primitive count is stored in 16 bits of LinearBVHNode
+    constexpr unsigned int kMaxLeafSize = 0xFFFFu;
+
+    // Inserts two zero bits between each of the lower 10 bits
+    std::uint32_t ExpandBits(std::uint32_t v)
+    {
+        v &= 0x3FFu;
+        v = (v * 0x00010001u) & 0xFF0000FFu;
+        v = (v * 0x00000101u) & 0x0F00F00Fu;
+        v = (v * 0x00000011u) & 0xC30C30C3u;
+        v = (v * 0x00000005u) & 0x49249249u;
+        return v;
+    }
+
+    // Inserts two zero bits between each of the lower 21 bits
+    std::uint64_t ExpandBits(std::uint64_t v)
+    {
+        v &= 0x1FFFFFull;
+        v = (v | v << 32) & 0x001F00000000FFFFull;
+        v = (v | v << 16) & 0x001F0000FF0000FFull;
+        v = (v | v << 8) & 0x100F00F00F00F00Full;
+        v = (v | v << 4) & 0x10C30C30C30C30C3ull;
+        v = (v | v << 2) & 0x1249249249249249ull;
+        return v;
+    }
+
+    // X occupies the highest bit of each triplet, so bit b of the code splits the axis 2 - b % 3
+    template <typename MortonCode>
+    struct MortonTraits
+    {
+        static constexpr unsigned int kBitsPerAxis = sizeof(MortonCode) == 4 ? 10 : 21;
+        static constexpr unsigned int kNumBits = kBitsPerAxis * 3;
+
+        static MortonCode Encode(float3 const& p)
+        {
+            return (ExpandBits(MortonCode(p.x)) << 2) | (ExpandBits(MortonCode(p.y)) << 1) | ExpandBits(MortonCode(p.z));
+        }
+    };
+
+    template <typename MortonCode>
+    struct MortonPrimitive
+    {
+        MortonCode code;
+        std::uint32_t index;
+    };
+
+    template <typename MortonCode>
+    int HighestBit(MortonCode value)
+    {
+        int bit = -1;
+        while (value)
+        {
+            value >>= 1;
+            ++bit;
+        }
+        return bit;
+    }
+
+    // Stable LSD radix sort. Each chunk counts its digits, the chunks then scatter
+    // to disjoint ranges so the result doesn't depend on the number of threads
+    template <typename MortonCode>
+    void RadixSort(ThreadPool& thread_pool, std::vector<MortonPrimitive<MortonCode>>& primitives)
+    {
+        std::size_t count = primitives.size();
+        std::size_t num_chunks = (count + kParallelGrainSize - 1) / kParallelGrainSize;
+        std::vector<MortonPrimitive<MortonCode>> sorted(count);
+        std::vector<std::array<std::size_t, kRadixSize>> offsets(num_chunks);
+
+        for (unsigned int shift = 0; shift < MortonTraits<MortonCode>::kNumBits; shift += kRadixBits)
+        {
+            thread_pool.ParallelFor(count, kParallelGrainSize, [&](std::size_t begin, std::size_t end)
+                {
+                    auto& histogram = offsets[begin / kParallelGrainSize];
+                    histogram.fill(0);
+                    for (std::size_t i = begin; i < end; ++i)
+                    {
+                        histogram[(primitives[i].code >> shift) & (kRadixSize - 1)]++;
+                    }
+                });
+
+            // Exclusive prefix sums ordered by digit, then by chunk
+            std::size_t offset = 0;
+            bool single_digit = false;
+            for (unsigned int digit = 0; digit < kRadixSize; ++digit)
+            {
+                std::size_t digit_start = offset;
+                for (auto& histogram : offsets)
+                {
+                    std::size_t digit_count = histogram[digit];
+                    histogram[digit] = offset;
+                    offset += digit_count;
+                }
+
+                single_digit = single_digit || (offset - digit_start == count);
+            }
+
+            // The pass would not change the order
+            if (single_digit)
+            {
+                continue;
+            }
+
+            thread_pool.ParallelFor(count, kParallelGrainSize, [&](std::size_t begin, std::size_t end)
+                {
+                    auto& chunk_offsets = offsets[begin / kParallelGrainSize];
+                    for (std::size_t i = begin; i < end; ++i)
+                    {
+                        sorted[chunk_offsets[(primitives[i].code >> shift) & (kRadixSize - 1)]++] = primitives[i];
+                    }
+                });
+
+            primitives.swap(sorted);
+        }
+    }
+
+    template <typename MortonCode>
+    struct EmitContext
+    {
+        std::vector<MortonPrimitive<MortonCode>> const& primitives;
+        std::vector<Bounds3> const& bounds;
+        unsigned int max_leaf_size;
+    };
+
+    // Splits the range at the highest bit that differs between its codes. Returns false
+    // if all codes are equal, the range is split in the middle then
+    template <typename MortonCode>
+    bool FindSplit(EmitContext<MortonCode> const& context, unsigned int start, unsigned int end,
+        unsigned int& mid, unsigned int& axis)
+    {
+        auto const& primitives = context.primitives;
+        MortonCode diff = primitives[start].code ^ primitives[end - 1].code;
+        if (diff == 0)
+        {
+            mid = (start + end) / 2;
+            axis = 0;
+            return false;
+        }
+
+        // All codes in the range share the bits above the split bit, so it grows monotonically
+        int bit = HighestBit(diff);
+        MortonCode mask = MortonCode(1) << bit;
+        auto split = std::partition_point(primitives.begin() + start, primitives.begin() + end,
+            [mask](MortonPrimitive<MortonCode> const& primitive) { return (primitive.code & mask) == 0; });
+
+        mid = (unsigned int)(split - primitives.begin());
+        axis = 2 - bit % 3;
+        return true;
+    }
+
+    // Appends the depth-first nodes of the range, the child offsets are relative to the first node in the array
+    template <typename MortonCode>
+    Bounds3 EmitSubtree(EmitContext<MortonCode> const& context, unsigned int start, unsigned int end,
+        std::vector<LinearBVHNode>& nodes)
+    {
+        unsigned int node_index = (unsigned int)nodes.size();
+        nodes.emplace_back();
+        // The parent links the subtree root once the subtree is placed
+        nodes[node_index].parent = INVALID_ID;
+
+        Bounds3 bounds;
+        if (end - start <= context.max_leaf_size)
+        {
+            for (unsigned int i = start; i < end; ++i)
+            {
+                bounds = Union(bounds, context.bounds[i]);
+            }
+
+            nodes[node_index].bounds = bounds;
+            nodes[node_index].offset = start;
+            nodes[node_index].num_primitives_axis = (end - start) << 16;
+            return bounds;
+        }
+
+        unsigned int mid;
+        unsigned int axis;
+        bool has_split = FindSplit(context, start, end, mid, axis);
+
+        bounds = EmitSubtree(context, start, mid, nodes);
+        nodes[node_index].first_child = node_index + 1;
+        nodes[node_index].offset = (unsigned int)nodes.size();
+        bounds = Union(bounds, EmitSubtree(context, mid, end, nodes));
+        nodes[nodes[node_index].first_child].parent = node_index;
+        nodes[nodes[node_index].offset].parent = node_index;
+
+        nodes[node_index].bounds = bounds;
+        nodes[node_index].num_primitives_axis = has_split ? axis : bounds.MaximumExtent();
+        return bounds;
+    }
+
+    // Upper levels of the hierarchy, split until the ranges are small enough for a single task
+    struct TopLevelNode
+    {
+        unsigned int start;
+        unsigned int end;
+        unsigned int axis;
+        bool has_split;
+        int children[2];
+        // Index of the subtree for the ranges emitted by a task, -1 for the interior nodes
+        int subtree;
+        // Position in the final array
+        unsigned int node_index;
+    };
+
+    struct Subtree
+    {
+        unsigned int start;
+        unsigned int end;
+        std::vector<LinearBVHNode> nodes;
+        unsigned int node_index;
+    };
+
+    template <typename MortonCode>
+    int BuildTopLevel(EmitContext<MortonCode> const& context, unsigned int start, unsigned int end,
+        std::vector<TopLevelNode>& top_nodes, std::vector<Subtree>& subtrees)
+    {
+        int index = (int)top_nodes.size();
+        top_nodes.push_back({ start, end, 0, false, { -1, -1 }, -1, 0 });
+
+        if (end - start <= kSubtreeSize)
+        {
+            top_nodes[index].subtree = (int)subtrees.size();
+            subtrees.push_back({ start, end, {}, 0 });
+            return index;
+        }
+
+        unsigned int mid;
+        unsigned int axis;
+        bool has_split = FindSplit(context, start, end, mid, axis);
+        top_nodes[index].axis = axis;
+        top_nodes[index].has_split = has_split;
+        int left = BuildTopLevel(context, start, mid, top_nodes, subtrees);
+        int right = BuildTopLevel(context, mid, end, top_nodes, subtrees);
+        top_nodes[index].children[0] = left;
+        top_nodes[index].children[1] = right;
+        return index;
+    }
+
+    // Assigns the depth-first positions of the top level nodes and the subtrees
+    void LayoutTopLevel(std::vector<TopLevelNode>& top_nodes, std::vector<Subtree>& subtrees, int index, unsigned int& offset)
+    {
+        TopLevelNode& node = top_nodes[index];
+        node.node_index = offset;
+
+        if (node.subtree >= 0)
+        {
+            Subtree& subtree = subtrees[node.subtree];
+            subtree.node_index = offset;
+            offset += (unsigned int)subtree.nodes.size();
+            return;
+        }
+
+        ++offset;
+        LayoutTopLevel(top_nodes, subtrees, node.children[0], offset);
+        LayoutTopLevel(top_nodes, subtrees, node.children[1], offset);
+    }
+}
+
+LinearBvh::LinearBvh(BvhBuildOptions const& options)
+    : options_(options)
+{
+    if (options_.morton_code_bits != 30 && options_.morton_code_bits != 63)
+    {
+        throw std::runtime_error("Morton code length must be 30 or 63 bits");
+    }
+
+    if (options_.max_leaf_size < 1 || options_.max_leaf_size > kMaxLeafSize)
+    {
+        throw std::runtime_error("BVH max leaf size must be in [1, " + std::to_string(kMaxLeafSize) + "]");
+    }
+
+    if (!(options_.rebuild_cost_ratio >= 1.0f))
+    {
+        throw std::runtime_error("BVH rebuild cost ratio must be at least 1");
+    }
+}
+
+void LinearBvh::BuildCPU(std::vector<Triangle> const& triangles)
+{
+    std::cout << "Building Linear Bounding Volume Hierarchy for scene" << std::endl;
+
+    if (options_.morton_code_bits == 30)
+    {
+        Build<std::uint32_t>(triangles);
+    }
+    else
+    {
+        Build<std::uint64_t>(triangles);
+    }
+}
+
+std::vector<DirtyRange> LinearBvh::Refit(std::vector<Triangle> const& triangles,
+    std::vector<std::uint32_t> const& triangle_indices)
+{
+    if (!refitter_)
+    {
+        refitter_ = std::make_unique<BvhRefitter>(nodes_, GetPrimitiveIndices(), triangles.size(), options_.traversal_cost);
+    }
+
+    return refitter_->Refit(nodes_, triangles, triangle_indices);
+}
+
+template <typename MortonCode>
+void LinearBvh::Build(std::vector<Triangle> const& triangles)
+{
+    build_stats_ = {};
+    nodes_.clear();
+    refitter_.reset();
+
+    if (triangles.empty())
+    {
+        throw std::runtime_error("Failed to build BVH for an empty scene");
+    }
+
+    auto start_time = Clock::now();
+
+    ThreadPool thread_pool(options_.num_threads);
+    std::size_t num_triangles = triangles.size();
+    std::size_t num_chunks = (num_triangles + kParallelGrainSize - 1) / kParallelGrainSize;
+
+    // Bounds of the centroids define the Morton grid
+    std::vector<Bounds3> chunk_bounds(num_chunks);
+    thread_pool.ParallelFor(num_triangles, kParallelGrainSize, [&](std::size_t begin, std::size_t end)
+        {
+            Bounds3 centroid_bounds;
+            for (std::size_t i = begin; i < end; ++i)
+            {
+                Bounds3 bounds = triangles[i].GetBounds();
+                centroid_bounds = Union(centroid_bounds, bounds.min * 0.5f + bounds.max * 0.5f);
+            }
+            chunk_bounds[begin / kParallelGrainSize] = centroid_bounds;
+        });
+
+    Bounds3 centroid_bounds;
+    for (auto const& bounds : chunk_bounds)
+    {
+        centroid_bounds = Union(centroid_bounds, bounds);
+    }
+
+    float grid_size = float((1u << MortonTraits<MortonCode>::kBitsPerAxis) - 1);
+    float3 extent = centroid_bounds.Diagonal();
+    float3 scale;
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        scale[axis] = extent[axis] > 0.0f ? grid_size / extent[axis] : 0.0f;
+    }
+
+    std::vector<MortonPrimitive<MortonCode>> primitives(num_triangles);
+    thread_pool.ParallelFor(num_triangles, kParallelGrainSize, [&](std::size_t begin, std::size_t end)
+        {
+            for (std::size_t i = begin; i < end; ++i)
+            {
+                Bounds3 bounds = triangles[i].GetBounds();
+                float3 centroid = bounds.min * 0.5f + bounds.max * 0.5f;
+                float3 grid_position;
+                for (int axis = 0; axis < 3; ++axis)
+                {
+                    float position = (centroid[axis] - centroid_bounds.min[axis]) * scale[axis];
+                    grid_position[axis] = std::min(std::max(position, 0.0f), grid_size);
+                }
+                primitives[i] = { MortonTraits<MortonCode>::Encode(grid_position), (std::uint32_t)i };
+            }
+        });
+
+    auto sort_start_time = Clock::now();
+
+    RadixSort(thread_pool, primitives);
+
+    auto hierarchy_start_time = Clock::now();
+
+    // The triangle slots follow the curve, the leaves reference contiguous ranges of them
+    std::vector<std::uint32_t> primitive_indices(num_triangles);
+    std::vector<Bounds3> ordered_bounds(num_triangles);
+    thread_pool.ParallelFor(num_triangles, kParallelGrainSize, [&](std::size_t begin, std::size_t end)
+        {
+            for (std::size_t i = begin; i < end; ++i)
+            {
+                primitive_indices[i] = primitives[i].index;
+                ordered_bounds[i] = triangles[primitives[i].index].GetBounds();
+            }
+        });
+
+    SetPrimitiveIndices(std::move(primitive_indices), num_triangles);
+
+    EmitContext<MortonCode> context = { primitives, ordered_bounds, options_.max_leaf_size };
+
+    // The few upper levels are split serially, the subtrees below are emitted in parallel
+    std::vector<TopLevelNode> top_nodes;
+    std::vector<Subtree> subtrees;
+    BuildTopLevel(context, 0, (unsigned int)num_triangles, top_nodes, subtrees);
+
+    thread_pool.ParallelFor(subtrees.size(), 1, [&](std::size_t begin, std::size_t end)
+        {
+            for (std::size_t i = begin; i < end; ++i)
+            {
+                EmitSubtree(context, subtrees[i].start, subtrees[i].end, subtrees[i].nodes);
+            }
+        });
+
+    unsigned int total_nodes = 0;
+    LayoutTopLevel(top_nodes, subtrees, 0, total_nodes);
+    nodes_.resize(total_nodes);
+
+    // Copy the subtrees to their final positions, the interior child offsets become absolute
+    thread_pool.ParallelFor(subtrees.size(), 1, [&](std::size_t begin, std::size_t end)
+        {
+            for (std::size_t i = begin; i < end; ++i)
+            {
+                Subtree& subtree = subtrees[i];
+                for (std::size_t j = 0; j < subtree.nodes.size(); ++j)
+                {
+                    LinearBVHNode node = subtree.nodes[j];
+                    if ((node.num_primitives_axis >> 16) == 0)
+                    {
+                        node.first_child += subtree.node_index;
+                        node.offset += subtree.node_index;
+                    }
+                    if (node.parent != INVALID_ID)
+                    {
+                        node.parent += subtree.node_index;
+                    }
+                    nodes_[subtree.node_index + j] = node;
+                }
+                std::vector<LinearBVHNode>().swap(subtree.nodes);
+            }
+        });
+
+    // The top level nodes are created in pre-order, so the children are finished when iterating backwards
+    for (auto it = top_nodes.rbegin(); it != top_nodes.rend(); ++it)
+    {
+        if (it->subtree >= 0)
+        {
+            continue;
+        }
+
+        TopLevelNode const& left = top_nodes[it->children[0]];
+        TopLevelNode const& right = top_nodes[it->children[1]];
+        LinearBVHNode& node = nodes_[it->node_index];
+        node.bounds = Union(nodes_[left.node_index].bounds, nodes_[right.node_index].bounds);
+        node.first_child = left.node_index;
+        node.offset = right.node_index;
+        node.num_primitives_axis = it->has_split ? it->axis : node.bounds.MaximumExtent();
+        node.parent = INVALID_ID;
+        nodes_[left.node_index].parent = it->node_index;
+        nodes_[right.node_index].parent = it->node_index;
+    }
+
+    AnnotateShadowChildOrder(nodes_, triangles, GetPrimitiveIndices());
+
+    auto layout_start_time = Clock::now();
+
+    if (options_.layout != BvhLayout::kDepthFirst)
+    {
+        nodes_ = ApplyBvhLayout(nodes_, options_.layout, triangles, GetPrimitiveIndices(), options_.layout_sample_rays);
+    }
+
+    auto end_time = Clock::now();
+
+    for (auto const& node : nodes_)
+    {
+        if (node.num_primitives_axis >> 16)
+        {
+            ++build_stats_.leaf_count;
+        }
+    }
+
+    build_stats_.node_count = total_nodes;
+    build_stats_.morton_time = ElapsedMilliseconds(start_time, sort_start_time);
+    build_stats_.sort_time = ElapsedMilliseconds(sort_start_time, hierarchy_start_time);
+    build_stats_.hierarchy_time = ElapsedMilliseconds(hierarchy_start_time, layout_start_time);
+    build_stats_.layout_time = ElapsedMilliseconds(layout_start_time, end_time);
+    build_stats_.total_time = ElapsedMilliseconds(start_time, end_time);
+    build_stats_.sah_cost = ComputeSahCost(nodes_, options_.traversal_cost);
+
+    std::cout << "LBVH created with " << build_stats_.node_count << " nodes (" << build_stats_.leaf_count
+        << " leaves) for " << num_triangles << " triangles using " << MortonTraits<MortonCode>::kNumBits
+        << "-bit Morton codes (" << float(nodes_.size() * sizeof(LinearBVHNode)) / (1024.0f * 1024.0f)
+        << " MB, SAH cost " << build_stats_.sah_cost << ")" << std::endl;
+    std::cout << "LBVH build time: " << build_stats_.total_time << " ms on " << thread_pool.GetThreadCount()
+        << " threads (Morton codes " << build_stats_.morton_time << " ms, sort " << build_stats_.sort_time
+        << " ms, hierarchy " << build_stats_.hierarchy_time << " ms, " << GetBvhLayoutName(options_.layout)
+        << " layout " << build_stats_.layout_time << " ms)" << std::endl;
+}
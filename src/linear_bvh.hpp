@@ -0,0 +1,68 @@
+/*****************************************************************************
+ MIT License
+
+ Copyright(c) 2023 Alexander Veselov
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this softwareand associated documentation files(the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions :
+
+ The above copyright noticeand this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *****************************************************************************/
+
+#pragma once
+
+#include "bvh.hpp"
+#include <vector>
+
+// Linear BVH builder. The primitives are sorted along a Morton curve and the hierarchy
+// is emitted from the bits of the sorted codes, which is much faster than the SAH
+// build at the cost of tree quality. Produces the same node layout as Bvh
+class LinearBvh : public AccelerationStructure
+{
+public:
+    explicit LinearBvh(BvhBuildOptions const& options = BvhBuildOptions());
+
+    void BuildCPU(std::vector<Triangle> const& triangles) override;
+    std::vector<LinearBVHNode> const& GetNodes() const override { return nodes_; }
+    std::vector<DirtyRange> Refit(std::vector<Triangle> const& triangles,
+        std::vector<std::uint32_t> const& triangle_indices) override;
+    float GetRefitCostRatio() const override { return refitter_ ? refitter_->GetSahCostRatio() : 1.0f; }
+
+    struct BuildStats
+    {
+        std::uint32_t node_count = 0;
+        std::uint32_t leaf_count = 0;
+        // Wall time of each build phase in milliseconds
+        double morton_time = 0.0;
+        double sort_time = 0.0;
+        double hierarchy_time = 0.0;
+        double layout_time = 0.0;
+        double total_time = 0.0;
+        float sah_cost = 0.0f;
+    };
+
+    BuildStats const& GetBuildStats() const { return build_stats_; }
+
+private:
+    template <typename MortonCode>
+    void Build(std::vector<Triangle> const& triangles);
+
+    BvhBuildOptions options_;
+    std::vector<LinearBVHNode> nodes_;
+    // Created by the first refit after a build
+    std::unique_ptr<BvhRefitter> refitter_;
+    BuildStats build_stats_;
+};
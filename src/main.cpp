@@ -23,6 +23,7 @@
  *****************************************************************************/
 
 #include "render.hpp"
+#include "linear_bvh.hpp"
 #include "utils/window.hpp"
 #include "CLI/CLI.hpp"
 
@@ -37,6 +38,14 @@ int main(int argc, char** argv)
         std::string scene_path = "assets/ShaderBalls.obj";
         float scene_scale = 1.0f;
         bool flip_yz = false;
+        bool instancing = false;
+        std::string bvh_builder = "sah";
+        std::string bvh_layout = "dfs";
+        std::string bvh_traversal = "auto";
+        std::string acc_structure_name;
+        bool bvh_layout_benchmark = false;
+        bool bvh_entry_hint_benchmark = false;
+        BvhBuildOptions bvh_options;
 
         // Parse the command line
         CLI::App cli_app("RayTracing");
@@ -48,21 +57,150 @@ int main(int argc, char** argv)
         cli_app.add_option("--scene", scene_path, "Scene path");
         cli_app.add_option("--scale", scene_scale, "Scene scale");
         cli_app.add_option("--flip_yz", flip_yz, "Flip Y and Z axis");
+        cli_app.add_option("--instancing", instancing, "Store translated copies of the scene objects as instances");
         cli_app.add_option("--opengl", use_opengl, "Use OpenGL");
+        cli_app.add_option("--bvh_builder", bvh_builder, "BVH builder (sah or lbvh)");
+        cli_app.add_option("--bvh_threads", bvh_options.num_threads, "BVH build thread count (0 - all hardware threads)");
+        cli_app.add_option("--bvh_buckets", bvh_options.num_buckets, "BVH SAH bucket count");
+        cli_app.add_option("--bvh_traversal_cost", bvh_options.traversal_cost, "BVH SAH node traversal cost");
+        cli_app.add_option("--bvh_max_leaf_size", bvh_options.max_leaf_size, "BVH maximum primitives in a leaf");
+        cli_app.add_option("--bvh_full_sweep", bvh_options.full_sweep_threshold, "BVH node size for full sweep SAH");
+        cli_app.add_option("--bvh_spatial_splits", bvh_options.spatial_splits, "Use BVH spatial splits (SBVH)");
+        cli_app.add_option("--bvh_max_duplication", bvh_options.max_duplication, "SBVH maximum duplicated references relative to the triangle count");
+        cli_app.add_option("--bvh_optimization_time", bvh_options.optimization_time, "Time budget of the BVH reinsertion optimization in seconds");
+        cli_app.add_option("--bvh_rebuild_ratio", bvh_options.rebuild_cost_ratio, "Rebuild a refitted BVH once its SAH cost grows by this factor");
+        cli_app.add_option("--bvh_background_build", bvh_options.background_build, "Render with a fast BVH until the SAH BVH is built in the background");
+        cli_app.add_option("--bvh_layout", bvh_layout, "BVH node memory layout (dfs, veb, treelet or hot)");
+        cli_app.add_option("--bvh_layout_samples", bvh_options.layout_sample_rays, "Number of rays measuring the node visits for the hot-first BVH layout");
+        cli_app.add_option("--bvh_layout_benchmark", bvh_layout_benchmark, "Compare the BVH layouts on the CPU and exit");
+        cli_app.add_option("--bvh_entry_hint_benchmark", bvh_entry_hint_benchmark, "Count the node visits of the camera rays with and without the entry hints on the CPU and exit");
+        cli_app.add_option("--bvh_width", bvh_options.width, "BVH width for traversal (2, 4 or 8)");
+        cli_app.add_option("--bvh_quantization", bvh_options.quantization_bits, "Quantize BVH node bounds to 8 or 16 bits (0 disables)");
+        cli_app.add_option("--bvh_traversal", bvh_traversal, "Binary BVH traversal stack (auto, private, short, stackless or treelet)");
+        cli_app.add_option("--bvh_treelet_benchmark", bvh_options.treelet_benchmark, "Time the treelet traversal against the single pass traversal");
+        cli_app.add_option("--watertight", bvh_options.watertight_triangles, "Use the watertight ray-triangle test");
+        cli_app.add_option("--bvh_compressed_leaves", bvh_options.compressed_leaves, "Store the BVH leaf triangles as shared vertex pools");
+        cli_app.add_option("--acc_structure", acc_structure_name, "Traversal preset overriding the BVH width, quantization and leaf format (bvh, bvh4, bvh8, bvh_q8, bvh_q16, bvh_compressed or grid)");
+        cli_app.add_option("--grid_top_density", bvh_options.grid_top_density, "Top level cells per triangle of the two-level grid");
+        cli_app.add_option("--grid_cell_density", bvh_options.grid_cell_density, "Leaf cells per triangle of each top level cell of the two-level grid");
+        cli_app.add_option("--lbvh_morton_bits", bvh_options.morton_code_bits, "LBVH Morton code length (30 or 63)");
 
         cli_app.parse(argc, argv);
 
+        if (bvh_builder != "sah" && bvh_builder != "lbvh")
+        {
+            throw std::runtime_error("Unknown BVH builder: " + bvh_builder);
+        }
+
+        bvh_options.layout = ParseBvhLayout(bvh_layout);
+
+        if (bvh_traversal == "auto")
+        {
+            bvh_options.traversal = BvhTraversal::kAuto;
+        }
+        else if (bvh_traversal == "private")
+        {
+            bvh_options.traversal = BvhTraversal::kPrivateStack;
+        }
+        else if (bvh_traversal == "short")
+        {
+            bvh_options.traversal = BvhTraversal::kShortStack;
+        }
+        else if (bvh_traversal == "stackless")
+        {
+            bvh_options.traversal = BvhTraversal::kStackless;
+        }
+        else if (bvh_traversal == "treelet")
+        {
+            bvh_options.traversal = BvhTraversal::kTreelet;
+        }
+        else
+        {
+            throw std::runtime_error("Unknown BVH traversal: " + bvh_traversal);
+        }
+
+        if (!acc_structure_name.empty())
+        {
+            bvh_options.width = 2;
+            bvh_options.quantization_bits = 0;
+            bvh_options.compressed_leaves = false;
+
+            if (acc_structure_name == "bvh4")
+            {
+                bvh_options.width = 4;
+            }
+            else if (acc_structure_name == "bvh8")
+            {
+                bvh_options.width = 8;
+            }
+            else if (acc_structure_name == "bvh_q8")
+            {
+                bvh_options.quantization_bits = 8;
+            }
+            else if (acc_structure_name == "bvh_q16")
+            {
+                bvh_options.quantization_bits = 16;
+            }
+            else if (acc_structure_name == "bvh_compressed")
+            {
+                bvh_options.compressed_leaves = true;
+            }
+            else if (acc_structure_name != "bvh" && acc_structure_name != "grid")
+            {
+                throw std::runtime_error("Unknown acceleration structure: " + acc_structure_name);
+            }
+        }
+
         // Load the scene
-        Scene scene(scene_path.c_str(), scene_scale, flip_yz);
+        Scene scene(scene_path.c_str(), scene_scale, flip_yz, instancing);
         // Add a directional light since obj format doesn't support lights
         scene.AddDirectionalLight({ -0.6f, -1.5f, 3.5f }, { 15.0f, 10.0f, 5.0f });
 
+        if (bvh_layout_benchmark || bvh_entry_hint_benchmark)
+        {
+            // Every layout is derived from the depth-first nodes of the same tree
+            if (bvh_layout_benchmark)
+            {
+                bvh_options.layout = BvhLayout::kDepthFirst;
+            }
+
+            std::unique_ptr<AccelerationStructure> acc_structure;
+            if (bvh_builder == "lbvh")
+            {
+                acc_structure = std::make_unique<LinearBvh>(bvh_options);
+            }
+            else
+            {
+                acc_structure = std::make_unique<Bvh>(bvh_options);
+            }
+
+            acc_structure->BuildCPU(scene.GetTriangles());
+            if (bvh_layout_benchmark)
+            {
+                BenchmarkBvhLayouts(acc_structure->GetNodes(), scene.GetTriangles(), acc_structure->GetPrimitiveIndices(),
+                    1 << 18, bvh_options.layout_sample_rays);
+            }
+
+            if (bvh_entry_hint_benchmark)
+            {
+                BenchmarkEntryHints(acc_structure->GetNodes(), scene.GetTriangles(), acc_structure->GetPrimitiveIndices(),
+                    window_width, window_height);
+            }
+
+            return 0;
+        }
+
         // Create the window
         Window window(window_width, window_height, "RayTracing");
 
         // Create the renderer
         Render::RenderBackend backend = use_opengl ? Render::RenderBackend::kOpenGL : Render::RenderBackend::kOpenCL;
-        Render render(window, backend, scene);
+        Render::BvhBuilder builder = bvh_builder == "lbvh" ? Render::BvhBuilder::kLinear : Render::BvhBuilder::kSah;
+        if (acc_structure_name == "grid")
+        {
+            builder = Render::BvhBuilder::kGrid;
+        }
+        Render render(window, backend, scene, builder, bvh_options);
 
         // Render loop
         while (!window.ShouldClose())
@@ -0,0 +1,256 @@
+/*****************************************************************************
+ MIT License
+
+ Copyright(c) 2023 Alexander Veselov
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this softwareand associated documentation files(the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions :
+
+ The above copyright noticeand this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *****************************************************************************/
+
+#include "quantized_bvh.hpp"
+#include "utils/timer.hpp"
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+namespace
+{
+    // Must match QUANTIZED_BVH_* in kernels/common/bvh.h
+    constexpr std::uint32_t kLeafFlag = 0x80000000u;
+    constexpr std::uint32_t kCountShift = 27;
+    constexpr std::uint32_t kMaxLeafPrimitives = 16;
+    constexpr std::uint32_t kMaxPrimitiveOffset = 0x07FFFFFFu;
+    constexpr int kMinExponent = -126;
+    constexpr int kMaxExponent = 127;
+
+    // Same arithmetic as DecodeChildBounds in the kernels, q * 2^e is exact so a fused
+    // multiply-add on the device gives the same result
+    float Decode(float origin, std::uint32_t q, int exponent)
+    {
+        return origin + std::ldexp((float)q, exponent);
+    }
+
+    template <typename Node, std::uint32_t Bits>
+    class BvhQuantizer
+    {
+    public:
+        explicit BvhQuantizer(std::vector<LinearBVHNode> const& nodes)
+            : nodes_(nodes)
+        {
+        }
+
+        std::vector<Node> Quantize()
+        {
+            std::vector<Node> quantized_nodes;
+
+            if (IsLeaf(nodes_[0]))
+            {
+                // The whole tree is a single leaf, reference it from the first child of the root
+                quantized_nodes.resize(1);
+                Bounds3 empty_bounds(nodes_[0].bounds.min);
+                EncodeNode(quantized_nodes[0], nodes_[0].bounds, empty_bounds);
+                quantized_nodes[0].child_info[0] = EncodeLeaf(nodes_[0]);
+                return quantized_nodes;
+            }
+
+            // Every interior node of the binary BVH becomes a quantized node, keep the order of the binary nodes
+            std::vector<std::uint32_t> node_indices(nodes_.size(), 0);
+            std::uint32_t num_interior_nodes = 0;
+            for (std::size_t i = 0; i < nodes_.size(); ++i)
+            {
+                if (!IsLeaf(nodes_[i]))
+                {
+                    node_indices[i] = num_interior_nodes++;
+                }
+            }
+
+            quantized_nodes.resize(num_interior_nodes);
+
+            for (std::size_t i = 0; i < nodes_.size(); ++i)
+            {
+                if (IsLeaf(nodes_[i]))
+                {
+                    continue;
+                }
+
+                std::size_t children[2] = { nodes_[i].first_child, nodes_[i].offset };
+                Node& node = quantized_nodes[node_indices[i]];
+                EncodeNode(node, nodes_[children[0]].bounds, nodes_[children[1]].bounds);
+
+                for (std::uint32_t child = 0; child < 2; ++child)
+                {
+                    LinearBVHNode const& child_node = nodes_[children[child]];
+                    node.child_info[child] = IsLeaf(child_node) ? EncodeLeaf(child_node) : node_indices[children[child]];
+                }
+            }
+
+            return quantized_nodes;
+        }
+
+    private:
+        static constexpr std::uint32_t kMaxValue = (1u << Bits) - 1;
+
+        static std::uint32_t EncodeLeaf(LinearBVHNode const& node)
+        {
+            std::uint32_t num_primitives = node.num_primitives_axis >> 16;
+
+            if (num_primitives > kMaxLeafPrimitives)
+            {
+                throw std::runtime_error("Quantized BVH supports at most " + std::to_string(kMaxLeafPrimitives)
+                    + " primitives per leaf, got " + std::to_string(num_primitives));
+            }
+
+            if (node.offset + num_primitives - 1 > kMaxPrimitiveOffset)
+            {
+                throw std::runtime_error("Too many primitives for the quantized BVH");
+            }
+
+            return kLeafFlag | ((num_primitives - 1) << kCountShift) | node.offset;
+        }
+
+        // Finds the quantized range of [min_value, max_value], returns false if it does not fit
+        static bool QuantizeRange(float origin, int exponent, float min_value, float max_value,
+            std::uint32_t& q_min, std::uint32_t& q_max)
+        {
+            double scale = std::ldexp(1.0, exponent);
+            double lo = std::floor(((double)min_value - origin) / scale);
+            double hi = std::ceil(((double)max_value - origin) / scale);
+
+            q_min = (std::uint32_t)std::fmax(0.0, std::fmin(lo, (double)kMaxValue));
+            q_max = (std::uint32_t)std::fmax(0.0, std::fmin(hi, (double)kMaxValue));
+
+            // The decode is rounded, step outwards until the range is conservative
+            while (q_min > 0 && Decode(origin, q_min, exponent) > min_value)
+            {
+                --q_min;
+            }
+
+            while (q_max < kMaxValue && Decode(origin, q_max, exponent) < max_value)
+            {
+                ++q_max;
+            }
+
+            return Decode(origin, q_min, exponent) <= min_value && Decode(origin, q_max, exponent) >= max_value;
+        }
+
+        static void SetCoordinate(Node& node, std::uint32_t index, std::uint32_t value)
+        {
+            constexpr std::uint32_t kValuesPerWord = 32 / Bits;
+            std::uint32_t shift = (index % kValuesPerWord) * Bits;
+            std::uint32_t& word = node.child_bounds[index / kValuesPerWord];
+            word = (word & ~(kMaxValue << shift)) | (value << shift);
+        }
+
+        static void EncodeNode(Node& node, Bounds3 const& left, Bounds3 const& right)
+        {
+            Bounds3 const* child_bounds[2] = { &left, &right };
+            Bounds3 frame = Union(left, right);
+
+            node.origin_x = frame.min.x;
+            node.origin_y = frame.min.y;
+            node.origin_z = frame.min.z;
+            node.exponents = 0;
+            for (auto& word : node.child_bounds)
+            {
+                word = 0;
+            }
+            node.child_info[0] = node.child_info[1] = 0;
+
+            for (std::uint32_t axis = 0; axis < 3; ++axis)
+            {
+                float origin = frame.min[axis];
+                float extent = frame.max[axis] - origin;
+
+                // Smallest power of two step that covers the extent
+                int exponent = kMinExponent;
+                if (extent > 0.0f)
+                {
+                    std::frexp(extent / (float)kMaxValue, &exponent);
+                    exponent = std::max(exponent, kMinExponent);
+                }
+
+                while (true)
+                {
+                    if (exponent > kMaxExponent)
+                    {
+                        throw std::runtime_error("Failed to quantize BVH node bounds");
+                    }
+
+                    std::uint32_t q[2][2];
+                    bool fits = true;
+                    for (std::uint32_t child = 0; child < 2 && fits; ++child)
+                    {
+                        fits = QuantizeRange(origin, exponent, child_bounds[child]->min[axis],
+                            child_bounds[child]->max[axis], q[child][0], q[child][1]);
+                    }
+
+                    if (fits)
+                    {
+                        for (std::uint32_t child = 0; child < 2; ++child)
+                        {
+                            SetCoordinate(node, child * 6 + axis, q[child][0]);
+                            SetCoordinate(node, child * 6 + 3 + axis, q[child][1]);
+                        }
+                        break;
+                    }
+
+                    ++exponent;
+                }
+
+                node.exponents |= (std::uint32_t)(exponent + 127) << (axis * 8);
+            }
+        }
+
+        std::vector<LinearBVHNode> const& nodes_;
+    };
+
+    template <typename Node, std::uint32_t Bits>
+    std::vector<Node> QuantizeBvh(std::vector<LinearBVHNode> const& nodes)
+    {
+        if (nodes.empty())
+        {
+            throw std::runtime_error("Failed to quantize an empty BVH");
+        }
+
+        auto start_time = Clock::now();
+
+        std::vector<Node> quantized_nodes = BvhQuantizer<Node, Bits>(nodes).Quantize();
+
+        auto end_time = Clock::now();
+        double quantize_time = ElapsedMilliseconds(start_time, end_time);
+
+        std::cout << "Quantized BVH (" << Bits << " bit) created with " << quantized_nodes.size() << " nodes ("
+            << sizeof(Node) << " bytes per node, " << float(quantized_nodes.size() * sizeof(Node)) / (1024.0f * 1024.0f)
+            << " MB vs " << float(nodes.size() * sizeof(LinearBVHNode)) / (1024.0f * 1024.0f) << " MB uncompressed) in "
+            << quantize_time << " ms" << std::endl;
+
+        return quantized_nodes;
+    }
+}
+
+std::vector<QuantizedBVHNode8> QuantizeBvh8(std::vector<LinearBVHNode> const& nodes)
+{
+    return QuantizeBvh<QuantizedBVHNode8, 8>(nodes);
+}
+
+std::vector<QuantizedBVHNode16> QuantizeBvh16(std::vector<LinearBVHNode> const& nodes)
+{
+    return QuantizeBvh<QuantizedBVHNode16, 16>(nodes);
+}
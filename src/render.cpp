@@ -28,19 +28,27 @@
 #include "mathlib/mathlib.hpp"
 #include "utils/cl_exception.hpp"
 #include "bvh.hpp"
+#include "linear_bvh.hpp"
+#include "two_level_bvh.hpp"
+#include "two_level_grid.hpp"
 #include "Utils/window.hpp"
 #include <backends/imgui_impl_opengl3.h>
 #include <backends/imgui_impl_win32.h>
+#include <algorithm>
+#include <chrono>
 #include <iostream>
 #include <fstream>
+#include <future>
 #include <sstream>
 
-Render::Render(Window& window, RenderBackend backend, Scene& scene)
+Render::Render(Window& window, RenderBackend backend, Scene& scene,
+    BvhBuilder bvh_builder, BvhBuildOptions const& bvh_options)
     : window_(window)
     , render_backend_(backend)
     , scene_(scene)
     , width_(window.GetWidth())
     , height_(window.GetHeight())
+    , bvh_rebuild_cost_ratio_(bvh_options.rebuild_cost_ratio)
 {
     if (render_backend_ == RenderBackend::kOpenCL)
     {
@@ -54,17 +62,38 @@ Render::Render(Window& window, RenderBackend backend, Scene& scene)
         cl_context_ = std::make_shared<CLContext>(all_platforms[0]);
     }
 
+    // The OpenGL integrator only traces the binary BVH
+    if (bvh_builder == BvhBuilder::kGrid && render_backend_ != RenderBackend::kOpenCL)
+    {
+        throw std::runtime_error("The grid is only supported by the OpenCL backend");
+    }
+
     framebuffer_ = std::make_unique<Framebuffer>(width_, height_);
     camera_controller_ = std::make_unique<CameraController>(window_);
 
     // Create acc structure
-    acc_structure_ = std::make_unique<Bvh>();
-    // Build it right here
-    acc_structure_->BuildCPU(scene_.GetTriangles());
+    bool background_build = bvh_options.background_build && bvh_builder == BvhBuilder::kSah;
+    if (background_build)
+    {
+        // The linear builder is the fastest one, the instanced scenes build their meshes with
+        // the cheapest SAH settings
+        BvhBuildOptions preview_options = bvh_options;
+        preview_options.num_buckets = 4;
+        preview_options.full_sweep_threshold = 0;
+        preview_options.spatial_splits = false;
+        preview_options.optimization_time = 0.0f;
+        preview_options.layout = BvhLayout::kDepthFirst;
+        acc_structure_ = CreateAccelerationStructure(BvhBuilder::kLinear, preview_options);
+    }
+    else
+    {
+        acc_structure_ = CreateAccelerationStructure(bvh_builder, bvh_options);
+    }
 
-    // TODO, NOTE: this is done after building the acc structure because it reorders triangles
-    // Need to get rid of reordering
-    scene_.Finalize();
+    // The build only reads the triangles, finalize the scene meanwhile
+    auto finalize = std::async(std::launch::async, [this]() { scene_.Finalize(); });
+    acc_structure_->BuildCPU(scene_.GetTriangles());
+    finalize.get();
 
     // Create integrator
     if (render_backend_ == RenderBackend::kOpenCL)
@@ -78,8 +107,99 @@ Render::Render(Window& window, RenderBackend backend, Scene& scene)
             framebuffer_->GetGLImage());
     }
 
+    integrator_->SetBvhWidth(bvh_options.width);
+    integrator_->SetBvhQuantization(bvh_options.quantization_bits);
+    integrator_->SetBvhTraversal(bvh_options.traversal);
+    integrator_->EnableTreeletBenchmark(bvh_options.treelet_benchmark);
+    integrator_->EnableWatertightTriangles(bvh_options.watertight_triangles);
+    integrator_->EnableCompressedLeaves(bvh_options.compressed_leaves);
+
     // Upload scene data to the GPU
     integrator_->UploadGPUData(scene_, *acc_structure_);
+
+    if (background_build)
+    {
+        // The task builds from its own copy of the triangles, the scene may move them meanwhile
+        std::unique_ptr<AccelerationStructure> acc_structure = CreateAccelerationStructure(bvh_builder, bvh_options);
+        background_build_ = std::async(std::launch::async,
+            [acc_structure = std::move(acc_structure), triangles = scene_.GetTriangles()]() mutable
+        {
+            acc_structure->BuildCPU(triangles);
+            return std::move(acc_structure);
+        });
+    }
+}
+
+std::unique_ptr<AccelerationStructure> Render::CreateAccelerationStructure(BvhBuilder bvh_builder,
+    BvhBuildOptions const& bvh_options) const
+{
+    if (!scene_.GetInstances().empty())
+    {
+        if (bvh_builder == BvhBuilder::kGrid)
+        {
+            throw std::runtime_error("The grid doesn't support instanced scenes");
+        }
+
+        return std::make_unique<TwoLevelBvh>(bvh_options, scene_.GetMeshes(), scene_.GetInstances());
+    }
+    else if (bvh_builder == BvhBuilder::kGrid)
+    {
+        return std::make_unique<TwoLevelGrid>(bvh_options);
+    }
+    else if (bvh_builder == BvhBuilder::kLinear)
+    {
+        return std::make_unique<LinearBvh>(bvh_options);
+    }
+    else
+    {
+        return std::make_unique<Bvh>(bvh_options);
+    }
+}
+
+void Render::SwapBackgroundBvh()
+{
+    // The discarded builds are released once they have finished
+    discarded_builds_.erase(std::remove_if(discarded_builds_.begin(), discarded_builds_.end(),
+        [](std::future<std::unique_ptr<AccelerationStructure>> const& build)
+        {
+            return build.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+        }), discarded_builds_.end());
+
+    if (!background_build_.valid() || background_build_.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+    {
+        return;
+    }
+
+    // Between the frames, the accumulation continues with the new tree
+    std::unique_ptr<AccelerationStructure> acc_structure = background_build_.get();
+    integrator_->SwapAccelerationStructure(scene_, *acc_structure);
+    acc_structure_ = std::move(acc_structure);
+    std::cout << "Swapped in the BVH built in the background" << std::endl;
+}
+
+void Render::UpdateTriangles(std::vector<std::uint32_t> const& triangle_indices)
+{
+    // The background build can't be used, it has read the old positions. Destroying its future
+    // would wait for the build, so it is kept until the build has finished
+    if (background_build_.valid())
+    {
+        discarded_builds_.push_back(std::move(background_build_));
+    }
+
+    auto const& triangles = scene_.GetTriangles();
+    std::vector<DirtyRange> node_ranges = acc_structure_->Refit(triangles, triangle_indices);
+
+    if (acc_structure_->GetRefitCostRatio() > bvh_rebuild_cost_ratio_)
+    {
+        // The refitted tree has become too slow to traverse
+        acc_structure_->BuildCPU(triangles);
+        integrator_->UploadRebuiltGeometry(scene_);
+        return;
+    }
+
+    // Refit keeps the triangle slots
+    integrator_->UpdateGPUData(scene_, CoalesceDirtyRanges(acc_structure_->MapToTriangleSlots(triangle_indices)),
+        node_ranges);
 }
 
 double Render::GetCurtime() const
@@ -159,6 +279,30 @@ void Render::DrawGUI()
             integrator_->EnableWhiteFurnace(gui_params_.enable_white_furnace);
         }
 
+        // Compares the distance ordered binary BVH traversal with the order by the ray direction sign
+        if (ImGui::Checkbox("BVH child order by ray sign", &gui_params_.enable_bvh_sign_order))
+        {
+            integrator_->EnableBvhSignOrder(gui_params_.enable_bvh_sign_order);
+        }
+
+        // Compares the alpha test in the traversal with the transparent surfaces passed through in the shading
+        if (ImGui::Checkbox("Alpha test in traversal", &gui_params_.enable_alpha_test))
+        {
+            integrator_->EnableAlphaTest(gui_params_.enable_alpha_test);
+        }
+
+        // Compares the camera rays started at the subtrees hit in the previous frame with the full traversal
+        if (ImGui::Checkbox("BVH entry hints", &gui_params_.enable_entry_hints))
+        {
+            integrator_->EnableEntryHints(gui_params_.enable_entry_hints);
+        }
+
+        // Compares the shadow rays testing the occluder of the previous frame first with the full traversal
+        if (ImGui::Checkbox("Shadow occluder cache", &gui_params_.enable_occluder_cache))
+        {
+            integrator_->EnableOccluderCache(gui_params_.enable_occluder_cache);
+        }
+
         static int aov_index = 0;
         const char* aov_names[] = { "Shaded Color", "Diffuse Albedo", "Depth", "Normal", "Motion Vectors" };
         if (ImGui::Combo("AOV", &aov_index, aov_names, 5))
@@ -184,6 +328,8 @@ void Render::RenderFrame()
         need_to_reset = true;
     }
 
+    SwapBackgroundBvh();
+
     camera_controller_->Update((float)GetDeltaTime());
     integrator_->SetCameraData(camera_controller_->GetData());
 
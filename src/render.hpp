@@ -26,12 +26,15 @@
 
 #include "integrator/integrator.hpp"
 #include "acceleration_structure.hpp"
+#include "bvh.hpp"
 #include "scene/scene.hpp"
 #include "utils/camera_controller.hpp"
 #include "utils/framebuffer.hpp"
 #include "gpu_wrappers/cl_context.hpp"
+#include <future>
 #include <memory>
 #include <ctime>
+#include <vector>
 
 class Window;
 class Render
@@ -43,13 +46,26 @@ public:
         kOpenGL
     };
 
-    Render(Window& window, RenderBackend backend, Scene& scene);
+    enum class BvhBuilder
+    {
+        kSah,
+        kLinear,
+        // Two-level uniform grid instead of a BVH, OpenCL only
+        kGrid
+    };
+
+    Render(Window& window, RenderBackend backend, Scene& scene,
+        BvhBuilder bvh_builder = BvhBuilder::kSah, BvhBuildOptions const& bvh_options = BvhBuildOptions());
     ~Render() = default;
 
     void    RenderFrame();
     double  GetCurtime()   const;
     double  GetDeltaTime() const;
     Window& GetWindow() const { return window_; }
+    // Call after the positions of the given scene triangles have changed. Refits the BVH and
+    // uploads the changed data, or rebuilds the tree once the refitted tree has become too slow.
+    // A running background build is discarded without waiting for it, it has read the old positions
+    void UpdateTriangles(std::vector<std::uint32_t> const& triangle_indices);
 
     std::shared_ptr<CLContext> GetCLContext() const { return cl_context_; }
 
@@ -58,6 +74,10 @@ private:
     void FrameEnd();
     void DrawGUI();
     void ReloadKernels();
+    std::unique_ptr<AccelerationStructure> CreateAccelerationStructure(BvhBuilder bvh_builder,
+        BvhBuildOptions const& bvh_options) const;
+    // Replaces the preview BVH once the background build has finished
+    void SwapBackgroundBvh();
     
 private:
     // Window
@@ -77,6 +97,11 @@ private:
     std::unique_ptr<Integrator> integrator_;
     // Acceleration structure
     std::unique_ptr<AccelerationStructure> acc_structure_;
+    float bvh_rebuild_cost_ratio_;
+    // High quality BVH built while rendering with the preview one
+    std::future<std::unique_ptr<AccelerationStructure>> background_build_;
+    // Builds discarded by UpdateTriangles that are still running
+    std::vector<std::future<std::unique_ptr<AccelerationStructure>>> discarded_builds_;
 
     std::unique_ptr<CameraController> camera_controller_;
     std::unique_ptr<Framebuffer>      framebuffer_;
@@ -89,6 +114,10 @@ private:
         bool  enable_denoiser = false;
         bool  enable_white_furnace = false;
         bool  enable_blue_noise = false;
+        bool  enable_bvh_sign_order = false;
+        bool  enable_alpha_test = true;
+        bool  enable_entry_hints = false;
+        bool  enable_occluder_cache = false;
     } gui_params_;
 
 };
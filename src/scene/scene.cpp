@@ -22,17 +22,15 @@
  SOFTWARE.
  *****************************************************************************/
 
-#include <GL/glew.h>
 
 #define TINYOBJLOADER_IMPLEMENTATION
 #include "tiny_obj_loader.h"
 
 #include "scene.hpp"
 #include "mathlib/mathlib.hpp"
-#include "render.hpp"
-#include "utils/cl_exception.hpp"
 
 #include <algorithm>
+#include <cstdint>
 #include <iostream>
 #include <fstream>
 #include <string>
@@ -40,12 +38,13 @@
 #include <ctime>
 #include <cctype>
 #include <filesystem>
+#include <unordered_map>
 
 #undef max
 
-Scene::Scene(const char* filename, float scale, bool flip_yz)
+Scene::Scene(const char* filename, float scale, bool flip_yz, bool instancing)
 {
-    Load(filename, scale, flip_yz);
+    Load(filename, scale, flip_yz, instancing);
 }
 
 namespace
@@ -122,9 +121,146 @@ unsigned int PackIorEmissionIdxTransparency(float ior, std::uint32_t emission_id
     return ((unsigned int)(ior * 25.5f)) | (emission_idx << 8)
         | ((unsigned int)(transparency * 255.0f) << 16) | (transparency_idx << 24);
 }
+
+bool NearlyEqual(float3 const& a, float3 const& b, float tolerance)
+{
+    return std::abs(a.x - b.x) <= tolerance && std::abs(a.y - b.y) <= tolerance && std::abs(a.z - b.z) <= tolerance;
+}
+
+bool NearlyEqual(Vertex const& a, Vertex const& b, float3 const& translation, float tolerance)
+{
+    const float kAttributeTolerance = 1e-3f;
+    return NearlyEqual(a.position + translation, b.position, tolerance)
+        && NearlyEqual(a.normal, b.normal, kAttributeTolerance)
+        && NearlyEqual(a.texcoord, b.texcoord, kAttributeTolerance);
+}
+
+// Finds the shapes that are translated copies of the previously added ones. OBJ files
+// have no instancing, so the repeated objects are stored as copies
+class InstanceDetector
+{
+public:
+    void AddShape(std::vector<Triangle>&& triangles)
+    {
+        if (triangles.empty())
+        {
+            return;
+        }
+
+        Bounds3 bounds;
+        for (auto const& triangle : triangles)
+        {
+            bounds = Union(bounds, triangle.GetBounds());
+        }
+
+        float3 extent = bounds.max - bounds.min;
+        float tolerance = 1e-5f * std::max(std::max(extent.x, extent.y), std::max(extent.z, 1.0f));
+        std::uint64_t key = ((std::uint64_t)triangles.size() << 32) | triangles[0].mtlIndex;
+
+        auto& candidates = candidates_[key];
+        for (std::size_t mesh_idx : candidates)
+        {
+            UniqueMesh& mesh = meshes_[mesh_idx];
+            float3 translation = bounds.min - mesh.bounds.min;
+
+            if (NearlyEqual(mesh.bounds.max + translation, bounds.max, tolerance)
+                && IsTranslatedCopy(mesh.triangles, triangles, translation, tolerance))
+            {
+                mesh.translations.push_back(translation);
+                return;
+            }
+        }
+
+        candidates.push_back(meshes_.size());
+        meshes_.push_back({ std::move(triangles), bounds, { float3(0.0f, 0.0f, 0.0f) } });
+    }
+
+    // The shapes used once are merged into the first mesh
+    void Finalize(std::vector<Triangle>& triangles, std::vector<Mesh>& meshes, std::vector<Instance>& instances)
+    {
+        std::size_t num_shapes = 0;
+        Mesh static_mesh = { (std::uint32_t)triangles.size(), 0 };
+        for (auto const& mesh : meshes_)
+        {
+            num_shapes += mesh.translations.size();
+            if (mesh.translations.size() == 1)
+            {
+                triangles.insert(triangles.end(), mesh.triangles.begin(), mesh.triangles.end());
+                static_mesh.triangle_count += (std::uint32_t)mesh.triangles.size();
+            }
+        }
+
+        if (static_mesh.triangle_count > 0)
+        {
+            AddInstance(instances, (std::uint32_t)meshes.size(), float3(0.0f, 0.0f, 0.0f));
+            meshes.push_back(static_mesh);
+        }
+
+        for (auto const& mesh : meshes_)
+        {
+            if (mesh.translations.size() > 1)
+            {
+                for (auto const& translation : mesh.translations)
+                {
+                    AddInstance(instances, (std::uint32_t)meshes.size(), translation);
+                }
+
+                meshes.push_back({ (std::uint32_t)triangles.size(), (std::uint32_t)mesh.triangles.size() });
+                triangles.insert(triangles.end(), mesh.triangles.begin(), mesh.triangles.end());
+            }
+        }
+
+        std::cout << "Instancing: " << num_shapes << " shapes stored as " << meshes.size() << " meshes with "
+            << instances.size() << " instances" << std::endl;
+    }
+
+private:
+    struct UniqueMesh
+    {
+        std::vector<Triangle> triangles;
+        Bounds3 bounds;
+        std::vector<float3> translations;
+    };
+
+    static bool IsTranslatedCopy(std::vector<Triangle> const& mesh, std::vector<Triangle> const& shape,
+        float3 const& translation, float tolerance)
+    {
+        for (std::size_t i = 0; i < mesh.size(); ++i)
+        {
+            if (mesh[i].mtlIndex != shape[i].mtlIndex
+                || !NearlyEqual(mesh[i].v1, shape[i].v1, translation, tolerance)
+                || !NearlyEqual(mesh[i].v2, shape[i].v2, translation, tolerance)
+                || !NearlyEqual(mesh[i].v3, shape[i].v3, translation, tolerance))
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    static void AddInstance(std::vector<Instance>& instances, std::uint32_t mesh_index, float3 const& translation)
+    {
+        Instance instance = {};
+        for (int row = 0; row < 3; ++row)
+        {
+            instance.object_to_world[row * 4 + row] = 1.0f;
+            instance.object_to_world[row * 4 + 3] = translation[row];
+            instance.world_to_object[row * 4 + row] = 1.0f;
+            instance.world_to_object[row * 4 + 3] = -translation[row];
+        }
+
+        instance.mesh_index = mesh_index;
+        instances.push_back(instance);
+    }
+
+    std::vector<UniqueMesh> meshes_;
+    // Meshes with the same triangle count and the first material
+    std::unordered_map<std::uint64_t, std::vector<std::size_t>> candidates_;
+};
 }
 
-void Scene::Load(const char* filename, float scale, bool flip_yz)
+void Scene::Load(const char* filename, float scale, bool flip_yz, bool instancing)
 {
     std::cout << "Loading object file " << filename << std::endl;
 
@@ -194,8 +330,11 @@ void Scene::Load(const char* filename, float scale, bool flip_yz)
         }
     };
 
+    InstanceDetector instance_detector;
+
     for (auto const& shape : shapes)
     {
+        std::vector<Triangle> shape_triangles;
         auto const& indices = shape.mesh.indices;
         // The mesh is triangular
         assert(indices.size() % 3 == 0);
@@ -259,14 +398,28 @@ void Scene::Load(const char* filename, float scale, bool flip_yz)
 
             if (shape.mesh.material_ids[face] >= 0 && shape.mesh.material_ids[face] < materials_.size())
             {
-                triangles_.emplace_back(v1, v2, v3, shape.mesh.material_ids[face]);
+                shape_triangles.emplace_back(v1, v2, v3, shape.mesh.material_ids[face]);
             }
             else
             {
                 // Use the default material
-                triangles_.emplace_back(v1, v2, v3, 0);
+                shape_triangles.emplace_back(v1, v2, v3, 0);
             }
         }
+
+        if (instancing)
+        {
+            instance_detector.AddShape(std::move(shape_triangles));
+        }
+        else
+        {
+            triangles_.insert(triangles_.end(), shape_triangles.begin(), shape_triangles.end());
+        }
+    }
+
+    if (instancing)
+    {
+        instance_detector.Finalize(triangles_, meshes_, instances_);
     }
 
     std::cout << "Load successful (" << triangles_.size() << " triangles)" << std::endl;
@@ -323,6 +476,8 @@ std::size_t Scene::LoadTexture(char const* filename)
 
 void Scene::CollectEmissiveTriangles()
 {
+    emissive_indices_.clear();
+
     for (auto triangle_idx = 0; triangle_idx < triangles_.size(); ++triangle_idx)
     {
         auto const& triangle = triangles_[triangle_idx];
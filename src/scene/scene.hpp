@@ -30,14 +30,25 @@
 #include <vector>
 #include <unordered_map>
 
+// Range of the scene triangles instanced by the two-level BVH
+struct Mesh
+{
+    std::uint32_t first_triangle;
+    std::uint32_t triangle_count;
+};
+
 class CLContext;
 class Scene
 {
 public:
-    Scene(const char* filename, float scale, bool flip_yz);
+    // With instancing, the shapes that are translated copies of another shape become its instances
+    Scene(const char* filename, float scale, bool flip_yz, bool instancing = false);
 
     std::vector<Triangle>& GetTriangles() { return triangles_; }
     std::vector<Triangle> const& GetTriangles() const { return triangles_; }
+    // Empty unless the scene is loaded with instancing
+    std::vector<Mesh> const& GetMeshes() const { return meshes_; }
+    std::vector<Instance> const& GetInstances() const { return instances_; }
     std::vector<std::uint32_t> const& GetEmissiveIndices() const { return emissive_indices_; }
     std::vector<PackedMaterial> const& GetMaterials() const { return materials_; }
     std::vector<Texture> const& GetTextures() const { return textures_; }
@@ -50,12 +61,14 @@ public:
     void AddDirectionalLight(float3 direction, float3 radiance);
 
 private:
-    void Load(char const* filename, float scale, bool flip_yz);
+    void Load(char const* filename, float scale, bool flip_yz, bool instancing);
     // Returns texture index in textures_
     std::size_t LoadTexture(char const* filename);
     void CollectEmissiveTriangles();
 
     std::vector<Triangle> triangles_;
+    std::vector<Mesh> meshes_;
+    std::vector<Instance> instances_;
     std::vector<std::uint32_t> emissive_indices_;
     std::vector<PackedMaterial> materials_;
     std::vector<Light> lights_;
@@ -0,0 +1,245 @@
+/*****************************************************************************
+ MIT License
+
+ Copyright(c) 2023 Alexander Veselov
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this softwareand associated documentation files(the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions :
+
+ The above copyright noticeand this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *****************************************************************************/
+
+#include "bvh.hpp"
+#include "bvh_metrics.hpp"
+#include "compressed_leaves.hpp"
+#include "linear_bvh.hpp"
+#include "quantized_bvh.hpp"
+#include "wide_bvh.hpp"
+#include "kernels/common/constants.h"
+#include "scene/scene.hpp"
+#include "utils/timer.hpp"
+#include "CLI/CLI.hpp"
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <memory>
+
+// Builds the acceleration structure of a scene on the CPU and writes a JSON report of the
+// tree quality, so the builders and their settings can be compared without a GPU
+namespace
+{
+    // Windows paths contain backslashes
+    std::string EscapeJson(std::string const& str)
+    {
+        std::string result;
+        for (char c : str)
+        {
+            if (c == '\\' || c == '"')
+            {
+                result += '\\';
+                result += c;
+            }
+            else if (static_cast<unsigned char>(c) < 0x20)
+            {
+                // Control characters are not allowed in JSON strings
+                char escaped[7];
+                std::snprintf(escaped, sizeof(escaped), "\\u%04x", static_cast<unsigned int>(c));
+                result += escaped;
+            }
+            else
+            {
+                result += c;
+            }
+        }
+
+        return result;
+    }
+
+    void WriteHistogram(std::ostream& out, std::vector<std::uint32_t> const& histogram)
+    {
+        out << "[";
+        for (std::size_t i = 0; i < histogram.size(); ++i)
+        {
+            out << (i > 0 ? ", " : "") << histogram[i];
+        }
+        out << "]";
+    }
+
+    // Leaves referencing more than 256 unique vertices can't be compressed
+    void WriteCompressedLeavesSize(std::ostream& out, std::vector<LinearBVHNode> const& nodes,
+        std::vector<Triangle> const& triangles)
+    {
+        try
+        {
+            CompressedLeaves leaves = CompressLeaves(nodes, triangles, false);
+            out << leaves.data.size() * sizeof(std::uint32_t);
+        }
+        catch (std::exception const&)
+        {
+            out << "null";
+        }
+    }
+
+    // Quantization is not possible for the leaves of more than 16 primitives
+    template <typename QuantizeFunc>
+    void WriteQuantizedSize(std::ostream& out, QuantizeFunc quantize, std::vector<LinearBVHNode> const& nodes)
+    {
+        try
+        {
+            auto quantized_nodes = quantize(nodes);
+            out << quantized_nodes.size() * sizeof(quantized_nodes[0]);
+        }
+        catch (std::exception const&)
+        {
+            out << "null";
+        }
+    }
+}
+
+int main(int argc, char** argv)
+{
+    try
+    {
+        std::string scene_path = "assets/ShaderBalls.obj";
+        std::string output_path = "bvh_report.json";
+        float scene_scale = 1.0f;
+        bool flip_yz = false;
+        std::string bvh_builder = "sah";
+        std::string bvh_layout = "dfs";
+        bool skip_epo = false;
+        BvhBuildOptions bvh_options;
+        bvh_options.print_stats = false;
+
+        CLI::App cli_app("BvhAnalyzer");
+
+        cli_app.set_help_flag("--help", "Print this help");
+        cli_app.add_option("--scene", scene_path, "Scene path");
+        cli_app.add_option("--scale", scene_scale, "Scene scale");
+        cli_app.add_option("--flip_yz", flip_yz, "Flip Y and Z axis");
+        cli_app.add_option("--output", output_path, "Path of the JSON report");
+        cli_app.add_option("--skip_epo", skip_epo, "Don't compute the end-point overlap, which is slow for large scenes");
+        cli_app.add_option("--bvh_builder", bvh_builder, "BVH builder (sah or lbvh)");
+        cli_app.add_option("--bvh_threads", bvh_options.num_threads, "BVH build thread count (0 - all hardware threads)");
+        cli_app.add_option("--bvh_buckets", bvh_options.num_buckets, "BVH SAH bucket count");
+        cli_app.add_option("--bvh_traversal_cost", bvh_options.traversal_cost, "BVH SAH node traversal cost");
+        cli_app.add_option("--bvh_max_leaf_size", bvh_options.max_leaf_size, "BVH maximum primitives in a leaf");
+        cli_app.add_option("--bvh_full_sweep", bvh_options.full_sweep_threshold, "BVH node size for full sweep SAH");
+        cli_app.add_option("--bvh_spatial_splits", bvh_options.spatial_splits, "Use BVH spatial splits (SBVH)");
+        cli_app.add_option("--bvh_max_duplication", bvh_options.max_duplication, "SBVH maximum duplicated references relative to the triangle count");
+        cli_app.add_option("--bvh_optimization_time", bvh_options.optimization_time, "Time budget of the BVH reinsertion optimization in seconds");
+        cli_app.add_option("--bvh_layout", bvh_layout, "BVH node memory layout (dfs, veb, treelet or hot)");
+        cli_app.add_option("--bvh_layout_samples", bvh_options.layout_sample_rays, "Number of rays measuring the node visits for the hot-first BVH layout");
+        cli_app.add_option("--lbvh_morton_bits", bvh_options.morton_code_bits, "LBVH Morton code length (30 or 63)");
+
+        cli_app.parse(argc, argv);
+
+        bvh_options.layout = ParseBvhLayout(bvh_layout);
+
+        std::unique_ptr<AccelerationStructure> acc_structure;
+        if (bvh_builder == "lbvh")
+        {
+            acc_structure = std::make_unique<LinearBvh>(bvh_options);
+        }
+        else if (bvh_builder == "sah")
+        {
+            acc_structure = std::make_unique<Bvh>(bvh_options);
+        }
+        else
+        {
+            throw std::runtime_error("Unknown BVH builder: " + bvh_builder);
+        }
+
+        Scene scene(scene_path.c_str(), scene_scale, flip_yz);
+        auto const& triangles = scene.GetTriangles();
+
+        auto start_time = Clock::now();
+        acc_structure->BuildCPU(triangles);
+        double build_time = ElapsedMilliseconds(start_time, Clock::now());
+
+        auto const& nodes = acc_structure->GetNodes();
+        auto const& primitive_indices = acc_structure->GetPrimitiveIndices();
+
+        std::cout << "Analyzing the BVH" << std::endl;
+        BvhTopologyStats topology = ComputeTopologyStats(nodes);
+        float sah_cost = ComputeSahCost(nodes, bvh_options.traversal_cost);
+
+        std::ofstream out(output_path);
+        if (!out)
+        {
+            throw std::runtime_error("Failed to open " + output_path);
+        }
+
+        out << "{\n";
+        out << "  \"scene\": \"" << EscapeJson(scene_path) << "\",\n";
+        out << "  \"builder\": \"" << EscapeJson(bvh_builder) << "\",\n";
+        out << "  \"layout\": \"" << EscapeJson(bvh_layout) << "\",\n";
+        out << "  \"spatial_splits\": " << (bvh_options.spatial_splits ? "true" : "false") << ",\n";
+        out << "  \"traversal_cost\": " << bvh_options.traversal_cost << ",\n";
+        out << "  \"max_leaf_size\": " << bvh_options.max_leaf_size << ",\n";
+        out << "  \"build_time_ms\": " << build_time << ",\n";
+        out << "  \"triangle_count\": " << triangles.size() << ",\n";
+        out << "  \"triangle_references\": " << primitive_indices.size() << ",\n";
+        out << "  \"node_count\": " << topology.node_count << ",\n";
+        out << "  \"leaf_count\": " << topology.leaf_count << ",\n";
+        out << "  \"sah_cost\": " << sah_cost << ",\n";
+        if (skip_epo)
+        {
+            out << "  \"epo\": null,\n";
+        }
+        else
+        {
+            out << "  \"epo\": " << ComputeEpo(nodes, triangles, primitive_indices,
+                bvh_options.traversal_cost, bvh_options.num_threads) << ",\n";
+        }
+        out << "  \"max_depth\": " << topology.max_depth << ",\n";
+        out << "  \"average_leaf_depth\": " << topology.average_leaf_depth << ",\n";
+        out << "  \"max_stack_depth\": " << topology.max_stack_depth << ",\n";
+        out << "  \"stack_size\": " << MAX_BVH_STACK_SIZE << ",\n";
+        out << "  \"stack_overflow\": " << (topology.max_stack_depth > MAX_BVH_STACK_SIZE ? "true" : "false") << ",\n";
+        out << "  \"leaf_size_histogram\": ";
+        WriteHistogram(out, topology.leaf_size_histogram);
+        out << ",\n";
+        out << "  \"leaf_depth_histogram\": ";
+        WriteHistogram(out, topology.leaf_depth_histogram);
+        out << ",\n";
+        out << "  \"memory\": {\n";
+        out << "    \"triangles\": " << primitive_indices.size() * sizeof(Triangle) << ",\n";
+        out << "    \"rt_triangles\": " << primitive_indices.size() * sizeof(RTTriangle) << ",\n";
+        out << "    \"compressed_leaves\": ";
+        WriteCompressedLeavesSize(out, nodes, acc_structure->GatherTriangles(triangles));
+        out << ",\n";
+        out << "    \"binary_nodes\": " << nodes.size() * sizeof(LinearBVHNode) << ",\n";
+        out << "    \"wide4_nodes\": " << CollapseBvh(nodes, 4).size() * sizeof(WideBVHNode) << ",\n";
+        out << "    \"wide8_nodes\": " << CollapseBvh(nodes, 8).size() * sizeof(WideBVHNode) << ",\n";
+        out << "    \"quantized8_nodes\": ";
+        WriteQuantizedSize(out, QuantizeBvh8, nodes);
+        out << ",\n";
+        out << "    \"quantized16_nodes\": ";
+        WriteQuantizedSize(out, QuantizeBvh16, nodes);
+        out << "\n";
+        out << "  }\n";
+        out << "}\n";
+
+        std::cout << "BVH report written to " << output_path << std::endl;
+    }
+    catch (std::exception& ex)
+    {
+        std::cerr << "Caught exception: " << ex.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,233 @@
+/*****************************************************************************
+ MIT License
+
+ Copyright(c) 2023 Alexander Veselov
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this softwareand associated documentation files(the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions :
+
+ The above copyright noticeand this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *****************************************************************************/
+
+#include "two_level_bvh.hpp"
+#include "bvh_metrics.hpp"
+#include "kernels/common/constants.h"
+#include "utils/timer.hpp"
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+namespace
+{
+    // Smaller meshes are built on a single thread, starting the thread pool costs more
+    constexpr std::uint32_t kParallelMeshBuildThreshold = 4096u;
+
+    Bounds3 TransformBounds(Bounds3 const& bounds, float const* m)
+    {
+        Bounds3 result;
+        for (int corner = 0; corner < 8; ++corner)
+        {
+            float3 p((corner & 1) ? bounds.max.x : bounds.min.x,
+                (corner & 2) ? bounds.max.y : bounds.min.y,
+                (corner & 4) ? bounds.max.z : bounds.min.z);
+
+            result = Union(result, float3(m[0] * p.x + m[1] * p.y + m[2] * p.z + m[3],
+                m[4] * p.x + m[5] * p.y + m[6] * p.z + m[7],
+                m[8] * p.x + m[9] * p.y + m[10] * p.z + m[11]));
+        }
+
+        return result;
+    }
+
+    // Deepest stack of TraceTwoLevelBvh, which keeps the top level nodes, the instances of a top
+    // level leaf and the mesh nodes in one stack. A top level leaf at depth d is reached with
+    // d far children on the stack, pushes all of its instances and enters the first of them
+    std::uint32_t ComputeTraversalStackSize(std::vector<LinearBVHNode> const& nodes,
+        std::vector<Instance> const& instances, std::vector<std::uint32_t> const& mesh_stack_sizes)
+    {
+        std::uint32_t stack_size = 0;
+        std::vector<std::pair<std::uint32_t, std::uint32_t>> stack = { { 0u, 0u } };
+        while (!stack.empty())
+        {
+            auto [node_idx, depth] = stack.back();
+            stack.pop_back();
+
+            LinearBVHNode const& node = nodes[node_idx];
+            if (!IsLeaf(node))
+            {
+                stack.emplace_back(node.first_child, depth + 1);
+                stack.emplace_back(node.offset, depth + 1);
+                continue;
+            }
+
+            std::uint32_t num_instances = GetPrimitiveCount(node);
+            stack_size = std::max(stack_size, depth + num_instances);
+            for (std::uint32_t i = 0; i < num_instances; ++i)
+            {
+                std::uint32_t mesh_stack_size = mesh_stack_sizes[instances[node.offset + i].mesh_index];
+                stack_size = std::max(stack_size, depth + num_instances - 1 + mesh_stack_size);
+            }
+        }
+
+        return stack_size;
+    }
+}
+
+TwoLevelBvh::TwoLevelBvh(BvhBuildOptions const& options, std::vector<Mesh> const& meshes,
+    std::vector<Instance> const& instances)
+    : options_(options)
+    , meshes_(meshes)
+    , instances_(instances)
+{
+    if (options_.width != 2 || options_.quantization_bits != 0)
+    {
+        throw std::runtime_error("Two-level BVH supports only the uncompressed binary nodes");
+    }
+
+    if (instances_.empty())
+    {
+        throw std::runtime_error("Two-level BVH requires at least one instance");
+    }
+
+    for (auto const& instance : instances_)
+    {
+        if (instance.mesh_index >= meshes_.size())
+        {
+            throw std::runtime_error("Instance references an invalid mesh");
+        }
+    }
+}
+
+void TwoLevelBvh::BuildCPU(std::vector<Triangle> const& triangles)
+{
+    if (options_.print_stats)
+    {
+        std::cout << "Building two-level Bounding Volume Hierarchy for " << meshes_.size() << " meshes and "
+            << instances_.size() << " instances" << std::endl;
+    }
+
+    auto start_time = Clock::now();
+
+    // Bottom level, the node offsets are relative to the start of the mesh trees for now
+    std::vector<LinearBVHNode> mesh_nodes;
+    std::vector<std::uint32_t> primitive_indices;
+    primitive_indices.reserve(triangles.size());
+    std::vector<std::uint32_t> mesh_roots(meshes_.size());
+    std::vector<std::uint32_t> mesh_triangle_counts(meshes_.size());
+    std::vector<Bounds3> mesh_bounds(meshes_.size());
+    std::vector<std::uint32_t> mesh_stack_sizes(meshes_.size());
+
+    for (std::size_t mesh_idx = 0; mesh_idx < meshes_.size(); ++mesh_idx)
+    {
+        Mesh const& mesh = meshes_[mesh_idx];
+        if (mesh.triangle_count == 0 || mesh.first_triangle + mesh.triangle_count > triangles.size())
+        {
+            throw std::runtime_error("Mesh references an invalid triangle range");
+        }
+
+        std::vector<Triangle> mesh_triangles(triangles.begin() + mesh.first_triangle,
+            triangles.begin() + mesh.first_triangle + mesh.triangle_count);
+
+        // The optimization time budget is distributed by the triangle count
+        BvhBuildOptions mesh_options = options_;
+        mesh_options.print_stats = false;
+        mesh_options.num_threads = mesh.triangle_count < kParallelMeshBuildThreshold ? 1 : options_.num_threads;
+        mesh_options.optimization_time = options_.optimization_time * mesh.triangle_count / triangles.size();
+
+        Bvh mesh_bvh(mesh_options);
+        mesh_bvh.BuildCPU(mesh_triangles);
+
+        std::uint32_t triangle_base = (std::uint32_t)primitive_indices.size();
+        std::uint32_t node_base = (std::uint32_t)mesh_nodes.size();
+        for (auto node : mesh_bvh.GetNodes())
+        {
+            node.offset += IsLeaf(node) ? triangle_base : node_base;
+            node.first_child += IsLeaf(node) ? 0 : node_base;
+            // The mesh roots keep INVALID_ID, they are not linked to the instance leaves
+            node.parent += node.parent != INVALID_ID ? node_base : 0;
+            mesh_nodes.push_back(node);
+        }
+
+        mesh_roots[mesh_idx] = node_base;
+        mesh_triangle_counts[mesh_idx] = (std::uint32_t)mesh_triangles.size();
+        mesh_bounds[mesh_idx] = mesh_bvh.GetNodes()[0].bounds;
+        mesh_stack_sizes[mesh_idx] = ComputeTopologyStats(mesh_bvh.GetNodes()).max_stack_depth;
+        for (auto local_index : mesh_bvh.GetPrimitiveIndices())
+        {
+            primitive_indices.push_back(mesh.first_triangle + local_index);
+        }
+    }
+
+    // Top level over the instances, the leaves reference the reordered instances
+    std::vector<Bounds3> instance_bounds(instances_.size());
+    std::size_t instanced_triangle_count = 0;
+    for (std::size_t i = 0; i < instances_.size(); ++i)
+    {
+        instance_bounds[i] = TransformBounds(mesh_bounds[instances_[i].mesh_index], instances_[i].object_to_world);
+        instanced_triangle_count += mesh_triangle_counts[instances_[i].mesh_index];
+    }
+
+    BvhBuildOptions instance_options = options_;
+    instance_options.print_stats = false;
+    instance_options.spatial_splits = false;
+    instance_options.optimization_time = 0.0f;
+
+    Bvh instance_bvh(instance_options);
+    std::vector<unsigned int> instance_order;
+    instance_bvh.Build(instance_bounds, instance_order);
+
+    std::uint32_t instance_node_count = (std::uint32_t)instance_bvh.GetNodes().size();
+    nodes_ = instance_bvh.GetNodes();
+    nodes_.reserve(nodes_.size() + mesh_nodes.size());
+    for (auto node : mesh_nodes)
+    {
+        node.offset += IsLeaf(node) ? 0 : instance_node_count;
+        node.first_child += IsLeaf(node) ? 0 : instance_node_count;
+        node.parent += node.parent != INVALID_ID ? instance_node_count : 0;
+        nodes_.push_back(node);
+    }
+
+    std::vector<Instance> ordered_instances(instance_order.size());
+    for (std::size_t i = 0; i < instance_order.size(); ++i)
+    {
+        ordered_instances[i] = instances_[instance_order[i]];
+        ordered_instances[i].blas_root = mesh_roots[ordered_instances[i].mesh_index] + instance_node_count;
+    }
+
+    // The stack of the trace kernel is not bounds checked
+    std::uint32_t stack_size = ComputeTraversalStackSize(nodes_, ordered_instances, mesh_stack_sizes);
+    if (stack_size > MAX_BVH_STACK_SIZE)
+    {
+        throw std::runtime_error("Two-level BVH traversal needs a stack of " + std::to_string(stack_size)
+            + " entries, the trace kernel has " + std::to_string(MAX_BVH_STACK_SIZE));
+    }
+
+    instances_.swap(ordered_instances);
+    SetPrimitiveIndices(std::move(primitive_indices), triangles.size());
+
+    double build_time = ElapsedMilliseconds(start_time, Clock::now());
+
+    if (options_.print_stats)
+    {
+        std::cout << "Two-level BVH created with " << mesh_nodes.size() << " mesh nodes for " << GetPrimitiveIndices().size()
+            << " triangles and " << instance_node_count << " instance nodes for " << instances_.size() << " instances ("
+            << instanced_triangle_count << " instanced triangles, "
+            << float(nodes_.size() * sizeof(LinearBVHNode) + instances_.size() * sizeof(Instance)) / (1024.0f * 1024.0f)
+            << " MB, SAH cost of the instance tree " << instance_bvh.GetBuildStats().sah_cost << ") in "
+            << build_time << " ms" << std::endl;
+    }
+}
@@ -0,0 +1,50 @@
+/*****************************************************************************
+ MIT License
+
+ Copyright(c) 2023 Alexander Veselov
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this softwareand associated documentation files(the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions :
+
+ The above copyright noticeand this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *****************************************************************************/
+
+#pragma once
+
+#include "bvh.hpp"
+#include "scene/scene.hpp"
+
+// Two-level acceleration structure: a BVH per unique mesh (bottom level) and a BVH over the
+// transformed mesh bounds of the instances (top level). The node buffer starts with the top
+// level tree, its leaves reference the instances, which point to the roots of the mesh trees.
+// Both levels use the SAH builder
+class TwoLevelBvh : public AccelerationStructure
+{
+public:
+    TwoLevelBvh(BvhBuildOptions const& options, std::vector<Mesh> const& meshes,
+        std::vector<Instance> const& instances);
+
+    // The triangle slots of each mesh are contiguous, the meshes keep their order
+    void BuildCPU(std::vector<Triangle> const& triangles) override;
+    std::vector<LinearBVHNode> const& GetNodes() const override { return nodes_; }
+    std::vector<Instance> const& GetInstances() const override { return instances_; }
+
+private:
+    BvhBuildOptions options_;
+    std::vector<Mesh> meshes_;
+    std::vector<Instance> instances_;
+    std::vector<LinearBVHNode> nodes_;
+};
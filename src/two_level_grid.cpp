@@ -0,0 +1,418 @@
+/*****************************************************************************
+ MIT License
+
+ Copyright(c) 2023 Alexander Veselov
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this softwareand associated documentation files(the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions :
+
+ The above copyright noticeand this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *****************************************************************************/
+
+#include "two_level_grid.hpp"
+#include "utils/thread_pool.hpp"
+#include "utils/timer.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <iostream>
+#include <numeric>
+#include <stdexcept>
+
+namespace
+{
+    constexpr std::size_t kParallelGrainSize = 16384;
+    // Top cells whose subgrids are filled by a single task
+    constexpr std::size_t kTopCellGrainSize = 64;
+    constexpr std::uint32_t kMaxTopResolution = 512;
+    // The subgrid resolution is stored in 8 bits per axis
+    constexpr std::uint32_t kMaxCellResolution = 0xFF;
+    // Cells are enlarged by this fraction of their size for the overlap tests, so that
+    // the triangles lying on the cell faces are not lost to rounding
+    constexpr float kCellEpsilon = 1e-4f;
+
+    // Overlap of a triangle and a grid cell, kept between the counting and the scatter pass
+    // of the counting sorts
+    struct CellOverlap
+    {
+        std::uint32_t cell;
+        std::uint32_t triangle;
+    };
+
+    // Resolution of roughly cubic cells giving density cells per triangle
+    void ComputeResolution(float3 const& extent, std::size_t num_triangles, float density,
+        std::uint32_t max_resolution, std::uint32_t resolution[3])
+    {
+        float scale = std::cbrt(density * float(num_triangles) / (extent.x * extent.y * extent.z));
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            float axis_resolution = std::min(extent[axis] * scale, float(max_resolution));
+            resolution[axis] = std::max((std::uint32_t)axis_resolution, 1u);
+        }
+    }
+
+    // Separating axes of the triangle-box test besides the box normals, which the cell range
+    // of the triangle bounds already covers: the triangle normal and the cross products of
+    // the edges with the box normals. The triangle intervals don't depend on the cell
+    class TriangleSeparatingAxes
+    {
+    public:
+        explicit TriangleSeparatingAxes(Triangle const& triangle)
+        {
+            float3 edges[3] =
+            {
+                triangle.v2.position - triangle.v1.position,
+                triangle.v3.position - triangle.v2.position,
+                triangle.v1.position - triangle.v3.position
+            };
+
+            axes_[0] = Cross(edges[0], edges[1]);
+            for (int i = 0; i < 3; ++i)
+            {
+                axes_[1 + i * 3] = float3(0.0f, -edges[i].z, edges[i].y);
+                axes_[2 + i * 3] = float3(edges[i].z, 0.0f, -edges[i].x);
+                axes_[3 + i * 3] = float3(-edges[i].y, edges[i].x, 0.0f);
+            }
+
+            // A degenerate axis projects everything to 0 and never separates
+            for (int i = 0; i < kNumAxes; ++i)
+            {
+                triangle.Project(axes_[i], min_[i], max_[i]);
+            }
+        }
+
+        bool Overlaps(Bounds3 const& bounds) const
+        {
+            float3 center = (bounds.min + bounds.max) * 0.5f;
+            float3 half_extent = (bounds.max - bounds.min) * 0.5f;
+
+            for (int i = 0; i < kNumAxes; ++i)
+            {
+                float3 const& axis = axes_[i];
+                float center_projection = Dot(center, axis);
+                float radius = half_extent.x * std::abs(axis.x) + half_extent.y * std::abs(axis.y)
+                    + half_extent.z * std::abs(axis.z);
+
+                if (center_projection + radius < min_[i] || center_projection - radius > max_[i])
+                {
+                    return false;
+                }
+            }
+
+            return true;
+        }
+
+    private:
+        static constexpr int kNumAxes = 10;
+        float3 axes_[kNumAxes];
+        float min_[kNumAxes];
+        float max_[kNumAxes];
+    };
+
+    // Calls func(x, y, z) for every cell of the grid that overlaps the triangle. The cells
+    // of the triangle bounds are tested with the separating axis test
+    template <typename Func>
+    void ForEachOverlappedCell(Triangle const& triangle, float3 const& grid_min, float3 const& cell_size,
+        std::uint32_t const resolution[3], Func&& func)
+    {
+        Bounds3 bounds = triangle.GetBounds();
+        std::uint32_t first[3];
+        std::uint32_t last[3];
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            float first_cell = (bounds.min[axis] - grid_min[axis]) / cell_size[axis] - kCellEpsilon;
+            float last_cell = (bounds.max[axis] - grid_min[axis]) / cell_size[axis] + kCellEpsilon;
+            if (last_cell < 0.0f || first_cell >= float(resolution[axis]))
+            {
+                return;
+            }
+
+            first[axis] = (std::uint32_t)std::max(first_cell, 0.0f);
+            last[axis] = std::min((std::uint32_t)last_cell, resolution[axis] - 1);
+        }
+
+        // A single cell overlaps the triangle bounds
+        if (first[0] == last[0] && first[1] == last[1] && first[2] == last[2])
+        {
+            func(first[0], first[1], first[2]);
+            return;
+        }
+
+        TriangleSeparatingAxes separating_axes(triangle);
+
+        for (std::uint32_t z = first[2]; z <= last[2]; ++z)
+        {
+            for (std::uint32_t y = first[1]; y <= last[1]; ++y)
+            {
+                for (std::uint32_t x = first[0]; x <= last[0]; ++x)
+                {
+                    std::uint32_t cell[3] = { x, y, z };
+                    Bounds3 cell_bounds;
+                    for (int axis = 0; axis < 3; ++axis)
+                    {
+                        cell_bounds.min[axis] = grid_min[axis] + (float(cell[axis]) - kCellEpsilon) * cell_size[axis];
+                        cell_bounds.max[axis] = grid_min[axis] + (float(cell[axis]) + 1.0f + kCellEpsilon) * cell_size[axis];
+                    }
+
+                    if (separating_axes.Overlaps(cell_bounds))
+                    {
+                        func(x, y, z);
+                    }
+                }
+            }
+        }
+    }
+}
+
+TwoLevelGrid::TwoLevelGrid(BvhBuildOptions const& options)
+    : options_(options)
+{
+    if (!(options_.grid_top_density > 0.0f) || !(options_.grid_cell_density > 0.0f))
+    {
+        throw std::runtime_error("Grid densities must be positive");
+    }
+}
+
+void TwoLevelGrid::BuildCPU(std::vector<Triangle> const& triangles)
+{
+    Build(triangles);
+
+    if (options_.print_stats)
+    {
+        std::cout << "Two-level grid created with " << grid_info_.resolution_x << "x" << grid_info_.resolution_y
+            << "x" << grid_info_.resolution_z << " top cells, " << build_stats_.cell_count << " cells and "
+            << build_stats_.reference_count << " references for " << triangles.size() << " triangles ("
+            << float(top_cells_.size() * sizeof(GridTopCell) + cells_.size() * sizeof(CellData)
+                + references_.size() * sizeof(std::uint32_t)) / (1024.0f * 1024.0f) << " MB)" << std::endl;
+        std::cout << "Grid build time: " << build_stats_.total_time << " ms (top level " << build_stats_.top_level_time
+            << " ms, cells " << build_stats_.cell_time << " ms)" << std::endl;
+    }
+}
+
+// Not an incremental update: the moved triangles change the cells they overlap, so the whole
+// grid is built again and every top cell is reported dirty
+std::vector<DirtyRange> TwoLevelGrid::Refit(std::vector<Triangle> const& triangles,
+    std::vector<std::uint32_t> const&)
+{
+    Build(triangles);
+    return { { 0, (std::uint32_t)top_cells_.size() } };
+}
+
+void TwoLevelGrid::Build(std::vector<Triangle> const& triangles)
+{
+    if (triangles.empty())
+    {
+        throw std::runtime_error("Failed to build grid for an empty scene");
+    }
+
+    build_stats_ = {};
+    auto start_time = Clock::now();
+
+    ThreadPool thread_pool(options_.num_threads);
+    std::size_t num_triangles = triangles.size();
+    std::size_t num_chunks = (num_triangles + kParallelGrainSize - 1) / kParallelGrainSize;
+
+    std::vector<Bounds3> chunk_bounds(num_chunks);
+    thread_pool.ParallelFor(num_triangles, kParallelGrainSize, [&](std::size_t begin, std::size_t end)
+        {
+            Bounds3 bounds;
+            for (std::size_t i = begin; i < end; ++i)
+            {
+                bounds = Union(bounds, triangles[i].GetBounds());
+            }
+            chunk_bounds[begin / kParallelGrainSize] = bounds;
+        });
+
+    Bounds3 bounds;
+    for (auto const& chunk : chunk_bounds)
+    {
+        bounds = Union(bounds, chunk);
+    }
+
+    // Flat scenes still need cells of some thickness
+    float3 extent = bounds.Diagonal();
+    float padding = std::max(std::max(std::max(extent.x, extent.y), extent.z) * kCellEpsilon, 1e-6f);
+    bounds.min -= float3(padding);
+    bounds.max += float3(padding);
+    extent = bounds.Diagonal();
+
+    std::uint32_t resolution[3];
+    ComputeResolution(extent, num_triangles, options_.grid_top_density, kMaxTopResolution, resolution);
+
+    float3 cell_size;
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        cell_size[axis] = extent[axis] / float(resolution[axis]);
+    }
+
+    grid_info_.bounds = bounds;
+    grid_info_.cell_size = cell_size;
+    grid_info_.resolution_x = resolution[0];
+    grid_info_.resolution_y = resolution[1];
+    grid_info_.resolution_z = resolution[2];
+    grid_info_.padding = 0;
+
+    std::size_t num_top_cells = std::size_t(resolution[0]) * resolution[1] * resolution[2];
+    auto top_cell_index = [&](std::uint32_t x, std::uint32_t y, std::uint32_t z)
+    {
+        return x + resolution[0] * (y + resolution[1] * z);
+    };
+
+    // Counting sort of the triangle-cell overlaps of the top level. The overlaps of each chunk
+    // are kept for the scatter instead of testing the triangles again, the counters are turned
+    // into the scatter positions
+    std::vector<std::vector<CellOverlap>> chunk_overlaps(num_chunks);
+    std::vector<std::atomic<std::uint32_t>> top_counters(num_top_cells);
+    thread_pool.ParallelFor(num_triangles, kParallelGrainSize, [&](std::size_t begin, std::size_t end)
+        {
+            auto& overlaps = chunk_overlaps[begin / kParallelGrainSize];
+            for (std::size_t i = begin; i < end; ++i)
+            {
+                ForEachOverlappedCell(triangles[i], bounds.min, cell_size, resolution,
+                    [&](std::uint32_t x, std::uint32_t y, std::uint32_t z)
+                    {
+                        std::uint32_t top_cell = top_cell_index(x, y, z);
+                        overlaps.push_back({ top_cell, (std::uint32_t)i });
+                        top_counters[top_cell].fetch_add(1, std::memory_order_relaxed);
+                    });
+            }
+        });
+
+    std::vector<std::uint32_t> top_offsets(num_top_cells + 1);
+    top_offsets[0] = 0;
+    for (std::size_t i = 0; i < num_top_cells; ++i)
+    {
+        std::uint32_t count = top_counters[i].load(std::memory_order_relaxed);
+        top_counters[i].store(top_offsets[i], std::memory_order_relaxed);
+        top_offsets[i + 1] = top_offsets[i] + count;
+    }
+
+    std::vector<std::uint32_t> top_references(top_offsets.back());
+    thread_pool.ParallelFor(num_chunks, 1, [&](std::size_t begin, std::size_t end)
+        {
+            for (std::size_t chunk = begin; chunk < end; ++chunk)
+            {
+                for (auto const& overlap : chunk_overlaps[chunk])
+                {
+                    std::uint32_t position = top_counters[overlap.cell].fetch_add(1, std::memory_order_relaxed);
+                    top_references[position] = overlap.triangle;
+                }
+                std::vector<CellOverlap>().swap(chunk_overlaps[chunk]);
+            }
+        });
+
+    // The scatter order depends on the threads, sorting keeps the build deterministic
+    thread_pool.ParallelFor(num_top_cells, kTopCellGrainSize, [&](std::size_t begin, std::size_t end)
+        {
+            for (std::size_t i = begin; i < end; ++i)
+            {
+                std::sort(top_references.begin() + top_offsets[i], top_references.begin() + top_offsets[i + 1]);
+            }
+        });
+
+    auto cell_start_time = Clock::now();
+
+    // Subgrid resolution of each top cell from its triangle count
+    top_cells_.assign(num_top_cells, GridTopCell{ 0, 0 });
+    std::uint32_t num_cells = 0;
+    for (std::size_t i = 0; i < num_top_cells; ++i)
+    {
+        std::uint32_t count = top_offsets[i + 1] - top_offsets[i];
+        if (count == 0)
+        {
+            continue;
+        }
+
+        std::uint32_t cell_resolution[3];
+        ComputeResolution(cell_size, count, options_.grid_cell_density, kMaxCellResolution, cell_resolution);
+        top_cells_[i].first_cell = num_cells;
+        top_cells_[i].resolution = cell_resolution[0] | (cell_resolution[1] << 8) | (cell_resolution[2] << 16);
+        num_cells += cell_resolution[0] * cell_resolution[1] * cell_resolution[2];
+    }
+
+    // Counting sort of the leaf cell overlaps. Each task owns the subgrids of its top cells,
+    // so the counters need no atomics and the references stay sorted
+    std::vector<std::vector<CellOverlap>> overlaps(num_top_cells);
+    cells_.assign(num_cells, CellData{ 0, 0 });
+    thread_pool.ParallelFor(num_top_cells, kTopCellGrainSize, [&](std::size_t begin, std::size_t end)
+        {
+            for (std::size_t i = begin; i < end; ++i)
+            {
+                GridTopCell const& top_cell = top_cells_[i];
+                std::uint32_t cell_resolution[3] = { top_cell.resolution & 0xFF,
+                    (top_cell.resolution >> 8) & 0xFF, (top_cell.resolution >> 16) & 0xFF };
+                std::uint32_t top_cell_position[3] = { std::uint32_t(i % resolution[0]),
+                    std::uint32_t(i / resolution[0] % resolution[1]),
+                    std::uint32_t(i / (std::size_t(resolution[0]) * resolution[1])) };
+
+                float3 subgrid_min;
+                float3 subgrid_cell_size;
+                for (int axis = 0; axis < 3; ++axis)
+                {
+                    subgrid_min[axis] = bounds.min[axis] + float(top_cell_position[axis]) * cell_size[axis];
+                    subgrid_cell_size[axis] = cell_size[axis] / float(cell_resolution[axis]);
+                }
+
+                for (std::uint32_t r = top_offsets[i]; r < top_offsets[i + 1]; ++r)
+                {
+                    std::uint32_t triangle_index = top_references[r];
+                    ForEachOverlappedCell(triangles[triangle_index], subgrid_min, subgrid_cell_size, cell_resolution,
+                        [&](std::uint32_t x, std::uint32_t y, std::uint32_t z)
+                        {
+                            std::uint32_t cell = top_cell.first_cell + x + cell_resolution[0] * (y + cell_resolution[1] * z);
+                            overlaps[i].push_back({ cell, triangle_index });
+                            ++cells_[cell].count;
+                        });
+                }
+            }
+        });
+
+    std::uint32_t num_references = 0;
+    for (auto& cell : cells_)
+    {
+        cell.start_index = num_references;
+        num_references += cell.count;
+        cell.count = 0;
+    }
+
+    references_.resize(num_references);
+    thread_pool.ParallelFor(num_top_cells, kTopCellGrainSize, [&](std::size_t begin, std::size_t end)
+        {
+            for (std::size_t i = begin; i < end; ++i)
+            {
+                for (auto const& overlap : overlaps[i])
+                {
+                    CellData& cell = cells_[overlap.cell];
+                    references_[cell.start_index + cell.count++] = overlap.triangle;
+                }
+                std::vector<CellOverlap>().swap(overlaps[i]);
+            }
+        });
+
+    // The cells reference the scene triangles directly
+    std::vector<std::uint32_t> primitive_indices(num_triangles);
+    std::iota(primitive_indices.begin(), primitive_indices.end(), 0u);
+    SetPrimitiveIndices(std::move(primitive_indices), num_triangles);
+
+    auto end_time = Clock::now();
+
+    build_stats_.top_cell_count = (std::uint32_t)num_top_cells;
+    build_stats_.cell_count = num_cells;
+    build_stats_.reference_count = num_references;
+    build_stats_.top_level_time = ElapsedMilliseconds(start_time, cell_start_time);
+    build_stats_.cell_time = ElapsedMilliseconds(cell_start_time, end_time);
+    build_stats_.total_time = ElapsedMilliseconds(start_time, end_time);
+}
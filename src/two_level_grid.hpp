@@ -0,0 +1,77 @@
+/*****************************************************************************
+ MIT License
+
+ Copyright(c) 2023 Alexander Veselov
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this softwareand associated documentation files(the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions :
+
+ The above copyright noticeand this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *****************************************************************************/
+
+#pragma once
+
+#include "bvh.hpp"
+#include <vector>
+
+// Two-level uniform grid. A coarse top level grid over the scene bounds stores a subgrid in each
+// of its cells, the resolution of which follows the number of triangles of the cell. The build
+// is a couple of counting sorts of the triangle-cell overlaps, which takes a few milliseconds,
+// so the grid is simply rebuilt when the triangles move
+class TwoLevelGrid : public AccelerationStructure
+{
+public:
+    explicit TwoLevelGrid(BvhBuildOptions const& options = BvhBuildOptions());
+
+    // The triangle slots are the scene triangles, the cells reference them
+    void BuildCPU(std::vector<Triangle> const& triangles) override;
+    // The grid has no BVH nodes
+    std::vector<LinearBVHNode> const& GetNodes() const override { return nodes_; }
+    // Rebuilds the whole grid, the indices of the moved triangles are ignored. The triangle slots
+    // don't change. Returns the range of the top cells
+    std::vector<DirtyRange> Refit(std::vector<Triangle> const& triangles,
+        std::vector<std::uint32_t> const& triangle_indices) override;
+
+    GridInfo const& GetGridInfo() const { return grid_info_; }
+    std::vector<GridTopCell> const& GetTopCells() const { return top_cells_; }
+    std::vector<CellData> const& GetCells() const { return cells_; }
+    // Triangle slots referenced by the leaf cells
+    std::vector<std::uint32_t> const& GetReferences() const { return references_; }
+
+    struct BuildStats
+    {
+        std::uint32_t top_cell_count = 0;
+        std::uint32_t cell_count = 0;
+        std::uint32_t reference_count = 0;
+        // Milliseconds spent binning the triangles into the top cells and building their subgrids
+        double top_level_time = 0.0;
+        double cell_time = 0.0;
+        double total_time = 0.0;
+    };
+
+    BuildStats const& GetBuildStats() const { return build_stats_; }
+
+private:
+    void Build(std::vector<Triangle> const& triangles);
+
+    BvhBuildOptions options_;
+    std::vector<LinearBVHNode> nodes_;
+    GridInfo grid_info_;
+    std::vector<GridTopCell> top_cells_;
+    std::vector<CellData> cells_;
+    std::vector<std::uint32_t> references_;
+    BuildStats build_stats_;
+};
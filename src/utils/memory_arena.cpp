@@ -0,0 +1,65 @@
+/*****************************************************************************
+ MIT License
+
+ Copyright(c) 2023 Alexander Veselov
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this softwareand associated documentation files(the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions :
+
+ The above copyright noticeand this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *****************************************************************************/
+
+#include "memory_arena.hpp"
+#include <algorithm>
+
+MemoryArena::MemoryArena(std::size_t block_size)
+    : block_size_(block_size)
+{
+}
+
+void* MemoryArena::AllocBytes(std::size_t size, std::size_t alignment)
+{
+    if (!blocks_.empty())
+    {
+        Block& block = blocks_.back();
+        std::uintptr_t base = reinterpret_cast<std::uintptr_t>(block.data.get());
+        std::size_t aligned_offset = ((base + current_offset_ + alignment - 1) & ~(alignment - 1)) - base;
+
+        if (aligned_offset + size <= block.size)
+        {
+            current_offset_ = aligned_offset + size;
+            return block.data.get() + aligned_offset;
+        }
+    }
+
+    // Current block is exhausted, allocate a new one. Reserve enough space
+    // for the alignment padding since new[] only guarantees the fundamental one
+    std::size_t new_block_size = std::max(block_size_, size + alignment);
+    blocks_.push_back({ std::unique_ptr<std::uint8_t[]>(new std::uint8_t[new_block_size]), new_block_size });
+    total_allocated_ += new_block_size;
+    peak_allocated_ = std::max(peak_allocated_, total_allocated_);
+    current_offset_ = 0;
+
+    return AllocBytes(size, alignment);
+}
+
+void MemoryArena::Release()
+{
+    blocks_.clear();
+    blocks_.shrink_to_fit();
+    current_offset_ = 0;
+    total_allocated_ = 0;
+}
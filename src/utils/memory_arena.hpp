@@ -0,0 +1,85 @@
+/*****************************************************************************
+ MIT License
+
+ Copyright(c) 2023 Alexander Veselov
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this softwareand associated documentation files(the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions :
+
+ The above copyright noticeand this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *****************************************************************************/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+// Bump allocator that hands out memory from large blocks and releases
+// everything at once. Destructors of the allocated objects are never called,
+// so it should only be used for trivially destructible types.
+class MemoryArena
+{
+public:
+    explicit MemoryArena(std::size_t block_size = 256 * 1024);
+    MemoryArena(MemoryArena const&) = delete;
+    MemoryArena& operator=(MemoryArena const&) = delete;
+
+    template <typename T, typename... Args>
+    T* Alloc(Args&&... args)
+    {
+        void* memory = AllocBytes(sizeof(T), alignof(T));
+        return new (memory) T(std::forward<Args>(args)...);
+    }
+
+    // Allocates an array of value-initialized objects
+    template <typename T>
+    T* AllocArray(std::size_t count)
+    {
+        T* array = static_cast<T*>(AllocBytes(sizeof(T) * count, alignof(T)));
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            new (array + i) T();
+        }
+        return array;
+    }
+
+    // Frees all blocks, previously allocated pointers become invalid
+    void Release();
+
+    // Bytes currently reserved by the arena blocks
+    std::size_t GetTotalAllocated() const { return total_allocated_; }
+    // Maximum number of bytes that has been reserved since the creation
+    std::size_t GetPeakAllocated() const { return peak_allocated_; }
+
+private:
+    void* AllocBytes(std::size_t size, std::size_t alignment);
+
+    struct Block
+    {
+        std::unique_ptr<std::uint8_t[]> data;
+        std::size_t size;
+    };
+
+    std::vector<Block> blocks_;
+    std::size_t block_size_;
+    std::size_t current_offset_ = 0;
+    std::size_t total_allocated_ = 0;
+    std::size_t peak_allocated_ = 0;
+};
@@ -0,0 +1,191 @@
+/*****************************************************************************
+ MIT License
+
+ Copyright(c) 2023 Alexander Veselov
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this softwareand associated documentation files(the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions :
+
+ The above copyright noticeand this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *****************************************************************************/
+
+#include "thread_pool.hpp"
+#include <algorithm>
+
+namespace
+{
+thread_local ThreadPool const* tls_thread_pool = nullptr;
+thread_local std::uint32_t tls_thread_index = 0;
+}
+
+ThreadPool::ThreadPool(std::uint32_t num_threads)
+{
+    if (num_threads == 0)
+    {
+        num_threads = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+
+    queues_.resize(num_threads);
+    for (auto& queue : queues_)
+    {
+        queue = std::make_unique<TaskQueue>();
+    }
+
+    // The queue #0 belongs to the owner thread
+    for (std::uint32_t thread_index = 1; thread_index < num_threads; ++thread_index)
+    {
+        threads_.emplace_back(&ThreadPool::WorkerThread, this, thread_index);
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(wake_mutex_);
+        stop_ = true;
+    }
+
+    wake_condition_.notify_all();
+
+    for (auto& thread : threads_)
+    {
+        thread.join();
+    }
+}
+
+std::uint32_t ThreadPool::GetThreadIndex() const
+{
+    return tls_thread_pool == this ? tls_thread_index : 0;
+}
+
+void ThreadPool::Run(TaskGroup& group, std::function<void()> task)
+{
+    group.pending_tasks_.fetch_add(1, std::memory_order_relaxed);
+
+    TaskQueue& queue = *queues_[GetThreadIndex()];
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.tasks.push_back({ std::move(task), &group });
+    }
+
+    {
+        // Lock to make sure the sleeping workers don't miss the notification
+        std::lock_guard<std::mutex> lock(wake_mutex_);
+        queued_tasks_.fetch_add(1, std::memory_order_release);
+    }
+
+    wake_condition_.notify_one();
+}
+
+bool ThreadPool::TryExecuteTask(std::uint32_t thread_index)
+{
+    Task task;
+    bool found = false;
+
+    // Newest task from the own queue first, it's likely to be hot in cache
+    {
+        TaskQueue& queue = *queues_[thread_index];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (!queue.tasks.empty())
+        {
+            task = std::move(queue.tasks.back());
+            queue.tasks.pop_back();
+            found = true;
+        }
+    }
+
+    // Then steal the oldest task from the other queues, it's likely to be the largest one
+    for (std::uint32_t i = 1; i < queues_.size() && !found; ++i)
+    {
+        TaskQueue& queue = *queues_[(thread_index + i) % queues_.size()];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (!queue.tasks.empty())
+        {
+            task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+            found = true;
+        }
+    }
+
+    if (!found)
+    {
+        return false;
+    }
+
+    queued_tasks_.fetch_sub(1, std::memory_order_relaxed);
+    task.function();
+    task.group->pending_tasks_.fetch_sub(1, std::memory_order_release);
+
+    return true;
+}
+
+void ThreadPool::WorkerThread(std::uint32_t thread_index)
+{
+    tls_thread_pool = this;
+    tls_thread_index = thread_index;
+
+    while (true)
+    {
+        if (TryExecuteTask(thread_index))
+        {
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(wake_mutex_);
+        wake_condition_.wait(lock, [this]()
+            {
+                return stop_ || queued_tasks_.load(std::memory_order_acquire) > 0;
+            });
+
+        if (stop_)
+        {
+            break;
+        }
+    }
+
+    tls_thread_pool = nullptr;
+}
+
+void ThreadPool::Wait(TaskGroup& group)
+{
+    std::uint32_t thread_index = GetThreadIndex();
+
+    while (!group.IsFinished())
+    {
+        // Help the workers instead of blocking
+        if (!TryExecuteTask(thread_index))
+        {
+            std::this_thread::yield();
+        }
+    }
+}
+
+void ThreadPool::ParallelFor(std::size_t count, std::size_t grain_size,
+    std::function<void(std::size_t, std::size_t)> const& func)
+{
+    grain_size = std::max<std::size_t>(grain_size, 1);
+
+    TaskGroup group;
+    for (std::size_t begin = grain_size; begin < count; begin += grain_size)
+    {
+        std::size_t end = std::min(begin + grain_size, count);
+        Run(group, [&func, begin, end]() { func(begin, end); });
+    }
+
+    // Process the first range on the calling thread
+    func(0, std::min(grain_size, count));
+    Wait(group);
+}
@@ -0,0 +1,95 @@
+/*****************************************************************************
+ MIT License
+
+ Copyright(c) 2023 Alexander Veselov
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this softwareand associated documentation files(the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions :
+
+ The above copyright noticeand this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *****************************************************************************/
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing thread pool. Each participating thread owns a task queue: tasks are
+// pushed to and popped from the back of the own queue, idle threads steal from the
+// front of the other queues. The thread that waits for a task group helps executing
+// the tasks instead of blocking, so the tasks can be spawned recursively.
+class ThreadPool
+{
+public:
+    class TaskGroup
+    {
+    public:
+        bool IsFinished() const { return pending_tasks_.load(std::memory_order_acquire) == 0; }
+
+    private:
+        friend class ThreadPool;
+        std::atomic<std::uint32_t> pending_tasks_{ 0 };
+    };
+
+    // Zero means the number of hardware threads. The calling thread counts as one of them
+    explicit ThreadPool(std::uint32_t num_threads = 0);
+    ~ThreadPool();
+    ThreadPool(ThreadPool const&) = delete;
+    ThreadPool& operator=(ThreadPool const&) = delete;
+
+    void Run(TaskGroup& group, std::function<void()> task);
+    void Wait(TaskGroup& group);
+
+    // Calls func(begin, end) for the consecutive ranges of grain_size elements in [0, count).
+    // The ranges don't depend on the number of threads
+    void ParallelFor(std::size_t count, std::size_t grain_size,
+        std::function<void(std::size_t, std::size_t)> const& func);
+
+    std::uint32_t GetThreadCount() const { return (std::uint32_t)queues_.size(); }
+    // Returns the index of the calling thread in [0, GetThreadCount()). Any thread that
+    // is not a worker of this pool gets index 0
+    std::uint32_t GetThreadIndex() const;
+
+private:
+    struct Task
+    {
+        std::function<void()> function;
+        TaskGroup* group;
+    };
+
+    struct TaskQueue
+    {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    void WorkerThread(std::uint32_t thread_index);
+    bool TryExecuteTask(std::uint32_t thread_index);
+
+    std::vector<std::unique_ptr<TaskQueue>> queues_;
+    std::vector<std::thread> threads_;
+    std::mutex wake_mutex_;
+    std::condition_variable wake_condition_;
+    std::atomic<std::uint32_t> queued_tasks_{ 0 };
+    bool stop_ = false;
+};
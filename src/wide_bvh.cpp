@@ -0,0 +1,213 @@
+/*****************************************************************************
+ MIT License
+
+ Copyright(c) 2023 Alexander Veselov
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this softwareand associated documentation files(the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions :
+
+ The above copyright noticeand this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *****************************************************************************/
+
+#include "wide_bvh.hpp"
+#include "utils/timer.hpp"
+#include <algorithm>
+#include <iostream>
+#include <limits>
+#include <stdexcept>
+
+namespace
+{
+    constexpr std::uint32_t kLanesPerRecord = 4;
+    // INVALID_ID in the kernels
+    constexpr std::uint32_t kEmptyLane = 0xFFFFFFFFu;
+
+    class BvhCollapser
+    {
+    public:
+        BvhCollapser(std::vector<LinearBVHNode> const& nodes, std::uint32_t width)
+            : nodes_(nodes), width_(width), records_per_node_(width / kLanesPerRecord)
+        {
+        }
+
+        std::vector<WideBVHNode> Collapse()
+        {
+            wide_nodes_.clear();
+            wide_nodes_.reserve(nodes_.size() / (width_ - 1) + records_per_node_);
+
+            if (IsLeaf(nodes_[0]))
+            {
+                // The whole tree is a single leaf, put it to the first lane of the root
+                std::uint32_t root = AllocateNode();
+                SetLane(root, 0, nodes_[0], nodes_[0].offset);
+            }
+            else
+            {
+                CollapseNode(0);
+            }
+
+            return std::move(wide_nodes_);
+        }
+
+    private:
+        std::uint32_t AllocateNode()
+        {
+            std::uint32_t index = (std::uint32_t)wide_nodes_.size();
+            wide_nodes_.resize(wide_nodes_.size() + records_per_node_);
+
+            for (std::uint32_t record = 0; record < records_per_node_; ++record)
+            {
+                WideBVHNode& wide_node = wide_nodes_[index + record];
+                for (std::uint32_t lane = 0; lane < kLanesPerRecord; ++lane)
+                {
+                    wide_node.min_x[lane] = wide_node.min_y[lane] = wide_node.min_z[lane] = std::numeric_limits<float>::max();
+                    wide_node.max_x[lane] = wide_node.max_y[lane] = wide_node.max_z[lane] = std::numeric_limits<float>::lowest();
+                    wide_node.child_offset[lane] = 0;
+                    wide_node.child_info[lane] = kEmptyLane;
+                }
+            }
+
+            return index;
+        }
+
+        void SetLane(std::uint32_t node_index, std::uint32_t child, LinearBVHNode const& node, std::uint32_t offset)
+        {
+            WideBVHNode& wide_node = wide_nodes_[node_index + child / kLanesPerRecord];
+            std::uint32_t lane = child % kLanesPerRecord;
+
+            wide_node.min_x[lane] = node.bounds.min.x;
+            wide_node.min_y[lane] = node.bounds.min.y;
+            wide_node.min_z[lane] = node.bounds.min.z;
+            wide_node.max_x[lane] = node.bounds.max.x;
+            wide_node.max_y[lane] = node.bounds.max.y;
+            wide_node.max_z[lane] = node.bounds.max.z;
+            wide_node.child_offset[lane] = offset;
+            wide_node.child_info[lane] = IsLeaf(node) ? (node.num_primitives_axis & 0xFFFF0000u) : 0;
+        }
+
+        // Returns the index of the first record of the wide node
+        std::uint32_t CollapseNode(std::uint32_t binary_index)
+        {
+            LinearBVHNode const& binary_node = nodes_[binary_index];
+            std::uint32_t children[8] = { binary_node.first_child, binary_node.offset };
+            std::uint32_t num_children = 2;
+
+            // Replace the interior child with the largest surface area by its children
+            while (num_children < width_)
+            {
+                int best_child = -1;
+                float best_area = std::numeric_limits<float>::lowest();
+                for (std::uint32_t i = 0; i < num_children; ++i)
+                {
+                    LinearBVHNode const& child = nodes_[children[i]];
+                    if (!IsLeaf(child) && child.bounds.SurfaceArea() > best_area)
+                    {
+                        best_child = (int)i;
+                        best_area = child.bounds.SurfaceArea();
+                    }
+                }
+
+                if (best_child < 0)
+                {
+                    break;
+                }
+
+                std::uint32_t opened = children[best_child];
+                children[best_child] = nodes_[opened].first_child;
+                children[num_children++] = nodes_[opened].offset;
+            }
+
+            std::uint32_t node_index = AllocateNode();
+            for (std::uint32_t i = 0; i < num_children; ++i)
+            {
+                LinearBVHNode const& child = nodes_[children[i]];
+                std::uint32_t offset = IsLeaf(child) ? child.offset : CollapseNode(children[i]);
+                SetLane(node_index, i, child, offset);
+            }
+
+            return node_index;
+        }
+
+        std::vector<LinearBVHNode> const& nodes_;
+        std::vector<WideBVHNode> wide_nodes_;
+        std::uint32_t width_;
+        std::uint32_t records_per_node_;
+    };
+}
+
+std::vector<WideBVHNode> CollapseBvh(std::vector<LinearBVHNode> const& nodes, std::uint32_t width)
+{
+    if (width != 4 && width != 8)
+    {
+        throw std::runtime_error("Wide BVH width must be 4 or 8");
+    }
+
+    if (nodes.empty())
+    {
+        throw std::runtime_error("Failed to collapse an empty BVH");
+    }
+
+    auto start_time = Clock::now();
+
+    std::vector<WideBVHNode> wide_nodes = BvhCollapser(nodes, width).Collapse();
+
+    auto end_time = Clock::now();
+    double collapse_time = ElapsedMilliseconds(start_time, end_time);
+
+    std::cout << "BVH" << width << " created with " << wide_nodes.size() / (width / kLanesPerRecord) << " nodes ("
+        << float(wide_nodes.size() * sizeof(WideBVHNode)) / (1024.0f * 1024.0f) << " MB) in "
+        << collapse_time << " ms" << std::endl;
+
+    return wide_nodes;
+}
+
+std::uint32_t ComputeWideStackSize(std::vector<WideBVHNode> const& nodes, std::uint32_t width)
+{
+    std::uint32_t records_per_node = width / kLanesPerRecord;
+    std::uint32_t stack_size = 0;
+
+    // Wide node and the number of entries on the traversal stack when it is visited
+    std::vector<std::pair<std::uint32_t, std::uint32_t>> stack = { { 0u, 0u } };
+    while (!stack.empty())
+    {
+        auto [node_index, pending] = stack.back();
+        stack.pop_back();
+
+        std::uint32_t num_interior_children = 0;
+        for (std::uint32_t record = 0; record < records_per_node; ++record)
+        {
+            for (std::uint32_t lane = 0; lane < kLanesPerRecord; ++lane)
+            {
+                num_interior_children += nodes[node_index + record].child_info[lane] == 0;
+            }
+        }
+
+        stack_size = std::max(stack_size, pending + num_interior_children);
+        for (std::uint32_t record = 0; record < records_per_node; ++record)
+        {
+            for (std::uint32_t lane = 0; lane < kLanesPerRecord; ++lane)
+            {
+                WideBVHNode const& node = nodes[node_index + record];
+                if (node.child_info[lane] == 0)
+                {
+                    stack.emplace_back(node.child_offset[lane], pending + num_interior_children - 1);
+                }
+            }
+        }
+    }
+
+    return stack_size;
+}
@@ -0,0 +1,39 @@
+/*****************************************************************************
+ MIT License
+
+ Copyright(c) 2023 Alexander Veselov
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this softwareand associated documentation files(the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions :
+
+ The above copyright noticeand this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *****************************************************************************/
+
+#pragma once
+
+#include "kernels/common/shared_structures.h"
+#include <cstdint>
+#include <vector>
+
+// Converts the binary BVH into a 4- or 8-wide one. Each wide node pulls up the
+// grandchildren of its binary node, opening the largest child first, until all
+// lanes are filled. The nodes are laid out depth-first and the leaves keep the
+// primitive ranges of the binary BVH
+std::vector<WideBVHNode> CollapseBvh(std::vector<LinearBVHNode> const& nodes, std::uint32_t width);
+
+// Deepest stack of the wide traversal, which pushes all interior children of a node it
+// intersects and continues with one of them
+std::uint32_t ComputeWideStackSize(std::vector<WideBVHNode> const& nodes, std::uint32_t width);